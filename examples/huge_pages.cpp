@@ -0,0 +1,92 @@
+// This benchmark compares the query time of an index built using normal pages
+// with indexes built using each kind of huge pages.
+// Random unit vectors are used, so that the size of the index is easy to vary.
+// The tables should be much larger than what the TLB covers for a difference to be visible.
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "puffinn.hpp"
+
+const unsigned long long GB = 1024*1024*1024;
+
+// Retrieve the number of kB of anonymous memory backed by transparent huge pages.
+std::string anon_huge_pages() {
+    std::ifstream in("/proc/self/smaps_rollup");
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.find("AnonHugePages:") == 0) {
+            return line.substr(line.find_first_not_of(' ', 14));
+        }
+    }
+    return "unknown";
+}
+
+// Takes the following arguments: (number of points) (dimensions) (space_usage in GB) (queries)
+int main(int argc, char* argv[]) {
+    unsigned int n = 1000000;
+    unsigned int dimensions = 100;
+    unsigned long long space_usage = 4*GB;
+    unsigned int num_queries = 1000;
+    switch (argc) {
+        case 5: num_queries = std::atoi(argv[4]);
+        case 4: space_usage = static_cast<unsigned long long>(std::atof(argv[3])*GB);
+        case 3: dimensions = std::atoi(argv[2]);
+        case 2: n = std::atoi(argv[1]);
+        case 1: break;
+        default:
+            std::cerr << "Usage: " << argv[0]
+                << " (number of points) (dimensions) (space_usage in GB) (queries)" << std::endl;
+            return -1;
+    }
+    const unsigned int k = 10;
+    const float recall = 0.9;
+
+    std::vector<std::vector<float>> dataset;
+    for (unsigned int i=0; i < n; i++) {
+        dataset.push_back(puffinn::UnitVectorFormat::generate_random(dimensions));
+    }
+    // Queries close to points in the dataset, so that they are answered
+    // after inspecting a moderate number of candidates.
+    std::vector<std::vector<float>> queries;
+    for (unsigned int i=0; i < num_queries; i++) {
+        auto query = dataset[(i*7919ull) % n];
+        auto noise = puffinn::UnitVectorFormat::generate_random(dimensions);
+        for (unsigned int j=0; j < dimensions; j++) {
+            query[j] += 0.5*noise[j];
+        }
+        queries.push_back(query);
+    }
+
+    std::vector<std::pair<std::string, puffinn::HugePages>> settings = {
+        { "none", puffinn::HugePages::None },
+        { "transparent", puffinn::HugePages::Transparent },
+        { "explicit 2MB", puffinn::HugePages::Explicit2MB },
+        { "explicit 1GB", puffinn::HugePages::Explicit1GB }
+    };
+    for (auto& setting : settings) {
+        // The setting applies to the arrays allocated while inserting and rebuilding.
+        puffinn::set_huge_pages(setting.second);
+        puffinn::Index<puffinn::CosineSimilarity> index(dimensions, space_usage);
+        for (auto& v : dataset) { index.insert(v); }
+        auto build_start = std::chrono::steady_clock::now();
+        index.rebuild();
+        std::chrono::duration<double> build_time = std::chrono::steady_clock::now()-build_start;
+
+        auto query_start = std::chrono::steady_clock::now();
+        size_t checksum = 0;
+        for (auto& query : queries) {
+            checksum += index.search(query, k, recall)[0];
+        }
+        std::chrono::duration<double> query_time = std::chrono::steady_clock::now()-query_start;
+
+        std::cout << setting.first << ": "
+            << "rebuild " << build_time.count() << "s, "
+            << num_queries/query_time.count() << " queries/s, "
+            << "transparent huge pages " << anon_huge_pages()
+            << " (checksum " << checksum << ")" << std::endl;
+    }
+}
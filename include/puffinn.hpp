@@ -1,9 +1,16 @@
 #pragma once
 
 #include "puffinn/collection.hpp"
+#include "puffinn/inner_product_index.hpp"
+#include "puffinn/two_tier_index.hpp"
+#include "puffinn/sharded_index.hpp"
 #include "puffinn/similarity_measure/cosine.hpp"
+#include "puffinn/similarity_measure/cosine_i8.hpp"
 #include "puffinn/similarity_measure/l2.hpp"
 #include "puffinn/similarity_measure/jaccard.hpp"
+#include "puffinn/similarity_measure/hamming.hpp"
+#include "puffinn/similarity_measure/inner_product.hpp"
 #include "puffinn/hash_source/independent.hpp"
 #include "puffinn/hash_source/tensor.hpp"
 #include "puffinn/hash_source/pool.hpp"
+#include "puffinn/hash_source/shared_rotation.hpp"
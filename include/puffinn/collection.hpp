@@ -5,16 +5,27 @@
 #include "puffinn/hash_source/deserialize.hpp"
 #include "puffinn/hash_source/hash_source.hpp"
 #include "puffinn/hash_source/independent.hpp"
+#include "puffinn/knn_graph.hpp"
 #include "puffinn/maxbuffer.hpp"
 #include "puffinn/maxpairbuffer.hpp"
+#include "puffinn/memory.hpp"
+#include "puffinn/numa.hpp"
+#include "puffinn/paircache.hpp"
 #include "puffinn/prefixmap.hpp"
+#include "puffinn/similarity_measure/generic.hpp"
 #include "puffinn/typedefs.hpp"
 
 #include "omp.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <istream>
 #include <memory>
+#include <mutex>
 #include <ostream>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace puffinn {
@@ -33,6 +44,13 @@ namespace puffinn {
         Simple
     };
 
+    // Written at the start of a serialized index, followed by the version of its format.
+    // Indexes serialized before the format was versioned start with their dataset instead.
+    const uint32_t INDEX_FORMAT_MAGIC = 0x58444950; // "PIDX"
+    // Incremented whenever the fields serialized by the index itself change.
+    // The filterer versions its own fields.
+    const uint32_t INDEX_FORMAT_VERSION = 1;
+
     class ChunkSerializable {
     public:
         virtual void serialize_chunk(std::ostream&, size_t) const = 0;
@@ -73,7 +91,8 @@ namespace puffinn {
     /// The LSH families default to good choices for the similarity measure
     /// and should usually not be explicitly set. 
     ///
-    /// @param TSim The similarity measure. Currently ``CosineSimilarity`` and ``JaccardSimilarity`` are supported.
+    /// @param TSim The similarity measure. Currently ``CosineSimilarity``, ``JaccardSimilarity``,
+    /// ``L2Distance`` and ``HammingSimilarity`` are supported.
     /// Depending on the similarity measure, points are stored internally using different ``Format``s.
     /// The ``Format`` specifies which types of input are supported.
     /// @param THash The family of Locality-Sensitive hash functions used to
@@ -88,10 +107,17 @@ namespace puffinn {
         typename TSketch = typename TSim::DefaultSketch
     >
     class Index : ChunkSerializable {
+        // How the stored values are hashed.
+        using Hashed = HashedSimilarity<TSim>;
+
         Dataset<typename TSim::Format> dataset;
         // Hash tables used by LSH.
         std::vector<PrefixMap<THash>> lsh_maps;
         std::unique_ptr<HashSource<THash>> hash_source;
+        // Identifies the hash functions and sketches when the hash source is built,
+        // so that indexes constructed using the functions of this index can be recognized.
+        // Zero until the hash source is built.
+        uint64_t hash_functions_id = 0;
         // Container of sketches. Also needs to be reset.
         Filterer<TSketch> filterer;
 
@@ -99,6 +125,9 @@ namespace puffinn {
         uint64_t memory_limit;
         // Number of values inserted the last time rebuild was called.
         uint32_t last_rebuild = 0;
+        // Placement of the dataset, sketches and tables on NUMA nodes.
+        // It is not serialized, since it depends on the machine.
+        NumaPolicy numa_policy = NumaPolicy::FirstTouch;
         // Construction of the hash source is delayed until the
         // first rebuild so that we know how many tables are at most used.
         std::unique_ptr<HashSourceArgs<THash>> hash_args;
@@ -113,6 +142,30 @@ namespace puffinn {
         // NOTE: This is not thread safe: i.e. we assume that no queries
         // are evaluated in parallel.
         QuerySketches query_sketches;
+        // Scratch space used when computing the hashes and sketches of queries.
+        // NOTE: This is not thread safe either.
+        std::vector<LshDatatype> query_scratch;
+        // Buffer for queries converted to the format used for hashing.
+        // NOTE: This is not thread safe either.
+        typename Hashed::Scratch query_hash_scratch;
+
+        // Read the header of a serialized index and return the stream.
+        // Throws std::invalid_argument if the index was serialized using another format.
+        static std::istream& read_format_header(std::istream& in) {
+            uint32_t magic = 0;
+            uint32_t version = 0;
+            in.read(reinterpret_cast<char*>(&magic), sizeof(uint32_t));
+            in.read(reinterpret_cast<char*>(&version), sizeof(uint32_t));
+            if (magic != INDEX_FORMAT_MAGIC || version != INDEX_FORMAT_VERSION) {
+                throw std::invalid_argument("unsupported serialization format");
+            }
+            return in;
+        }
+
+        // Number of bytes used by the fields of the index that are not measured elsewhere.
+        uint64_t index_memory_usage() const {
+            return sizeof(Index)-sizeof(Dataset<typename TSim::Format>);
+        }
 
     public:
         /// Construct an empty index.
@@ -120,8 +173,11 @@ namespace puffinn {
         /// @param dataset_args Arguments specifying how the dataset should be stored,
         /// depending on the format of the similarity measure.
         /// When using ``CosineSimilarity``, it specifies the dimension that all vectors must have.
+        /// When using ``CosineSimilarityI8``, it is a ``UnitVectorI8Args``, which can be constructed
+        /// from the dimension alone.
         /// When using ``JaccardSimilarity``, it specifies the universe size. All tokens must be
         /// integers between 0, inclusive, and the paramter, exclusive.
+        /// When using ``HammingSimilarity``, it specifies the number of bits in each vector.
         /// @param memory_limit The number of bytes of memory that the index is permitted to use.
         /// Using more memory almost always means that queries are more efficient.
         /// @param hash_args Arguments used to construct the source from which hashes are drawn.
@@ -129,6 +185,8 @@ namespace puffinn {
         /// It is recommended to use the default value.
         /// @param sketch_args Similar to ``hash_args``, but for the hash family specified in ``TSketch``.
         /// It is recommended to use the default value.
+        /// It is not used if the hash source also provides sketches,
+        /// as is the case for ``SharedRotationHashArgs``.
         Index(
             typename TSim::Format::Args dataset_args,
             uint64_t memory_limit,
@@ -136,22 +194,56 @@ namespace puffinn {
             const HashSourceArgs<TSketch>& sketch_args = IndependentHashArgs<TSketch>()
         )
           : dataset(Dataset<typename TSim::Format>(dataset_args)),
-            filterer(sketch_args, dataset.get_description()),
+            filterer(
+                sketch_args,
+                Hashed::description(dataset.get_description()),
+                !hash_args.provides_sketches()),
             memory_limit(memory_limit),
             hash_args(hash_args.copy())
         {
             static_assert(
-                std::is_same<TSim, typename THash::Sim>::value
-                && std::is_same<TSim, typename TSketch::Sim>::value,
+                std::is_same<typename Hashed::Sim, typename THash::Sim>::value
+                && std::is_same<typename Hashed::Sim, typename TSketch::Sim>::value,
                 "Hash function not applicable to similarity measure");
         }
 
+        /// Construct an empty index which uses the same hash functions and sketches as another index.
+        ///
+        /// The values of the two indexes can then be joined using ``join``.
+        /// The other index must have been rebuilt.
+        /// The new index uses at most as many tables as the other index.
+        ///
+        /// @param other The index whose hash functions are used.
+        /// Its values must be of the same format and dimension.
+        /// @param memory_limit The number of bytes of memory that the new index is permitted to use.
+        Index(const Index& other, uint64_t memory_limit)
+          : dataset(Dataset<typename TSim::Format>(other.dataset.get_description().args)),
+            filterer(other.filterer.copy_functions()),
+            memory_limit(memory_limit),
+            hash_args(other.hash_args->copy())
+        {
+            if (!other.hash_source) {
+                throw std::invalid_argument("other");
+            }
+            hash_source = other.hash_source->clone();
+            hash_functions_id = other.hash_functions_id;
+            // The tables are filled during the first rebuild.
+            lsh_maps.reserve(other.lsh_maps.size());
+            for (size_t i=0; i < other.lsh_maps.size(); i++) {
+                lsh_maps.emplace_back(MAX_HASHBITS);
+            }
+        }
+
         /// Deserialize an index.
         ///
         /// It is assumed that the input data is a serialized index
         /// using the same version of PUFFINN.
+        /// Indexes serialized by versions whose format differs are rejected by throwing
+        /// ``std::invalid_argument``.
+        /// This is an incompatible change: indexes serialized before the format was versioned
+        /// cannot be read and must be rebuilt from the original data.
         Index(std::istream& in)
-          : dataset(in),
+          : dataset(read_format_header(in)),
             filterer(in)
         {
             hash_args = deserialize_hash_args<THash>(in);
@@ -159,6 +251,7 @@ namespace puffinn {
             in.read(reinterpret_cast<char*>(&has_hash_source), sizeof(bool));
             if (has_hash_source) {
                 hash_source = hash_args->deserialize_source(in);
+                in.read(reinterpret_cast<char*>(&hash_functions_id), sizeof(uint64_t));
             }
             size_t num_maps;
             in.read(reinterpret_cast<char*>(&num_maps), sizeof(size_t));
@@ -190,6 +283,8 @@ namespace puffinn {
         ///
         /// @param use_chunks Whether to split the serialized index into chunks. Defaults to false.
         void serialize(std::ostream& out, bool use_chunks = false) const {
+            out.write(reinterpret_cast<const char*>(&INDEX_FORMAT_MAGIC), sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(&INDEX_FORMAT_VERSION), sizeof(uint32_t));
             dataset.serialize(out);
             filterer.serialize(out);
             hash_args->serialize(out);
@@ -197,6 +292,7 @@ namespace puffinn {
             out.write(reinterpret_cast<char*>(&has_hash_source), sizeof(bool));
             if (has_hash_source) {
                 hash_source->serialize(out);
+                out.write(reinterpret_cast<const char*>(&hash_functions_id), sizeof(uint64_t));
             }
             size_t num_maps = lsh_maps.size();
             out.write(reinterpret_cast<char*>(&num_maps), sizeof(size_t));
@@ -246,21 +342,41 @@ namespace puffinn {
         /// This is done in parallel by default.
         /// The number of threads used can be specified using the
         /// OMP_NUM_THREADS environment variable.
+        ///
+        /// The hashes of new points are written directly into preallocated space in the tables,
+        /// after which each table is sorted.
+        /// Besides the final size of the index, the additional memory used at any point is
+        /// at most the size of one table per thread, plus a small buffer per thread.
+        ///
+        /// The number of tables is chosen so that the total capacity in the ``memory_report``
+        /// after rebuilding is at most the memory limit.
         void rebuild() {
-            // Compute sketches for the new vectors.
-            filterer.add_sketches(dataset, last_rebuild);
-
-            auto desc = dataset.get_description();
-            auto table_bytes = PrefixMap<THash>::memory_usage(dataset.get_size(), hash_args->function_memory_usage(desc, MAX_HASHBITS));
-            auto filterer_bytes = filterer.memory_usage(desc);
-
-            uint64_t required_mem = dataset.memory_usage()+filterer_bytes; 
+            // The sketches of the new vectors are computed together with their hashes.
+            bool shared_sketches = hash_args->provides_sketches();
+            filterer.reserve_sketches(dataset.get_size());
+
+            // Everything but the tables and their hash functions has its final size,
+            // so its memory usage is measured.
+            auto stored_desc = dataset.get_description();
+            auto desc = Hashed::description(stored_desc);
+            auto current = memory_report();
+            uint64_t required_mem =
+                current.dataset.capacity
+                + current.sketches.capacity
+                + filterer.function_memory_usage()
+                + index_memory_usage();
+            auto table_bytes = PrefixMap<THash>::memory_usage(
+                dataset.get_size(),
+                hash_args->function_memory_usage(desc, MAX_HASHBITS));
             unsigned int num_tables = 0;
             uint64_t table_mem = 0;
-            while (required_mem + table_mem < memory_limit) {
+            while (required_mem + table_mem <= memory_limit) {
                 num_tables++;
-                table_mem = hash_args->memory_usage(desc, num_tables, MAX_HASHBITS)
-                    + num_tables * table_bytes;
+                // Hash functions are only sampled during the first rebuild.
+                uint64_t hash_mem = hash_source
+                    ? hash_source->memory_usage()
+                    : hash_args->memory_usage(desc, num_tables, MAX_HASHBITS);
+                table_mem = hash_mem + num_tables*table_bytes;
             }
             if (num_tables != 0) {
                 num_tables--;
@@ -279,11 +395,15 @@ namespace puffinn {
                     // the number of tables is not going to increase again.
                     lsh_maps.pop_back();
                 }
+                // Each map contains a large prefix index, so the unused slots are released.
+                lsh_maps.shrink_to_fit();
             } else {
                 hash_source = hash_args->build(
-                    dataset.get_description(),
+                    desc,
                     num_tables,
                     MAX_HASHBITS);
+                std::uniform_int_distribution<uint64_t> id_distribution(1);
+                hash_functions_id = id_distribution(get_default_random_generator());
                 // Construct the prefixmaps.
                 lsh_maps.reserve(num_tables);
                 for (unsigned int repetition=0; repetition < num_tables; repetition++) {
@@ -291,34 +411,94 @@ namespace puffinn {
                 }
             }
 
+            size_t num_new_vectors = dataset.get_size()-last_rebuild;
             for (auto& map : lsh_maps) {
-                map.reserve(dataset.get_size());
+                map.reserve(num_new_vectors);
             }
 
-            // Compute hashes for the new vectors in order, so that caching works.
+            // Compute hashes for the new vectors in blocks of consecutive vectors,
+            // so that hash functions can be evaluated on many vectors at once.
             // Hash a vector in all the different ways needed.
+            // Only a block of hashes per thread is kept, as they are scattered
+            // directly into the maps.
             std::vector<std::vector<uint64_t>> tl_hash_values;
             tl_hash_values.resize(omp_get_max_threads());
-            for (size_t i=0; i < tl_hash_values.size(); i++) {
-                tl_hash_values[i].resize(lsh_maps.size());
-            }
-            #pragma omp parallel for
-            for (size_t idx=last_rebuild; idx < dataset.get_size(); idx++) {
+            std::vector<std::vector<FilterLshDatatype>> tl_sketch_values;
+            tl_sketch_values.resize(omp_get_max_threads());
+            std::vector<typename Hashed::Scratch> tl_scratch(omp_get_max_threads());
+            size_t num_blocks = (num_new_vectors+HASH_BLOCK_SIZE-1)/HASH_BLOCK_SIZE;
+            #pragma omp parallel for schedule(dynamic)
+            for (size_t block=0; block < num_blocks; block++) {
                 auto tid = omp_get_thread_num();
                 auto & hash_values = tl_hash_values[tid];
+                size_t block_start = last_rebuild+block*HASH_BLOCK_SIZE;
+                size_t block_len = std::min(HASH_BLOCK_SIZE, dataset.get_size()-block_start);
+                auto & sketch_values = tl_sketch_values[tid];
+                auto vectors = Hashed::view(
+                    dataset[block_start],
+                    block_len,
+                    stored_desc,
+                    tl_scratch[tid]);
                 // Write the hash values in the vector
-                this->hash_source->hash_repetitions(dataset[idx], hash_values);
+                if (shared_sketches) {
+                    this->hash_source->hash_and_sketch_block(
+                        vectors,
+                        block_len,
+                        desc.storage_len,
+                        hash_values,
+                        sketch_values);
+                    filterer.store_sketches(block_start, block_len, sketch_values.data());
+                } else {
+                    this->hash_source->hash_repetitions_block(
+                        vectors,
+                        block_len,
+                        desc.storage_len,
+                        hash_values);
+                    filterer.sketch_block(
+                        block_start,
+                        vectors,
+                        block_len,
+                        desc.storage_len,
+                        sketch_values);
+                }
+                // The hash source can contain more tables than are used.
+                size_t hashes_per_vector = hash_values.size()/block_len;
                 // Copy the hash values in the appropriate prefix maps
                 for (size_t map_idx = 0; map_idx < lsh_maps.size(); map_idx++) {
-                    lsh_maps[map_idx].insert(tid, idx, hash_values[map_idx]);
+                    for (size_t v=0; v < block_len; v++) {
+                        lsh_maps[map_idx].insert(
+                            block_start+v-last_rebuild,
+                            block_start+v,
+                            hash_values[v*hashes_per_vector+map_idx]);
+                    }
                 }
             }
 
-            #pragma omp parallel for
+            // Each thread sorts one map at a time.
+            #pragma omp parallel for schedule(dynamic)
             for (size_t map_idx = 0; map_idx < lsh_maps.size(); map_idx++) {
                 lsh_maps[map_idx].rebuild();
             }
             last_rebuild = dataset.get_size();
+            // Rebuilding reallocates the memory, which is placed where it was first touched.
+            if (numa_policy != NumaPolicy::FirstTouch) {
+                apply_numa_policy();
+            }
+        }
+
+        /// Choose how the memory of the index is placed on the NUMA nodes of the machine.
+        ///
+        /// The policy is applied to the dataset, sketches and tables immediately
+        /// and again after each rebuild.
+        /// On machines with several NUMA nodes, ``NumaPolicy::Interleave`` avoids
+        /// that threads on some nodes access the whole index remotely.
+        /// Switching back to ``NumaPolicy::FirstTouch`` only affects memory allocated afterwards,
+        /// such as by the next rebuild.
+        /// The policy is ignored if the kernel does not support NUMA,
+        /// or on other platforms than Linux.
+        void set_numa_policy(NumaPolicy policy) {
+            numa_policy = policy;
+            apply_numa_policy();
         }
 
         /// Search for the approximate ``k`` nearest neighbors to a query.
@@ -345,7 +525,49 @@ namespace puffinn {
         ) {
             auto desc = dataset.get_description();
             auto stored_query = to_stored_type<typename TSim::Format>(query, desc);
-            return search_formatted_query(stored_query.get(), k, recall, filter_type);
+            return search_formatted_query(stored_query.get(), k, recall, filter_type)
+                .best_indices();
+        }
+
+        /// Search for the approximate ``k`` nearest neighbors to a query
+        /// and retrieve their similarities to the query.
+        ///
+        /// The parameters are the same as for ``search``.
+        /// @return The index of each of the ``k`` nearest found neighbors
+        /// together with its similarity to the query,
+        /// ordered so that the most similar neighbor is first.
+        template <typename T>
+        std::vector<std::pair<uint32_t, float>> search_with_similarities(
+            const T& query,
+            unsigned int k,
+            float recall,
+            FilterType filter_type = FilterType::Default
+        ) {
+            auto desc = dataset.get_description();
+            auto stored_query = to_stored_type<typename TSim::Format>(query, desc);
+            return search_formatted_query(stored_query.get(), k, recall, filter_type)
+                .best_entries();
+        }
+
+        /// Search for the approximate ``k`` nearest neighbors to a query
+        /// and retrieve statistics about how the query was answered.
+        ///
+        /// The parameters are the same as for ``search``.
+        /// @return The indices of the ``k`` nearest found neighbors, ordered as in ``search``,
+        /// together with the statistics of the query.
+        template <typename T>
+        std::pair<std::vector<uint32_t>, QueryStats> search_with_stats(
+            const T& query,
+            unsigned int k,
+            float recall,
+            FilterType filter_type = FilterType::Default
+        ) {
+            auto desc = dataset.get_description();
+            auto stored_query = to_stored_type<typename TSim::Format>(query, desc);
+            QueryStats stats;
+            auto res = search_formatted_query(stored_query.get(), k, recall, filter_type, stats)
+                .best_indices();
+            return std::make_pair(res, stats);
         }
 
         /// Search for the approximate ``k`` nearest neighbors to a value already inserted into the index.
@@ -360,7 +582,8 @@ namespace puffinn {
             FilterType filter_type = FilterType::Default
         ) {
             // search for one more as the query will be part of the result set.
-            auto res = search_formatted_query(dataset[idx], k+1, recall, filter_type);
+            auto res = search_formatted_query(dataset[idx], k+1, recall, filter_type)
+                .best_indices();
             if (res.size() != 0 && res[0] == idx) {
                 res.erase(res.begin());
             } else {
@@ -387,7 +610,40 @@ namespace puffinn {
         ) const {
             auto stored = to_stored_type<typename TSim::Format>(
                 query, dataset.get_description());
-            return search_bf_formatted_query(stored.get(), k);
+            return search_bf_formatted_query(stored.get(), k).best_indices();
+        }
+
+        /// Measure the memory used by each component of the index.
+        ///
+        /// The same measurements are used by ``rebuild`` to choose the number of tables.
+        /// Buffers used while rebuilding and during queries are not included.
+        MemoryReport memory_report() const {
+            MemoryReport res;
+            res.dataset = dataset.memory_report();
+            // The fields of the index itself are counted with the tables.
+            res.tables = MemoryUsage(index_memory_usage(), index_memory_usage());
+            res.tables += MemoryUsage(
+                0,
+                (lsh_maps.capacity()-lsh_maps.size())*sizeof(PrefixMap<THash>));
+            for (auto& map : lsh_maps) {
+                res.tables += map.memory_report();
+            }
+            res.sketches = filterer.sketch_memory();
+            uint64_t function_bytes = filterer.function_memory_usage();
+            if (hash_source) {
+                function_bytes += hash_source->memory_usage();
+            }
+            res.hash_functions = MemoryUsage(function_bytes, function_bytes);
+            return res;
+        }
+
+        /// Change the number of bytes that the index is permitted to use.
+        ///
+        /// The number of tables is adjusted the next time ``rebuild`` is called.
+        /// Since tables are never added after the first rebuild, only lowering the limit
+        /// has an effect at that point.
+        void set_memory_limit(uint64_t limit) {
+            memory_limit = limit;
         }
 
         // Retrieve the number of inserted vectors.
@@ -400,35 +656,642 @@ namespace puffinn {
             return lsh_maps.size();
         }
 
-        /// Find the top-k closest pairs, with the given recall
+        /// Find the approximate top-``k`` closest pairs of inserted values.
+        ///
+        /// @param k The number of pairs to search for.
+        /// @param recall The expected recall of the result, as described in ``search``.
+        /// @param filter_type The approach used to filter candidate pairs.
+        /// Unless it is ``FilterType::None``, pairs are only compared if their sketches are
+        /// close enough for the pair to possibly be among the ``k`` closest found so far.
+        /// As in ``search``, this might make the recall slightly lower.
+        /// @return The ``k`` closest found pairs, with the most similar pair first.
         std::vector<std::pair<unsigned int, unsigned int>> closest_pairs(
             unsigned int k,
             float recall,
-            FilterType /*filter_type*/ = FilterType::Default
+            FilterType filter_type = FilterType::Default
         ) {
-            g_performance_metrics.clear();
             g_performance_metrics.new_query();
             g_performance_metrics.start_timer(Computation::Total);
 
             size_t nthreads = omp_get_max_threads();
-            
-            // Allocate one buffer per thread to hold the pairs
+
+            PairSearch state(
+                k,
+                nthreads,
+                filter_type,
+                dataset.get_size(),
+                lsh_maps.size(),
+                dataset.get_description().storage_len);
+
+            join_levels(
+                state,
+                [&]() {
+                    compare_pairs(
+                        state,
+                        [&](int tid, uint32_t r, uint32_t s, float sim) {
+                            // Pairs that are not more similar than the k'th best pair
+                            // found by any thread are not inserted.
+                            if (sim > state.threshold.load(std::memory_order_relaxed)) {
+                                state.tl_maxbuffer[tid].insert(std::make_pair(r, s), sim);
+                            }
+                        });
+                },
+                [&](int depth) {
+                    merge_pair_buffers(state);
+
+                    // remove inactive nodes
+                    auto kth_similarity =
+                        state.publish_threshold(state.tl_maxbuffer[0].smallest_value());
+                    if (state.use_sketches) {
+                        for (auto& filter : state.tl_filter) {
+                            update_pair_filter(filter, kth_similarity);
+                        }
+                    }
+                    auto table_idx = lsh_maps.size();
+                    auto last_tables = (depth == MAX_HASHBITS ? table_idx : lsh_maps.size());
+                    float failure_prob = hash_source->failure_probability(
+                        depth,
+                        table_idx,
+                        last_tables,
+                        kth_similarity
+                    );
+                    return failure_prob <= 1-recall;
+                });
+            g_performance_metrics.store_time(Computation::Total);
+            return state.tl_maxbuffer[0].best_indices();
+        }
+
+        /// Find the pairs of inserted values with a similarity of at least the given threshold.
+        ///
+        /// The pairs are found as in ``closest_pairs``, but the search stops once each pair above
+        /// the threshold has been found with the expected recall,
+        /// so the number of pairs does not need to be known in advance.
+        /// Rather than being collected, the pairs are passed to a callback as the search proceeds.
+        /// The pairs found in each block of colliding values are passed to the callback
+        /// as soon as the block has been compared, so the memory used does not depend on
+        /// the number of pairs.
+        /// The callback is called from the threads carrying out the search,
+        /// but never by more than one thread at a time.
+        ///
+        /// A pair is reported at most once in each table, so at most ``get_repetitions()`` times.
+        /// The compared pairs are remembered in a cache of at most 32MB to skip pairs
+        /// that were already found in another table or at a longer hash length.
+        /// Pairs are only reported again if they were evicted from the cache,
+        /// which happens when there are many more candidate pairs than cache slots.
+        ///
+        /// @param threshold The smallest similarity of a reported pair.
+        /// @param recall The expected recall of the result.
+        /// Each pair with a similarity of at least ``threshold`` is found with at least this
+        /// probability, unless it is filtered out by the sketches.
+        /// @param callback Function called as ``callback(a, b, similarity)`` for each found pair,
+        /// where ``a < b`` are the indices of the values.
+        /// @param filter_type The approach used to filter candidate pairs.
+        /// Unless it is ``FilterType::None``, only pairs whose sketches are close enough for the
+        /// pair to possibly have the threshold similarity are compared.
+        template <typename TCallback>
+        void similarity_join(
+            float threshold,
+            float recall,
+            TCallback&& callback,
+            FilterType filter_type = FilterType::Default
+        ) {
+            g_performance_metrics.new_query();
+            g_performance_metrics.start_timer(Computation::Total);
+
+            size_t nthreads = omp_get_max_threads();
+            PairSearch state(
+                0,
+                nthreads,
+                filter_type,
+                dataset.get_size(),
+                lsh_maps.size(),
+                dataset.get_description().storage_len);
+            state.tighten_filters = false;
+            if (state.use_sketches) {
+                for (auto& filter : state.tl_filter) {
+                    update_pair_filter(filter, threshold);
+                }
+            }
+            // The pairs found by each thread in the current block.
+            std::vector<std::vector<MaxPairBuffer::ResultPair>> tl_results(nthreads);
+            std::mutex callback_mutex;
+            join_levels(
+                state,
+                [&]() {
+                    compare_pairs(
+                        state,
+                        [&](int tid, uint32_t r, uint32_t s, float sim) {
+                            if (sim >= threshold) {
+                                tl_results[tid].push_back({
+                                    std::make_pair(std::min(r, s), std::max(r, s)),
+                                    sim });
+                            }
+                        },
+                        [&](int tid) {
+                            auto& results = tl_results[tid];
+                            if (results.empty()) {
+                                return;
+                            }
+                            {
+                                std::lock_guard<std::mutex> lock(callback_mutex);
+                                for (auto& pair : results) {
+                                    callback(pair.first.first, pair.first.second, pair.second);
+                                }
+                            }
+                            results.clear();
+                        });
+                },
+                [&](int depth) {
+                    auto table_idx = lsh_maps.size();
+                    auto last_tables = (depth == MAX_HASHBITS ? table_idx : lsh_maps.size());
+                    float failure_prob = hash_source->failure_probability(
+                        depth,
+                        table_idx,
+                        last_tables,
+                        threshold
+                    );
+                    return failure_prob <= 1-recall;
+                });
+            g_performance_metrics.store_time(Computation::Total);
+        }
+
+        /// Find the approximate ``k`` nearest neighbors of every inserted value.
+        ///
+        /// The values that collide in each table are compared bucket by bucket,
+        /// as in ``closest_pairs``, which is much faster than calling ``search_from_index``
+        /// for every value.
+        /// A value stops being searched for once its ``k``'th nearest neighbor found so far
+        /// is similar enough that it would have been found with the expected recall.
+        ///
+        /// @param k The number of neighbors of each value.
+        /// @param recall The expected recall of the neighbors of each value,
+        /// as described in ``search``.
+        /// @return The found neighbors of each value, excluding the value itself.
+        /// Values have fewer than ``k`` neighbors if only few values are similar to them.
+        KnnGraph knn_graph(unsigned int k, float recall) {
+            g_performance_metrics.new_query();
+            g_performance_metrics.start_timer(Computation::Total);
+
+            KnnSearch state(k, dataset.get_size(), lsh_maps.size());
+            join_levels(
+                state,
+                [&]() { compare_neighbors(state); },
+                [&](int depth) {
+                    auto table_idx = lsh_maps.size();
+                    auto last_tables = (depth == MAX_HASHBITS ? table_idx : lsh_maps.size());
+                    auto min_similarity =
+                        min_certain_similarity(depth, table_idx, last_tables, recall);
+                    return deactivate_neighbors(state, min_similarity) == 0;
+                });
+            auto res = state.graph();
+            g_performance_metrics.store_time(Computation::Total);
+            return res;
+        }
+
+        /// Whether this and another index use the same hash functions and sketches,
+        /// as is the case for an index constructed using the hash functions of the other.
+        ///
+        /// Both indexes must have been rebuilt.
+        /// The functions are identified by a random number drawn when they are sampled,
+        /// so the check takes constant time.
+        bool shares_hash_functions(const Index& other) const {
+            return hash_source && other.hash_source && hash_functions_id == other.hash_functions_id;
+        }
+
+        /// Find the approximate top-``k`` most similar pairs of a value in this index
+        /// and a value in another index.
+        ///
+        /// The sorted tables of the two indexes are merged table by table,
+        /// so that only values sharing a hash prefix are compared,
+        /// starting from the longest prefix.
+        /// This is much faster than searching for each value of one index in the other.
+        ///
+        /// @param other An index sharing the hash functions of this index,
+        /// see ``shares_hash_functions``. Both indexes must have been rebuilt.
+        /// @param k The number of pairs to search for.
+        /// @param recall The expected recall of the result, as described in ``closest_pairs``.
+        /// @param filter_type The approach used to filter candidate pairs,
+        /// as described in ``closest_pairs``.
+        /// @return The ``k`` most similar found pairs ``(r, s)``,
+        /// where ``r`` is the index of a value in this index and ``s`` in ``other``,
+        /// with the most similar pair first.
+        std::vector<std::pair<uint32_t, uint32_t>> join(
+            const Index& other,
+            unsigned int k,
+            float recall,
+            FilterType filter_type = FilterType::Default
+        ) {
+            if (!shares_hash_functions(other)) {
+                throw std::invalid_argument("other");
+            }
+            g_performance_metrics.new_query();
+            g_performance_metrics.start_timer(Computation::Total);
+
+            size_t nthreads = omp_get_max_threads();
+            PairSearch state(
+                k,
+                nthreads,
+                filter_type,
+                dataset.get_size()+other.dataset.get_size(),
+                lsh_maps.size(),
+                dataset.get_description().storage_len,
+                false);
+            join_levels_with(
+                other,
+                state,
+                [&]() {
+                    compare_join_pairs(
+                        other,
+                        state,
+                        [&](int tid, uint32_t r, uint32_t s, float sim, float threshold) {
+                            if (sim > threshold) {
+                                state.tl_maxbuffer[tid].insert(std::make_pair(r, s), sim);
+                            }
+                        });
+                },
+                [&](int depth) {
+                    merge_pair_buffers(state);
+                    auto kth_similarity =
+                        state.publish_threshold(state.tl_maxbuffer[0].smallest_value());
+                    if (state.use_sketches) {
+                        for (auto& filter : state.tl_filter) {
+                            update_pair_filter(filter, kth_similarity);
+                        }
+                    }
+                    auto num_tables = std::min(lsh_maps.size(), other.lsh_maps.size());
+                    float failure_prob = hash_source->failure_probability(
+                        depth,
+                        num_tables,
+                        num_tables,
+                        kth_similarity);
+                    return failure_prob <= 1-recall;
+                });
+            g_performance_metrics.store_time(Computation::Total);
+            return state.tl_maxbuffer[0].best_indices();
+        }
+
+        /// Find the pairs of a value in this index and a value in another index
+        /// with a similarity of at least the given threshold.
+        ///
+        /// The pairs are found as in ``join``.
+        ///
+        /// @param other An index sharing the hash functions of this index.
+        /// @param threshold The smallest similarity of a pair in the result.
+        /// @param recall The expected recall of the result.
+        /// Each pair with a similarity of at least ``threshold`` is found with at least this
+        /// probability, unless it is filtered out by the sketches.
+        /// @param filter_type The approach used to filter candidate pairs.
+        /// Unless it is ``FilterType::None``, only pairs whose sketches are close enough for the
+        /// pair to possibly have the threshold similarity are compared.
+        /// @return The found pairs ``(r, s)`` together with their similarities,
+        /// with the most similar pair first.
+        std::vector<MaxPairBuffer::ResultPair> join_threshold(
+            const Index& other,
+            float threshold,
+            float recall,
+            FilterType filter_type = FilterType::Default
+        ) {
+            if (!shares_hash_functions(other)) {
+                throw std::invalid_argument("other");
+            }
+            g_performance_metrics.new_query();
+            g_performance_metrics.start_timer(Computation::Total);
+
+            size_t nthreads = omp_get_max_threads();
+            PairSearch state(
+                0,
+                nthreads,
+                filter_type,
+                dataset.get_size()+other.dataset.get_size(),
+                lsh_maps.size(),
+                dataset.get_description().storage_len,
+                false);
+            state.tighten_filters = false;
+            if (state.use_sketches) {
+                for (auto& filter : state.tl_filter) {
+                    update_pair_filter(filter, threshold);
+                }
+            }
+            std::vector<std::vector<MaxPairBuffer::ResultPair>> tl_results(nthreads);
+            join_levels_with(
+                other,
+                state,
+                [&]() {
+                    compare_join_pairs(
+                        other,
+                        state,
+                        [&](int tid, uint32_t r, uint32_t s, float sim, float) {
+                            if (sim >= threshold) {
+                                tl_results[tid].push_back({ std::make_pair(r, s), sim });
+                            }
+                        });
+                },
+                [&](int depth) {
+                    auto num_tables = std::min(lsh_maps.size(), other.lsh_maps.size());
+                    float failure_prob = hash_source->failure_probability(
+                        depth,
+                        num_tables,
+                        num_tables,
+                        threshold);
+                    return failure_prob <= 1-recall;
+                });
+
+            std::vector<MaxPairBuffer::ResultPair> res;
+            for (auto& results : tl_results) {
+                res.insert(res.end(), results.begin(), results.end());
+                results = std::vector<MaxPairBuffer::ResultPair>();
+            }
+            // Pairs that were forgotten by the cache can be found multiple times.
+            std::sort(res.begin(), res.end(),
+                [](const MaxPairBuffer::ResultPair& a, const MaxPairBuffer::ResultPair& b) {
+                    return a.second > b.second || (a.second == b.second && a.first < b.first);
+                });
+            res.erase(
+                std::unique(res.begin(), res.end(),
+                    [](const MaxPairBuffer::ResultPair& a, const MaxPairBuffer::ResultPair& b) {
+                        return a.first == b.first;
+                    }),
+                res.end());
+            g_performance_metrics.store_time(Computation::Total);
+            return res;
+        }
+
+        MaxPairBuffer global_bf_join(unsigned int k) {
+            MaxPairBuffer maxbuffer(k);
+            g_performance_metrics.new_query();
+            g_performance_metrics.start_timer(Computation::Total);
+            for (size_t r = 0; r < dataset.get_size(); r++) {
+                for (size_t s = r + 1; s < dataset.get_size(); s++) {
+                    auto dist = TSim::compute_similarity(
+                        dataset[r], 
+                        dataset[s], 
+                        dataset.get_description());
+                    maxbuffer.insert(std::make_pair(r, s), dist);
+                }
+            }
+            g_performance_metrics.store_time(Computation::Total);
+            return maxbuffer;//.best_indices();
+        }
+
+    private:
+        // Sketch filter for the candidate pairs considered by one thread in closest_pairs.
+        struct PairFilter {
+            // The similarity that max_sketch_diff was computed for.
+            float similarity = 0.0;
+            // Max hamming distance between the sketches of a pair for it to be compared.
+            uint_fast8_t max_sketch_diff = NUM_FILTER_HASHBITS;
+        };
+
+        // Number of pair comparisons that closest_pairs aims to assign to each task.
+        const static uint64_t PAIR_TASK_COST = 1 << 14;
+        // Number of values gathered into each tile when comparing large blocks.
+        const static unsigned int PAIR_TILE_SIZE = 64;
+        // Blocks with at least this many pairs are compared in tiles if the similarity measure
+        // supports it. Smaller blocks and blocks whose pairs have mostly been compared already
+        // are compared one pair at a time, which allows skipping pairs using sketches and the cache.
+        const static uint64_t MIN_TILED_PAIRS = 256;
+        // Number of pairs looked up in the cache to decide whether to compare a block in tiles.
+        const static unsigned int PAIR_CACHE_SAMPLES = 16;
+
+        // Consecutive positions in a table, so that each position in [row_begin, row_end)
+        // is paired with the positions in [col_begin, col_end) that come after it.
+        struct PairBlock {
+            uint32_t row_begin;
+            uint32_t row_end;
+            uint32_t col_begin;
+            uint32_t col_end;
+        };
+
+        // A range of blocks in a table, which are compared by a single thread.
+        struct PairTask {
+            uint32_t table;
+            uint32_t first_block;
+            uint32_t last_block;
+        };
+
+        // The pairs to compare in each level of a join, which are split into tasks of roughly
+        // PAIR_TASK_COST comparisons. Small blocks are grouped and large blocks are split by rows,
+        // so that a table with a large bucket does not stall a level.
+        struct PairSchedule {
+            // Blocks to compare in each table in the current level.
+            std::vector<std::vector<PairBlock>> blocks;
+            // Tasks in each table in the current level.
+            std::vector<std::vector<PairTask>> table_tasks;
+            // Comparisons in the blocks of each table that are not assigned to a task yet.
+            std::vector<uint64_t> open_cost;
+            // Tasks of all tables.
+            std::vector<PairTask> tasks;
+
+            PairSchedule(size_t num_tables)
+              : blocks(num_tables),
+                table_tasks(num_tables),
+                open_cost(num_tables, 0)
+            {
+            }
+
+            void clear_table(size_t table) {
+                blocks[table].clear();
+                table_tasks[table].clear();
+                open_cost[table] = 0;
+            }
+
+            // Add the pairs between two ranges of positions in a table.
+            // The ranges are either equal or disjoint, with the rows first.
+            void add_blocks(
+                size_t table,
+                uint32_t row_begin,
+                uint32_t row_end,
+                uint32_t col_begin,
+                uint32_t col_end
+            ) {
+                auto r = row_begin;
+                while (r < row_end) {
+                    auto block_begin = r;
+                    uint64_t cost = 0;
+                    while (r < row_end && open_cost[table]+cost < PAIR_TASK_COST) {
+                        cost += col_end-std::max(col_begin, r+1);
+                        r++;
+                    }
+                    if (cost != 0) {
+                        blocks[table].push_back({ block_begin, r, col_begin, col_end });
+                    }
+                    open_cost[table] += cost;
+                    if (open_cost[table] >= PAIR_TASK_COST) {
+                        close_task(table);
+                    }
+                }
+            }
+
+            // Assign the remaining blocks of the table to a task.
+            void close_task(size_t table) {
+                uint32_t first_block = 0;
+                if (!table_tasks[table].empty()) {
+                    first_block = table_tasks[table].back().last_block;
+                }
+                uint32_t last_block = blocks[table].size();
+                if (first_block != last_block) {
+                    table_tasks[table].push_back({
+                        static_cast<uint32_t>(table), first_block, last_block });
+                }
+                open_cost[table] = 0;
+            }
+
+            // Gather the tasks of all tables.
+            void collect_tasks() {
+                tasks.clear();
+                for (auto& t : table_tasks) {
+                    tasks.insert(tasks.end(), t.begin(), t.end());
+                }
+            }
+        };
+
+        // State of closest_pairs shared between the levels.
+        struct PairSearch : PairSchedule {
+            // Number of pairs searched for, or 0 when searching for the pairs above a threshold.
+            unsigned int k;
+            // Buffers holding the pairs found by each thread.
             std::vector<MaxPairBuffer> tl_maxbuffer;
-            for (size_t tid=0; tid < nthreads; tid++) {
-                tl_maxbuffer.emplace_back(k);
+            // One filter per thread. With the default filter type, each thread tightens its filter
+            // to the shared threshold after each block. Otherwise filters are only updated
+            // between levels.
+            std::vector<PairFilter> tl_filter;
+            bool use_sketches;
+            bool tighten_filters;
+            // Pairs collide in many tables and at several levels.
+            // A bounded number of the compared pairs are remembered to skip repeated comparisons.
+            PairCache compared;
+            // Two tiles per thread, which values from the rows and columns of blocks are gathered into.
+            std::vector<AlignedStorage<typename TSim::Format>> tl_tiles;
+            // The largest k'th similarity in any thread's buffer,
+            // which is a lower bound of the k'th similarity of the result.
+            // Threads publish their own k'th similarity and prune against this after each block,
+            // rather than only learning about better pairs when the buffers are merged.
+            std::atomic<float> threshold;
+
+            PairSearch(
+                unsigned int k,
+                size_t nthreads,
+                FilterType filter_type,
+                uint64_t num_values,
+                size_t num_tables,
+                unsigned int storage_len,
+                bool unordered_pairs = true
+            )
+              : PairSchedule(num_tables),
+                k(k),
+                tl_filter(nthreads),
+                use_sketches(filter_type != FilterType::None),
+                tighten_filters(filter_type == FilterType::Default),
+                compared(num_values),
+                threshold(0.0)
+            {
+                for (size_t tid=0; tid < nthreads; tid++) {
+                    tl_maxbuffer.emplace_back(k, unordered_pairs);
+                }
+                if (HasBlockSimilarity<TSim>::value) {
+                    tl_tiles.reserve(2*nthreads);
+                    for (size_t i=0; i < 2*nthreads; i++) {
+                        tl_tiles.push_back(
+                            allocate_storage<typename TSim::Format>(PAIR_TILE_SIZE, storage_len));
+                    }
+                }
             }
 
+            // Raise the shared threshold to the k'th similarity of a buffer
+            // and retrieve the resulting threshold.
+            float publish_threshold(float kth_similarity) {
+                float current = threshold.load(std::memory_order_relaxed);
+                while (
+                    kth_similarity > current &&
+                    !threshold.compare_exchange_weak(
+                        current, kth_similarity, std::memory_order_relaxed)
+                ) {}
+                return std::max(current, kth_similarity);
+            }
+        };
+
+        // State of knn_graph shared between the levels.
+        struct KnnSearch : PairSchedule {
+            // Number of locks protecting the buffers of neighbors.
+            const static uint32_t NUM_LOCKS = 1 << 16;
+
+            // The neighbors found for each value.
+            std::vector<MaxBuffer> neighbors;
+            // The smallest similarity that a new neighbor of each value needs to beat,
+            // which can be read without holding the lock of the value.
+            std::unique_ptr<std::atomic<float>[]> kth_similarity;
+            // Whether each value is still searched for.
+            // Pairs of values that are no longer searched for are not compared.
+            std::vector<uint8_t> active;
+            // Spin locks protecting the buffers, each shared by the values with equal lowest bits.
+            std::unique_ptr<std::atomic_flag[]> locks;
+            // Remembers compared pairs, as in closest_pairs.
+            PairCache compared;
+
+            KnnSearch(unsigned int k, uint32_t num_values, size_t num_tables)
+              : PairSchedule(num_tables),
+                neighbors(num_values, MaxBuffer(k)),
+                kth_similarity(new std::atomic<float>[num_values]),
+                active(num_values, 1),
+                locks(new std::atomic_flag[NUM_LOCKS]),
+                compared(num_values)
+            {
+                for (uint32_t i=0; i < num_values; i++) {
+                    kth_similarity[i].store(neighbors[i].smallest_value(), std::memory_order_relaxed);
+                }
+                for (uint32_t i=0; i < NUM_LOCKS; i++) {
+                    locks[i].clear();
+                }
+            }
+
+            // Add a neighbor to a value unless it is less similar than the k'th neighbor.
+            void add_neighbor(uint32_t idx, uint32_t neighbor, float similarity) {
+                if (similarity <= kth_similarity[idx].load(std::memory_order_relaxed)) {
+                    return;
+                }
+                auto& lock = locks[idx%NUM_LOCKS];
+                while (lock.test_and_set(std::memory_order_acquire)) {}
+                neighbors[idx].insert(neighbor, similarity);
+                kth_similarity[idx].store(neighbors[idx].smallest_value(), std::memory_order_relaxed);
+                lock.clear(std::memory_order_release);
+            }
+
+            KnnGraph graph() {
+                KnnGraph res;
+                res.offsets.reserve(neighbors.size()+1);
+                for (auto& buffer : neighbors) {
+                    for (auto& entry : buffer.best_entries()) {
+                        res.neighbors.push_back(entry.first);
+                        res.similarities.push_back(entry.second);
+                    }
+                    res.offsets.push_back(res.neighbors.size());
+                }
+                return res;
+            }
+        };
+
+        // Join the values in all tables level by level, from the longest shared hash prefix
+        // to the shortest.
+        //
+        // In each level, the blocks of pairs that first share a prefix of that length
+        // are added to the schedule and compare_level() is called to compare them.
+        // Afterwards, finish_level(depth) is called, which returns whether to stop.
+        template <typename TCompare, typename TFinish>
+        void join_levels(PairSchedule& schedule, TCompare&& compare_level, TFinish&& finish_level) {
             // Store segments efficiently (?).
             // indices in segments[i][j-1], ..., segments[i][j]-1 in lsh_maps[i]
             // share the same hash code.
+            // The boundaries of the next level are written to new_segments,
+            // after which the two are swapped to reuse their memory.
             std::vector<std::vector<uint32_t>> segments (lsh_maps.size());
+            std::vector<std::vector<uint32_t>> new_segments (lsh_maps.size());
 
             g_performance_metrics.start_timer(Computation::SearchInit);
 
             // Set up data structures. Create segments for initial hash codes.
-            #pragma omp parallel for
+            #pragma omp parallel for schedule(dynamic)
             for (size_t i = 0; i < lsh_maps.size(); i++) {
-                int tid = omp_get_thread_num();
+                schedule.clear_table(i);
                 segments[i].push_back(0);
                 for (size_t j = 1; j < lsh_maps[i].hashes.size(); j++) {
                     if (lsh_maps[i].hashes[j] != lsh_maps[i].hashes[j-1]) {
@@ -438,32 +1301,26 @@ namespace puffinn {
                 // Carry out initial all-to-all comparisons within a segment.
                 // We leave out the first and last segment since it's filled up with filler elements.
                 for (size_t j = 2; j < segments[i].size() - 1; j++) { 
-                    auto range = lsh_maps[i].get_segment(segments[i][j-1], segments[i][j]);
-                    for (auto r = range.first; r < range.second; r++) {
-                        for (auto s = r + 1; s < range.second; s++) {
-                            auto R = *r;
-                            auto S = *s;
-                            // comparisons++;
-                            auto dist = TSim::compute_similarity(
-                                dataset[R], 
-                                dataset[S], 
-                                dataset.get_description());
-                            tl_maxbuffer[tid].insert(std::make_pair(R, S), dist);
-                        }
-                    }
-                }            
+                    schedule.add_blocks(
+                        i,
+                        segments[i][j-1], segments[i][j],
+                        segments[i][j-1], segments[i][j]);
+                }
+                schedule.close_task(i);
             }
+            schedule.collect_tasks();
+            compare_level();
             g_performance_metrics.store_time(Computation::SearchInit);
 
             uint32_t prefix_mask = 0xffffffff;
             for (int depth = MAX_HASHBITS; depth >= 0; depth--) {
                 // check current level
                 g_performance_metrics.start_timer(Computation::Search);
-                std::vector<std::vector<uint32_t>> new_segments (lsh_maps.size());
 
-                #pragma omp parallel for
+                #pragma omp parallel for schedule(dynamic)
                 for (size_t i = 0; i < lsh_maps.size(); i++) {
-                    int tid = omp_get_thread_num();
+                    schedule.clear_table(i);
+                    new_segments[i].clear();
                     new_segments[i].push_back(0);
 
                     // check each pair of adjacent segments in lsh_maps[i] in ``depth``.
@@ -471,71 +1328,476 @@ namespace puffinn {
                         auto left = (lsh_maps[i].hashes[segments[i][j - 1]]) & prefix_mask;
                         auto actual = (lsh_maps[i].hashes[segments[i][j]]) & prefix_mask;
                         if (left == actual) {
-                            for (uint32_t r = segments[i][j-1]; r < segments[i][j]; r++) {
-                                for (uint32_t s = segments[i][j]; s < segments[i][j + 1]; s++) {
-                                    auto R = lsh_maps[i].indices[r];
-                                    auto S = lsh_maps[i].indices[s];
-
-                                    auto dist = TSim::compute_similarity(
-                                        dataset[R], 
-                                        dataset[S], 
-                                        dataset.get_description());
-                                    tl_maxbuffer[tid].insert(std::make_pair(R, S), dist);
-                                }
-                            }
+                            schedule.add_blocks(
+                                i,
+                                segments[i][j-1], segments[i][j],
+                                segments[i][j], segments[i][j+1]);
                         } else {
                             new_segments[i].push_back(segments[i][j]);
                         }
                     }
+                    schedule.close_task(i);
                 } 
+                schedule.collect_tasks();
+                compare_level();
                 g_performance_metrics.store_time(Computation::Search);   
 
-                for (size_t tid=1; tid<nthreads; tid++) {
-                    tl_maxbuffer[0].add_all(tl_maxbuffer[tid]);
-                }
-            
-                // remove inactive nodes
-                auto kth_similarity = tl_maxbuffer[0].smallest_value();
-                auto table_idx = lsh_maps.size();
-                auto last_tables = (depth == MAX_HASHBITS ? table_idx : lsh_maps.size());
-                float failure_prob = hash_source->failure_probability(
-                    depth,
-                    table_idx,
-                    last_tables,
-                    kth_similarity
-                );
-                // g_performance_metrics.store_time(Computation::CheckTermination);
-                if (failure_prob <= 1-recall) {
+                if (finish_level(depth)) {
                     break;
                 }
 
                 // prepare next round
-                segments = new_segments;
+                std::swap(segments, new_segments);
                 prefix_mask <<= 1;
             }
-            g_performance_metrics.store_time(Computation::Total);
-            return tl_maxbuffer[0].best_indices();
         }
 
-        MaxPairBuffer global_bf_join(unsigned int k) {
-            MaxPairBuffer maxbuffer(k);
-            g_performance_metrics.new_query();
-            g_performance_metrics.start_timer(Computation::Total);
-            for (size_t r = 0; r < dataset.get_size(); r++) {
-                for (size_t s = r + 1; s < dataset.get_size(); s++) {
-                    auto dist = TSim::compute_similarity(
-                        dataset[r], 
-                        dataset[s], 
+        // Join the values in this index with those in another index sharing its hash functions,
+        // level by level as in join_levels.
+        //
+        // The tables of the two indexes are merged by scanning the groups of values
+        // in the other index that share a prefix and searching for the same prefix in this index.
+        // In the added blocks, the rows are positions in a table of this index and the columns
+        // are positions in the same table of the other index, offset by the size of this table.
+        template <typename TCompare, typename TFinish>
+        void join_levels_with(
+            const Index& other,
+            PairSchedule& schedule,
+            TCompare&& compare_level,
+            TFinish&& finish_level
+        ) {
+            auto num_tables = std::min(lsh_maps.size(), other.lsh_maps.size());
+            uint32_t prefix_mask = 0xffffffff;
+            // The bit removed from the prefix in the current level.
+            uint32_t removed_bit = 0;
+            bool initial = true;
+            for (int depth = MAX_HASHBITS; depth >= 0; depth--) {
+                g_performance_metrics.start_timer(
+                    initial ? Computation::SearchInit : Computation::Search);
+                #pragma omp parallel for schedule(dynamic)
+                for (size_t i = 0; i < num_tables; i++) {
+                    schedule.clear_table(i);
+                    // The first level contains the pairs with equal hashes.
+                    // Otherwise, the pairs with equal prefixes that differ in the removed bit
+                    // are new in this level.
+                    if (initial || removed_bit != 0) {
+                        add_join_blocks(other.lsh_maps[i], i, prefix_mask, removed_bit, schedule);
+                    }
+                    schedule.close_task(i);
+                }
+                schedule.collect_tasks();
+                compare_level();
+                g_performance_metrics.store_time(
+                    initial ? Computation::SearchInit : Computation::Search);
+                if (initial) {
+                    // The level with the full hashes is checked for termination
+                    // after the next one, as in join_levels.
+                    initial = false;
+                    depth++;
+                    continue;
+                }
+
+                if (finish_level(depth)) {
+                    break;
+                }
+                prefix_mask <<= 1;
+                removed_bit = (removed_bit == 0 ? 1 : removed_bit << 1);
+            }
+        }
+
+        // Add the blocks of pairs in a table of this and another index
+        // whose hashes are equal when masked, but differ in the removed bit.
+        // If the removed bit is 0, all pairs with equal masked hashes are added.
+        void add_join_blocks(
+            const PrefixMap<THash>& other_map,
+            size_t table,
+            uint32_t prefix_mask,
+            uint32_t removed_bit,
+            PairSchedule& schedule
+        ) const {
+            auto& map = lsh_maps[table];
+            // Positions in the other table are offset so that they come after this table.
+            uint32_t offset = map.hashes.size();
+            // The first and last SEGMENT_SIZE values are padding.
+            uint32_t r = SEGMENT_SIZE;
+            uint32_t r_last = map.hashes.size()-SEGMENT_SIZE;
+            uint32_t s = SEGMENT_SIZE;
+            uint32_t s_last = other_map.hashes.size()-SEGMENT_SIZE;
+            // Find the first position in a range whose masked hash is at least the given value.
+            auto lower_bound = [](
+                const LargeVector<LshDatatype>& hashes,
+                uint32_t begin,
+                uint32_t end,
+                LshDatatype value,
+                uint32_t mask
+            ) {
+                return static_cast<uint32_t>(std::lower_bound(
+                    hashes.begin()+begin,
+                    hashes.begin()+end,
+                    value,
+                    [mask](LshDatatype hash, LshDatatype value) {
+                        return (hash & mask) < value;
+                    }) - hashes.begin());
+            };
+            while (s < s_last && r < r_last) {
+                auto prefix = other_map.hashes[s] & prefix_mask;
+                uint32_t s_end = s+1;
+                while (s_end < s_last && (other_map.hashes[s_end] & prefix_mask) == prefix) {
+                    s_end++;
+                }
+                r = lower_bound(map.hashes, r, r_last, prefix, prefix_mask);
+                auto r_end = lower_bound(map.hashes, r, r_last, prefix+1, prefix_mask);
+                if (removed_bit == 0) {
+                    schedule.add_blocks(table, r, r_end, offset+s, offset+s_end);
+                } else if (r != r_end) {
+                    // Within the prefix, values with the removed bit set come last.
+                    auto mask = prefix_mask | removed_bit;
+                    auto r_split = lower_bound(map.hashes, r, r_end, prefix | removed_bit, mask);
+                    auto s_split = lower_bound(other_map.hashes, s, s_end, prefix | removed_bit, mask);
+                    schedule.add_blocks(table, r, r_split, offset+s_split, offset+s_end);
+                    schedule.add_blocks(table, r_split, r_end, offset+s, offset+s_split);
+                }
+                r = r_end;
+                s = s_end;
+            }
+        }
+
+        // Compare the pairs in all tasks of the current level of a join with another index.
+        //
+        // Pairs that are not filtered out are passed to visit(tid, r, s, similarity, threshold),
+        // where threshold is the shared threshold at the start of the block.
+        template <typename TVisit>
+        void compare_join_pairs(const Index& other, PairSearch& state, TVisit&& visit) {
+            auto desc = dataset.get_description();
+            uint32_t num_values = dataset.get_size();
+            #pragma omp parallel for schedule(dynamic)
+            for (size_t task_idx = 0; task_idx < state.tasks.size(); task_idx++) {
+                int tid = omp_get_thread_num();
+                auto& task = state.tasks[task_idx];
+                auto& map = lsh_maps[task.table];
+                auto& other_map = other.lsh_maps[task.table];
+                uint32_t offset = map.hashes.size();
+                auto sketch_idx = task.table%NUM_SKETCHES;
+                auto& filter = state.tl_filter[tid];
+                for (auto b = task.first_block; b < task.last_block; b++) {
+                    auto& block = state.blocks[task.table][b];
+                    float threshold = state.threshold.load(std::memory_order_relaxed);
+                    for (uint32_t r = block.row_begin; r < block.row_end; r++) {
+                        auto R = map.indices[r];
+                        for (uint32_t s = block.col_begin; s < block.col_end; s++) {
+                            auto S = other_map.indices[s-offset];
+                            if (state.use_sketches) {
+                                uint_fast8_t sketch_diff = popcountll(
+                                    filterer.get_sketch(R, sketch_idx)
+                                    ^ other.filterer.get_sketch(S, sketch_idx));
+                                if (sketch_diff > filter.max_sketch_diff) {
+                                    continue;
+                                }
+                            }
+                            // Indices in the other index are offset to distinguish (r, s) and (s, r).
+                            if (state.compared.insert(R, num_values+S)) {
+                                continue;
+                            }
+                            auto sim = TSim::compute_similarity(dataset[R], other.dataset[S], desc);
+                            visit(tid, R, S, sim, threshold);
+                        }
+                    }
+                    finish_block(state, tid);
+                }
+            }
+        }
+
+        // Compare the pairs in all tasks of the current level of knn_graph.
+        void compare_neighbors(KnnSearch& state) {
+            auto desc = dataset.get_description();
+            #pragma omp parallel for schedule(dynamic)
+            for (size_t task_idx = 0; task_idx < state.tasks.size(); task_idx++) {
+                auto& task = state.tasks[task_idx];
+                auto& map = lsh_maps[task.table];
+                for (auto b = task.first_block; b < task.last_block; b++) {
+                    auto& block = state.blocks[task.table][b];
+                    for (uint32_t r = block.row_begin; r < block.row_end; r++) {
+                        for (uint32_t s = std::max(block.col_begin, r+1); s < block.col_end; s++) {
+                            auto R = map.indices[r];
+                            auto S = map.indices[s];
+                            if (!state.active[R] && !state.active[S]) {
+                                continue;
+                            }
+                            if (state.compared.insert(R, S)) {
+                                continue;
+                            }
+                            auto sim = TSim::compute_similarity(dataset[R], dataset[S], desc);
+                            state.add_neighbor(R, S, sim);
+                            state.add_neighbor(S, R, sim);
+                        }
+                    }
+                }
+            }
+        }
+
+        // Find the smallest similarity, up to a small error, for which a pair would have collided
+        // at the given depth with probability at least ``recall``.
+        // Returns a value above 1 if no similarity is large enough.
+        float min_certain_similarity(
+            int depth,
+            size_t tables,
+            size_t last_tables,
+            float recall
+        ) const {
+            auto certain = [&](float similarity) {
+                return hash_source->failure_probability(
+                    depth, tables, last_tables, similarity) <= 1-recall;
+            };
+            if (!certain(1.0)) {
+                return 2.0;
+            }
+            // The failure probability decreases as the similarity increases.
+            float low = 0.0;
+            float high = 1.0;
+            for (int i=0; i < 20; i++) {
+                float mid = (low+high)/2;
+                if (certain(mid)) {
+                    high = mid;
+                } else {
+                    low = mid;
+                }
+            }
+            return high;
+        }
+
+        // Stop searching for the values whose k'th neighbor is at least as similar as
+        // the given similarity.
+        // Returns the number of values that are still searched for.
+        size_t deactivate_neighbors(KnnSearch& state, float min_similarity) {
+            size_t num_active = 0;
+            #pragma omp parallel for reduction(+: num_active)
+            for (size_t i = 0; i < state.neighbors.size(); i++) {
+                if (!state.active[i]) {
+                    continue;
+                }
+                state.neighbors[i].compact();
+                auto kth = state.neighbors[i].smallest_value();
+                state.kth_similarity[i].store(kth, std::memory_order_relaxed);
+                if (kth >= min_similarity) {
+                    state.active[i] = 0;
+                } else {
+                    num_active++;
+                }
+            }
+            return num_active;
+        }
+
+        // Place the large arrays of the index on NUMA nodes according to the current policy.
+        void apply_numa_policy() const {
+            dataset.apply_numa_policy(numa_policy);
+            filterer.apply_numa_policy(numa_policy);
+            #pragma omp parallel for schedule(dynamic)
+            for (size_t i = 0; i < lsh_maps.size(); i++) {
+                lsh_maps[i].apply_numa_policy(numa_policy);
+            }
+        }
+
+        // Compare the pairs in all tasks of the current level.
+        //
+        // Pairs that are not filtered out are passed to visit(tid, r, s, similarity).
+        template <typename TVisit>
+        void compare_pairs(PairSearch& state, TVisit&& visit) {
+            compare_pairs(state, visit, [](int) {});
+        }
+
+        // Compare the pairs in all tasks of the current level,
+        // calling flush(tid) after each block is compared.
+        template <typename TVisit, typename TFlush>
+        void compare_pairs(PairSearch& state, TVisit&& visit, TFlush&& flush) {
+            #pragma omp parallel for schedule(dynamic)
+            for (size_t task_idx = 0; task_idx < state.tasks.size(); task_idx++) {
+                int tid = omp_get_thread_num();
+                auto& task = state.tasks[task_idx];
+                for (auto b = task.first_block; b < task.last_block; b++) {
+                    compare_block(
+                        state,
+                        tid,
+                        task.table,
+                        state.blocks[task.table][b],
+                        visit,
+                        HasBlockSimilarity<TSim>());
+                    flush(tid);
+                }
+            }
+        }
+
+        // Compare the pairs in a block one at a time.
+        template <typename TVisit>
+        void compare_block(
+            PairSearch& state,
+            int tid,
+            uint32_t table,
+            const PairBlock& block,
+            TVisit& visit,
+            std::false_type
+        ) {
+            auto& map = lsh_maps[table];
+            auto sketch_idx = table%NUM_SKETCHES;
+            auto& filter = state.tl_filter[tid];
+            for (uint32_t r = block.row_begin; r < block.row_end; r++) {
+                for (uint32_t s = std::max(block.col_begin, r+1); s < block.col_end; s++) {
+                    auto R = map.indices[r];
+                    auto S = map.indices[s];
+                    if (state.use_sketches && !pair_passes_filter(filter, R, S, sketch_idx)) {
+                        continue;
+                    }
+                    if (state.compared.insert(R, S)) {
+                        continue;
+                    }
+                    auto sim = TSim::compute_similarity(
+                        dataset[R],
+                        dataset[S],
                         dataset.get_description());
-                    maxbuffer.insert(std::make_pair(r, s), dist);
+                    visit(tid, R, S, sim);
                 }
             }
-            g_performance_metrics.store_time(Computation::Total);
-            return maxbuffer;//.best_indices();
+            finish_block(state, tid);
         }
 
-    private:
-        std::vector<unsigned int> search_bf_formatted_query(
+        // Compare the pairs in a block, using tiles if the block is large.
+        //
+        // The values of each tile are gathered into contiguous memory
+        // and all of their similarities are computed at once.
+        // This is cheaper than filtering each pair in large blocks.
+        // Searches at a fixed threshold record the pairs in the cache as when comparing
+        // one pair at a time, so that they are not compared again in other tables.
+        template <typename TVisit>
+        void compare_block(
+            PairSearch& state,
+            int tid,
+            uint32_t table,
+            const PairBlock& block,
+            TVisit& visit,
+            std::true_type
+        ) {
+            uint64_t num_rows = block.row_end-block.row_begin;
+            uint64_t num_cols = block.col_end-std::max(block.col_begin, block.row_begin+1);
+            if (
+                num_rows*num_cols < MIN_TILED_PAIRS ||
+                mostly_compared(state.compared, lsh_maps[table], block)
+            ) {
+                compare_block(state, tid, table, block, visit, std::false_type());
+                return;
+            }
+
+            auto desc = dataset.get_description();
+            auto& map = lsh_maps[table];
+            bool record_pairs = (state.k == 0);
+            auto row_tile = state.tl_tiles[2*tid].get();
+            auto col_tile = state.tl_tiles[2*tid+1].get();
+            for (uint32_t r0 = block.row_begin; r0 < block.row_end; r0 += PAIR_TILE_SIZE) {
+                uint32_t r1 = std::min(r0+PAIR_TILE_SIZE, block.row_end);
+                gather(map, r0, r1, row_tile);
+                for (
+                    uint32_t c0 = std::max(block.col_begin, r0+1);
+                    c0 < block.col_end;
+                    c0 += PAIR_TILE_SIZE
+                ) {
+                    uint32_t c1 = std::min(c0+PAIR_TILE_SIZE, block.col_end);
+                    gather(map, c0, c1, col_tile);
+                    TSim::compute_similarities(
+                        row_tile, r1-r0, col_tile, c1-c0, desc,
+                        [&](unsigned int i, unsigned int j, float sim) {
+                            if (c0+j <= r0+i) {
+                                return;
+                            }
+                            auto R = map.indices[r0+i];
+                            auto S = map.indices[c0+j];
+                            if (record_pairs && state.compared.insert(R, S)) {
+                                return;
+                            }
+                            visit(tid, R, S, sim);
+                        });
+                }
+            }
+            finish_block(state, tid);
+        }
+
+        // Share the k'th similarity found by a thread after comparing a block.
+        void finish_block(PairSearch& state, int tid) {
+            // Searches at a fixed threshold do not keep the best pairs.
+            if (state.k == 0) {
+                return;
+            }
+            auto threshold = state.publish_threshold(state.tl_maxbuffer[tid].smallest_value());
+            if (state.tighten_filters) {
+                update_pair_filter(state.tl_filter[tid], threshold);
+            }
+        }
+
+        // Merge the buffers of all threads into the first one using a parallel tree reduction.
+        void merge_pair_buffers(PairSearch& state) {
+            auto& buffers = state.tl_maxbuffer;
+            for (size_t step = 1; step < buffers.size(); step *= 2) {
+                #pragma omp parallel for
+                for (size_t tid = 0; tid < buffers.size()-step; tid += 2*step) {
+                    buffers[tid].add_all(buffers[tid+step]);
+                }
+            }
+        }
+
+        // Estimate whether most pairs in a block have already been compared,
+        // by looking up evenly spread pairs in the cache.
+        // Comparing these pairs one at a time is then cheaper than computing the whole block.
+        bool mostly_compared(
+            const PairCache& compared,
+            const PrefixMap<THash>& map,
+            const PairBlock& block
+        ) const {
+            unsigned int hits = 0;
+            uint32_t num_rows = block.row_end-block.row_begin;
+            for (unsigned int i=0; i < PAIR_CACHE_SAMPLES; i++) {
+                uint32_t r = block.row_begin+static_cast<uint64_t>(i)*num_rows/PAIR_CACHE_SAMPLES;
+                uint32_t first_col = std::max(block.col_begin, r+1);
+                if (first_col >= block.col_end) {
+                    continue;
+                }
+                uint32_t s = first_col
+                    + static_cast<uint64_t>(i)*(block.col_end-first_col)/PAIR_CACHE_SAMPLES;
+                hits += compared.contains(map.indices[r], map.indices[s]);
+            }
+            return 2*hits > PAIR_CACHE_SAMPLES;
+        }
+
+        // Copy the values at consecutive positions in a table into contiguous memory.
+        void gather(
+            const PrefixMap<THash>& map,
+            uint32_t begin,
+            uint32_t end,
+            typename TSim::Format::Type* tile
+        ) const {
+            auto storage_len = dataset.get_description().storage_len;
+            for (uint32_t pos = begin; pos < end; pos++) {
+                auto value = dataset[map.indices[pos]];
+                std::copy(value, value+storage_len, &tile[(pos-begin)*storage_len]);
+            }
+        }
+
+        // Make the filter only accept pairs that can be at least as similar as the given value.
+        void update_pair_filter(PairFilter& filter, float kth_similarity) const {
+            if (kth_similarity > filter.similarity) {
+                filter.similarity = kth_similarity;
+                filter.max_sketch_diff = filterer.get_max_sketch_diff(kth_similarity);
+            }
+        }
+
+        bool pair_passes_filter(
+            const PairFilter& filter,
+            uint32_t r,
+            uint32_t s,
+            int_fast32_t sketch_idx
+        ) const {
+            uint_fast8_t sketch_diff = popcountll(
+                filterer.get_sketch(r, sketch_idx) ^ filterer.get_sketch(s, sketch_idx));
+            return sketch_diff <= filter.max_sketch_diff;
+        }
+
+        MaxBuffer search_bf_formatted_query(
             typename TSim::Format::Type* query,
             unsigned int k
         ) const {
@@ -547,36 +1809,61 @@ namespace puffinn {
                     dataset.get_description());
                 res.insert(i, sim);
             }
-            std::vector<uint32_t> res_indices;
-            for (auto p : res.best_entries()) {
-                res_indices.push_back(p.first);
-            }
-            return res_indices;
+            return res;
         }
 
-        std::vector<uint32_t> search_formatted_query(
+        MaxBuffer search_formatted_query(
             typename TSim::Format::Type* query,
             unsigned int k,
             float recall,
             FilterType filter_type
+        ) {
+            QueryStats stats;
+            return search_formatted_query(query, k, recall, filter_type, stats);
+        }
+
+        MaxBuffer search_formatted_query(
+            typename TSim::Format::Type* query,
+            unsigned int k,
+            float recall,
+            FilterType filter_type,
+            QueryStats& stats
         ) {
             if (dataset.get_size() < 100) {
                 // Due to optimizations values near the edges in prefixmaps are discarded.
                 // When there are fewer total values than SEGMENT_SIZE, all values will be skipped.
                 // However at that point, brute force is likely to be faster regardless.
+                stats.candidates = dataset.get_size();
+                stats.candidates_passing_filter = dataset.get_size();
+                stats.distance_computations = dataset.get_size();
                 return search_bf_formatted_query(query, k);
             }
             g_performance_metrics.new_query();
             g_performance_metrics.start_timer(Computation::Total);
 
             MaxBuffer maxbuffer(k);
-            g_performance_metrics.start_timer(Computation::Hashing);
-            hash_source->hash_repetitions(query, this->query_hashes);
-            g_performance_metrics.store_time(Computation::Hashing);
+            auto hash_query = Hashed::view(
+                query,
+                1,
+                dataset.get_description(),
+                query_hash_scratch);
+            if (hash_args->provides_sketches()) {
+                g_performance_metrics.start_timer(Computation::Hashing);
+                hash_source->hash_and_sketch(
+                    hash_query,
+                    this->query_hashes,
+                    this->query_sketches.query_sketches);
+                this->query_sketches.max_sketch_diff = NUM_FILTER_HASHBITS;
+                g_performance_metrics.store_time(Computation::Hashing);
+            } else {
+                g_performance_metrics.start_timer(Computation::Hashing);
+                hash_source->hash_repetitions(hash_query, this->query_hashes, this->query_scratch);
+                g_performance_metrics.store_time(Computation::Hashing);
 
-            g_performance_metrics.start_timer(Computation::Sketching);
-            filterer.sketch(query, this->query_sketches);
-            g_performance_metrics.store_time(Computation::Sketching);
+                g_performance_metrics.start_timer(Computation::Sketching);
+                filterer.sketch(hash_query, this->query_sketches, this->query_scratch);
+                g_performance_metrics.store_time(Computation::Sketching);
+            }
 
             g_performance_metrics.start_timer(Computation::Search);
             switch (filter_type) {
@@ -586,7 +1873,8 @@ namespace puffinn {
                         maxbuffer,
                         recall,
                         this->query_sketches,
-                        this->query_hashes);
+                        this->query_hashes,
+                        stats);
                     break;
                 case FilterType::Simple:
                     search_maps_simple_filter(
@@ -594,7 +1882,8 @@ namespace puffinn {
                         maxbuffer,
                         recall,
                         this->query_sketches,
-                        this->query_hashes);
+                        this->query_hashes,
+                        stats);
                     break;
                 default:
                     search_maps(
@@ -602,14 +1891,19 @@ namespace puffinn {
                         maxbuffer, 
                         recall, 
                         this->query_sketches, 
-                        this->query_hashes
+                        this->query_hashes,
+                        stats
                     );
             }
             g_performance_metrics.store_time(Computation::Search);
+            g_performance_metrics.add_candidates(stats.candidates);
+            g_performance_metrics.add_distance_computations(stats.distance_computations);
+            g_performance_metrics.set_hash_length(stats.depth);
+            g_performance_metrics.set_considered_maps(stats.considered_maps);
 
-            auto res = maxbuffer.best_indices();
+            maxbuffer.compact();
             g_performance_metrics.store_time(Computation::Total);
-            return res;
+            return maxbuffer;
         }
 
         // Size of buffer of 4element segments to consider at once.
@@ -685,7 +1979,8 @@ namespace puffinn {
             MaxBuffer& maxbuffer,
             float recall,
             QuerySketches sketches,
-            std::vector<uint64_t> & query_hashes
+            std::vector<uint64_t> & query_hashes,
+            QueryStats& stats
         ) const {
             SearchBuffers buffers(lsh_maps, sketches, query_hashes);
             for (uint_fast8_t depth=MAX_HASHBITS; depth > 0; depth--) {
@@ -693,6 +1988,9 @@ namespace puffinn {
                 g_performance_metrics.start_timer(Computation::Consider);
                 for (uint_fast32_t range_idx=0; range_idx < buffers.num_ranges; range_idx++) {
                     auto range = buffers.ranges[range_idx];
+                    stats.candidates += range.second-range.first;
+                    stats.candidates_passing_filter += range.second-range.first;
+                    stats.distance_computations += range.second-range.first;
                     while (range.first != range.second) {
                         auto idx = *range.first;
                         auto dist = TSim::compute_similarity(
@@ -715,13 +2013,14 @@ namespace puffinn {
                     kth_similarity
                 );
                 g_performance_metrics.store_time(Computation::CheckTermination);
+                stats.failure_probability = failure_prob;
                 if (failure_prob <= 1-recall) {
-                    g_performance_metrics.set_hash_length(depth);
-                    g_performance_metrics.set_considered_maps(
-                        (MAX_HASHBITS-depth+1)*lsh_maps.size());
+                    stats.depth = depth;
+                    stats.considered_maps = (MAX_HASHBITS-depth+1)*lsh_maps.size();
                     return;
                 }
             }
+            stats.considered_maps = MAX_HASHBITS*lsh_maps.size();
         }
 
         // Search maps with a simple implementation of filtering.
@@ -731,7 +2030,8 @@ namespace puffinn {
             float recall,
             QuerySketches sketches,
             // TODO make const
-            std::vector<uint64_t> & query_hashes
+            std::vector<uint64_t> & query_hashes,
+            QueryStats& stats
         ) const {
             SearchBuffers buffers(lsh_maps, sketches, query_hashes);
             for (uint_fast8_t depth=MAX_HASHBITS; depth > 0; depth--) {
@@ -739,11 +2039,14 @@ namespace puffinn {
                 g_performance_metrics.start_timer(Computation::Consider);
                 for (uint_fast32_t range_idx=0; range_idx < buffers.num_ranges; range_idx++) {
                     auto range = buffers.ranges[range_idx];
+                    stats.candidates += range.second-range.first;
                     while (range.first != range.second) {
                         auto idx = *range.first;
                         auto sketch_idx = range_idx%NUM_SKETCHES;
                         auto sketch = filterer.get_sketch(idx, sketch_idx);
                         if (buffers.sketches.passes_filter(sketch, sketch_idx)) {
+                            stats.candidates_passing_filter++;
+                            stats.distance_computations++;
                             auto dist = TSim::compute_similarity(
                                 query,
                                 dataset[idx],
@@ -767,13 +2070,14 @@ namespace puffinn {
                     kth_similarity
                 );
                 g_performance_metrics.store_time(Computation::CheckTermination);
+                stats.failure_probability = failure_prob;
                 if (failure_prob <= 1-recall) {
-                    g_performance_metrics.set_hash_length(depth);
-                    g_performance_metrics.set_considered_maps(
-                        (MAX_HASHBITS-depth+1)*lsh_maps.size());
+                    stats.depth = depth;
+                    stats.considered_maps = (MAX_HASHBITS-depth+1)*lsh_maps.size();
                     return;
                 }
             }
+            stats.considered_maps = MAX_HASHBITS*lsh_maps.size();
         }
 
         // Search all maps and insert the candidates into the buffer.
@@ -783,7 +2087,8 @@ namespace puffinn {
             float recall,
             QuerySketches sketches,
             // TODO Make const
-            std::vector<uint64_t> & query_hashes
+            std::vector<uint64_t> & query_hashes,
+            QueryStats& stats
         ) const {
             const size_t FILTER_BUFFER_SIZE = 128;
 
@@ -873,7 +2178,7 @@ namespace puffinn {
                             range.first += 4;
                             range_idx += (range.first == range.second);
                         }
-                        g_performance_metrics.add_candidates(RING_SIZE*4);
+                        stats.candidates += RING_SIZE*4;
                     }
                     // Consider rest of values in ring when it isn't full.
                     // Can again add up to 4*RING_SIZE values to the buffer.
@@ -912,7 +2217,7 @@ namespace puffinn {
                         passing_filter[num_passing_filter] = v4;
                         num_passing_filter += p4;
                     }
-                    g_performance_metrics.add_candidates(4*(RING_SIZE-missing_ring_vals));
+                    stats.candidates += 4*(RING_SIZE-missing_ring_vals);
 
                     // Empty buffer
                     g_performance_metrics.store_time(Computation::Filtering);
@@ -929,7 +2234,8 @@ namespace puffinn {
                             dataset.get_description());
                         maxbuffer.insert(idx, dist);
                     }
-                    g_performance_metrics.add_distance_computations(num_passing_filter);
+                    stats.candidates_passing_filter += num_passing_filter;
+                    stats.distance_computations += num_passing_filter;
                     num_passing_filter = 0;
                     auto kth_similarity = maxbuffer.smallest_value();
                     buffers.sketches.max_sketch_diff = filterer.get_max_sketch_diff(kth_similarity);
@@ -946,16 +2252,17 @@ namespace puffinn {
                         kth_similarity
                     );
                     g_performance_metrics.store_time(Computation::CheckTermination);
+                    stats.failure_probability = failure_prob;
                     if (failure_prob <= 1-recall) {
-                        g_performance_metrics.set_hash_length(depth);
-                        g_performance_metrics.set_considered_maps(
-                            (MAX_HASHBITS-depth)*lsh_maps.size()+table_idx);
+                        stats.depth = depth;
+                        stats.considered_maps = (MAX_HASHBITS-depth)*lsh_maps.size()+table_idx;
                         return;
                     }
                     g_performance_metrics.start_timer(Computation::Filtering);
                 }
                 g_performance_metrics.store_time(Computation::Filtering);
             }
+            stats.considered_maps = MAX_HASHBITS*lsh_maps.size();
         }
 
         void serialize_chunk(std::ostream& out, size_t idx) const {
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "puffinn/format/generic.hpp"
+#include "puffinn/memory.hpp"
+#include "puffinn/numa.hpp"
 #include "puffinn/typedefs.hpp"
 
 #include <cstring>
@@ -134,13 +136,28 @@ namespace puffinn {
         }
 
         uint64_t memory_usage() const {
+            return memory_report().capacity;
+        }
+
+        // Place the stored vectors on the NUMA nodes according to the policy.
+        void apply_numa_policy(NumaPolicy policy) const {
+            puffinn::apply_numa_policy(
+                data.get(),
+                static_cast<size_t>(capacity)*storage_len*sizeof(typename T::Type),
+                policy);
+        }
+
+        // Measure the memory used by the stored vectors.
+        MemoryUsage memory_report() const {
             uint64_t inner_memory = 0;
             for (size_t i=0; i < inserted_vectors*storage_len; i++) {
-                inner_memory += T::inner_memory_usage(data.get()[i]); 
+                inner_memory += T::inner_memory_usage(data.get()[i]);
             }
-            return sizeof(Dataset<T>)
-                + capacity*storage_len*sizeof(typename T::Type)
-                + inner_memory;
+            return MemoryUsage(
+                sizeof(Dataset<T>)
+                    + inserted_vectors*storage_len*sizeof(typename T::Type)
+                    + inner_memory,
+                sizeof(Dataset<T>) + data.memory_usage() + inner_memory);
         }
     };
 }
@@ -4,6 +4,10 @@
 #include "puffinn/typedefs.hpp"
 #include "puffinn/hash_source/deserialize.hpp"
 #include "puffinn/hash_source/hash_source.hpp"
+#include "puffinn/hash_source/independent.hpp"
+#include "puffinn/huge_pages.hpp"
+#include "puffinn/memory.hpp"
+#include "puffinn/numa.hpp"
 #include "puffinn/performance.hpp"
 
 #include "omp.h"
@@ -11,11 +15,9 @@
 #include <cstring>
 #include <immintrin.h>
 #include <memory>
+#include <utility>
 
 namespace puffinn {
-    const size_t NUM_SKETCHES = 32;
-    const size_t LOG_NUM_SKETCHES = 5;
-
     // Sketches for a single query.
     struct QuerySketches {
         // Sketches for the current query.
@@ -31,26 +33,67 @@ namespace puffinn {
         }
     };
 
+    // Written at the start of a serialized filterer, followed by the version of its format.
+    // Filterers serialized before the format was versioned start with a flag or a hash source type,
+    // which never match it.
+    const uint32_t FILTERER_FORMAT_MAGIC = 0x46465550; // "PUFF"
+    // Incremented whenever the serialized format of the filterer or its hash source changes.
+    const uint32_t FILTERER_FORMAT_VERSION = 1;
+
     template <typename T>
     class Filterer {
         std::unique_ptr<HashSource<T>> hash_source;
 
         // Filters are stored with sketches for the same value adjacent.
-        std::vector<FilterLshDatatype> sketches;
+        LargeVector<FilterLshDatatype> sketches;
         std::unique_ptr<HashSourceArgs<T>> sketch_args;
+        // Whether the sketches are computed by the filterer.
+        // Otherwise they are computed elsewhere and stored using store_sketches,
+        // and the hash source is only used for its collision probabilities.
+        bool computes_sketches;
+
+        Filterer(
+            std::unique_ptr<HashSource<T>> hash_source,
+            std::unique_ptr<HashSourceArgs<T>> sketch_args,
+            bool computes_sketches
+        )
+          : hash_source(std::move(hash_source)),
+            sketch_args(std::move(sketch_args)),
+            computes_sketches(computes_sketches)
+        {
+        }
 
     public:
-        Filterer(const HashSourceArgs<T>& args, DatasetDescription<typename T::Sim::Format> dataset)
-          : hash_source(
-                args.build(
-                    dataset,
-                    NUM_SKETCHES,
-                    NUM_FILTER_HASHBITS)),
-            sketch_args(args.copy())
+        // If compute_sketches is false, the given arguments are ignored
+        // and no sketching functions are sampled.
+        Filterer(
+            const HashSourceArgs<T>& args,
+            DatasetDescription<typename T::Sim::Format> dataset,
+            bool compute_sketches = true
+        )
+          : computes_sketches(compute_sketches)
         {
+            if (computes_sketches) {
+                sketch_args = args.copy();
+            } else {
+                sketch_args = std::make_unique<IndependentHashArgs<T>>();
+            }
+            hash_source = sketch_args->build(
+                dataset,
+                computes_sketches ? NUM_SKETCHES : 0,
+                NUM_FILTER_HASHBITS);
         }
 
+        // Throws std::invalid_argument if the filterer was serialized using another format.
         Filterer(std::istream& in) {
+            uint32_t magic = 0;
+            uint32_t version = 0;
+            in.read(reinterpret_cast<char*>(&magic), sizeof(uint32_t));
+            in.read(reinterpret_cast<char*>(&version), sizeof(uint32_t));
+            if (magic != FILTERER_FORMAT_MAGIC || version != FILTERER_FORMAT_VERSION) {
+                throw std::invalid_argument("unsupported serialization format");
+            }
+            in.read(reinterpret_cast<char*>(&computes_sketches), sizeof(bool));
             sketch_args = deserialize_hash_args<T>(in);
             hash_source = sketch_args->deserialize_source(in);
             size_t len;
@@ -60,6 +103,9 @@ namespace puffinn {
         }
 
         void serialize(std::ostream& out) const {
+            out.write(reinterpret_cast<const char*>(&FILTERER_FORMAT_MAGIC), sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(&FILTERER_FORMAT_VERSION), sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(&computes_sketches), sizeof(bool));
             sketch_args->serialize(out);
             hash_source->serialize(out);
             size_t len = sketches.size();
@@ -67,37 +113,95 @@ namespace puffinn {
             out.write(reinterpret_cast<const char*>(sketches.data()), len*sizeof(FilterLshDatatype));
         }
 
-        uint64_t memory_usage(DatasetDescription<typename T::Sim::Format> dataset) {
-            return sketch_args->memory_usage(dataset, NUM_SKETCHES, NUM_FILTER_HASHBITS)
-                + sketches.size()*sizeof(FilterLshDatatype)
-                + NUM_SKETCHES*sketch_args->function_memory_usage(dataset, NUM_FILTER_HASHBITS);
+        // Construct an empty filterer which uses copies of the sketching functions of this filterer,
+        // without sampling new functions.
+        // Sketches computed by it can be compared to those of this filterer.
+        Filterer copy_functions() const {
+            return Filterer(hash_source->clone(), sketch_args->copy(), computes_sketches);
+        }
+
+        // Measure the memory used by the stored sketches.
+        MemoryUsage sketch_memory() const {
+            return vector_memory(sketches);
+        }
+
+        // Place the stored sketches on the NUMA nodes according to the policy.
+        void apply_numa_policy(NumaPolicy policy) const {
+            puffinn::apply_numa_policy(sketches, policy);
+        }
+
+        // Number of bytes used by the sketching functions.
+        uint64_t function_memory_usage() const {
+            return hash_source->memory_usage();
         }
 
         void add_sketches(
             const Dataset<typename T::Sim::Format>& dataset,
             uint32_t first_index
         ) {
-            sketches.resize(dataset.get_size()*NUM_SKETCHES);
+            reserve_sketches(dataset.get_size());
 
             std::vector<std::vector<uint64_t>> tl_sketch_values;
             tl_sketch_values.resize(omp_get_max_threads());
-            for (size_t i=0; i < tl_sketch_values.size(); i++) {
-                tl_sketch_values[i].resize(NUM_SKETCHES);
-            }
-            #pragma omp parallel for
-            for (size_t idx = first_index; idx < dataset.get_size(); idx++) {
+            size_t num_new_vectors = dataset.get_size()-first_index;
+            size_t num_blocks = (num_new_vectors+HASH_BLOCK_SIZE-1)/HASH_BLOCK_SIZE;
+            #pragma omp parallel for schedule(dynamic)
+            for (size_t block=0; block < num_blocks; block++) {
                 auto tid = omp_get_thread_num();
-                auto & sketch_values = tl_sketch_values[tid];
-                hash_source->hash_repetitions(dataset[idx], sketch_values);
-                size_t offset = idx * NUM_SKETCHES;
-                for (size_t sketch_index = 0; sketch_index < NUM_SKETCHES; sketch_index++) {
-                    sketches[offset + sketch_index] = sketch_values[sketch_index];// (*hash_functions[sketch_index])(state.get());
-                }
+                size_t block_start = first_index+block*HASH_BLOCK_SIZE;
+                size_t block_len = std::min(HASH_BLOCK_SIZE, dataset.get_size()-block_start);
+                sketch_block(
+                    block_start,
+                    dataset[block_start],
+                    block_len,
+                    dataset.get_description().storage_len,
+                    tl_sketch_values[tid]);
             }
         }
 
-        void sketch(const typename T::Sim::Format::Type* const vec, QuerySketches & output) const {
-            hash_source->hash_repetitions(vec, output.query_sketches);
+        // Compute and store the sketches of consecutive values, which are stored `stride` apart.
+        // Space for the sketches must have been reserved using reserve_sketches.
+        // The buffer is used to hold the sketch values and can be reused across calls.
+        void sketch_block(
+            uint32_t first_index,
+            const typename T::Sim::Format::Type* vectors,
+            size_t num_values,
+            unsigned int stride,
+            std::vector<uint64_t>& sketch_values
+        ) {
+            hash_source->hash_repetitions_block(vectors, num_values, stride, sketch_values);
+            // The sketches of each vector are adjacent both in the output and in the filterer.
+            store_sketches(first_index, num_values, sketch_values.data());
+        }
+
+        // Make room for exactly the sketches of the given number of values,
+        // which are then stored using store_sketches.
+        void reserve_sketches(size_t num_values) {
+            sketches.reserve(num_values*NUM_SKETCHES);
+            sketches.resize(num_values*NUM_SKETCHES);
+        }
+
+        // Store sketches computed elsewhere for consecutive values,
+        // with the sketches of each value adjacent.
+        void store_sketches(
+            uint32_t first_index,
+            size_t num_values,
+            const FilterLshDatatype* values
+        ) {
+            std::copy(
+                values,
+                values+num_values*NUM_SKETCHES,
+                sketches.begin()+first_index*NUM_SKETCHES);
+        }
+
+        // Compute the sketches of a query.
+        // The scratch space can be reused across queries to avoid allocations.
+        void sketch(
+            const typename T::Sim::Format::Type* const vec,
+            QuerySketches & output,
+            std::vector<LshDatatype> & scratch
+        ) const {
+            hash_source->hash_repetitions(vec, output.query_sketches, scratch);
             output.max_sketch_diff = NUM_FILTER_HASHBITS;
         }
 
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <istream>
+#include <ostream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "puffinn/format/generic.hpp"
+#include "puffinn/typedefs.hpp"
+
+namespace puffinn {
+    /// A format for storing binary vectors, such as fingerprints or perceptual hashes.
+    ///
+    /// Both ``std::vector<bool>`` and ``std::vector<uint64_t>`` are supported as input type.
+    /// In the latter case, the bits are packed with bit ``i`` being bit ``i%64`` of word ``i/64``.
+    /// All bits above the number of dimensions must be zero.
+    ///
+    /// The bits are stored packed in 64-bit words using 256-bit alignment.
+    struct BinaryVectorFormat {
+        using Type = uint64_t;
+        /// Number of bits.
+        using Args = unsigned int;
+        // 256 bit vectors
+        const static unsigned int ALIGNMENT = 256/8;
+
+        // Number of bits in each stored value.
+        const static unsigned int BITS_PER_WORD = 64;
+
+        static unsigned int storage_dimensions(Args dimensions) {
+            return (dimensions+BITS_PER_WORD-1)/BITS_PER_WORD;
+        }
+
+        static void store(
+            const std::vector<bool>& input,
+            Type* storage,
+            DatasetDescription<BinaryVectorFormat> dataset
+        ) {
+            if (input.size() != dataset.args) {
+                throw std::invalid_argument("input.size()");
+            }
+            for (size_t i=0; i < dataset.storage_len; i++) {
+                storage[i] = 0;
+            }
+            for (size_t i=0; i < input.size(); i++) {
+                if (input[i]) {
+                    storage[i/BITS_PER_WORD] |= 1ull << (i%BITS_PER_WORD);
+                }
+            }
+        }
+
+        static void store(
+            const std::vector<uint64_t>& input,
+            Type* storage,
+            DatasetDescription<BinaryVectorFormat> dataset
+        ) {
+            auto num_words = storage_dimensions(dataset.args);
+            if (input.size() != num_words) {
+                throw std::invalid_argument("input.size()");
+            }
+            auto unused_bits = num_words*BITS_PER_WORD-dataset.args;
+            if (unused_bits != 0 && (input.back() >> (BITS_PER_WORD-unused_bits)) != 0) {
+                throw std::invalid_argument("bit outside range");
+            }
+            for (size_t i=0; i < num_words; i++) {
+                storage[i] = input[i];
+            }
+            for (size_t i=num_words; i < dataset.storage_len; i++) {
+                storage[i] = 0;
+            }
+        }
+
+        static void free(Type&) {}
+
+        static uint64_t inner_memory_usage(Type&) {
+            return 0;
+        }
+
+        // Generate a packed vector where each bit is set with probability 1/2.
+        static std::vector<uint64_t> generate_random(unsigned int dimensions) {
+            auto& generator = get_default_random_generator();
+            std::uniform_int_distribution<uint64_t> word_distribution;
+
+            std::vector<uint64_t> words;
+            for (unsigned int i=0; i < storage_dimensions(dimensions); i++) {
+                words.push_back(word_distribution(generator));
+            }
+            if (dimensions%BITS_PER_WORD != 0) {
+                words.back() &= (1ull << (dimensions%BITS_PER_WORD))-1;
+            }
+            return words;
+        }
+
+        static void serialize_args(std::ostream& out, const Args& args) {
+            out.write(reinterpret_cast<const char*>(&args), sizeof(Args));
+        }
+
+        static void deserialize_args(std::istream& in, Args* args) {
+            in.read(reinterpret_cast<char*>(args), sizeof(Args));
+        }
+
+        static void serialize_type(std::ostream& out, const Type& type) {
+            out.write(reinterpret_cast<const char*>(&type), sizeof(Type));
+        }
+
+        static void deserialize_type(std::istream& in, Type* type) {
+            in.read(reinterpret_cast<char*>(type), sizeof(Type));
+        }
+    };
+
+    template <>
+    std::vector<uint64_t> convert_stored_type<BinaryVectorFormat, std::vector<uint64_t>>(
+        typename BinaryVectorFormat::Type* storage,
+        DatasetDescription<BinaryVectorFormat> dataset
+    ) {
+        return std::vector<uint64_t>(
+            storage,
+            storage+BinaryVectorFormat::storage_dimensions(dataset.args));
+    }
+
+    template <>
+    std::vector<bool> convert_stored_type<BinaryVectorFormat, std::vector<bool>>(
+        typename BinaryVectorFormat::Type* storage,
+        DatasetDescription<BinaryVectorFormat> dataset
+    ) {
+        std::vector<bool> res;
+        res.reserve(dataset.args);
+        for (size_t i=0; i < dataset.args; i++) {
+            auto word = storage[i/BinaryVectorFormat::BITS_PER_WORD];
+            res.push_back((word >> (i%BinaryVectorFormat::BITS_PER_WORD)) & 1);
+        }
+        return res;
+    }
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "puffinn/huge_pages.hpp"
+
 #include <istream>
 #include <memory>
 #include <ostream>
@@ -52,6 +54,19 @@ namespace puffinn {
             len = 0;
         }
 
+        // Number of bytes requested for the buffer.
+        size_t buffer_len() const {
+            return len*sizeof(typename T::Type)+T::ALIGNMENT;
+        }
+
+        void release() {
+            for (size_t i=0; i < len; i++) {
+                T::free(aligned[i]);
+            }
+            deallocate_large(raw_mem, buffer_len());
+            reset();
+        }
+
     public:
         AlignedStorage() {
             reset();
@@ -62,7 +77,7 @@ namespace puffinn {
         {
             size_t buffer_len = len*sizeof(typename T::Type)+T::ALIGNMENT;
 
-            raw_mem = operator new(buffer_len);
+            raw_mem = allocate_large(buffer_len);
             void* raw_aligned = raw_mem;
             if (T::ALIGNMENT != 0) {
                 std::align(
@@ -78,7 +93,7 @@ namespace puffinn {
             }
         }
 
-        AlignedStorage(AlignedStorage&& other)
+        AlignedStorage(AlignedStorage&& other) noexcept
           : raw_mem(other.raw_mem),
             aligned(other.aligned),
             len(other.len)
@@ -86,8 +101,9 @@ namespace puffinn {
             other.reset();
         }
 
-        AlignedStorage& operator=(AlignedStorage&& rhs) {
+        AlignedStorage& operator=(AlignedStorage&& rhs) noexcept {
             if (this != &rhs) {
+                release();
                 raw_mem = rhs.raw_mem;
                 aligned = rhs.aligned;
                 len = rhs.len;
@@ -97,15 +113,20 @@ namespace puffinn {
         }
 
         ~AlignedStorage() {
-            for (size_t i=0; i < len; i++) {
-                T::free(aligned[i]);
-            }
-            operator delete(raw_mem);
+            release();
         }
 
         typename T::Type* get() const {
             return aligned;
         }
+
+        // Number of bytes allocated, not including memory owned by the stored values.
+        uint64_t memory_usage() const {
+            if (raw_mem == nullptr) {
+                return 0;
+            }
+            return allocated_large_bytes(raw_mem, buffer_len());
+        }
     };
 
     // Allocate a number of vectors of a specific format.
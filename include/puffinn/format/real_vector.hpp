@@ -1,12 +1,21 @@
 #pragma once
 
+#include <istream>
+#include <ostream>
+#include <random>
 #include <vector>
 
 #include "puffinn/format/generic.hpp"
+#include "puffinn/typedefs.hpp"
 
 namespace puffinn {
+    /// A format for storing real vectors.
+    ///
+    /// Currently, only ``std::vector<float>`` is supported as input type.
+    /// The values are stored as 32-bit floats using 256-bit alignment.
     struct RealVectorFormat {
         using Type = float;
+        /// Number of dimensions.
         using Args = unsigned int;
         // 256 bit vectors
         const static unsigned int ALIGNMENT = 256/8;
@@ -33,6 +42,10 @@ namespace puffinn {
 
         static void free(Type&) {}
 
+        static uint64_t inner_memory_usage(Type&) {
+            return 0;
+        }
+
         static std::vector<float> generate_random(unsigned int dimensions) {
             std::normal_distribution<float> normal_distribution(0.0, 1.0);
             auto& generator = get_default_random_generator();
@@ -42,5 +55,29 @@ namespace puffinn {
             }
             return values;
         }
+
+        static void serialize_args(std::ostream& out, const Args& args) {
+            out.write(reinterpret_cast<const char*>(&args), sizeof(Args));
+        }
+
+        static void deserialize_args(std::istream& in, Args* args) {
+            in.read(reinterpret_cast<char*>(args), sizeof(Args));
+        }
+
+        static void serialize_type(std::ostream& out, const Type& type) {
+            out.write(reinterpret_cast<const char*>(&type), sizeof(Type));
+        }
+
+        static void deserialize_type(std::istream& in, Type* type) {
+            in.read(reinterpret_cast<char*>(type), sizeof(Type));
+        }
     };
+
+    template <>
+    std::vector<float> convert_stored_type<RealVectorFormat, std::vector<float>>(
+        typename RealVectorFormat::Type* storage,
+        DatasetDescription<RealVectorFormat> dataset
+    ) {
+        return std::vector<float>(storage, storage+dataset.args);
+    }
 }
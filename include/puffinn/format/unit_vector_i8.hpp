@@ -0,0 +1,165 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+#include "puffinn/format/generic.hpp"
+#include "puffinn/format/unit_vector.hpp"
+#include "puffinn/typedefs.hpp"
+
+namespace puffinn {
+    /// Arguments of the ``UnitVectorI8Format``.
+    struct UnitVectorI8Args {
+        /// Number of dimensions.
+        unsigned int dimensions;
+        /// The largest absolute value of a coordinate after normalization.
+        /// Coordinates are quantized to 255 levels between minus and plus this value
+        /// and larger coordinates are clamped.
+        /// Using the actual maximum of the dataset, see ``UnitVectorI8Format::max_coordinate``,
+        /// gives the highest precision.
+        float max_coordinate;
+
+        UnitVectorI8Args() : UnitVectorI8Args(0) {}
+
+        UnitVectorI8Args(unsigned int dimensions, float max_coordinate = 1.0)
+          : dimensions(dimensions),
+            max_coordinate(max_coordinate)
+        {
+            if (!(max_coordinate > 0.0 && max_coordinate <= 1.0)) {
+                throw std::invalid_argument("max_coordinate");
+            }
+        }
+    };
+
+    /// A format for storing real vectors of unit length using a single byte per coordinate.
+    ///
+    /// This uses half the memory of the ``UnitVectorFormat``,
+    /// which leaves more memory for hash tables.
+    /// Currently, only ``std::vector<float>`` is supported as input type.
+    /// The vectors do not need to be normalized before insertion.
+    ///
+    /// Each coordinate is stored as a signed 8-bit integer scaled by
+    /// the ``max_coordinate`` of the dataset.
+    /// The precision is lower than that of the ``UnitVectorFormat``,
+    /// so computed similarities are approximate.
+    /// The vectors are stored using 256-bit alignment.
+    struct UnitVectorI8Format {
+        // Represent the values as integers between -127 and 127, where 127 is the max_coordinate.
+        // -128 is never used, so that the absolute value of every coordinate fits in the type.
+        using Type = int8_t;
+        using Args = UnitVectorI8Args;
+
+        const static unsigned int ALIGNMENT = VECTOR256_ALIGNMENT;
+
+        // Largest stored value, representing the max_coordinate.
+        const static int MAX_VALUE = 127;
+
+        // Convert a coordinate of a unit vector to the internal representation.
+        static int8_t to_8bit(float val, const Args& args) {
+            float scaled = std::round(val*MAX_VALUE/args.max_coordinate);
+            scaled = std::max(std::min(scaled, static_cast<float>(MAX_VALUE)), -static_cast<float>(MAX_VALUE));
+            return static_cast<int8_t>(scaled);
+        }
+
+        // Convert a value from the internal representation to a coordinate of a unit vector.
+        static float from_8bit(Type val, const Args& args) {
+            return static_cast<float>(val)*args.max_coordinate/MAX_VALUE;
+        }
+
+        /// Find the largest absolute value of a coordinate in the given vectors after normalization.
+        ///
+        /// This can be used as the ``max_coordinate`` of the dataset,
+        /// either using all vectors or a representative sample.
+        static float max_coordinate(const std::vector<std::vector<float>>& vectors) {
+            float res = 0.0;
+            for (auto& vec : vectors) {
+                float len_squared = 0.0;
+                float max_abs = 0.0;
+                for (auto v : vec) {
+                    len_squared += v*v;
+                    max_abs = std::max(max_abs, std::abs(v));
+                }
+                if (len_squared != 0.0) {
+                    res = std::max(res, max_abs/std::sqrt(len_squared));
+                }
+            }
+            // Avoid dividing by zero when quantizing.
+            return res == 0.0 ? 1.0 : std::min(res, 1.0f);
+        }
+
+        static unsigned int storage_dimensions(Args args) {
+            return args.dimensions;
+        }
+
+        static uint64_t inner_memory_usage(Type&) {
+            return 0;
+        }
+
+        static void store(
+            const std::vector<float>& input,
+            Type* storage,
+            DatasetDescription<UnitVectorI8Format> dataset
+        ) {
+            if (input.size() != dataset.args.dimensions) {
+                throw std::invalid_argument("input.size()");
+            }
+
+            float len_squared = 0.0;
+            for (auto v : input) {
+                len_squared += v*v;
+            }
+            auto len = std::sqrt(len_squared);
+            if (len == 0.0) {
+                len = 1.0;
+            }
+
+            for (size_t i=0; i < input.size(); i++) {
+                storage[i] = to_8bit(input[i]/len, dataset.args);
+            }
+            for (size_t i=input.size(); i < dataset.storage_len; i++) {
+                storage[i] = 0;
+            }
+        }
+
+        static void free(Type&) {}
+
+        static std::vector<float> generate_random(Args args) {
+            return UnitVectorFormat::generate_random(args.dimensions);
+        }
+
+        static void serialize_args(std::ostream& out, const Args& args) {
+            out.write(reinterpret_cast<const char*>(&args.dimensions), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(&args.max_coordinate), sizeof(float));
+        }
+
+        static void deserialize_args(std::istream& in, Args* args) {
+            in.read(reinterpret_cast<char*>(&args->dimensions), sizeof(unsigned int));
+            in.read(reinterpret_cast<char*>(&args->max_coordinate), sizeof(float));
+        }
+
+        static void serialize_type(std::ostream& out, const Type& type) {
+            out.write(reinterpret_cast<const char*>(&type), sizeof(Type));
+        }
+
+        static void deserialize_type(std::istream& in, Type* type) {
+            in.read(reinterpret_cast<char*>(type), sizeof(Type));
+        }
+    };
+
+    template <>
+    std::vector<float> convert_stored_type<UnitVectorI8Format, std::vector<float>>(
+        typename UnitVectorI8Format::Type* storage,
+        DatasetDescription<UnitVectorI8Format> dataset
+    ) {
+        std::vector<float> res;
+        res.reserve(dataset.args.dimensions);
+        for (size_t i=0; i < dataset.args.dimensions; i++) {
+            res.push_back(UnitVectorI8Format::from_8bit(storage[i], dataset.args));
+        }
+        return res;
+    }
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "puffinn/typedefs.hpp"
+
+#include <cstdint>
+#include <vector>
+
+namespace puffinn {
+    // Concatenate the values of consecutive functions into hashes.
+    // Hash i is made from the values of functions i*functions_per_hash, ..., with the first function
+    // in the most significant bits, after which the lowest bits_to_cut bits are removed.
+    static void concatenate_function_values(
+        const LshDatatype* values,
+        size_t num_hashes,
+        unsigned int functions_per_hash,
+        uint_fast8_t bits_per_function,
+        unsigned int bits_to_cut,
+        uint64_t* output
+    ) {
+        for (size_t hash = 0; hash < num_hashes; hash++) {
+            auto hash_values = &values[hash*functions_per_hash];
+            uint64_t res = 0;
+            for (unsigned int i=0; i < functions_per_hash; i++) {
+                res <<= bits_per_function;
+                res |= hash_values[i];
+            }
+            output[hash] = res >> bits_to_cut;
+        }
+    }
+
+    // Compute concatenated hashes of a single vector by evaluating one function at a time.
+    template <typename F, typename V>
+    static void hash_concatenated_unbatched(
+        const std::vector<F>& functions,
+        const V* vec,
+        unsigned int functions_per_hash,
+        uint_fast8_t bits_per_function,
+        unsigned int bits_to_cut,
+        uint64_t* output
+    ) {
+        size_t num_hashes = functions.size()/functions_per_hash;
+        for (size_t hash = 0; hash < num_hashes; hash++) {
+            size_t offset = hash*functions_per_hash;
+            uint64_t res = 0;
+            for (unsigned int i=0; i < functions_per_hash; i++) {
+                res <<= bits_per_function;
+                res |= functions[offset+i](vec);
+            }
+            output[hash] = res >> bits_to_cut;
+        }
+    }
+
+    // Number of bytes used by a list of sampled functions, including unused capacity.
+    template <typename F>
+    static uint64_t functions_memory_usage(const std::vector<F>& functions) {
+        uint64_t res = (functions.capacity()-functions.size())*sizeof(F);
+        for (auto& f : functions) {
+            res += f.memory_usage();
+        }
+        return res;
+    }
+
+    // Evaluates a fixed list of sampled hash functions on a block of stored vectors.
+    //
+    // The vectors are expected to be stored consecutively, `stride` values apart,
+    // as they are in a ``Dataset``.
+    // The result for function f on vector v is written to output[v*functions.size()+f].
+    //
+    // This version evaluates one function on one vector at a time.
+    // Families whose functions can share work when evaluated together specialize it.
+    template <typename T>
+    class FunctionBatch {
+    public:
+        FunctionBatch() = default;
+
+        FunctionBatch(std::vector<typename T::Function>&) {
+        }
+
+        // Number of bytes used besides the functions themselves.
+        uint64_t memory_usage() const {
+            return 0;
+        }
+
+        void hash(
+            const std::vector<typename T::Function>& functions,
+            const typename T::Sim::Format::Type* vectors,
+            size_t num_vectors,
+            unsigned int stride,
+            LshDatatype* output
+        ) const {
+            for (size_t v=0; v < num_vectors; v++) {
+                auto vec = &vectors[v*stride];
+                auto vec_output = &output[v*functions.size()];
+                for (size_t f=0; f < functions.size(); f++) {
+                    vec_output[f] = functions[f](vec);
+                }
+            }
+        }
+
+        // Compute the hashes made by concatenating the values of consecutive functions,
+        // as described in concatenate_function_values.
+        // The hashes of each vector are written after one another.
+        void hash_concatenated(
+            const std::vector<typename T::Function>& functions,
+            const typename T::Sim::Format::Type* vectors,
+            size_t num_vectors,
+            unsigned int stride,
+            unsigned int functions_per_hash,
+            uint_fast8_t bits_per_function,
+            unsigned int bits_to_cut,
+            uint64_t* output
+        ) const {
+            size_t num_hashes = functions.size()/functions_per_hash;
+            for (size_t v=0; v < num_vectors; v++) {
+                hash_concatenated_unbatched(
+                    functions,
+                    &vectors[v*stride],
+                    functions_per_hash,
+                    bits_per_function,
+                    bits_to_cut,
+                    &output[v*num_hashes]);
+            }
+        }
+    };
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include "puffinn/dataset.hpp"
+#include "puffinn/format/binary_vector.hpp"
+#include "puffinn/similarity_measure/hamming.hpp"
+
+#include <cmath>
+#include <istream>
+#include <ostream>
+#include <random>
+#include <vector>
+
+namespace puffinn {
+    class BitSamplingFunction {
+        // Positions of the sampled bits, with the first position in the most significant bit.
+        std::vector<uint32_t> positions;
+
+    public:
+        BitSamplingFunction(DatasetDescription<BinaryVectorFormat> dataset, unsigned int num_bits) {
+            // Bits are sampled with replacement, so that they are independent.
+            std::uniform_int_distribution<uint32_t> position_distribution(
+                0,
+                std::max(dataset.args, 1u)-1);
+            auto& generator = get_default_random_generator();
+            positions.reserve(num_bits);
+            for (unsigned int i=0; i < num_bits; i++) {
+                positions.push_back(position_distribution(generator));
+            }
+        }
+
+        BitSamplingFunction(std::istream& in) {
+            size_t len;
+            in.read(reinterpret_cast<char*>(&len), sizeof(size_t));
+            positions.resize(len);
+            in.read(reinterpret_cast<char*>(&positions[0]), len*sizeof(uint32_t));
+        }
+
+        void serialize(std::ostream& out) const {
+            size_t len = positions.size();
+            out.write(reinterpret_cast<const char*>(&len), sizeof(size_t));
+            out.write(reinterpret_cast<const char*>(&positions[0]), len*sizeof(uint32_t));
+        }
+
+        // Number of bytes used by this function.
+        uint64_t memory_usage() const {
+            return sizeof(BitSamplingFunction) + positions.capacity()*sizeof(uint32_t);
+        }
+
+        // Hash the given vector.
+        LshDatatype operator()(const uint64_t* const vec) const {
+            LshDatatype res = 0;
+            for (auto pos : positions) {
+                auto word = vec[pos/BinaryVectorFormat::BITS_PER_WORD];
+                res = (res << 1) | ((word >> (pos%BinaryVectorFormat::BITS_PER_WORD)) & 1);
+            }
+            return res;
+        }
+    };
+
+    /// Arguments for ``BitSamplingHash``.
+    struct BitSamplingArgs {
+        /// Number of bits sampled by each function.
+        unsigned int bits_per_function;
+
+        constexpr BitSamplingArgs()
+          : bits_per_function(8)
+        {
+        }
+
+        BitSamplingArgs(std::istream& in) {
+            in.read(reinterpret_cast<char*>(&bits_per_function), sizeof(unsigned int));
+        }
+
+        void serialize(std::ostream& out) const {
+            out.write(reinterpret_cast<const char*>(&bits_per_function), sizeof(unsigned int));
+        }
+
+        void set_no_preprocessing() {
+        }
+
+        uint64_t memory_usage(DatasetDescription<BinaryVectorFormat>) const {
+            return sizeof(BitSamplingFunction) + bits_per_function*sizeof(uint32_t);
+        }
+    };
+
+    /// A multi-bit hash function for binary vectors, which samples random bits of the vector.
+    ///
+    /// Each bit collides with a probability equal to the ``HammingSimilarity``.
+    /// Since bits are sampled independently, a hash of ``k`` bits collides
+    /// with probability ``similarity^k``.
+    class BitSamplingHash {
+    public:
+        using Args = BitSamplingArgs;
+        using Sim = HammingSimilarity;
+        using Function = BitSamplingFunction;
+
+    private:
+        DatasetDescription<BinaryVectorFormat> dataset;
+        Args args;
+
+    public:
+        BitSamplingHash(DatasetDescription<BinaryVectorFormat> dataset, Args args)
+          : dataset(dataset),
+            args(args)
+        {
+        }
+
+        BitSamplingHash(std::istream& in)
+          : dataset(in),
+            args(in)
+        {
+        }
+
+        void serialize(std::ostream& out) const {
+            dataset.serialize(out);
+            args.serialize(out);
+        }
+
+        Function sample() {
+            return Function(dataset, args.bits_per_function);
+        }
+
+        unsigned int bits_per_function() const {
+            return args.bits_per_function;
+        }
+
+        float collision_probability(float similarity, int_fast8_t num_bits) const {
+            return std::pow(similarity, num_bits);
+        }
+
+        // Number of bytes used by the family, not including sampled functions.
+        uint64_t memory_usage() const {
+            return sizeof(BitSamplingHash);
+        }
+
+        // Number of bytes that a family constructed with the given arguments will use.
+        static uint64_t estimate_memory_usage(DatasetDescription<BinaryVectorFormat>, const Args&) {
+            return sizeof(BitSamplingHash);
+        }
+    };
+
+    /// ``BitSamplingHash``, but only sample a single bit to make it suitable for sketching.
+    class BitSamplingHash1Bit {
+    public:
+        using Args = BitSamplingArgs;
+        using Sim = HammingSimilarity;
+        using Function = BitSamplingFunction;
+
+    private:
+        DatasetDescription<BinaryVectorFormat> dataset;
+
+    public:
+        BitSamplingHash1Bit(DatasetDescription<BinaryVectorFormat> dataset, Args)
+          : dataset(dataset)
+        {
+        }
+
+        BitSamplingHash1Bit(std::istream& in)
+          : dataset(in)
+        {
+        }
+
+        void serialize(std::ostream& out) const {
+            dataset.serialize(out);
+        }
+
+        Function sample() {
+            return Function(dataset, 1);
+        }
+
+        unsigned int bits_per_function() const {
+            return 1;
+        }
+
+        float collision_probability(float similarity, int_fast8_t num_bits) const {
+            if (num_bits > 1) { num_bits = 1; }
+            return std::pow(similarity, num_bits);
+        }
+
+        // Number of bytes used by the family, not including sampled functions.
+        uint64_t memory_usage() const {
+            return sizeof(BitSamplingHash1Bit);
+        }
+
+        // Number of bytes that a family constructed with the given arguments will use.
+        static uint64_t estimate_memory_usage(DatasetDescription<BinaryVectorFormat>, const Args&) {
+            return sizeof(BitSamplingHash1Bit);
+        }
+    };
+}
@@ -2,6 +2,7 @@
 
 #include "puffinn/dataset.hpp"
 #include "external/ffht/fht_header_only.h"
+#include "puffinn/hash/batch.hpp"
 #include "puffinn/format/unit_vector.hpp"
 #include "puffinn/math.hpp"
 #include "puffinn/similarity_measure/cosine.hpp"
@@ -13,6 +14,21 @@ namespace puffinn {
 
         CrossPolytopeCollisionEstimates() {}
 
+        // Number of segments of width 2*eps that the similarities from -1 to 1 are split into.
+        static size_t num_segments(float eps) {
+            size_t res = 0;
+            for (double alpha = -1; alpha <= 1; alpha += 2*eps) {
+                res++;
+            }
+            return res;
+        }
+
+        // Number of bytes used by the estimates for the given number of dimensions.
+        static uint64_t estimate_memory_usage(unsigned int dimensions, float eps) {
+            auto num_bits = ceil_log(dimensions)+2;
+            return num_bits*(sizeof(std::vector<float>)+num_segments(eps)*sizeof(float));
+        }
+
         CrossPolytopeCollisionEstimates(
             unsigned int dimensions,
             unsigned int num_repetitions,
@@ -28,6 +44,9 @@ namespace puffinn {
             // Number of collisions for each number of used bits
             std::vector<int> collisions(log_dimensions+2);
             probabilities = std::vector<std::vector<float>>(log_dimensions+2);
+            for (auto& p : probabilities) {
+                p.reserve(num_segments(eps));
+            }
 
             double alpha = -1;
             //foreach [alpha, alpha+eps) segment
@@ -90,6 +109,7 @@ namespace puffinn {
         CrossPolytopeCollisionEstimates(std::istream& in) {
             size_t d1;
             in.read(reinterpret_cast<char*>(&d1), sizeof(size_t));
+            probabilities.reserve(d1);
 
             for (size_t i=0; i < d1; i++) {
                 size_t d2;
@@ -116,6 +136,14 @@ namespace puffinn {
         float get_collision_probability(float sim, int_fast8_t num_bits) const {
             return probabilities[num_bits][(size_t)(sim/eps)];
         }
+
+        uint64_t memory_usage() const {
+            uint64_t res = probabilities.capacity()*sizeof(std::vector<float>);
+            for (auto& p : probabilities) {
+                res += p.capacity()*sizeof(float);
+            }
+            return res;
+        }
     };
 
     class FHTCrossPolytopeHashFunction {
@@ -126,23 +154,6 @@ namespace puffinn {
         // Hash idx * num_rotations * dimensions as power of 2
         std::vector<int8_t> random_signs;
 
-        // Calculate a unique value depending on which axis is closest to the given floating point
-        // vector.
-        LshDatatype encode_closest_axis(float* vec) const {
-            int res = 0;
-            float max_sim = 0;
-            for (int i = 0; i < (1 << log_dimensions); i++) {
-                if (vec[i] > max_sim) {
-                    res = i;
-                    max_sim = vec[i];
-                } else if (-vec[i] > max_sim) {
-                    res = i+(1 << log_dimensions);
-                    max_sim = -vec[i];
-                }
-            }
-            return res;
-        }
-
     public:
         // Create a cross polytope hasher using the given number of pseudorandom rotations
         // using hadamard transforms.
@@ -183,10 +194,36 @@ namespace puffinn {
             out.write(reinterpret_cast<const char*>(&random_signs[0]), random_signs.size()*sizeof(int8_t));
         }
 
-        // Hash the given vector
-        LshDatatype operator()(const int16_t* const vec) const {
-            float rotated_vec[1 << log_dimensions];
+        // Number of bytes used by this function.
+        uint64_t memory_usage() const {
+            return sizeof(FHTCrossPolytopeHashFunction) + random_signs.capacity()*sizeof(int8_t);
+        }
+
+        // Number of values in a rotated vector.
+        unsigned int get_rotated_dimensions() const {
+            return 1 << log_dimensions;
+        }
+
+        // Calculate a unique value depending on which axis is closest to the given floating point
+        // vector.
+        LshDatatype encode_closest_axis(const float* vec) const {
+            int res = 0;
+            float max_sim = 0;
+            for (int i = 0; i < (1 << log_dimensions); i++) {
+                if (vec[i] > max_sim) {
+                    res = i;
+                    max_sim = vec[i];
+                } else if (-vec[i] > max_sim) {
+                    res = i+(1 << log_dimensions);
+                    max_sim = -vec[i];
+                }
+            }
+            return res;
+        }
 
+        // Apply the pseudo-random rotation to the given vector.
+        // The output array must have room for get_rotated_dimensions() values.
+        void rotate(const int16_t* const vec, float* rotated_vec) const {
             // Reset rotation vec
             for (int i=0; i<dimensions; i++) {
                 rotated_vec[i] = UnitVectorFormat::from_16bit_fixed_point(vec[i]);
@@ -204,7 +241,12 @@ namespace puffinn {
                 // Apply the fast hadamard transform
                 fht(rotated_vec, log_dimensions);
             }
+        }
 
+        // Hash the given vector
+        LshDatatype operator()(const int16_t* const vec) const {
+            float rotated_vec[1 << log_dimensions];
+            rotate(vec, rotated_vec);
             return encode_closest_axis(rotated_vec);
         }
     };
@@ -308,12 +350,31 @@ namespace puffinn {
         ) const {
             return estimates.get_collision_probability(similarity, num_bits);
         }
+
+        // Number of bytes used by the family, not including sampled functions.
+        uint64_t memory_usage() const {
+            return sizeof(FHTCrossPolytopeHash) + estimates.memory_usage();
+        }
+
+        // Number of bytes that a family constructed with the given arguments will use.
+        static uint64_t estimate_memory_usage(
+            DatasetDescription<UnitVectorFormat> dataset,
+            const Args& args
+        ) {
+            return sizeof(FHTCrossPolytopeHash)
+                + CrossPolytopeCollisionEstimates::estimate_memory_usage(
+                    1 << ceil_log(dataset.args),
+                    args.estimation_eps);
+        }
     };
 
     class CrossPolytopeHashFunction {
         unsigned int dimensions;
         unsigned int padded_dimensions;
+        // Owned rotation matrix. Empty once the matrix has been moved into a stacked matrix.
         AlignedStorage<UnitVectorFormat> random_matrix;
+        // The rotation matrix that is used, which is either owned or part of a stacked matrix.
+        const int16_t* matrix;
 
     public:
         CrossPolytopeHashFunction(DatasetDescription<UnitVectorFormat> dataset)
@@ -333,6 +394,7 @@ namespace puffinn {
                     &random_matrix.get()[dim*padded_dimensions],
                     dataset);
             }
+            matrix = random_matrix.get();
         }
 
         CrossPolytopeHashFunction(std::istream& in) {
@@ -343,21 +405,70 @@ namespace puffinn {
                 padded_dimensions);
             auto matrix_len = (1 << ceil_log(dimensions))*padded_dimensions;
             in.read(reinterpret_cast<char*>(random_matrix.get()), matrix_len*sizeof(int16_t));
+            matrix = random_matrix.get();
         }
 
+        // If the matrix has been moved into a stacked matrix, the copy refers to the same matrix
+        // until it is moved into another one. Otherwise the matrix is copied.
+        CrossPolytopeHashFunction(const CrossPolytopeHashFunction& other)
+          : dimensions(other.dimensions),
+            padded_dimensions(other.padded_dimensions),
+            matrix(other.matrix)
+        {
+            if (other.random_matrix.get() != nullptr) {
+                random_matrix = allocate_storage<UnitVectorFormat>(get_rows(), padded_dimensions);
+                std::copy(
+                    other.matrix,
+                    other.matrix+get_rows()*padded_dimensions,
+                    random_matrix.get());
+                matrix = random_matrix.get();
+            }
+        }
+
+        CrossPolytopeHashFunction(CrossPolytopeHashFunction&&) = default;
+        CrossPolytopeHashFunction& operator=(CrossPolytopeHashFunction&&) = default;
+
         void serialize(std::ostream& out) const {
             out.write(reinterpret_cast<const char*>(&dimensions), sizeof(unsigned int));
             out.write(reinterpret_cast<const char*>(&padded_dimensions), sizeof(unsigned int));
 
             auto matrix_len = (1 << ceil_log(dimensions))*padded_dimensions;
-            out.write(reinterpret_cast<const char*>(random_matrix.get()), matrix_len*sizeof(int16_t));
+            out.write(reinterpret_cast<const char*>(matrix), matrix_len*sizeof(int16_t));
+        }
+
+        unsigned int get_dimensions() const {
+            return dimensions;
+        }
+
+        unsigned int get_padded_dimensions() const {
+            return padded_dimensions;
+        }
+
+        // Number of rows in the rotation matrix.
+        unsigned int get_rows() const {
+            return 1 << ceil_log(dimensions);
+        }
+
+        // Number of bytes used by this function,
+        // not including a stacked matrix that the rotation has been moved into.
+        uint64_t memory_usage() const {
+            return sizeof(CrossPolytopeHashFunction) + random_matrix.memory_usage();
+        }
+
+        // Copy the rotation matrix into the given aligned storage, which is then used
+        // instead of the owned matrix.
+        // The storage must outlive this function.
+        void move_matrix(int16_t* destination) {
+            std::copy(matrix, matrix+get_rows()*padded_dimensions, destination);
+            matrix = destination;
+            random_matrix = AlignedStorage<UnitVectorFormat>();
         }
 
         LshDatatype operator()(const int16_t* const vec) const {
             LshDatatype res = 0;
             uint16_t max_abs_dot = 0;
             for (unsigned int i=0; i<(1u << ceil_log(dimensions)); i++) {
-                auto matrix_row = &random_matrix.get()[i*padded_dimensions];
+                auto matrix_row = &matrix[i*padded_dimensions];
                 // dot product
                 auto rotated_i = dot_product_i16(vec, matrix_row, dimensions);
                 if (rotated_i > max_abs_dot) {
@@ -402,7 +513,8 @@ namespace puffinn {
 
         uint64_t memory_usage(DatasetDescription<UnitVectorFormat> dataset) const {
             return sizeof(CrossPolytopeHashFunction)
-                + dataset.args*dataset.storage_len*sizeof(int16_t);
+                + (1 << ceil_log(dataset.args))*dataset.storage_len*sizeof(int16_t)
+                + UnitVectorFormat::ALIGNMENT;
         }
     };
 
@@ -466,5 +578,170 @@ namespace puffinn {
         ) const {
             return estimates.get_collision_probability(similarity, num_bits);
         }
+
+        // Number of bytes used by the family, not including sampled functions.
+        uint64_t memory_usage() const {
+            return sizeof(CrossPolytopeHash) + estimates.memory_usage();
+        }
+
+        // Number of bytes that a family constructed with the given arguments will use.
+        static uint64_t estimate_memory_usage(
+            DatasetDescription<UnitVectorFormat> dataset,
+            const Args& args
+        ) {
+            return sizeof(CrossPolytopeHash)
+                + CrossPolytopeCollisionEstimates::estimate_memory_usage(
+                    1 << ceil_log(dataset.args),
+                    args.estimation_eps);
+        }
+    };
+
+    /// Evaluates cross-polytope functions together by stacking their rotation matrices
+    /// into one contiguous matrix.
+    ///
+    /// Hashing a block of vectors is then a cache-blocked int16 matrix multiplication,
+    /// where the closest axis of each function is found while its dot products are computed.
+    template <>
+    class FunctionBatch<CrossPolytopeHash> {
+        // Number of vectors hashed by one function before moving on to the next function,
+        // so that the rows of the function stay in cache.
+        const static size_t VECTOR_BLOCK = 32;
+
+        unsigned int dimensions = 0;
+        unsigned int padded_dimensions = 0;
+        unsigned int rows_per_function = 0;
+        // Rotation matrices of all functions, one after the other.
+        AlignedStorage<UnitVectorFormat> matrix;
+
+        // Find the closest axis of the rotated vectors, for NUM_VECS consecutive vectors.
+        template <unsigned int NUM_VECS>
+        void encode_closest_axes(
+            const int16_t* rows,
+            const int16_t* vecs,
+            unsigned int stride,
+            LshDatatype* output,
+            size_t output_stride
+        ) const {
+            LshDatatype res[NUM_VECS] = {0};
+            int max_abs_dot[NUM_VECS] = {0};
+            auto update = [&](unsigned int vec, unsigned int row, int16_t rotated) {
+                if (rotated > max_abs_dot[vec]) {
+                    max_abs_dot[vec] = rotated;
+                    res[vec] = row;
+                } else if (-rotated > max_abs_dot[vec]) {
+                    max_abs_dot[vec] = -rotated;
+                    res[vec] = row+rows_per_function;
+                }
+            };
+
+            unsigned int row = 0;
+            #ifdef __AVX2__
+                int16_t dots[8];
+                for (; row+4 <= rows_per_function; row += 4) {
+                    dot_products_i16_4xn_avx2<NUM_VECS>(
+                        &rows[row*padded_dimensions],
+                        padded_dimensions,
+                        vecs,
+                        stride,
+                        dimensions,
+                        dots);
+                    for (unsigned int v=0; v < NUM_VECS; v++) {
+                        for (unsigned int i=0; i < 4; i++) {
+                            update(v, row+i, dots[4*v+i]);
+                        }
+                    }
+                }
+            #endif
+            for (; row < rows_per_function; row++) {
+                for (unsigned int v=0; v < NUM_VECS; v++) {
+                    update(
+                        v,
+                        row,
+                        dot_product_i16(&vecs[v*stride], &rows[row*padded_dimensions], dimensions));
+                }
+            }
+            for (unsigned int v=0; v < NUM_VECS; v++) {
+                output[v*output_stride] = res[v];
+            }
+        }
+
+    public:
+        FunctionBatch() = default;
+
+        // Number of bytes used by the stacked matrix.
+        uint64_t memory_usage() const {
+            return matrix.memory_usage();
+        }
+
+        FunctionBatch(std::vector<CrossPolytopeHashFunction>& functions) {
+            if (functions.empty()) {
+                return;
+            }
+            dimensions = functions[0].get_dimensions();
+            padded_dimensions = functions[0].get_padded_dimensions();
+            rows_per_function = functions[0].get_rows();
+            matrix = allocate_storage<UnitVectorFormat>(
+                functions.size()*rows_per_function,
+                padded_dimensions);
+            for (size_t f=0; f < functions.size(); f++) {
+                functions[f].move_matrix(
+                    &matrix.get()[f*rows_per_function*padded_dimensions]);
+            }
+        }
+
+        void hash(
+            const std::vector<CrossPolytopeHashFunction>& functions,
+            const int16_t* vectors,
+            size_t num_vectors,
+            unsigned int stride,
+            LshDatatype* output
+        ) const {
+            auto num_functions = functions.size();
+            for (size_t block_start=0; block_start < num_vectors; block_start += VECTOR_BLOCK) {
+                auto block_end = std::min(num_vectors, block_start+VECTOR_BLOCK);
+                for (size_t f=0; f < num_functions; f++) {
+                    auto rows = &matrix.get()[f*rows_per_function*padded_dimensions];
+                    size_t v = block_start;
+                    for (; v+2 <= block_end; v += 2) {
+                        encode_closest_axes<2>(
+                            rows, &vectors[v*stride], stride, &output[v*num_functions+f], num_functions);
+                    }
+                    if (v < block_end) {
+                        encode_closest_axes<1>(
+                            rows, &vectors[v*stride], stride, &output[v*num_functions+f], num_functions);
+                    }
+                }
+            }
+        }
+
+        void hash_concatenated(
+            const std::vector<CrossPolytopeHashFunction>& functions,
+            const int16_t* vectors,
+            size_t num_vectors,
+            unsigned int stride,
+            unsigned int functions_per_hash,
+            uint_fast8_t bits_per_function,
+            unsigned int bits_to_cut,
+            uint64_t* output
+        ) const {
+            if (num_vectors == 1) {
+                // Avoid allocating scratch space when hashing queries.
+                hash_concatenated_unbatched(
+                    functions, vectors, functions_per_hash, bits_per_function, bits_to_cut, output);
+                return;
+            }
+            size_t num_hashes = functions.size()/functions_per_hash;
+            std::vector<LshDatatype> values(num_vectors*functions.size());
+            hash(functions, vectors, num_vectors, stride, values.data());
+            for (size_t v=0; v < num_vectors; v++) {
+                concatenate_function_values(
+                    &values[v*functions.size()],
+                    num_hashes,
+                    functions_per_hash,
+                    bits_per_function,
+                    bits_to_cut,
+                    &output[v*num_hashes]);
+            }
+        }
     };
 }
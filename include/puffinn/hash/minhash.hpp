@@ -57,6 +57,7 @@ namespace puffinn {
         BitPermutation(std::mt19937_64& rng, unsigned int universe_size, unsigned int num_bits)
           : num_bits(num_bits)
         {
+            perm.reserve(std::min(universe_size, (1u << num_bits)));
             for (unsigned int i=0; i < std::min(universe_size, (1u << num_bits)); i++) {
                 perm.push_back(i);
             }
@@ -82,6 +83,11 @@ namespace puffinn {
             out.write(reinterpret_cast<const char*>(&perm[0]), len*sizeof(uint32_t));
         }
 
+        // Number of bytes used besides the permutation itself.
+        uint64_t inner_memory_usage() const {
+            return perm.capacity()*sizeof(uint32_t);
+        }
+
         LshDatatype operator()(LshDatatype v) const {
             if (num_bits != 0) {
                 auto mask = (1 << num_bits)-1;
@@ -113,6 +119,11 @@ namespace puffinn {
             permutation.serialize(out);
         }
 
+        // Number of bytes used by this function.
+        uint64_t memory_usage() const {
+            return sizeof(MinHashFunction) + permutation.inner_memory_usage();
+        }
+
         LshDatatype operator()(const std::vector<uint32_t>* const vec) const {
             uint64_t min_hash = 0xFFFFFFFFFFFFFFFF; // 2^64-1
             uint32_t min_token = 0;
@@ -156,7 +167,7 @@ namespace puffinn {
         }
 
         uint64_t memory_usage(DatasetDescription<SetFormat> dataset) const {
-            auto perm_len = std::min(dataset.args, (1u << randomized_bits));
+            auto perm_len = std::min(std::max(dataset.args, 2u), (1u << randomized_bits));
             uint64_t perm_mem = perm_len * sizeof(uint32_t);
             return sizeof(MinHashFunction)+perm_mem;
         }
@@ -218,6 +229,16 @@ namespace puffinn {
             float miss_collision_prob = num_possible_hashes/(set_size-1);
             return similarity+(1-similarity)*miss_collision_prob;
         }
+
+        // Number of bytes used by the family, not including sampled functions.
+        uint64_t memory_usage() const {
+            return sizeof(MinHash);
+        }
+
+        // Number of bytes that a family constructed with the given arguments will use.
+        static uint64_t estimate_memory_usage(DatasetDescription<SetFormat>, const Args&) {
+            return sizeof(MinHash);
+        }
     };
 
     class MinHash1BitFunction {
@@ -238,6 +259,11 @@ namespace puffinn {
             hash.serialize(out);
         }
 
+        // Number of bytes used by this function.
+        uint64_t memory_usage() const {
+            return hash.memory_usage();
+        }
+
         LshDatatype operator()(const std::vector<uint32_t>* const vec) const {
             return hash(vec)%2;
         }
@@ -280,5 +306,15 @@ namespace puffinn {
             if (num_bits > 1) { num_bits = 1; }
             return minhash.collision_probability(similarity, num_bits);
         }
+
+        // Number of bytes used by the family, not including sampled functions.
+        uint64_t memory_usage() const {
+            return sizeof(MinHash1Bit);
+        }
+
+        // Number of bytes that a family constructed with the given arguments will use.
+        static uint64_t estimate_memory_usage(DatasetDescription<SetFormat>, const Args&) {
+            return sizeof(MinHash1Bit);
+        }
     };
 }
@@ -0,0 +1,360 @@
+#pragma once
+
+#include "puffinn/dataset.hpp"
+#include "puffinn/format/real_vector.hpp"
+#include "puffinn/hash/batch.hpp"
+#include "puffinn/math.hpp"
+#include "puffinn/similarity_measure/l2.hpp"
+
+#include <cmath>
+#include <istream>
+#include <ostream>
+#include <random>
+
+namespace puffinn {
+    // Probability that the bucket indices of two points collide modulo 2^period_bits,
+    // when the projections are quantized into buckets of the given width using a random offset.
+    //
+    // The difference between the projections of two points at the given distance is normally
+    // distributed with a standard deviation equal to the distance.
+    // Given that difference, the bucket indices differ by k with probability
+    // max(0, 1-|difference/width-k|), which is integrated over the normal distribution.
+    static double pstable_collision_probability(
+        double distance,
+        double width,
+        unsigned int period_bits
+    ) {
+        const double SQRT_2 = std::sqrt(2.0);
+        const double SQRT_2PI = std::sqrt(2.0*M_PI);
+        // Differences of more than this many standard deviations are ignored.
+        const double MAX_DEVIATIONS = 10.0;
+        // Above this number of terms, the indices are considered to be independent.
+        const double MAX_TERMS = 1e5;
+
+        double period = std::pow(2.0, period_bits);
+        double s = distance/width;
+        if (period_bits == 0 || s < 1e-9) {
+            return 1.0;
+        }
+        // Checked before converting to an integer, since infinite or very large distances
+        // do not fit in one.
+        double max_k_bound = std::ceil(1.0+MAX_DEVIATIONS*s);
+        if (!std::isfinite(s) || max_k_bound/period > MAX_TERMS) {
+            return 1.0/period;
+        }
+        long max_k = static_cast<long>(max_k_bound);
+        // Scaled normal cdf and pdf, where the pdf is multiplied by s^2.
+        auto cdf = [&](double x) { return 0.5*std::erfc(-x/(s*SQRT_2)); };
+        auto pdf = [&](double x) { return s*std::exp(-x*x/(2*s*s))/SQRT_2PI; };
+        // Probability that the indices differ by exactly k.
+        auto difference_prob = [&](double k) {
+            double left =
+                -(pdf(k)-pdf(k-1))
+                -(k-1)*(cdf(k)-cdf(k-1));
+            double right =
+                (k+1)*(cdf(k+1)-cdf(k))
+                +(pdf(k+1)-pdf(k));
+            return left+right;
+        };
+
+        double res = difference_prob(0);
+        for (double k=period; k <= max_k; k += period) {
+            // The distribution is symmetric.
+            res += 2*difference_prob(k);
+        }
+        return std::min(1.0, std::max(res, 1.0/period));
+    }
+
+    // Collision probabilities of p-stable functions for similarities in segments of width eps,
+    // computed for the lowest similarity in each segment.
+    // Since the probabilities increase with the similarity, they are never overestimated.
+    struct PStableCollisionEstimates {
+        std::vector<std::vector<float>> probabilities;
+        float eps;
+
+        PStableCollisionEstimates() {}
+
+        PStableCollisionEstimates(float width, unsigned int bits_per_function, float eps)
+          : eps(eps)
+        {
+            auto num_segments = static_cast<size_t>(std::ceil(1.0/eps))+1;
+            probabilities.resize(bits_per_function+1);
+            for (unsigned int num_bits=0; num_bits <= bits_per_function; num_bits++) {
+                // The first bits of the index are the index when using wider buckets.
+                double bucket_width = width*std::pow(2.0, bits_per_function-num_bits);
+                probabilities[num_bits].reserve(num_segments);
+                for (size_t segment=0; segment < num_segments; segment++) {
+                    float similarity = std::min(1.0f, segment*eps);
+                    probabilities[num_bits].push_back(pstable_collision_probability(
+                        similarity_to_distance(similarity),
+                        bucket_width,
+                        num_bits));
+                }
+            }
+        }
+
+        // Inverse of L2Distance::compute_similarity.
+        static double similarity_to_distance(float similarity) {
+            if (similarity <= 0.0) {
+                return INFINITY;
+            }
+            return std::sqrt(std::max(0.0, 1.0/similarity-1.0));
+        }
+
+        static uint64_t estimate_memory_usage(unsigned int bits_per_function, float eps) {
+            auto num_segments = static_cast<size_t>(std::ceil(1.0/eps))+1;
+            return (bits_per_function+1)*(sizeof(std::vector<float>)+num_segments*sizeof(float));
+        }
+
+        float get_collision_probability(float sim, int_fast8_t num_bits) const {
+            auto& probs = probabilities[num_bits];
+            return probs[std::min(static_cast<size_t>(sim/eps), probs.size()-1)];
+        }
+
+        uint64_t memory_usage() const {
+            uint64_t res = probabilities.capacity()*sizeof(std::vector<float>);
+            for (auto& p : probabilities) {
+                res += p.capacity()*sizeof(float);
+            }
+            return res;
+        }
+    };
+
+    class PStableHashFunction {
+        AlignedStorage<RealVectorFormat> projection;
+        unsigned int dimensions;
+        float offset;
+        float width;
+        unsigned int num_bits;
+
+    public:
+        PStableHashFunction(
+            DatasetDescription<RealVectorFormat> dataset,
+            float width,
+            unsigned int num_bits
+        )
+          : projection(allocate_storage<RealVectorFormat>(1, dataset.storage_len)),
+            dimensions(dataset.storage_len),
+            width(width),
+            num_bits(num_bits)
+        {
+            auto vec = RealVectorFormat::generate_random(dataset.args);
+            RealVectorFormat::store(vec, projection.get(), dataset);
+            // The offset is random within a whole period of the returned values,
+            // so that the first bits are also a random quantization.
+            std::uniform_real_distribution<float> offset_distribution(0.0, width*(1 << num_bits));
+            offset = offset_distribution(get_default_random_generator());
+        }
+
+        PStableHashFunction(std::istream& in) {
+            in.read(reinterpret_cast<char*>(&dimensions), sizeof(unsigned int));
+            in.read(reinterpret_cast<char*>(&offset), sizeof(float));
+            in.read(reinterpret_cast<char*>(&width), sizeof(float));
+            in.read(reinterpret_cast<char*>(&num_bits), sizeof(unsigned int));
+            projection = allocate_storage<RealVectorFormat>(1, dimensions);
+            in.read(reinterpret_cast<char*>(projection.get()), dimensions*sizeof(float));
+        }
+
+        PStableHashFunction(const PStableHashFunction& other)
+          : projection(allocate_storage<RealVectorFormat>(1, other.dimensions)),
+            dimensions(other.dimensions),
+            offset(other.offset),
+            width(other.width),
+            num_bits(other.num_bits)
+        {
+            std::copy(
+                other.projection.get(),
+                other.projection.get()+dimensions,
+                projection.get());
+        }
+
+        PStableHashFunction(PStableHashFunction&&) = default;
+        PStableHashFunction& operator=(PStableHashFunction&&) = default;
+
+        void serialize(std::ostream& out) const {
+            out.write(reinterpret_cast<const char*>(&dimensions), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(&offset), sizeof(float));
+            out.write(reinterpret_cast<const char*>(&width), sizeof(float));
+            out.write(reinterpret_cast<const char*>(&num_bits), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(projection.get()), dimensions*sizeof(float));
+        }
+
+        // Number of bytes used by this function.
+        uint64_t memory_usage() const {
+            return sizeof(PStableHashFunction) + projection.memory_usage();
+        }
+
+        // Hash the given vector.
+        LshDatatype operator()(const float* const vec) const {
+            auto dot = dot_product_float(projection.get(), vec, dimensions);
+            auto bucket = static_cast<int64_t>(std::floor((dot+offset)/width));
+            return bucket & ((1 << num_bits)-1);
+        }
+    };
+
+    /// Arguments for ``PStableHash`` and ``PStableHash1Bit``.
+    struct PStableArgs {
+        /// Width of the buckets that the projections are divided into.
+        ///
+        /// This should be on the order of the distance between points and their nearest neighbors.
+        float bucket_width;
+        /// Number of bits of the bucket index used by each ``PStableHash`` function.
+        unsigned int bits_per_function;
+        /// Granularity of the precomputed collision probabilities.
+        float estimation_eps;
+
+        constexpr PStableArgs()
+          : bucket_width(4.0),
+            bits_per_function(4),
+            estimation_eps(1e-3)
+        {
+        }
+
+        PStableArgs(std::istream& in) {
+            in.read(reinterpret_cast<char*>(&bucket_width), sizeof(float));
+            in.read(reinterpret_cast<char*>(&bits_per_function), sizeof(unsigned int));
+            in.read(reinterpret_cast<char*>(&estimation_eps), sizeof(float));
+        }
+
+        void serialize(std::ostream& out) const {
+            out.write(reinterpret_cast<const char*>(&bucket_width), sizeof(float));
+            out.write(reinterpret_cast<const char*>(&bits_per_function), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(&estimation_eps), sizeof(float));
+        }
+
+        void set_no_preprocessing() {
+            estimation_eps = 2.0;
+        }
+
+        uint64_t memory_usage(DatasetDescription<RealVectorFormat> dataset) const {
+            return sizeof(PStableHashFunction)
+                + dataset.storage_len*sizeof(RealVectorFormat::Type)
+                + RealVectorFormat::ALIGNMENT;
+        }
+    };
+
+    /// A multi-bit hash function for real vectors under the euclidean distance,
+    /// also known as E2LSH.
+    ///
+    /// Points are projected onto a random line, with each coordinate of the direction
+    /// sampled from a standard normal distribution.
+    /// The line is split into buckets of equal width at a random offset,
+    /// and the lowest bits of the index of the bucket are used as the hash.
+    /// The first bits of the hash are then the index when using wider buckets,
+    /// which is used when fewer bits are needed.
+    /// The collision probabilities are computed exactly as a function of the distance.
+    class PStableHash {
+    public:
+        using Args = PStableArgs;
+        using Sim = L2Distance;
+        using Function = PStableHashFunction;
+
+    private:
+        DatasetDescription<RealVectorFormat> dataset;
+        Args args;
+        PStableCollisionEstimates estimates;
+
+    public:
+        PStableHash(DatasetDescription<RealVectorFormat> dataset, Args args)
+          : dataset(dataset),
+            args(args),
+            estimates(args.bucket_width, args.bits_per_function, args.estimation_eps)
+        {
+        }
+
+        PStableHash(std::istream& in)
+          : dataset(in),
+            args(in),
+            estimates(args.bucket_width, args.bits_per_function, args.estimation_eps)
+        {
+        }
+
+        void serialize(std::ostream& out) const {
+            dataset.serialize(out);
+            args.serialize(out);
+        }
+
+        Function sample() {
+            return Function(dataset, args.bucket_width, args.bits_per_function);
+        }
+
+        unsigned int bits_per_function() const {
+            return args.bits_per_function;
+        }
+
+        float collision_probability(float similarity, int_fast8_t num_bits) const {
+            return estimates.get_collision_probability(similarity, num_bits);
+        }
+
+        // Number of bytes used by the family, not including sampled functions.
+        uint64_t memory_usage() const {
+            return sizeof(PStableHash) + estimates.memory_usage();
+        }
+
+        // Number of bytes that a family constructed with the given arguments will use.
+        static uint64_t estimate_memory_usage(DatasetDescription<RealVectorFormat>, const Args& args) {
+            return sizeof(PStableHash)
+                + PStableCollisionEstimates::estimate_memory_usage(
+                    args.bits_per_function,
+                    args.estimation_eps);
+        }
+    };
+
+    /// ``PStableHash``, but only use the lowest bit of the bucket index
+    /// to make it suitable for sketching.
+    class PStableHash1Bit {
+    public:
+        using Args = PStableArgs;
+        using Sim = L2Distance;
+        using Function = PStableHashFunction;
+
+    private:
+        DatasetDescription<RealVectorFormat> dataset;
+        Args args;
+        PStableCollisionEstimates estimates;
+
+    public:
+        PStableHash1Bit(DatasetDescription<RealVectorFormat> dataset, Args args)
+          : dataset(dataset),
+            args(args),
+            estimates(args.bucket_width, 1, args.estimation_eps)
+        {
+        }
+
+        PStableHash1Bit(std::istream& in)
+          : dataset(in),
+            args(in),
+            estimates(args.bucket_width, 1, args.estimation_eps)
+        {
+        }
+
+        void serialize(std::ostream& out) const {
+            dataset.serialize(out);
+            args.serialize(out);
+        }
+
+        Function sample() {
+            return Function(dataset, args.bucket_width, 1);
+        }
+
+        unsigned int bits_per_function() const {
+            return 1;
+        }
+
+        float collision_probability(float similarity, int_fast8_t num_bits) const {
+            if (num_bits > 1) { num_bits = 1; }
+            return estimates.get_collision_probability(similarity, num_bits);
+        }
+
+        // Number of bytes used by the family, not including sampled functions.
+        uint64_t memory_usage() const {
+            return sizeof(PStableHash1Bit) + estimates.memory_usage();
+        }
+
+        // Number of bytes that a family constructed with the given arguments will use.
+        static uint64_t estimate_memory_usage(DatasetDescription<RealVectorFormat>, const Args& args) {
+            return sizeof(PStableHash1Bit)
+                + PStableCollisionEstimates::estimate_memory_usage(1, args.estimation_eps);
+        }
+    };
+}
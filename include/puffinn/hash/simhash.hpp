@@ -2,6 +2,7 @@
 
 #include "puffinn/dataset.hpp"
 #include "puffinn/format/unit_vector.hpp"
+#include "puffinn/hash/batch.hpp"
 #include "puffinn/math.hpp"
 #include "puffinn/similarity_measure/cosine.hpp"
 
@@ -10,7 +11,10 @@
 
 namespace puffinn {
     class SimHashFunction {
+        // Owned hyperplane. Empty once the hyperplane has been moved into a stacked matrix.
         AlignedStorage<UnitVectorFormat> hash_vec;
+        // The hyperplane that is used, which is either owned or part of a stacked matrix.
+        const int16_t* hyperplane;
         unsigned int dimensions;
 
     public:
@@ -20,6 +24,7 @@ namespace puffinn {
         {
             auto vec = UnitVectorFormat::generate_random(dataset.args);
             UnitVectorFormat::store(vec, hash_vec.get(), dataset);
+            hyperplane = hash_vec.get();
         }
 
         SimHashFunction(std::istream& in) {
@@ -28,18 +33,55 @@ namespace puffinn {
             in.read(
                 reinterpret_cast<char*>(hash_vec.get()),
                 dimensions*sizeof(typename UnitVectorFormat::Type));
+            hyperplane = hash_vec.get();
         }
 
+        // If the hyperplane has been moved into a stacked matrix, the copy refers to the same matrix
+        // until it is moved into another one. Otherwise the hyperplane is copied.
+        SimHashFunction(const SimHashFunction& other)
+          : hyperplane(other.hyperplane),
+            dimensions(other.dimensions)
+        {
+            if (other.hash_vec.get() != nullptr) {
+                hash_vec = allocate_storage<UnitVectorFormat>(1, dimensions);
+                std::copy(other.hyperplane, other.hyperplane+dimensions, hash_vec.get());
+                hyperplane = hash_vec.get();
+            }
+        }
+
+        SimHashFunction(SimHashFunction&&) = default;
+        SimHashFunction& operator=(SimHashFunction&&) = default;
+
         void serialize(std::ostream& out) const {
             out.write(reinterpret_cast<const char*>(&dimensions), sizeof(unsigned int));
             out.write(
-                reinterpret_cast<const char*>(hash_vec.get()),
+                reinterpret_cast<const char*>(hyperplane),
                 dimensions*sizeof(typename UnitVectorFormat::Type));
         }
 
+        // Number of values in the stored hyperplane.
+        unsigned int get_dimensions() const {
+            return dimensions;
+        }
+
+        // Copy the hyperplane into the given aligned storage, which is then used
+        // instead of the owned hyperplane.
+        // The storage must outlive this function.
+        void move_hyperplane(int16_t* destination) {
+            std::copy(hyperplane, hyperplane+dimensions, destination);
+            hyperplane = destination;
+            hash_vec = AlignedStorage<UnitVectorFormat>();
+        }
+
+        // Number of bytes used by this function,
+        // not including a stacked matrix that the hyperplane has been moved into.
+        uint64_t memory_usage() const {
+            return sizeof(SimHashFunction) + hash_vec.memory_usage();
+        }
+
         // Hash the given vector.
         LshDatatype operator()(const int16_t * const vec) const {
-            auto dot = dot_product_i16(hash_vec.get(), vec, dimensions);
+            auto dot = dot_product_i16(hyperplane, vec, dimensions);
             return dot >= UnitVectorFormat::to_16bit_fixed_point(0.0);
         }
     };
@@ -53,7 +95,9 @@ namespace puffinn {
         void serialize(std::ostream&) const {}
 
         uint64_t memory_usage(DatasetDescription<UnitVectorFormat> dataset) const {
-            return sizeof(SimHashFunction) + dataset.storage_len*sizeof(UnitVectorFormat::Type);
+            return sizeof(SimHashFunction)
+                + dataset.storage_len*sizeof(UnitVectorFormat::Type)
+                + UnitVectorFormat::ALIGNMENT;
         }
 
         void set_no_preprocessing() {}
@@ -89,6 +133,16 @@ namespace puffinn {
             return SimHashFunction(dataset);
         }
 
+        // Number of bytes used by the family, not including sampled functions.
+        uint64_t memory_usage() const {
+            return sizeof(SimHash);
+        }
+
+        // Number of bytes that a family constructed with the given arguments will use.
+        static uint64_t estimate_memory_usage(DatasetDescription<UnitVectorFormat>, const Args&) {
+            return sizeof(SimHash);
+        }
+
         unsigned int bits_per_function() {
             return 1;
         }
@@ -101,4 +155,130 @@ namespace puffinn {
             }
         }
     };
+
+    /// Evaluates SimHash functions together by stacking their hyperplanes
+    /// into one contiguous matrix.
+    ///
+    /// Concatenated hashes, such as sketches, are then computed with a register-blocked
+    /// matrix-vector product, where the sign bits are packed into the hashes directly.
+    template <>
+    class FunctionBatch<SimHash> {
+        // Number of vectors hashed by the hyperplanes of one hash before moving on to the next,
+        // so that the hyperplanes stay in cache.
+        const static size_t VECTOR_BLOCK = 32;
+
+        unsigned int dimensions = 0;
+        // Hyperplanes of all functions, one after the other.
+        AlignedStorage<UnitVectorFormat> matrix;
+
+        // Pack the signs of the dot products with consecutive hyperplanes
+        // into a hash for each of NUM_VECS consecutive vectors.
+        template <unsigned int NUM_VECS>
+        void pack_signs(
+            const int16_t* hyperplanes,
+            unsigned int num_hyperplanes,
+            const int16_t* vecs,
+            unsigned int stride,
+            unsigned int bits_to_cut,
+            uint64_t* output,
+            size_t output_stride
+        ) const {
+            const int16_t ZERO = UnitVectorFormat::to_16bit_fixed_point(0.0);
+            uint64_t res[NUM_VECS] = {0};
+
+            unsigned int plane = 0;
+            #ifdef __AVX2__
+                int16_t dots[8];
+                for (; plane+4 <= num_hyperplanes; plane += 4) {
+                    dot_products_i16_4xn_avx2<NUM_VECS>(
+                        &hyperplanes[plane*dimensions],
+                        dimensions,
+                        vecs,
+                        stride,
+                        dimensions,
+                        dots);
+                    for (unsigned int v=0; v < NUM_VECS; v++) {
+                        res[v] = (res[v] << 4)
+                            | ((dots[4*v] >= ZERO) << 3)
+                            | ((dots[4*v+1] >= ZERO) << 2)
+                            | ((dots[4*v+2] >= ZERO) << 1)
+                            | (dots[4*v+3] >= ZERO);
+                    }
+                }
+            #endif
+            for (; plane < num_hyperplanes; plane++) {
+                for (unsigned int v=0; v < NUM_VECS; v++) {
+                    auto dot = dot_product_i16(
+                        &hyperplanes[plane*dimensions], &vecs[v*stride], dimensions);
+                    res[v] = (res[v] << 1) | (dot >= ZERO);
+                }
+            }
+            for (unsigned int v=0; v < NUM_VECS; v++) {
+                output[v*output_stride] = res[v] >> bits_to_cut;
+            }
+        }
+
+    public:
+        FunctionBatch() = default;
+
+        FunctionBatch(std::vector<SimHashFunction>& functions) {
+            if (functions.empty()) {
+                return;
+            }
+            dimensions = functions[0].get_dimensions();
+            matrix = allocate_storage<UnitVectorFormat>(functions.size(), dimensions);
+            for (size_t f=0; f < functions.size(); f++) {
+                functions[f].move_hyperplane(&matrix.get()[f*dimensions]);
+            }
+        }
+
+        uint64_t memory_usage() const {
+            return matrix.memory_usage();
+        }
+
+        void hash(
+            const std::vector<SimHashFunction>& functions,
+            const int16_t* vectors,
+            size_t num_vectors,
+            unsigned int stride,
+            LshDatatype* output
+        ) const {
+            for (size_t v=0; v < num_vectors; v++) {
+                for (size_t f=0; f < functions.size(); f++) {
+                    output[v*functions.size()+f] = functions[f](&vectors[v*stride]);
+                }
+            }
+        }
+
+        // SimHash has one bit per function, so bits_per_function is always 1.
+        void hash_concatenated(
+            const std::vector<SimHashFunction>& functions,
+            const int16_t* vectors,
+            size_t num_vectors,
+            unsigned int stride,
+            unsigned int functions_per_hash,
+            uint_fast8_t /*bits_per_function*/,
+            unsigned int bits_to_cut,
+            uint64_t* output
+        ) const {
+            size_t num_hashes = functions.size()/functions_per_hash;
+            for (size_t block_start=0; block_start < num_vectors; block_start += VECTOR_BLOCK) {
+                auto block_end = std::min(num_vectors, block_start+VECTOR_BLOCK);
+                for (size_t hash=0; hash < num_hashes; hash++) {
+                    auto hyperplanes = &matrix.get()[hash*functions_per_hash*dimensions];
+                    size_t v = block_start;
+                    for (; v+2 <= block_end; v += 2) {
+                        pack_signs<2>(
+                            hyperplanes, functions_per_hash, &vectors[v*stride], stride,
+                            bits_to_cut, &output[v*num_hashes+hash], num_hashes);
+                    }
+                    if (v < block_end) {
+                        pack_signs<1>(
+                            hyperplanes, functions_per_hash, &vectors[v*stride], stride,
+                            bits_to_cut, &output[v*num_hashes+hash], num_hashes);
+                    }
+                }
+            }
+        }
+    };
 }
@@ -3,9 +3,22 @@
 #include "puffinn/hash_source/hash_source.hpp"
 #include "puffinn/hash_source/independent.hpp"
 #include "puffinn/hash_source/pool.hpp"
+#include "puffinn/hash_source/shared_rotation.hpp"
 #include "puffinn/hash_source/tensor.hpp"
 
 namespace puffinn {
+    // Only the fast-hadamard cross-polytope LSH can share its rotations with the sketches.
+    template <typename T>
+    static std::unique_ptr<HashSourceArgs<T>> deserialize_shared_rotation_args(std::istream&) {
+        throw std::invalid_argument("hash source type");
+    }
+
+    template <>
+    std::unique_ptr<HashSourceArgs<FHTCrossPolytopeHash>>
+    deserialize_shared_rotation_args<FHTCrossPolytopeHash>(std::istream& in) {
+        return std::make_unique<SharedRotationHashArgs>(in);
+    }
+
     template <typename T>
     static std::unique_ptr<HashSourceArgs<T>> deserialize_hash_args(std::istream& in) {
         HashSourceType type;
@@ -17,6 +30,8 @@ namespace puffinn {
                 return std::make_unique<HashPoolArgs<T>>(in);
             case HashSourceType::Tensor:
                 return std::make_unique<TensoredHashArgs<T>>(in);
+            case HashSourceType::SharedRotation:
+                return deserialize_shared_rotation_args<T>(in);
             default:
                 throw std::invalid_argument("hash source type");
         }
@@ -1,12 +1,21 @@
 #pragma once
 
+#include "puffinn/typedefs.hpp"
+
+#include <memory>
 #include <ostream>
+#include <stdexcept>
+#include <vector>
 
 namespace puffinn {
+    // Number of consecutive vectors hashed together when computing hashes for a dataset.
+    const size_t HASH_BLOCK_SIZE = 64;
+
     enum class HashSourceType {
         Independent,
         Pool,
-        Tensor
+        Tensor,
+        SharedRotation
     };
 
     template <typename T>
@@ -28,6 +37,58 @@ namespace puffinn {
             std::vector<uint64_t> & output
         ) const = 0;
 
+        // Compute the LSH values as above, using the given scratch space for intermediate values.
+        // Reusing the scratch space across calls avoids allocations in sources that need it.
+        virtual void hash_repetitions(
+            const typename T::Sim::Format::Type * const input,
+            std::vector<uint64_t> & output,
+            std::vector<LshDatatype> & /*scratch*/
+        ) const {
+            hash_repetitions(input, output);
+        }
+
+        // Compute the LSH values for a block of consecutively stored vectors,
+        // each `stride` values apart, as they are stored in a ``Dataset``.
+        // The hashes of each vector are written after one another to the output array,
+        // in the same order as they are by hash_repetitions.
+        virtual void hash_repetitions_block(
+            const typename T::Sim::Format::Type * const input,
+            size_t num_vectors,
+            unsigned int stride,
+            std::vector<uint64_t> & output
+        ) const {
+            output.clear();
+            std::vector<uint64_t> vector_hashes;
+            for (size_t v=0; v < num_vectors; v++) {
+                hash_repetitions(&input[v*stride], vector_hashes);
+                output.insert(output.end(), vector_hashes.begin(), vector_hashes.end());
+            }
+        }
+
+        // Compute the LSH values as in hash_repetitions, along with NUM_SKETCHES sketches
+        // of NUM_FILTER_HASHBITS bits each.
+        // Only supported by sources whose arguments provide sketches.
+        virtual void hash_and_sketch(
+            const typename T::Sim::Format::Type * const,
+            std::vector<uint64_t> &,
+            std::vector<FilterLshDatatype> &
+        ) const {
+            throw std::invalid_argument("hash source does not provide sketches");
+        }
+
+        // Compute the LSH values and sketches for a block of consecutively stored vectors,
+        // as in hash_repetitions_block.
+        // Only supported by sources whose arguments provide sketches.
+        virtual void hash_and_sketch_block(
+            const typename T::Sim::Format::Type * const,
+            size_t /*num_vectors*/,
+            unsigned int /*stride*/,
+            std::vector<uint64_t> &,
+            std::vector<FilterLshDatatype> &
+        ) const {
+            throw std::invalid_argument("hash source does not provide sketches");
+        }
+
         virtual float collision_probability(
             float similarity,
             uint_fast8_t num_bits
@@ -45,6 +106,9 @@ namespace puffinn {
 
         virtual uint_fast8_t get_bits_per_function() const = 0;
 
+        // Number of bytes used by this source, including its sampled functions.
+        virtual uint64_t memory_usage() const = 0;
+
         // Probability of collision with a concatenated LSH function.
         float concatenated_collision_probability(uint_fast8_t num_bits, float similarity) const {
             auto bits_per_function = get_bits_per_function();
@@ -58,6 +122,8 @@ namespace puffinn {
 
         virtual void serialize(std::ostream&) const = 0;
 
+        // Create a copy of this source which uses the same functions.
+        virtual std::unique_ptr<HashSource<T>> clone() const = 0;
     };
 
     /// Arguments that can be supplied with data from the ``LSHTable`` to construct a HashSource.
@@ -74,12 +140,19 @@ namespace puffinn {
 
         virtual std::unique_ptr<HashSourceArgs<T>> copy() const = 0;
 
+        /// Whether the built source also computes the sketches used for filtering.
+        virtual bool provides_sketches() const {
+            return false;
+        }
+
+        /// Number of bytes that a source built with the given arguments will use.
         virtual uint64_t memory_usage(
             DatasetDescription<typename T::Sim::Format> dataset,
             unsigned int num_tables,
             unsigned int num_bits
         ) const = 0;
 
+        /// Number of bytes used by each table to refer to the functions of the source.
         virtual uint64_t function_memory_usage(
             DatasetDescription<typename T::Sim::Format> dataset,
             unsigned int num_bits
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "puffinn/dataset.hpp"
+#include "puffinn/hash/batch.hpp"
 #include "puffinn/hash_source/hash_source.hpp"
 
 namespace puffinn {
@@ -9,6 +10,8 @@ namespace puffinn {
     class IndependentHashSource : public HashSource<T> {
         T hash_family;
         std::vector<typename T::Function> hash_functions;
+        // Evaluates all functions at once when hashing blocks of vectors.
+        FunctionBatch<T> batch;
         unsigned int num_hashers;
         unsigned int functions_per_hasher;
         uint_fast8_t bits_per_function;
@@ -35,6 +38,7 @@ namespace puffinn {
             for (unsigned int i=0; i < num_functions; i++) {
                 hash_functions.push_back(hash_family.sample());
             }
+            batch = FunctionBatch<T>(hash_functions);
         }
 
         IndependentHashSource(std::istream& in)
@@ -46,6 +50,7 @@ namespace puffinn {
             for (size_t i=0; i < funcs_len; i++) {
                 hash_functions.push_back(typename T::Function(in));
             }
+            batch = FunctionBatch<T>(hash_functions);
             in.read(reinterpret_cast<char*>(&num_hashers), sizeof(unsigned int));
             in.read(reinterpret_cast<char*>(&functions_per_hasher), sizeof(unsigned int));
             in.read(reinterpret_cast<char*>(&bits_per_function), sizeof(uint_fast8_t));
@@ -53,6 +58,23 @@ namespace puffinn {
             in.read(reinterpret_cast<char*>(&bits_to_cut), sizeof(unsigned int));
         }
 
+        // The functions are stacked anew, so the copy does not refer to the other source.
+        IndependentHashSource(const IndependentHashSource& other)
+          : hash_family(other.hash_family),
+            hash_functions(other.hash_functions),
+            batch(hash_functions),
+            num_hashers(other.num_hashers),
+            functions_per_hasher(other.functions_per_hasher),
+            bits_per_function(other.bits_per_function),
+            next_function(other.next_function),
+            bits_to_cut(other.bits_to_cut)
+        {
+        }
+
+        std::unique_ptr<HashSource<T>> clone() const {
+            return std::make_unique<IndependentHashSource<T>>(*this);
+        }
+
         void serialize(std::ostream& out) const {
             hash_family.serialize(out);
             size_t funcs_len = hash_functions.size();
@@ -72,17 +94,40 @@ namespace puffinn {
             std::vector<uint64_t> & output
         ) const {
             output.resize(num_hashers);
-            // Iterate through all the functions, accumulating bits
-            for (size_t rep = 0; rep < num_hashers; rep++) {
-                size_t offset = rep * functions_per_hasher;
-                uint64_t res = 0;
-                for (unsigned int i=0; i < functions_per_hasher; i++) {
-                    res <<= bits_per_function;
-                    res |= hash_functions[offset+i](input);
-                }
-                res >>= bits_to_cut;
-                output[rep] = res;
-            }
+            batch.hash_concatenated(
+                hash_functions,
+                input,
+                1,
+                0,
+                functions_per_hasher,
+                bits_per_function,
+                bits_to_cut,
+                output.data());
+        }
+
+        void hash_repetitions_block(
+            const typename T::Sim::Format::Type * const input,
+            size_t num_vectors,
+            unsigned int stride,
+            std::vector<uint64_t> & output
+        ) const {
+            output.resize(num_vectors*num_hashers);
+            batch.hash_concatenated(
+                hash_functions,
+                input,
+                num_vectors,
+                stride,
+                functions_per_hasher,
+                bits_per_function,
+                bits_to_cut,
+                output.data());
+        }
+
+        uint64_t memory_usage() const {
+            return sizeof(IndependentHashSource<T>)
+                + hash_family.memory_usage()
+                + functions_memory_usage(hash_functions)
+                + batch.memory_usage();
         }
 
         // Retrieve the number of functions this source can create.
@@ -167,6 +212,7 @@ namespace puffinn {
             auto bits = T(dataset, args_copy).bits_per_function();
             auto funcs_per_hash = (num_bits+bits-1)/bits;
             return sizeof(IndependentHashSource<T>)
+                + T::estimate_memory_usage(dataset, args)
                 + funcs_per_hash*num_tables*args.memory_usage(dataset);
         }
 
@@ -1,7 +1,9 @@
 #pragma once
 
 #include "puffinn/dataset.hpp"
+#include "puffinn/hash/batch.hpp"
 #include "puffinn/hash_source/hash_source.hpp"
+#include "puffinn/math.hpp"
 
 namespace puffinn {
     // A pool of hash functions that can be shared.
@@ -10,15 +12,61 @@ namespace puffinn {
     // perform worse.
     template <typename T>
     class HashPool : public HashSource<T> {
+        // Number of tables that are concatenated at once.
+        const static unsigned int TABLES_PER_STEP = 8;
+
         T hash_family;
         std::vector<typename T::Function> hash_functions;
-        std::vector<std::vector<unsigned int>> indices;
+        // Evaluates all functions in the pool at once.
+        FunctionBatch<T> batch;
+        // The i'th function used by table t is at indices[i*padded_tables+t].
+        // The number of tables is padded to a multiple of TABLES_PER_STEP using index 0,
+        // so that the functions of several tables can be concatenated at once.
+        std::vector<uint32_t> indices;
         unsigned int num_tables;
+        unsigned int padded_tables;
+        unsigned int functions_per_hasher;
         uint_fast8_t bits_per_function;
         unsigned int bits_per_hasher;
         unsigned int current_sampling_rep = 0;
         unsigned int bits_to_cut;
 
+        // Concatenate the pool values into the hashes of all tables.
+        // The output array must have room for padded_tables values.
+        void concatenate_pool(const LshDatatype* pool, uint64_t* output) const {
+            #ifdef __AVX2__
+                __m128i shift = _mm_cvtsi32_si128(bits_per_function);
+                __m128i cut = _mm_cvtsi32_si128(bits_to_cut);
+                for (unsigned int table=0; table < padded_tables; table += TABLES_PER_STEP) {
+                    __m256i res_lo = _mm256_setzero_si256();
+                    __m256i res_hi = _mm256_setzero_si256();
+                    for (unsigned int i=0; i < functions_per_hasher; i++) {
+                        __m256i idx = _mm256_loadu_si256(
+                            (__m256i*)&indices[i*padded_tables+table]);
+                        __m256i values = _mm256_i32gather_epi32(
+                            reinterpret_cast<const int*>(pool), idx, sizeof(LshDatatype));
+                        res_lo = _mm256_or_si256(
+                            _mm256_sll_epi64(res_lo, shift),
+                            _mm256_cvtepu32_epi64(_mm256_castsi256_si128(values)));
+                        res_hi = _mm256_or_si256(
+                            _mm256_sll_epi64(res_hi, shift),
+                            _mm256_cvtepu32_epi64(_mm256_extracti128_si256(values, 1)));
+                    }
+                    _mm256_storeu_si256((__m256i*)&output[table], _mm256_srl_epi64(res_lo, cut));
+                    _mm256_storeu_si256((__m256i*)&output[table+4], _mm256_srl_epi64(res_hi, cut));
+                }
+            #else
+                for (unsigned int table=0; table < padded_tables; table++) {
+                    uint64_t res = 0;
+                    for (unsigned int i=0; i < functions_per_hasher; i++) {
+                        res <<= bits_per_function;
+                        res |= pool[indices[i*padded_tables+table]];
+                    }
+                    output[table] = res >> bits_to_cut;
+                }
+            #endif
+        }
+
     public:
         HashPool(
             DatasetDescription<typename T::Sim::Format> desc,
@@ -29,6 +77,7 @@ namespace puffinn {
         )
           : hash_family(desc, args),
             num_tables(num_tables),
+            padded_tables(ceil_to_multiple(num_tables, TABLES_PER_STEP)),
             bits_per_function(hash_family.bits_per_function()),
             bits_per_hasher(bits_per_hasher)
         {
@@ -37,21 +86,20 @@ namespace puffinn {
             for (unsigned int i=0; i < num_functions; i++) {
                 hash_functions.push_back(hash_family.sample());
             }
+            batch = FunctionBatch<T>(hash_functions);
 
             auto& rand_gen = get_default_random_generator();
             std::uniform_int_distribution<unsigned int> random_idx(0, num_functions-1);
-            
-            indices.reserve(num_tables);
+
+            functions_per_hasher = (bits_per_hasher+bits_per_function-1)/bits_per_function;
+            indices.resize(functions_per_hasher*padded_tables, 0);
             for (size_t rep = 0; rep < num_tables; rep++) {
-                std::vector<unsigned int> rep_indices;
-                rep_indices.reserve(bits_per_hasher);
-                for (size_t i=0; i < bits_per_hasher; i += bits_per_function) {
-                    rep_indices.push_back(random_idx(rand_gen));
+                for (size_t i=0; i < functions_per_hasher; i++) {
+                    indices[i*padded_tables+rep] = random_idx(rand_gen);
                 }
-                indices.push_back(rep_indices);
             }
 
-            bits_to_cut = bits_per_function * indices[0].size() - bits_per_hasher;
+            bits_to_cut = bits_per_function*functions_per_hasher - bits_per_hasher;
         }
 
         HashPool(std::istream& in)
@@ -63,27 +111,41 @@ namespace puffinn {
             for (size_t i=0; i < len; i++) {
                 hash_functions.emplace_back(in);
             }
+            batch = FunctionBatch<T>(hash_functions);
             size_t len_indices;
             in.read(reinterpret_cast<char*>(&len_indices), sizeof(size_t));
-            for (size_t i=0; i < len_indices; i++) {
-                std::vector<unsigned int> rep_indices;
-                size_t len_index_array;
-                in.read(reinterpret_cast<char*>(&len_index_array), sizeof(size_t));
-                for (size_t j=0; j < len_index_array; j++) {
-                    unsigned int idx;
-                    in.read(reinterpret_cast<char*>(&idx), sizeof(unsigned int));
-                    rep_indices.push_back(idx);
-                }
-                indices.push_back(rep_indices);
-            }
+            indices.resize(len_indices);
+            in.read(reinterpret_cast<char*>(indices.data()), len_indices*sizeof(uint32_t));
 
             in.read(reinterpret_cast<char*>(&num_tables), sizeof(unsigned int));
+            in.read(reinterpret_cast<char*>(&padded_tables), sizeof(unsigned int));
+            in.read(reinterpret_cast<char*>(&functions_per_hasher), sizeof(unsigned int));
             in.read(reinterpret_cast<char*>(&bits_per_function), sizeof(uint_fast8_t));
             in.read(reinterpret_cast<char*>(&bits_per_hasher), sizeof(unsigned int));
             in.read(reinterpret_cast<char*>(&current_sampling_rep), sizeof(unsigned int));
             in.read(reinterpret_cast<char*>(&bits_to_cut), sizeof(unsigned int));
         }
 
+        // The functions are stacked anew, so the copy does not refer to the other pool.
+        HashPool(const HashPool& other)
+          : hash_family(other.hash_family),
+            hash_functions(other.hash_functions),
+            batch(hash_functions),
+            indices(other.indices),
+            num_tables(other.num_tables),
+            padded_tables(other.padded_tables),
+            functions_per_hasher(other.functions_per_hasher),
+            bits_per_function(other.bits_per_function),
+            bits_per_hasher(other.bits_per_hasher),
+            current_sampling_rep(other.current_sampling_rep),
+            bits_to_cut(other.bits_to_cut)
+        {
+        }
+
+        std::unique_ptr<HashSource<T>> clone() const {
+            return std::make_unique<HashPool<T>>(*this);
+        }
+
         void serialize(std::ostream& out) const {
             hash_family.serialize(out);
             size_t len = hash_functions.size();
@@ -93,36 +155,28 @@ namespace puffinn {
             }
             size_t len_indices = indices.size();
             out.write(reinterpret_cast<char*>(&len_indices), sizeof(size_t));
-            for (auto& index_vec : indices) {
-                size_t len_index_vec = index_vec.size();
-                out.write(reinterpret_cast<char*>(&len_index_vec), sizeof(size_t));
-                for (auto i : index_vec) {
-                    out.write(reinterpret_cast<const char*>(&i), sizeof(unsigned int));
-                }
-            }
+            out.write(reinterpret_cast<const char*>(indices.data()), len_indices*sizeof(uint32_t));
             out.write(reinterpret_cast<const char*>(&num_tables), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(&padded_tables), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(&functions_per_hasher), sizeof(unsigned int));
             out.write(reinterpret_cast<const char*>(&bits_per_function), sizeof(uint_fast8_t));
             out.write(reinterpret_cast<const char*>(&bits_per_hasher), sizeof(unsigned int));
             out.write(reinterpret_cast<const char*>(&current_sampling_rep), sizeof(unsigned int));
             out.write(reinterpret_cast<const char*>(&bits_to_cut), sizeof(unsigned int));
         }
 
-        uint64_t concatenate_hash(
-            const std::vector<unsigned int>& indices,
-            const LshDatatype* hashes
-        ) const {
-            uint64_t res = 0;
-            for (auto idx : indices) {
-                res <<= bits_per_function;
-                res |= hashes[idx];
-            }
-            return res;
-        }
-
         unsigned int get_size() const {
             return hash_functions.size();
         }
 
+        uint64_t memory_usage() const {
+            return sizeof(HashPool<T>)
+                + hash_family.memory_usage()
+                + functions_memory_usage(hash_functions)
+                + batch.memory_usage()
+                + indices.capacity()*sizeof(uint32_t);
+        }
+
         uint_fast8_t get_bits_per_function() const {
             return bits_per_function;
         }
@@ -135,25 +189,39 @@ namespace puffinn {
             const typename T::Sim::Format::Type * const input,
             std::vector<uint64_t> & output
         ) const {
-            output.clear();
+            std::vector<LshDatatype> scratch;
+            hash_repetitions(input, output, scratch);
+        }
 
-            // TODO: remove this allocation and reuse the scratch space
-            std::vector<uint64_t> pool;
-            pool.reserve(hash_functions.size());
+        void hash_repetitions(
+            const typename T::Sim::Format::Type * const input,
+            std::vector<uint64_t> & output,
+            std::vector<LshDatatype> & scratch
+        ) const {
+            scratch.resize(hash_functions.size());
+            batch.hash(hash_functions, input, 1, 0, scratch.data());
 
-            for (size_t i = 0; i < hash_functions.size(); i++) {
-                pool.push_back(hash_functions[i](input));
-            }
+            // Shrinking afterwards keeps the capacity, so a reused output does not reallocate.
+            output.resize(padded_tables);
+            concatenate_pool(scratch.data(), output.data());
+            output.resize(num_tables);
+        }
 
-            for (size_t rep = 0; rep < num_tables; rep++) {
-                // Concatenate the hashes
-                uint64_t res = 0;
-                for (auto idx : indices[rep]) {
-                    res <<= bits_per_function;
-                    res |= pool[idx];
-                }
-                output.push_back(res >> bits_to_cut);
+        void hash_repetitions_block(
+            const typename T::Sim::Format::Type * const input,
+            size_t num_vectors,
+            unsigned int stride,
+            std::vector<uint64_t> & output
+        ) const {
+            std::vector<LshDatatype> pool(num_vectors*hash_functions.size());
+            batch.hash(hash_functions, input, num_vectors, stride, pool.data());
+
+            // The padding of each vector is overwritten by the next one.
+            output.resize(num_vectors*num_tables+(padded_tables-num_tables));
+            for (size_t v=0; v < num_vectors; v++) {
+                concatenate_pool(&pool[v*hash_functions.size()], &output[v*num_tables]);
             }
+            output.resize(num_vectors*num_tables);
         }
 
         float icollision_probability(float p) const {
@@ -238,24 +306,25 @@ namespace puffinn {
 
         uint64_t memory_usage(
             DatasetDescription<typename T::Sim::Format> dataset,
-            unsigned int /*num_tables*/,
-            unsigned int /*num_bits*/
+            unsigned int num_tables,
+            unsigned int num_bits
         ) const {
             typename T::Args args_copy(args);
             args_copy.set_no_preprocessing();
             auto bits = T(dataset, args_copy).bits_per_function();
+            auto funcs_per_hash = (num_bits+bits-1)/bits;
+            auto padded_tables = ceil_to_multiple(num_tables, 8u);
             return sizeof(HashPool<T>)
-                + pool_size/bits*args.memory_usage(dataset);
+                + T::estimate_memory_usage(dataset, args)
+                + pool_size/bits*args.memory_usage(dataset)
+                + funcs_per_hash*padded_tables*sizeof(uint32_t);
         }
 
         uint64_t function_memory_usage(
-            DatasetDescription<typename T::Sim::Format> dataset,
-            unsigned int num_bits
+            DatasetDescription<typename T::Sim::Format>,
+            unsigned int /*num_bits*/
         ) const {
-            typename T::Args args_copy(args);
-            args_copy.set_no_preprocessing();
-            auto bits = T(dataset, args_copy).bits_per_function();
-            return (num_bits+bits-1)/bits*sizeof(unsigned int);
+            return 0; // The indices of all tables are stored in the pool
         }
 
         std::unique_ptr<HashSource<T>> deserialize_source(std::istream& in) const {
@@ -0,0 +1,288 @@
+#pragma once
+
+#include "puffinn/dataset.hpp"
+#include "puffinn/hash/crosspolytope.hpp"
+#include "puffinn/hash_source/hash_source.hpp"
+#include "puffinn/typedefs.hpp"
+
+#include <algorithm>
+
+namespace puffinn {
+    // A source of independent fast-hadamard cross-polytope hash functions,
+    // which also computes the sketches used for filtering.
+    //
+    // The signs of the coordinates of a pseudo-randomly rotated vector are used as sketch bits,
+    // which are random hyperplane bits like the ones computed by SimHash.
+    // Since the vector is already rotated when hashing, the sketches are almost free.
+    // If the tables do not use enough rotations to fill all sketches, additional rotations are
+    // sampled that are only used for sketching.
+    class SharedRotationHashSource : public HashSource<FHTCrossPolytopeHash> {
+        FHTCrossPolytopeHash hash_family;
+        std::vector<FHTCrossPolytopeHashFunction> hash_functions;
+        unsigned int num_hashers;
+        unsigned int functions_per_hasher;
+        uint_fast8_t bits_per_function;
+        unsigned int bits_to_cut;
+        // Number of values in a rotated vector.
+        unsigned int rotated_dimensions;
+        // The first functions are used for sketching.
+        unsigned int num_sketch_functions;
+
+        // Write the signs of the rotated coordinates into the sketches, starting at the given bit.
+        // Bits past the end of the sketches are discarded.
+        // When there are at least 8 coordinates, the bit is always a multiple of 8.
+        void append_signs(const float* rotated, uint64_t* sketches, size_t& bit) const {
+            const size_t total_bits = NUM_SKETCHES*NUM_FILTER_HASHBITS;
+            unsigned int i = 0;
+            #ifdef __AVX__
+                for (; i+8 <= rotated_dimensions && bit < total_bits; i += 8) {
+                    uint64_t signs = ~_mm256_movemask_ps(_mm256_loadu_ps(&rotated[i])) & 0xff;
+                    sketches[bit/64] |= signs << (bit%64);
+                    bit += 8;
+                }
+            #endif
+            for (; i < rotated_dimensions && bit < total_bits; i++) {
+                uint64_t sign = rotated[i] >= 0.0f;
+                sketches[bit/64] |= sign << (bit%64);
+                bit++;
+            }
+        }
+
+        void hash_and_sketch_vector(
+            const int16_t* const input,
+            uint64_t* hashes,
+            uint64_t* sketches
+        ) const {
+            float rotated[rotated_dimensions];
+            std::fill(sketches, sketches+NUM_SKETCHES, 0);
+            size_t sketch_bit = 0;
+            size_t num_table_functions = num_hashers*functions_per_hasher;
+
+            uint64_t hash = 0;
+            for (size_t f=0; f < hash_functions.size(); f++) {
+                hash_functions[f].rotate(input, rotated);
+                if (f < num_table_functions) {
+                    hash <<= bits_per_function;
+                    hash |= hash_functions[f].encode_closest_axis(rotated);
+                    if ((f+1)%functions_per_hasher == 0) {
+                        hashes[f/functions_per_hasher] = hash >> bits_to_cut;
+                        hash = 0;
+                    }
+                }
+                if (f < num_sketch_functions) {
+                    append_signs(rotated, sketches, sketch_bit);
+                }
+            }
+        }
+
+    public:
+        SharedRotationHashSource(
+            DatasetDescription<UnitVectorFormat> desc,
+            FHTCrossPolytopeArgs args,
+            // Number of hashers to create.
+            unsigned int num_hashers,
+            // Number of bits per hasher.
+            unsigned int num_bits
+        )
+          : hash_family(desc, args),
+            num_hashers(num_hashers)
+        {
+            bits_per_function = hash_family.bits_per_function();
+            functions_per_hasher =
+                (num_bits+bits_per_function-1)/bits_per_function;
+            bits_to_cut = bits_per_function*functions_per_hasher-num_bits;
+            rotated_dimensions = 1 << ceil_log(desc.args);
+            num_sketch_functions =
+                (NUM_SKETCHES*NUM_FILTER_HASHBITS+rotated_dimensions-1)/rotated_dimensions;
+
+            auto num_functions = std::max(functions_per_hasher*num_hashers, num_sketch_functions);
+            hash_functions.reserve(num_functions);
+            for (unsigned int i=0; i < num_functions; i++) {
+                hash_functions.push_back(hash_family.sample());
+            }
+        }
+
+        SharedRotationHashSource(std::istream& in)
+          : hash_family(in)
+        {
+            size_t funcs_len;
+            in.read(reinterpret_cast<char*>(&funcs_len), sizeof(size_t));
+            hash_functions.reserve(funcs_len);
+            for (size_t i=0; i < funcs_len; i++) {
+                hash_functions.push_back(FHTCrossPolytopeHashFunction(in));
+            }
+            in.read(reinterpret_cast<char*>(&num_hashers), sizeof(unsigned int));
+            in.read(reinterpret_cast<char*>(&functions_per_hasher), sizeof(unsigned int));
+            in.read(reinterpret_cast<char*>(&bits_per_function), sizeof(uint_fast8_t));
+            in.read(reinterpret_cast<char*>(&bits_to_cut), sizeof(unsigned int));
+            in.read(reinterpret_cast<char*>(&rotated_dimensions), sizeof(unsigned int));
+            in.read(reinterpret_cast<char*>(&num_sketch_functions), sizeof(unsigned int));
+        }
+
+        std::unique_ptr<HashSource<FHTCrossPolytopeHash>> clone() const {
+            return std::make_unique<SharedRotationHashSource>(*this);
+        }
+
+        void serialize(std::ostream& out) const {
+            hash_family.serialize(out);
+            size_t funcs_len = hash_functions.size();
+            out.write(reinterpret_cast<char*>(&funcs_len), sizeof(size_t));
+            for (auto& h : hash_functions) {
+                h.serialize(out);
+            }
+            out.write(reinterpret_cast<const char*>(&num_hashers), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(&functions_per_hasher), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(&bits_per_function), sizeof(uint_fast8_t));
+            out.write(reinterpret_cast<const char*>(&bits_to_cut), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(&rotated_dimensions), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(&num_sketch_functions), sizeof(unsigned int));
+        }
+
+        void hash_repetitions(
+            const int16_t* const input,
+            std::vector<uint64_t> & output
+        ) const {
+            output.resize(num_hashers);
+            for (unsigned int hasher=0; hasher < num_hashers; hasher++) {
+                size_t offset = hasher*functions_per_hasher;
+                uint64_t res = 0;
+                for (unsigned int i=0; i < functions_per_hasher; i++) {
+                    res <<= bits_per_function;
+                    res |= hash_functions[offset+i](input);
+                }
+                output[hasher] = res >> bits_to_cut;
+            }
+        }
+
+        void hash_and_sketch(
+            const int16_t* const input,
+            std::vector<uint64_t> & hashes,
+            std::vector<FilterLshDatatype> & sketches
+        ) const {
+            hashes.resize(num_hashers);
+            sketches.resize(NUM_SKETCHES);
+            hash_and_sketch_vector(input, hashes.data(), sketches.data());
+        }
+
+        void hash_and_sketch_block(
+            const int16_t* const input,
+            size_t num_vectors,
+            unsigned int stride,
+            std::vector<uint64_t> & hashes,
+            std::vector<FilterLshDatatype> & sketches
+        ) const {
+            hashes.resize(num_vectors*num_hashers);
+            sketches.resize(num_vectors*NUM_SKETCHES);
+            for (size_t v=0; v < num_vectors; v++) {
+                hash_and_sketch_vector(
+                    &input[v*stride],
+                    &hashes[v*num_hashers],
+                    &sketches[v*NUM_SKETCHES]);
+            }
+        }
+
+        uint_fast8_t get_bits_per_function() const {
+            return bits_per_function;
+        }
+
+        uint64_t memory_usage() const {
+            return sizeof(SharedRotationHashSource)
+                + hash_family.memory_usage()
+                + functions_memory_usage(hash_functions);
+        }
+
+        float collision_probability(
+            float similarity,
+            uint_fast8_t num_bits
+        ) const {
+            return hash_family.collision_probability(similarity, num_bits);
+        }
+
+        float failure_probability(
+            uint_fast8_t hash_length,
+            uint_fast32_t tables,
+            uint_fast32_t max_tables,
+            float kth_similarity
+        ) const {
+            float col_prob =
+                this->concatenated_collision_probability(hash_length, kth_similarity);
+            float last_prob =
+                this->concatenated_collision_probability(hash_length+1, kth_similarity);
+            return std::pow(1.0-col_prob, tables)*std::pow(1-last_prob, max_tables-tables);
+        }
+    };
+
+    /// Describes a hash source of independent ``FHTCrossPolytopeHash`` functions,
+    /// whose rotations are also used to compute the sketches used for filtering.
+    ///
+    /// The sketch bits are the signs of coordinates after the pseudo-random rotation.
+    /// When used by an ``Index``, the sketches are computed at the same time as the hashes,
+    /// which avoids most of the cost of sketching.
+    /// The ``sketch_args`` of the ``Index`` are then not used to compute sketches,
+    /// and the filtering assumes the collision probabilities of ``SimHash``.
+    struct SharedRotationHashArgs : public HashSourceArgs<FHTCrossPolytopeHash> {
+        /// Arguments for the hash family.
+        FHTCrossPolytopeArgs args;
+
+        SharedRotationHashArgs() = default;
+
+        SharedRotationHashArgs(std::istream& in)
+          : args(in)
+        {
+        }
+
+        void serialize(std::ostream& out) const {
+            HashSourceType type = HashSourceType::SharedRotation;
+            out.write(reinterpret_cast<char*>(&type), sizeof(HashSourceType));
+            args.serialize(out);
+        }
+
+        std::unique_ptr<HashSource<FHTCrossPolytopeHash>> build(
+            DatasetDescription<UnitVectorFormat> desc,
+            unsigned int num_tables,
+            unsigned int num_bits
+        ) const {
+            return std::make_unique<SharedRotationHashSource>(
+                desc,
+                args,
+                num_tables,
+                num_bits
+            );
+        }
+
+        std::unique_ptr<HashSourceArgs<FHTCrossPolytopeHash>> copy() const {
+            return std::make_unique<SharedRotationHashArgs>(*this);
+        }
+
+        bool provides_sketches() const {
+            return true;
+        }
+
+        uint64_t memory_usage(
+            DatasetDescription<UnitVectorFormat> dataset,
+            unsigned int num_tables,
+            unsigned int num_bits
+        ) const {
+            auto bits = ceil_log(dataset.args)+1;
+            auto funcs_per_hash = (num_bits+bits-1)/bits;
+            auto rotated_dimensions = 1u << ceil_log(dataset.args);
+            auto sketch_funcs =
+                (NUM_SKETCHES*NUM_FILTER_HASHBITS+rotated_dimensions-1)/rotated_dimensions;
+            uint64_t num_funcs = std::max<uint64_t>(funcs_per_hash*num_tables, sketch_funcs);
+            return sizeof(SharedRotationHashSource)
+                + FHTCrossPolytopeHash::estimate_memory_usage(dataset, args)
+                + num_funcs*args.memory_usage(dataset);
+        }
+
+        uint64_t function_memory_usage(
+            DatasetDescription<UnitVectorFormat>,
+            unsigned int /*num_bits*/
+        ) const {
+            return 0;
+        }
+
+        std::unique_ptr<HashSource<FHTCrossPolytopeHash>> deserialize_source(std::istream& in) const {
+            return std::make_unique<SharedRotationHashSource>(in);
+        }
+    };
+}
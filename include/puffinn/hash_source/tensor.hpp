@@ -2,18 +2,24 @@
 
 #include "puffinn/hash_source/independent.hpp"
 
-namespace puffinn {
-    uint64_t intersperse_zero(int64_t val) {
-        uint64_t mask = 1;
-        uint64_t shift = 0;
+#if defined(__BMI2__) || defined(__AVX2__)
+    #include <immintrin.h>
+#endif
 
-        uint64_t res = 0;
-        for (unsigned i=0; i < sizeof(uint64_t)*8/2; i++) {
-            res |= (val & mask) << shift;
-            mask <<= 1;
-            shift++;
-        }
-        return res;
+namespace puffinn {
+    // Place the lower 32 bits of the value at the even bit positions, leaving zeros in between.
+    static uint64_t intersperse_zero(uint64_t val) {
+        #ifdef __BMI2__
+            return _pdep_u64(val, 0x5555555555555555llu);
+        #else
+            uint64_t res = val & 0xFFFFFFFFllu;
+            res = (res | (res << 16)) & 0x0000FFFF0000FFFFllu;
+            res = (res | (res << 8)) & 0x00FF00FF00FF00FFllu;
+            res = (res | (res << 4)) & 0x0F0F0F0F0F0F0F0Fllu;
+            res = (res | (res << 2)) & 0x3333333333333333llu;
+            res = (res | (res << 1)) & 0x5555555555555555llu;
+            return res;
+        #endif
     }
 
     // Helper function for getting indices to tensor.
@@ -41,6 +47,47 @@ namespace puffinn {
         unsigned int num_hashers;
         unsigned int next_hash_idx = 0;
         unsigned int num_bits;
+        // The hashes combined into each hash, as indices into the hashes of the
+        // independent source. Precomputed from get_minimal_index_pair.
+        std::vector<uint32_t> left_indices;
+        std::vector<uint32_t> right_indices;
+
+        // Interleave the hashes of the independent source with zeros,
+        // shifted so that the left and right hashes use different bits.
+        void spread_hashes(const uint64_t* hashes, uint64_t* spread) const {
+            size_t tensored_hashers = independent_hash_source.get_size();
+            size_t right_start = tensored_hashers/2;
+            // With an odd number of bits, the lowest bit of the right hash is discarded.
+            unsigned int left_shift = (num_bits%2 == 0) ? 1 : 0;
+            unsigned int right_shift = num_bits%2;
+            for (size_t i=0; i < right_start; i++) {
+                spread[i] = intersperse_zero(hashes[i]) << left_shift;
+            }
+            for (size_t i=right_start; i < tensored_hashers; i++) {
+                spread[i] = intersperse_zero(hashes[i]) >> right_shift;
+            }
+        }
+
+        // Combine the spread hashes into the output hashes.
+        void combine_hashes(const uint64_t* spread, uint64_t* output) const {
+            size_t rep = 0;
+            #ifdef __AVX2__
+                for (; rep+4 <= num_hashers; rep += 4) {
+                    __m256i left = _mm256_i32gather_epi64(
+                        reinterpret_cast<const long long*>(spread),
+                        _mm_loadu_si128((__m128i*)&left_indices[rep]),
+                        sizeof(uint64_t));
+                    __m256i right = _mm256_i32gather_epi64(
+                        reinterpret_cast<const long long*>(spread),
+                        _mm_loadu_si128((__m128i*)&right_indices[rep]),
+                        sizeof(uint64_t));
+                    _mm256_storeu_si256((__m256i*)&output[rep], _mm256_or_si256(left, right));
+                }
+            #endif
+            for (; rep < num_hashers; rep++) {
+                output[rep] = spread[left_indices[rep]] | spread[right_indices[rep]];
+            }
+        }
 
     public:
         TensoredHashSource(
@@ -59,6 +106,14 @@ namespace puffinn {
             num_hashers(num_hashers),
             num_bits(num_bits)
         {
+            size_t right_start = independent_hash_source.get_size()/2;
+            left_indices.reserve(num_hashers);
+            right_indices.reserve(num_hashers);
+            for (unsigned int rep=0; rep < num_hashers; rep++) {
+                auto index_pair = get_minimal_index_pair(rep);
+                left_indices.push_back(index_pair.first);
+                right_indices.push_back(right_start+index_pair.second);
+            }
         }
 
         TensoredHashSource(std::istream& in)
@@ -67,6 +122,14 @@ namespace puffinn {
             in.read(reinterpret_cast<char*>(&num_hashers), sizeof(unsigned int));
             in.read(reinterpret_cast<char*>(&next_hash_idx), sizeof(unsigned int));
             in.read(reinterpret_cast<char*>(&num_bits), sizeof(unsigned int));
+            left_indices.resize(num_hashers);
+            right_indices.resize(num_hashers);
+            in.read(reinterpret_cast<char*>(left_indices.data()), num_hashers*sizeof(uint32_t));
+            in.read(reinterpret_cast<char*>(right_indices.data()), num_hashers*sizeof(uint32_t));
+        }
+
+        std::unique_ptr<HashSource<T>> clone() const {
+            return std::make_unique<TensoredHashSource<T>>(*this);
         }
 
         void serialize(std::ostream& out) const {
@@ -74,6 +137,8 @@ namespace puffinn {
             out.write(reinterpret_cast<const char*>(&num_hashers), sizeof(unsigned int));
             out.write(reinterpret_cast<const char*>(&next_hash_idx), sizeof(unsigned int));
             out.write(reinterpret_cast<const char*>(&num_bits), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(left_indices.data()), num_hashers*sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(right_indices.data()), num_hashers*sizeof(uint32_t));
         }
 
         void hash_repetitions(
@@ -92,29 +157,26 @@ namespace puffinn {
             size_t tensored_hashers = independent_hash_source.get_size();
             independent_hash_source.hash_repetitions(input, output);
             output.resize(num_hashers + tensored_hashers);
-            for (size_t i=0; i<tensored_hashers; i++) {
-                output[num_hashers+i] = intersperse_zero(output[i]);
-            }
-            size_t right_start = tensored_hashers / 2;
-
-            if (num_bits % 2 == 0) {
-                for (size_t i=0; i < tensored_hashers / 2; i++) {
-                    output[num_hashers + i] <<= 1;
-                }
-            } else {
-                for (size_t i=right_start; i < tensored_hashers; i++) {
-                    output[num_hashers + i] >>= 1;
-                }
-            }
+            spread_hashes(output.data(), &output[num_hashers]);
+            combine_hashes(&output[num_hashers], output.data());
+            output.resize(num_hashers);
+        }
 
-            for(size_t rep=0; rep < num_hashers; rep++) {
-                auto index_pair = get_minimal_index_pair(rep);
-                uint32_t h_left = output[num_hashers + index_pair.first];
-                uint32_t h_right = output[num_hashers + right_start + index_pair.second];
-                uint32_t h = h_left | h_right;
-                output[rep] = h;
+        void hash_repetitions_block(
+            const typename T::Sim::Format::Type * const input,
+            size_t num_vectors,
+            unsigned int stride,
+            std::vector<uint64_t> & output
+        ) const {
+            size_t tensored_hashers = independent_hash_source.get_size();
+            std::vector<uint64_t> hashes;
+            independent_hash_source.hash_repetitions_block(input, num_vectors, stride, hashes);
+            std::vector<uint64_t> spread(tensored_hashers);
+            output.resize(num_vectors*num_hashers);
+            for (size_t v=0; v < num_vectors; v++) {
+                spread_hashes(&hashes[v*tensored_hashers], spread.data());
+                combine_hashes(spread.data(), &output[v*num_hashers]);
             }
-            output.resize(num_hashers);
         }
 
         float collision_probability(
@@ -165,6 +227,14 @@ namespace puffinn {
         uint_fast8_t get_bits_per_function() const {
             return independent_hash_source.get_bits_per_function();
         }
+
+        uint64_t memory_usage() const {
+            return sizeof(TensoredHashSource<T>)
+                - sizeof(IndependentHashSource<T>)
+                + independent_hash_source.memory_usage()
+                + left_indices.capacity()*sizeof(uint32_t)
+                + right_indices.capacity()*sizeof(uint32_t);
+        }
     };
 
     /// Describes a hash source where hashes are constructed by combining a unique pair of smaller hashes from two sets.
@@ -211,8 +281,10 @@ namespace puffinn {
             unsigned int num_bits
         ) const {
             IndependentHashArgs<T> inner_args;
+            inner_args.args = args;
             auto inner_size = 2*std::ceil(std::sqrt(static_cast<float>(num_tables)));
             return sizeof(TensoredHashSource<T>)
+                + 2*num_tables*sizeof(uint32_t)
                 + inner_args.memory_usage(dataset, inner_size, (num_bits+1)/2)
                 + inner_size*inner_args.function_memory_usage(dataset, num_bits);
         }
@@ -0,0 +1,256 @@
+#pragma once
+
+#ifdef __linux__
+    #include <sys/mman.h>
+#endif
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+namespace puffinn {
+    /// The pages used for the large arrays of an index,
+    /// which are the dataset, the sketches and the tables.
+    ///
+    /// Searching accesses these arrays at random positions,
+    /// so with normal 4KB pages, misses in the TLB are almost as costly as cache misses.
+    /// Larger pages reduce the number of TLB misses.
+    /// Every option falls back to the next one if the pages are unavailable.
+    /// Explicit huge pages are reserved whole, so the rounded-up size of each array
+    /// is counted towards the memory limit.
+    /// Huge pages are only used on Linux. Elsewhere every option uses normal pages.
+    enum class HugePages {
+        /// Normal pages.
+        None,
+        /// Transparent huge pages, which the kernel uses where possible when asked using
+        /// ``madvise``. This requires that transparent huge pages are not disabled.
+        Transparent,
+        /// 2MB pages reserved by the administrator through ``/proc/sys/vm/nr_hugepages``.
+        Explicit2MB,
+        /// 1GB pages reserved by the administrator.
+        /// They are only used for arrays that fill whole pages up to an eighth of a page,
+        /// which requires at least 896MB. Smaller arrays use 2MB pages.
+        Explicit1GB
+    };
+
+    // Arrays smaller than this are allocated normally,
+    // since they would waste most of a huge page.
+    const size_t MIN_LARGE_ARRAY_BYTES = 1 << 20;
+    const size_t HUGE_PAGE_BYTES = 1 << 21;
+    // 1GB pages are only used when rounding an array up to whole pages
+    // wastes at most this fraction of the mapping.
+    const size_t MAX_GIGANTIC_PAGE_WASTE_DIVISOR = 8;
+
+    inline size_t round_up(size_t val, size_t mult) {
+        return (val+mult-1)/mult*mult;
+    }
+
+    // Log2 of the size of the explicit huge pages tried first for a mapping of the given length,
+    // or 0 if explicit huge pages are not used.
+    inline int explicit_page_shift(size_t len, HugePages pages) {
+        if (pages == HugePages::Explicit1GB) {
+            size_t mapped_len = round_up(len, size_t(1) << 30);
+            if ((mapped_len-len)*MAX_GIGANTIC_PAGE_WASTE_DIVISOR <= mapped_len) {
+                return 30;
+            }
+        }
+        if (pages == HugePages::Explicit1GB || pages == HugePages::Explicit2MB) {
+            return 21;
+        }
+        return 0;
+    }
+
+    // The pages chosen with set_huge_pages.
+    inline std::atomic<HugePages>& huge_page_setting() {
+        static std::atomic<HugePages> setting(HugePages::None);
+        return setting;
+    }
+
+    /// Choose the pages used for the large arrays allocated from now on.
+    ///
+    /// Arrays are reallocated when an index is rebuilt or deserialized,
+    /// so this should be set before these are done.
+    /// The setting is shared by all indexes in the process.
+    inline void set_huge_pages(HugePages pages) {
+        huge_page_setting().store(pages);
+    }
+
+    /// Retrieve the pages used for large arrays.
+    inline HugePages get_huge_pages() {
+        return huge_page_setting().load();
+    }
+
+#ifdef __linux__
+    // Stored after the end of each mapped array, so that it can be unmapped
+    // regardless of which pages were used.
+    struct LargeArrayMapping {
+        void* base;
+        size_t len;
+        // Bytes reserved for the array, which is the whole mapping for explicit huge pages.
+        size_t reserved;
+    };
+
+    // Length of the mapping of an array, which includes room for the mapping after it.
+    inline size_t array_mapping_len(size_t bytes) {
+        return round_up(bytes, alignof(LargeArrayMapping))+sizeof(LargeArrayMapping);
+    }
+
+    // The mapping stored after an array allocated using allocate_large.
+    inline LargeArrayMapping& array_mapping(void* mem, size_t bytes) {
+        size_t offset = round_up(bytes, alignof(LargeArrayMapping));
+        return *reinterpret_cast<LargeArrayMapping*>(static_cast<char*>(mem)+offset);
+    }
+
+    // Map a region using explicit huge pages of 2^page_shift bytes.
+    // Returns nullptr if no such pages are available.
+    inline void* map_huge_pages(size_t len, int page_shift, LargeArrayMapping& mapping) {
+        // The length of the mapping must be a multiple of the page size.
+        size_t mapped_len = round_up(len, size_t(1) << page_shift);
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+        void* mem = mmap(
+            nullptr, mapped_len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (page_shift << MAP_HUGE_SHIFT), -1, 0);
+#else
+        // The page size cannot be chosen.
+        void* mem = MAP_FAILED;
+#endif
+        if (mem == MAP_FAILED) {
+            return nullptr;
+        }
+        mapping = { mem, mapped_len, mapped_len };
+        return mem;
+    }
+
+    // Map a region of normal pages that is aligned to the given power of two.
+    inline void* map_aligned(size_t len, size_t alignment, LargeArrayMapping& mapping) {
+        size_t mapped_len = len+alignment-1;
+        void* mem = mmap(
+            nullptr, mapped_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        mapping = { mem, mapped_len, mapped_len };
+        return reinterpret_cast<void*>(round_up(reinterpret_cast<uintptr_t>(mem), alignment));
+    }
+
+    // Allocate memory for a large array using the pages chosen with set_huge_pages.
+    // Small arrays are allocated using operator new.
+    inline void* allocate_large(size_t bytes) {
+        if (bytes < MIN_LARGE_ARRAY_BYTES) {
+            return ::operator new(bytes);
+        }
+        size_t len = array_mapping_len(bytes);
+
+        LargeArrayMapping mapping;
+        void* res = nullptr;
+        auto pages = get_huge_pages();
+        auto page_shift = explicit_page_shift(len, pages);
+        if (page_shift == 30) {
+            res = map_huge_pages(len, 30, mapping);
+        }
+        if (res == nullptr && page_shift != 0) {
+            res = map_huge_pages(len, 21, mapping);
+        }
+        if (res == nullptr) {
+            // Only the touched pages are backed by memory, so just the array is counted.
+            if (pages == HugePages::None) {
+                res = map_aligned(len, 1, mapping);
+            } else {
+                // Transparent huge pages are only used for the aligned parts of a mapping.
+                res = map_aligned(len, HUGE_PAGE_BYTES, mapping);
+                // Failing to use huge pages is not an error.
+#ifdef MADV_HUGEPAGE
+                madvise(mapping.base, mapping.len, MADV_HUGEPAGE);
+#endif
+            }
+            mapping.reserved = bytes;
+        }
+        array_mapping(res, bytes) = mapping;
+        return res;
+    }
+
+    // Free memory allocated using allocate_large with the same number of bytes.
+    inline void deallocate_large(void* mem, size_t bytes) {
+        if (mem == nullptr) {
+            return;
+        }
+        if (bytes < MIN_LARGE_ARRAY_BYTES) {
+            ::operator delete(mem);
+            return;
+        }
+        auto mapping = array_mapping(mem, bytes);
+        munmap(mapping.base, mapping.len);
+    }
+
+    // Number of bytes reserved for an array allocated using allocate_large with the given size.
+    inline size_t allocated_large_bytes(const void* mem, size_t bytes) {
+        if (bytes < MIN_LARGE_ARRAY_BYTES) {
+            return bytes;
+        }
+        return array_mapping(const_cast<void*>(mem), bytes).reserved;
+    }
+
+    // Number of bytes that will be reserved for an array of the given size,
+    // assuming that the pages chosen with set_huge_pages are available.
+    inline size_t large_allocation_bytes(size_t bytes) {
+        if (bytes < MIN_LARGE_ARRAY_BYTES) {
+            return bytes;
+        }
+        size_t len = array_mapping_len(bytes);
+        auto page_shift = explicit_page_shift(len, get_huge_pages());
+        return page_shift == 0 ? bytes : round_up(len, size_t(1) << page_shift);
+    }
+#else
+    inline void* allocate_large(size_t bytes) {
+        return ::operator new(bytes);
+    }
+
+    inline void deallocate_large(void* mem, size_t) {
+        ::operator delete(mem);
+    }
+
+    inline size_t allocated_large_bytes(const void*, size_t bytes) {
+        return bytes;
+    }
+
+    inline size_t large_allocation_bytes(size_t bytes) {
+        return bytes;
+    }
+#endif
+
+    // An allocator for the large arrays of an index, which uses the pages chosen with
+    // set_huge_pages.
+    template <typename T>
+    struct LargeArrayAllocator {
+        using value_type = T;
+
+        LargeArrayAllocator() = default;
+
+        template <typename U>
+        LargeArrayAllocator(const LargeArrayAllocator<U>&) {}
+
+        T* allocate(size_t n) {
+            return static_cast<T*>(allocate_large(n*sizeof(T)));
+        }
+
+        void deallocate(T* mem, size_t n) {
+            deallocate_large(mem, n*sizeof(T));
+        }
+    };
+
+    template <typename T, typename U>
+    bool operator==(const LargeArrayAllocator<T>&, const LargeArrayAllocator<U>&) {
+        return true;
+    }
+
+    template <typename T, typename U>
+    bool operator!=(const LargeArrayAllocator<T>&, const LargeArrayAllocator<U>&) {
+        return false;
+    }
+
+    // A vector whose contents are allocated using LargeArrayAllocator.
+    template <typename T>
+    using LargeVector = std::vector<T, LargeArrayAllocator<T>>;
+}
@@ -0,0 +1,254 @@
+#pragma once
+
+#include "puffinn/collection.hpp"
+#include "puffinn/dataset.hpp"
+#include "puffinn/format/real_vector.hpp"
+#include "puffinn/memory.hpp"
+#include "puffinn/similarity_measure/cosine.hpp"
+#include "puffinn/similarity_measure/inner_product.hpp"
+
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+namespace puffinn {
+    /// An index which supports approximate maximum inner product queries.
+    ///
+    /// The vectors are transformed as described in ``InnerProductSimilarity``
+    /// and stored in an ``Index`` using ``CosineSimilarity``,
+    /// so any of its LSH families can be used.
+    /// Since the cosine between the transformed vectors orders the points by their inner product
+    /// with the query, the guarantees on the recall carry over.
+    /// A copy of each inserted vector is kept to re-rank a shortlist of candidates
+    /// by their exact inner product, which recovers neighbors that the hashed
+    /// representation placed just outside the top ``k``.
+    ///
+    /// The upper bound on the norms of the vectors is either given at construction,
+    /// or set to the largest norm of the vectors inserted before the first call to ``rebuild``.
+    /// Vectors inserted later with a larger norm are shortened when they are hashed,
+    /// which reduces the probability of finding them.
+    ///
+    /// @param THash The family of Locality-Sensitive hash functions used for ``CosineSimilarity``.
+    /// @param TSketch The family of 1-bit Locality-Sensitive hash functions used for ``CosineSimilarity``.
+    template <
+        typename THash = FHTCrossPolytopeHash,
+        typename TSketch = SimHash
+    >
+    class InnerProductIndex {
+        // The inserted vectors without transformation.
+        Dataset<RealVectorFormat> vectors;
+        // Index containing the transformed vectors.
+        Index<CosineSimilarity, THash, TSketch> index;
+        // Upper bound on the norm of the inserted vectors,
+        // or 0 if it is determined by the first rebuild.
+        float max_norm;
+        // Number of bytes allowed to be used in total.
+        uint64_t memory_limit;
+
+        // Number of bytes used by the fields that are not measured elsewhere.
+        uint64_t own_memory_usage() const {
+            return sizeof(InnerProductIndex)
+                - sizeof(Dataset<RealVectorFormat>)
+                - sizeof(Index<CosineSimilarity, THash, TSketch>);
+        }
+
+        // Order the candidates by their exact inner product with the query and keep the best k.
+        std::vector<uint32_t> rank(
+            const std::vector<uint32_t>& candidates,
+            float* query,
+            unsigned int k
+        ) const {
+            auto desc = vectors.get_description();
+            std::vector<std::pair<float, uint32_t>> scored;
+            scored.reserve(candidates.size());
+            for (auto idx : candidates) {
+                scored.emplace_back(
+                    InnerProductSimilarity::compute_similarity(vectors[idx], query, desc),
+                    idx);
+            }
+            auto num_results = std::min(static_cast<size_t>(k), scored.size());
+            std::partial_sort(scored.begin(), scored.begin()+num_results, scored.end(),
+                [](const std::pair<float, uint32_t>& a, const std::pair<float, uint32_t>& b) {
+                    return a.first > b.first || (a.first == b.first && a.second < b.second);
+                });
+            std::vector<uint32_t> res;
+            res.reserve(num_results);
+            for (size_t i=0; i < num_results; i++) {
+                res.push_back(scored[i].second);
+            }
+            return res;
+        }
+
+    public:
+        /// Number of candidates in the shortlist per result when no size is given to ``search``.
+        const static unsigned int DEFAULT_SHORTLIST_FACTOR = 4;
+
+        /// Construct an empty index.
+        ///
+        /// @param dimensions The number of dimensions that all vectors must have.
+        /// @param memory_limit The number of bytes of memory that the index is permitted to use,
+        /// including the copy of the inserted vectors.
+        /// @param hash_args Arguments used to construct the source from which hashes are drawn.
+        /// @param sketch_args Similar to ``hash_args``, but for the hash family specified in ``TSketch``.
+        /// @param max_norm Upper bound on the norm of the inserted vectors.
+        /// If 0, the largest norm of the vectors inserted before the first rebuild is used.
+        InnerProductIndex(
+            unsigned int dimensions,
+            uint64_t memory_limit,
+            const HashSourceArgs<THash>& hash_args = IndependentHashArgs<THash>(),
+            const HashSourceArgs<TSketch>& sketch_args = IndependentHashArgs<TSketch>(),
+            float max_norm = 0.0
+        )
+          : vectors(dimensions),
+            index(dimensions+1, memory_limit, hash_args, sketch_args),
+            max_norm(max_norm),
+            memory_limit(memory_limit)
+        {
+            if (max_norm < 0.0) {
+                throw std::invalid_argument("max_norm");
+            }
+        }
+
+        /// Deserialize an index.
+        ///
+        /// It is assumed that the input data is a serialized index
+        /// using the same version of PUFFINN.
+        InnerProductIndex(std::istream& in)
+          : vectors(in),
+            index(in)
+        {
+            in.read(reinterpret_cast<char*>(&max_norm), sizeof(float));
+            in.read(reinterpret_cast<char*>(&memory_limit), sizeof(uint64_t));
+        }
+
+        /// Deserialize a single chunk.
+        void deserialize_chunk(std::istream& in) {
+            index.deserialize_chunk(in);
+        }
+
+        /// Serialize the index to the output stream to be loaded later.
+        ///
+        /// @param use_chunks Whether to split the serialized index into chunks,
+        /// as described in ``Index::serialize``. Defaults to false.
+        void serialize(std::ostream& out, bool use_chunks = false) const {
+            vectors.serialize(out);
+            index.serialize(out, use_chunks);
+            out.write(reinterpret_cast<const char*>(&max_norm), sizeof(float));
+            out.write(reinterpret_cast<const char*>(&memory_limit), sizeof(uint64_t));
+        }
+
+        /// Get an iterator over serialized chunks in the dataset.
+        SerializeIter serialize_chunks() const {
+            return index.serialize_chunks();
+        }
+
+        /// Insert a vector into the index.
+        ///
+        /// Before the vector can be found using the ``search`` method,
+        /// ``rebuild`` must be called.
+        void insert(const std::vector<float>& value) {
+            vectors.insert(value);
+        }
+
+        /// Retrieve the n'th vector inserted into the index.
+        template <typename T>
+        T get(uint32_t idx) {
+            return convert_stored_type<RealVectorFormat, T>(
+                vectors[idx],
+                vectors.get_description());
+        }
+
+        /// Rebuild the index using the currently inserted vectors.
+        ///
+        /// See ``Index::rebuild``.
+        void rebuild() {
+            auto desc = vectors.get_description();
+            if (max_norm == 0.0 && index.get_size() == 0) {
+                for (size_t i=index.get_size(); i < vectors.get_size(); i++) {
+                    float len_squared = dot_product_float(vectors[i], vectors[i], desc.storage_len);
+                    max_norm = std::max(max_norm, std::sqrt(len_squared));
+                }
+            }
+            for (size_t i=index.get_size(); i < vectors.get_size(); i++) {
+                auto vec = convert_stored_type<RealVectorFormat, std::vector<float>>(
+                    vectors[i], desc);
+                index.insert(InnerProductSimilarity::transform_data(vec, max_norm));
+            }
+            uint64_t used = vectors.memory_report().capacity + own_memory_usage();
+            index.set_memory_limit(memory_limit > used ? memory_limit-used : 0);
+            index.rebuild();
+        }
+
+        /// Search for the approximate ``k`` vectors with the largest inner product with the query.
+        ///
+        /// A shortlist of candidates is found using the cosine index
+        /// and re-ranked by their exact inner product before the best ``k`` are kept.
+        ///
+        /// @param query The query vector.
+        /// @param k The number of neighbors to search for.
+        /// @param recall The expected recall of the shortlist with respect to the transformed vectors,
+        /// as described in ``Index::search``.
+        /// @param filter_type The approach used to filter candidates.
+        /// @param shortlist_size The number of candidates that are re-ranked
+        /// by their exact inner product.
+        /// If 0, ``DEFAULT_SHORTLIST_FACTOR*k`` is used.
+        /// @return The indices of the found vectors,
+        /// ordered so that the vector with the largest inner product is first.
+        std::vector<uint32_t> search(
+            const std::vector<float>& query,
+            unsigned int k,
+            float recall,
+            FilterType filter_type = FilterType::Default,
+            unsigned int shortlist_size = 0
+        ) {
+            if (shortlist_size == 0) {
+                shortlist_size = DEFAULT_SHORTLIST_FACTOR*k;
+            }
+            shortlist_size = std::max(shortlist_size, k);
+            auto stored = to_stored_type<RealVectorFormat>(query, vectors.get_description());
+            auto candidates = index.search(
+                InnerProductSimilarity::transform_query(query),
+                shortlist_size,
+                recall,
+                filter_type);
+            return rank(candidates, stored.get(), k);
+        }
+
+        /// Search for the ``k`` vectors with the largest inner product with the query
+        /// by computing the inner product with each inserted vector.
+        ///
+        /// ``rebuild`` does not need to be called before a vector is considered.
+        std::vector<uint32_t> search_bf(const std::vector<float>& query, unsigned int k) const {
+            auto stored = to_stored_type<RealVectorFormat>(query, vectors.get_description());
+            std::vector<uint32_t> all(vectors.get_size());
+            for (uint32_t i=0; i < vectors.get_size(); i++) {
+                all[i] = i;
+            }
+            return rank(all, stored.get(), k);
+        }
+
+        /// Measure the memory used by each component of the index.
+        ///
+        /// Both the inserted and the transformed vectors are included in the dataset.
+        MemoryReport memory_report() const {
+            auto res = index.memory_report();
+            res.dataset += vectors.memory_report();
+            res.tables += MemoryUsage(own_memory_usage(), own_memory_usage());
+            return res;
+        }
+
+        /// Retrieve the upper bound on the norms used when transforming vectors.
+        ///
+        /// This is 0 until the first rebuild, unless it was given at construction.
+        float get_max_norm() const {
+            return max_norm;
+        }
+
+        // Retrieve the number of inserted vectors.
+        unsigned int get_size() const {
+            return vectors.get_size();
+        }
+    };
+}
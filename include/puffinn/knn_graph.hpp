@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace puffinn {
+    /// The approximate nearest neighbors of every value in an index,
+    /// stored as a graph in compressed sparse row format.
+    ///
+    /// The neighbors of the value with index ``i`` are stored in ``neighbors``
+    /// from position ``offsets[i]`` up to, but not including, ``offsets[i+1]``,
+    /// ordered so that the most similar neighbor is first.
+    struct KnnGraph {
+        /// The position of the first neighbor of each value,
+        /// followed by the total number of neighbors.
+        std::vector<uint64_t> offsets;
+        /// The indices of the neighbors of all values.
+        std::vector<uint32_t> neighbors;
+        /// The similarity between each value and the corresponding neighbor.
+        std::vector<float> similarities;
+
+        KnnGraph() : offsets(1, 0) {}
+
+        /// Retrieve the number of values in the graph.
+        size_t size() const {
+            return offsets.size()-1;
+        }
+
+        /// Retrieve the number of neighbors of a value.
+        uint64_t degree(uint32_t idx) const {
+            return offsets[idx+1]-offsets[idx];
+        }
+    };
+}
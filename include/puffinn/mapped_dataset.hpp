@@ -0,0 +1,233 @@
+#pragma once
+
+#include "puffinn/dataset.hpp"
+#include "puffinn/format/generic.hpp"
+#include "puffinn/memory.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+namespace puffinn {
+    // A container for inserted vectors with the same interface as ``Dataset``,
+    // which is stored in memory-mapped pages.
+    //
+    // If a path is given, the pages are backed by a file at that path,
+    // so that the operating system can evict them when memory is scarce.
+    // The file is unlinked as soon as it is created, so it is removed when the dataset is destroyed.
+    // Otherwise anonymous memory is used, which behaves like a ``Dataset``.
+    //
+    // Only formats whose values do not own memory can be mapped.
+    template <typename T>
+    class MappedDataset {
+        static_assert(
+            std::is_trivially_copyable<typename T::Type>::value,
+            "Format cannot be memory-mapped");
+
+        typename T::Args args;
+        // Number of dimensions of stored vectors, including padding.
+        unsigned int storage_len;
+        // Number of inserted vectors.
+        unsigned int inserted_vectors;
+        // Maximal number of inserted vectors.
+        unsigned int capacity;
+        // Descriptor of the backing file or -1 if the memory is anonymous.
+        int fd;
+        // Mapped vectors, which are page aligned.
+        typename T::Type* data;
+
+        size_t mapping_len(unsigned int num_vectors) const {
+            // mmap does not accept a length of zero.
+            return std::max(
+                static_cast<size_t>(num_vectors)*storage_len*sizeof(typename T::Type),
+                static_cast<size_t>(1));
+        }
+
+        void open_file(const std::string& path) {
+            fd = -1;
+            if (path.empty()) {
+                return;
+            }
+            fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+            if (fd == -1) {
+                throw std::runtime_error("open");
+            }
+            ::unlink(path.c_str());
+        }
+
+        // Map room for the given number of vectors,
+        // keeping the contents of the current mapping.
+        void remap(unsigned int new_capacity) {
+            auto len = mapping_len(new_capacity);
+            void* mem;
+            if (fd == -1) {
+                mem = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (mem == MAP_FAILED) {
+                    throw std::runtime_error("mmap");
+                }
+                if (data != nullptr) {
+                    std::memcpy(mem, data, inserted_vectors*storage_len*sizeof(typename T::Type));
+                }
+            } else {
+                // The contents are kept in the file.
+                if (ftruncate(fd, len) != 0) {
+                    throw std::runtime_error("ftruncate");
+                }
+                mem = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (mem == MAP_FAILED) {
+                    throw std::runtime_error("mmap");
+                }
+            }
+            unmap();
+            data = static_cast<typename T::Type*>(mem);
+            capacity = new_capacity;
+        }
+
+        void unmap() {
+            if (data != nullptr) {
+                munmap(data, mapping_len(capacity));
+                data = nullptr;
+            }
+        }
+
+        void close_file() {
+            if (fd != -1) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+
+    public:
+        // Create an empty storage for vectors with the given arguments.
+        //
+        // If the path is empty, anonymous memory is used instead of a file.
+        MappedDataset(typename T::Args args, const std::string& path = "")
+          : args(args),
+            storage_len(pad_dimensions<T>(T::storage_dimensions(args))),
+            inserted_vectors(0),
+            capacity(0),
+            data(nullptr)
+        {
+            open_file(path);
+            remap(DEFAULT_CAPACITY);
+        }
+
+        // Deserialize a dataset serialized by either this class or ``Dataset``.
+        MappedDataset(std::istream& in, const std::string& path = "")
+          : inserted_vectors(0),
+            capacity(0),
+            data(nullptr)
+        {
+            T::deserialize_args(in, &args);
+            in.read(reinterpret_cast<char*>(&storage_len), sizeof(unsigned int));
+            unsigned int num_vectors;
+            in.read(reinterpret_cast<char*>(&num_vectors), sizeof(unsigned int));
+            open_file(path);
+            remap(std::max(num_vectors, DEFAULT_CAPACITY));
+            for (size_t i=0; i < static_cast<size_t>(num_vectors)*storage_len; i++) {
+                T::deserialize_type(in, &data[i]);
+            }
+            inserted_vectors = num_vectors;
+        }
+
+        MappedDataset(const MappedDataset&) = delete;
+        MappedDataset& operator=(const MappedDataset&) = delete;
+
+        MappedDataset(MappedDataset&& other)
+          : args(other.args),
+            storage_len(other.storage_len),
+            inserted_vectors(other.inserted_vectors),
+            capacity(other.capacity),
+            fd(other.fd),
+            data(other.data)
+        {
+            other.fd = -1;
+            other.data = nullptr;
+        }
+
+        MappedDataset& operator=(MappedDataset&& rhs) {
+            if (this != &rhs) {
+                unmap();
+                close_file();
+                args = rhs.args;
+                storage_len = rhs.storage_len;
+                inserted_vectors = rhs.inserted_vectors;
+                capacity = rhs.capacity;
+                fd = rhs.fd;
+                data = rhs.data;
+                rhs.fd = -1;
+                rhs.data = nullptr;
+            }
+            return *this;
+        }
+
+        ~MappedDataset() {
+            unmap();
+            close_file();
+        }
+
+        // Serialize the dataset in the same format as ``Dataset``.
+        void serialize(std::ostream& out) const {
+            T::serialize_args(out, args);
+            out.write(reinterpret_cast<const char*>(&storage_len), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(&inserted_vectors), sizeof(unsigned int));
+            for (size_t i=0; i < static_cast<size_t>(inserted_vectors)*storage_len; i++) {
+                T::serialize_type(out, data[i]);
+            }
+        }
+
+        // Access the vector at the given position.
+        typename T::Type* operator[](unsigned int idx) const {
+            return &data[static_cast<size_t>(idx)*storage_len];
+        }
+
+        DatasetDescription<T> get_description() const {
+            DatasetDescription<T> res;
+            res.args = args;
+            res.storage_len = storage_len;
+            return res;
+        }
+
+        // Retrieve the number of inserted vectors.
+        unsigned int get_size() const {
+            return inserted_vectors;
+        }
+
+        // Retrieve the capacity of the dataset
+        unsigned int get_capacity() const {
+            return capacity;
+        }
+
+        // Whether the vectors are kept in memory rather than in a file.
+        bool is_anonymous() const {
+            return fd == -1;
+        }
+
+        // Insert a vector.
+        template <typename U>
+        void insert(const U& vec) {
+            if (inserted_vectors == capacity) {
+                remap(std::ceil(capacity*EXPANSION_FACTOR));
+            }
+            T::store(vec, (*this)[inserted_vectors], get_description());
+            inserted_vectors++;
+        }
+
+        // Measure the memory used by the stored vectors, regardless of where they are mapped.
+        MemoryUsage memory_report() const {
+            return MemoryUsage(
+                sizeof(MappedDataset)
+                    + static_cast<uint64_t>(inserted_vectors)*storage_len*sizeof(typename T::Type),
+                sizeof(MappedDataset) + mapping_len(capacity));
+        }
+    };
+}
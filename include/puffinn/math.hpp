@@ -1,11 +1,12 @@
 #pragma once
 
+#include "puffinn/typedefs.hpp"
+
 #if defined(__AVX2__) || defined(__AVX__)
     #include <immintrin.h>
 #endif
 
 
-
 namespace puffinn {
     #ifdef __AVX2__
         static int16_t dot_product_i16_avx2(const int16_t* lhs, const int16_t* rhs, unsigned int dimensions) {
@@ -51,6 +52,109 @@ namespace puffinn {
         #endif
     }
 
+    #ifdef __AVX2__
+        // Sum the values in each of eight vectors.
+        // The i'th value in the result is the sum of the values in the i'th vector.
+        static __m128i horizontal_sum_8x_i16_avx2(
+            __m256i a0, __m256i a1, __m256i a2, __m256i a3,
+            __m256i a4, __m256i a5, __m256i a6, __m256i a7
+        ) {
+            __m256i s01 = _mm256_hadd_epi16(a0, a1);
+            __m256i s23 = _mm256_hadd_epi16(a2, a3);
+            __m256i s45 = _mm256_hadd_epi16(a4, a5);
+            __m256i s67 = _mm256_hadd_epi16(a6, a7);
+            __m256i s = _mm256_hadd_epi16(
+                _mm256_hadd_epi16(s01, s23),
+                _mm256_hadd_epi16(s45, s67));
+            // Each 128 bit lane now contains the partial sums of its half of the inputs.
+            return _mm_add_epi16(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+        }
+
+        // Compute the dot products of four consecutive rows with NUM_VECS consecutive vectors,
+        // which is the register-blocked kernel of a small int16 matrix multiplication.
+        // NUM_VECS must be 1 or 2.
+        //
+        // The dot product of row i and vector j is written to output[4*j+i].
+        // 8 values are always written.
+        // The results are equal to those of dot_product_i16.
+        template <unsigned int NUM_VECS>
+        static void dot_products_i16_4xn_avx2(
+            const int16_t* rows,
+            unsigned int row_stride,
+            const int16_t* vecs,
+            unsigned int vec_stride,
+            unsigned int dimensions,
+            int16_t* output
+        ) {
+            const static unsigned int VALUES_PER_VEC = 16;
+            static_assert(NUM_VECS == 1 || NUM_VECS == 2, "unsupported number of vectors");
+
+            __m256i acc[8];
+            for (auto& a : acc) { a = _mm256_setzero_si256(); }
+
+            for (unsigned int i=0; i < dimensions; i += VALUES_PER_VEC) {
+                __m256i r0 = _mm256_load_si256((__m256i*)&rows[i]);
+                __m256i r1 = _mm256_load_si256((__m256i*)&rows[row_stride+i]);
+                __m256i r2 = _mm256_load_si256((__m256i*)&rows[2*row_stride+i]);
+                __m256i r3 = _mm256_load_si256((__m256i*)&rows[3*row_stride+i]);
+                for (unsigned int j=0; j < NUM_VECS; j++) {
+                    __m256i v = _mm256_load_si256((__m256i*)&vecs[j*vec_stride+i]);
+                    acc[4*j] = _mm256_add_epi16(acc[4*j], _mm256_mulhrs_epi16(r0, v));
+                    acc[4*j+1] = _mm256_add_epi16(acc[4*j+1], _mm256_mulhrs_epi16(r1, v));
+                    acc[4*j+2] = _mm256_add_epi16(acc[4*j+2], _mm256_mulhrs_epi16(r2, v));
+                    acc[4*j+3] = _mm256_add_epi16(acc[4*j+3], _mm256_mulhrs_epi16(r3, v));
+                }
+            }
+            _mm_storeu_si128(
+                (__m128i*)output,
+                horizontal_sum_8x_i16_avx2(
+                    acc[0], acc[1], acc[2], acc[3], acc[4], acc[5], acc[6], acc[7]));
+        }
+    #endif
+
+    // Compute the dot products between each of a number of rows and each of a number of columns,
+    // which are all stored `stride` apart.
+    // The dot product of row i and column j is passed to store(i, j, value).
+    // The results are equal to those of dot_product_i16.
+    template <typename F>
+    static void dot_products_i16_block(
+        const int16_t* rows,
+        unsigned int num_rows,
+        const int16_t* cols,
+        unsigned int num_cols,
+        unsigned int stride,
+        unsigned int dimensions,
+        F&& store
+    ) {
+        unsigned int i=0;
+        #ifdef __AVX2__
+            alignas(16) int16_t res[8];
+            for (; i+4 <= num_rows; i += 4) {
+                unsigned int j=0;
+                for (; j+2 <= num_cols; j += 2) {
+                    dot_products_i16_4xn_avx2<2>(
+                        &rows[i*stride], stride, &cols[j*stride], stride, dimensions, res);
+                    for (unsigned int r=0; r < 4; r++) {
+                        store(i+r, j, res[r]);
+                        store(i+r, j+1, res[4+r]);
+                    }
+                }
+                if (j < num_cols) {
+                    dot_products_i16_4xn_avx2<1>(
+                        &rows[i*stride], stride, &cols[j*stride], stride, dimensions, res);
+                    for (unsigned int r=0; r < 4; r++) {
+                        store(i+r, j, res[r]);
+                    }
+                }
+            }
+        #endif
+        for (; i < num_rows; i++) {
+            for (unsigned int j=0; j < num_cols; j++) {
+                store(i, j, dot_product_i16(&rows[i*stride], &cols[j*stride], dimensions));
+            }
+        }
+    }
+
     #ifdef __AVX__
         // Compute the l2 distance between two floating point vectors without taking the
         // final root.
@@ -84,6 +188,65 @@ namespace puffinn {
         }
     #endif
 
+    #ifdef __AVX__
+        // Compute the dot product between two floating point vectors.
+        // Both must be 256-bit aligned and padded with zeros to a multiple of 8 values.
+        static float dot_product_float_avx(const float* lhs, const float* rhs, unsigned int dimensions) {
+            // Number of float values that fit into a 256 bit vector.
+            const static unsigned int VALUES_PER_VEC = 8;
+            // Independent accumulators, so that consecutive additions do not wait for each other.
+            const static unsigned int NUM_ACCUMULATORS = 4;
+
+            __m256 acc[NUM_ACCUMULATORS];
+            for (auto& a : acc) { a = _mm256_setzero_ps(); }
+
+            unsigned int i = 0;
+            for (; i+NUM_ACCUMULATORS*VALUES_PER_VEC <= dimensions; i += NUM_ACCUMULATORS*VALUES_PER_VEC) {
+                for (unsigned int j=0; j < NUM_ACCUMULATORS; j++) {
+                    __m256 l = _mm256_load_ps(&lhs[i+j*VALUES_PER_VEC]);
+                    __m256 r = _mm256_load_ps(&rhs[i+j*VALUES_PER_VEC]);
+                    #ifdef __FMA__
+                        acc[j] = _mm256_fmadd_ps(l, r, acc[j]);
+                    #else
+                        acc[j] = _mm256_add_ps(acc[j], _mm256_mul_ps(l, r));
+                    #endif
+                }
+            }
+            for (; i < dimensions; i += VALUES_PER_VEC) {
+                __m256 tmp = _mm256_mul_ps(
+                    _mm256_load_ps(&lhs[i]),
+                    _mm256_load_ps(&rhs[i]));
+                acc[0] = _mm256_add_ps(acc[0], tmp);
+            }
+            __m256 res = _mm256_add_ps(
+                _mm256_add_ps(acc[0], acc[1]),
+                _mm256_add_ps(acc[2], acc[3]));
+            alignas(32) float stored[VALUES_PER_VEC];
+            _mm256_store_ps(stored, res);
+            float ret = 0;
+            for (unsigned i=0; i < VALUES_PER_VEC; i++) {
+                ret += stored[i];
+            }
+            return ret;
+        }
+    #endif
+
+    static float dot_product_float_simple(const float* lhs, const float* rhs, unsigned int dimensions) {
+        float res = 0.0;
+        for (unsigned int i=0; i < dimensions; i++) {
+            res += lhs[i]*rhs[i];
+        }
+        return res;
+    }
+
+    static float dot_product_float(const float* lhs, const float* rhs, unsigned int dimensions) {
+        #ifdef __AVX__
+            return dot_product_float_avx(lhs, rhs, dimensions);
+        #else
+            return dot_product_float_simple(lhs, rhs, dimensions);
+        #endif
+    }
+
     static float l2_distance_float_simple(const float* lhs, const float* rhs, unsigned int dimensions) {
         float res = 0.0;
         for (unsigned int i=0; i < dimensions; i++) {
@@ -101,6 +264,121 @@ namespace puffinn {
         #endif
     }
 
+    #ifdef __AVX2__
+        // Compute the dot product of two vectors of 8-bit integers between -127 and 127.
+        // The number of dimensions must be a multiple of 32.
+        //
+        // The instructions multiply unsigned by signed bytes, so the sign of lhs is moved to rhs.
+        static int32_t dot_product_i8_avx2(const int8_t* lhs, const int8_t* rhs, unsigned int dimensions) {
+            // Number of i8 values that fit into a 256 bit vector.
+            const static unsigned int VALUES_PER_VEC = 32;
+
+            __m256i res = _mm256_setzero_si256();
+            #if !(defined(__AVX512VNNI__) && defined(__AVX512VL__))
+                const __m256i ones = _mm256_set1_epi16(1);
+            #endif
+            for (unsigned int i=0; i < dimensions; i += VALUES_PER_VEC) {
+                __m256i a = _mm256_load_si256((__m256i*)&lhs[i]);
+                __m256i b = _mm256_load_si256((__m256i*)&rhs[i]);
+                __m256i abs_a = _mm256_sign_epi8(a, a);
+                __m256i signed_b = _mm256_sign_epi8(b, a);
+                #if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+                    res = _mm256_dpbusd_epi32(res, abs_a, signed_b);
+                #else
+                    // Sums of two products are at most 2*127*127, so they do not saturate.
+                    __m256i pairs = _mm256_maddubs_epi16(abs_a, signed_b);
+                    res = _mm256_add_epi32(res, _mm256_madd_epi16(pairs, ones));
+                #endif
+            }
+            __m128i sum = _mm_add_epi32(
+                _mm256_castsi256_si128(res),
+                _mm256_extracti128_si256(res, 1));
+            sum = _mm_hadd_epi32(sum, sum);
+            sum = _mm_hadd_epi32(sum, sum);
+            return _mm_cvtsi128_si32(sum);
+        }
+    #endif
+
+    static int32_t dot_product_i8_simple(const int8_t* lhs, const int8_t* rhs, unsigned int dimensions) {
+        int32_t res = 0;
+        for (unsigned int i=0; i < dimensions; i++) {
+            res += static_cast<int32_t>(lhs[i])*static_cast<int32_t>(rhs[i]);
+        }
+        return res;
+    }
+
+    // Compute the dot product of two vectors of 8-bit integers between -127 and 127.
+    static int32_t dot_product_i8(const int8_t* lhs, const int8_t* rhs, unsigned int dimensions) {
+        #ifdef __AVX2__
+            if (dimensions%32 == 0) {
+                return dot_product_i8_avx2(lhs, rhs, dimensions);
+            }
+        #endif
+        return dot_product_i8_simple(lhs, rhs, dimensions);
+    }
+
+    #ifdef __AVX2__
+        // Count the number of differing bits between two packed binary vectors.
+        // The number of words must be a multiple of 4.
+        //
+        // The bits of each byte are counted by looking up both nibbles in a table,
+        // after which the counts are summed into 64-bit lanes.
+        static unsigned int hamming_distance_avx2(
+            const uint64_t* lhs,
+            const uint64_t* rhs,
+            unsigned int words
+        ) {
+            // Number of u64 values that fit into a 256 bit vector.
+            const static unsigned int VALUES_PER_VEC = 4;
+
+            const __m256i lookup = _mm256_setr_epi8(
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+            const __m256i low_mask = _mm256_set1_epi8(0x0f);
+
+            __m256i res = _mm256_setzero_si256();
+            for (unsigned int i=0; i < words; i += VALUES_PER_VEC) {
+                __m256i diff = _mm256_xor_si256(
+                    _mm256_load_si256((__m256i*)&lhs[i]),
+                    _mm256_load_si256((__m256i*)&rhs[i]));
+                __m256i low = _mm256_and_si256(diff, low_mask);
+                __m256i high = _mm256_and_si256(_mm256_srli_epi16(diff, 4), low_mask);
+                __m256i counts = _mm256_add_epi8(
+                    _mm256_shuffle_epi8(lookup, low),
+                    _mm256_shuffle_epi8(lookup, high));
+                res = _mm256_add_epi64(res, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+            }
+            alignas(32) uint64_t stored[VALUES_PER_VEC];
+            _mm256_store_si256((__m256i*)stored, res);
+            return stored[0]+stored[1]+stored[2]+stored[3];
+        }
+    #endif
+
+    static unsigned int hamming_distance_simple(
+        const uint64_t* lhs,
+        const uint64_t* rhs,
+        unsigned int words
+    ) {
+        unsigned int res = 0;
+        for (unsigned int i=0; i < words; i++) {
+            res += popcountll(lhs[i] ^ rhs[i]);
+        }
+        return res;
+    }
+
+    // Count the number of differing bits between two packed binary vectors.
+    static unsigned int hamming_distance(const uint64_t* lhs, const uint64_t* rhs, unsigned int words) {
+        // With AVX512 population counts, the simple version is vectorized by the compiler.
+        #if defined(__AVX2__) && !defined(__AVX512VPOPCNTDQ__)
+            // Short codes, such as 256-bit hashes, are faster to count one word at a time.
+            const unsigned int MIN_AVX2_WORDS = 16;
+            if (words >= MIN_AVX2_WORDS && words%4 == 0) {
+                return hamming_distance_avx2(lhs, rhs, words);
+            }
+        #endif
+        return hamming_distance_simple(lhs, rhs, words);
+    }
+
     // Round up to nearest power of two.
     constexpr static unsigned int ceil_log(unsigned int value) {
         unsigned int log = 0;
@@ -75,6 +75,12 @@ namespace puffinn {
             return true;
         }
 
+        // Remove all but the `k` entries with the highest associated values,
+        // so that smallest_value takes all inserted values into account.
+        void compact() {
+            filter();
+        }
+
         // Retrieve the `k` entries with the highest associated values.
         std::vector<ResultPair> best_entries() {
             filter();
@@ -9,13 +9,18 @@
 #include <vector>
 
 namespace puffinn {
-    // Stores the `k` indices with the highest similarities seen so far. Similarities are always values between 0 and 1. 
+    // Stores the `k` pairs of indices with the highest similarities seen so far. Similarities are always values between 0 and 1. 
+    //
+    // By default, pairs are unordered, so that (a, b) and (b, a) are the same pair,
+    // which is stored with the smallest index first.
     class MaxPairBuffer {
     public:
         using ResultPair = std::pair<std::pair<uint32_t, uint32_t>, float>;
 
     private:
         const unsigned int size;
+        // Whether the order of the indices in a pair is irrelevant.
+        const bool unordered;
         unsigned int inserted_values;
         float minval;
         std::vector<ResultPair> data;
@@ -47,8 +52,9 @@ namespace puffinn {
 
     public:
         // Construct a buffer containing `size` elements. The memory used is twice that.
-        MaxPairBuffer(unsigned int k)
+        MaxPairBuffer(unsigned int k, bool unordered = true)
           : size(k),
+            unordered(unordered),
             inserted_values(0),
             minval(0.0),
             data(std::vector<ResultPair>(2*k))
@@ -71,7 +77,7 @@ namespace puffinn {
                 filter();
             }
             auto elements = idx;
-            if (idx.first > idx.second) {
+            if (unordered && idx.first > idx.second) {
                 elements = {idx.second, idx.first};
             }
             data[inserted_values] = { elements, value };
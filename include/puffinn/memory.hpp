@@ -0,0 +1,69 @@
+#pragma once
+
+#include "puffinn/huge_pages.hpp"
+
+#include <cstdint>
+#include <vector>
+
+namespace puffinn {
+    /// Number of bytes used by part of an index.
+    struct MemoryUsage {
+        /// Bytes used by the stored contents.
+        uint64_t size = 0;
+        /// Bytes allocated, including unused capacity and alignment padding.
+        uint64_t capacity = 0;
+
+        MemoryUsage() = default;
+
+        MemoryUsage(uint64_t size, uint64_t capacity)
+          : size(size),
+            capacity(capacity)
+        {
+        }
+
+        MemoryUsage& operator+=(const MemoryUsage& rhs) {
+            size += rhs.size;
+            capacity += rhs.capacity;
+            return *this;
+        }
+    };
+
+    /// Measured memory usage of each component of an ``Index``.
+    ///
+    /// The same measurements are used to decide how many tables fit within the memory limit.
+    /// Overhead of the memory allocator itself is not included.
+    struct MemoryReport {
+        /// The stored values.
+        MemoryUsage dataset;
+        /// The LSH tables.
+        MemoryUsage tables;
+        /// The sketches used for filtering.
+        MemoryUsage sketches;
+        /// All sampled hash functions, including those used for sketching.
+        MemoryUsage hash_functions;
+
+        /// Memory used by all components.
+        MemoryUsage total() const {
+            MemoryUsage res;
+            res += dataset;
+            res += tables;
+            res += sketches;
+            res += hash_functions;
+            return res;
+        }
+    };
+
+    // Memory used by the contents of a vector, not including the vector itself.
+    template <typename T, typename A>
+    MemoryUsage vector_memory(const std::vector<T, A>& vec) {
+        return MemoryUsage(vec.size()*sizeof(T), vec.capacity()*sizeof(T));
+    }
+
+    // Memory used by the contents of a large vector, including the rounding up to whole pages.
+    template <typename T>
+    MemoryUsage vector_memory(const LargeVector<T>& vec) {
+        return MemoryUsage(
+            vec.size()*sizeof(T),
+            allocated_large_bytes(vec.data(), vec.capacity()*sizeof(T)));
+    }
+}
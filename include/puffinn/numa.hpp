@@ -0,0 +1,99 @@
+#pragma once
+
+#ifdef __linux__
+    #include <linux/mempolicy.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace puffinn {
+    /// How the memory of an index is placed on the NUMA nodes of the machine.
+    enum class NumaPolicy {
+        /// Pages are placed on the node of the thread that first touches them,
+        /// which is the default of the operating system.
+        /// When the index is built by threads on one node,
+        /// threads on other nodes access all of it remotely.
+        /// Switching back to this policy does not move pages that are already placed.
+        FirstTouch,
+        /// Pages are spread evenly across all nodes,
+        /// so that threads on every node see the same memory bandwidth and latency.
+        Interleave
+    };
+
+    // Retrieve a mask of the online NUMA nodes, considering at most the first 64 nodes.
+    // Returns 0 if the nodes cannot be determined.
+    static uint64_t online_numa_nodes() {
+        std::ifstream in("/sys/devices/system/node/online");
+        std::string ranges;
+        if (!std::getline(in, ranges)) {
+            return 0;
+        }
+        // The nodes are listed as ranges such as "0-1,4".
+        uint64_t res = 0;
+        size_t pos = 0;
+        while (pos < ranges.size()) {
+            size_t end = ranges.find(',', pos);
+            if (end == std::string::npos) {
+                end = ranges.size();
+            }
+            auto range = ranges.substr(pos, end-pos);
+            auto dash = range.find('-');
+            unsigned long first = std::stoul(range.substr(0, dash));
+            unsigned long last = (dash == std::string::npos ? first : std::stoul(range.substr(dash+1)));
+            for (auto node = first; node <= last && node < 64; node++) {
+                res |= uint64_t(1) << node;
+            }
+            pos = end+1;
+        }
+        return res;
+    }
+
+    // Apply a NUMA policy to the pages that are entirely contained in a range of memory.
+    // When interleaving, pages that are already allocated are moved to conform to the policy.
+    //
+    // Returns whether the policy was applied.
+    // It cannot be applied when the kernel does not support NUMA,
+    // in which case the placement is unchanged.
+    // Pages that are already allocated keep their placement when switching to FirstTouch,
+    // since the kernel does not move pages when the default policy is set.
+    static bool apply_numa_policy(const void* data, size_t len, NumaPolicy policy) {
+        // The policies are enumerators, so the header is detected through one of its macros.
+#if defined(__linux__) && defined(MPOL_MF_MOVE) && defined(SYS_mbind)
+        static const uint64_t nodes = online_numa_nodes();
+        if (nodes == 0) {
+            return false;
+        }
+        uintptr_t page_size = sysconf(_SC_PAGESIZE);
+        uintptr_t begin = (reinterpret_cast<uintptr_t>(data)+page_size-1)/page_size*page_size;
+        uintptr_t end = (reinterpret_cast<uintptr_t>(data)+len)/page_size*page_size;
+        if (begin >= end) {
+            return true;
+        }
+        long res;
+        if (policy == NumaPolicy::Interleave) {
+            // The kernel only reads maxnode-1 bits of the mask.
+            res = syscall(
+                SYS_mbind, begin, end-begin, MPOL_INTERLEAVE, &nodes, 8*sizeof(nodes)+1, MPOL_MF_MOVE);
+        } else {
+            res = syscall(SYS_mbind, begin, end-begin, MPOL_DEFAULT, nullptr, 0, 0);
+        }
+        return res == 0;
+#else
+        (void)data;
+        (void)len;
+        (void)policy;
+        return false;
+#endif
+    }
+
+    // Apply a NUMA policy to the storage of a vector.
+    template <typename T, typename A>
+    static bool apply_numa_policy(const std::vector<T, A>& vec, NumaPolicy policy) {
+        return apply_numa_policy(vec.data(), vec.capacity()*sizeof(T), policy);
+    }
+}
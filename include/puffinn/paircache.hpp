@@ -0,0 +1,75 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace puffinn {
+    // Maximum number of slots in a PairCache is 2^MAX_PAIR_CACHE_LOG_SIZE.
+    // With 8 bytes per slot, this bounds the memory used to 32MB.
+    const unsigned int MAX_PAIR_CACHE_LOG_SIZE = 22;
+
+    // A bounded set of pairs of indices that have already been compared,
+    // which can be shared between threads.
+    //
+    // Each pair is mapped to a single slot, which only remembers the last pair mapped to it.
+    // Pairs can therefore be forgotten, but a pair is never reported as seen
+    // unless it was inserted, so no pair is skipped without having been compared.
+    // The order of the indices in a pair does not matter.
+    class PairCache {
+        // Pairs packed with the smallest index in the high bits.
+        // A pair of equal indices is never inserted, so 0 marks an empty slot.
+        std::unique_ptr<std::atomic<uint64_t>[]> slots;
+        unsigned int log_size;
+
+        static uint64_t key(uint32_t a, uint32_t b) {
+            return (static_cast<uint64_t>(std::min(a, b)) << 32) | std::max(a, b);
+        }
+
+        // Find the slot that a pair is mapped to.
+        std::atomic<uint64_t>& slot_of(uint64_t k) const {
+            // Fibonacci hashing
+            return slots[(k*0x9E3779B97F4A7C15ull) >> (64-log_size)];
+        }
+
+    public:
+        // Create a cache which is large enough for all pairs of the given number of values,
+        // but has at most 2^max_log_size slots.
+        PairCache(uint64_t num_values, unsigned int max_log_size = MAX_PAIR_CACHE_LOG_SIZE)
+          : log_size(1)
+        {
+            uint64_t num_pairs = num_values*(num_values-std::min(num_values, uint64_t(1)))/2;
+            while (log_size < max_log_size && (uint64_t(1) << log_size) < num_pairs) {
+                log_size++;
+            }
+            // Value-initialization of the trivial atomics sets all slots to 0.
+            slots.reset(new std::atomic<uint64_t>[uint64_t(1) << log_size]());
+        }
+
+        // Insert a pair of distinct indices.
+        // Returns whether the pair was already in the cache.
+        bool insert(uint32_t a, uint32_t b) {
+            auto k = key(a, b);
+            auto& slot = slot_of(k);
+            // Another thread can overwrite the slot concurrently,
+            // but each slot always contains a pair that was inserted.
+            if (slot.load(std::memory_order_relaxed) == k) {
+                return true;
+            }
+            slot.store(k, std::memory_order_relaxed);
+            return false;
+        }
+
+        // Whether a pair of distinct indices is in the cache.
+        bool contains(uint32_t a, uint32_t b) const {
+            auto k = key(a, b);
+            return slot_of(k).load(std::memory_order_relaxed) == k;
+        }
+
+        // Number of bytes used by the cache.
+        uint64_t memory_usage() const {
+            return sizeof(PairCache) + (uint64_t(1) << log_size)*sizeof(uint64_t);
+        }
+    };
+}
@@ -1,16 +1,23 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
-#include <map>
-#include <unordered_map>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
 #include <vector>
 
 #include "puffinn/typedefs.hpp"
 
-const bool PUFFINN_PERFORMANCE = false;
-const bool PUFFINN_PERFORMANCE_TIME = false;
-
 namespace puffinn {
     const size_t NUM_TIMED_COMPUTATIONS = 11;
+    /// The parts of a query whose duration is measured.
     // Indented to match subgroups
     enum class Computation {
         Total,
@@ -26,107 +33,504 @@ namespace puffinn {
                 CheckTermination
     };
 
-    struct QueryMetrics {
-        unsigned int distance_computations;
-        unsigned int candidates;
-        unsigned int considered_maps;
-        unsigned int hash_length;
-        double time[NUM_TIMED_COMPUTATIONS];
+    // The name of each computation when exporting metrics.
+    static const char* computation_name(Computation computation) {
+        static const char* names[NUM_TIMED_COMPUTATIONS] = {
+            "total",
+            "hashing",
+            "sketching",
+            "search",
+            "search_init",
+            "create_query",
+            "reduce_prefix",
+            "filtering",
+            "consider",
+            "maxbuffer_filter",
+            "check_termination"
+        };
+        return names[static_cast<int>(computation)];
+    }
 
-        double get_time(Computation computation) const {
-            return time[static_cast<int>(computation)];
+    // Durations are bucketed with this many bits of precision.
+    const unsigned int LATENCY_PRECISION_BITS = 4;
+    const unsigned int LATENCY_SUB_BUCKETS = 1 << LATENCY_PRECISION_BITS;
+    // Durations of 2^(LATENCY_MAX_EXPONENT+1) nanoseconds or more are put in the last bucket.
+    const unsigned int LATENCY_MAX_EXPONENT = 41;
+    const size_t NUM_LATENCY_BUCKETS =
+        (LATENCY_MAX_EXPONENT-LATENCY_PRECISION_BITS+2)*LATENCY_SUB_BUCKETS;
+
+    /// A histogram of durations using a fixed amount of memory.
+    ///
+    /// Durations are measured in nanoseconds.
+    /// Below 16ns each duration has its own bucket.
+    /// Above that, every power of two is split into 16 buckets,
+    /// so percentiles are accurate to within about 6%.
+    /// Durations of more than about an hour are all put into the last bucket.
+    struct LatencyHistogram {
+        /// The number of durations in each bucket.
+        std::array<uint64_t, NUM_LATENCY_BUCKETS> counts;
+        /// The sum of all durations in nanoseconds.
+        uint64_t total_ns;
+        /// The longest duration in nanoseconds.
+        uint64_t max_ns;
+
+        LatencyHistogram()
+          : total_ns(0),
+            max_ns(0)
+        {
+            counts.fill(0);
+        }
+
+        /// Retrieve the bucket containing a duration.
+        static size_t bucket_of(uint64_t ns) {
+            if (ns < LATENCY_SUB_BUCKETS) {
+                return ns;
+            }
+            unsigned int msb = 63-__builtin_clzll(ns);
+            if (msb > LATENCY_MAX_EXPONENT) {
+                return NUM_LATENCY_BUCKETS-1;
+            }
+            // The bits following the most significant bit select the sub-bucket.
+            unsigned int shift = msb-LATENCY_PRECISION_BITS;
+            return (shift+1)*LATENCY_SUB_BUCKETS + (ns >> shift)-LATENCY_SUB_BUCKETS;
+        }
+
+        /// Retrieve the longest duration in nanoseconds that is put in a bucket.
+        static uint64_t bucket_limit(size_t bucket) {
+            if (bucket < LATENCY_SUB_BUCKETS) {
+                return bucket;
+            }
+            unsigned int shift = bucket/LATENCY_SUB_BUCKETS-1;
+            uint64_t lowest = static_cast<uint64_t>(bucket%LATENCY_SUB_BUCKETS+LATENCY_SUB_BUCKETS) << shift;
+            return lowest+(uint64_t(1) << shift)-1;
         }
 
+        /// Add a duration.
+        void record(uint64_t ns) {
+            counts[bucket_of(ns)]++;
+            total_ns += ns;
+            if (ns > max_ns) {
+                max_ns = ns;
+            }
+        }
+
+        /// Add all durations in another histogram.
+        void merge(const LatencyHistogram& other) {
+            for (size_t i=0; i < NUM_LATENCY_BUCKETS; i++) {
+                counts[i] += other.counts[i];
+            }
+            total_ns += other.total_ns;
+            if (other.max_ns > max_ns) {
+                max_ns = other.max_ns;
+            }
+        }
+
+        /// Retrieve the number of durations.
+        uint64_t count() const {
+            uint64_t res = 0;
+            for (auto c : counts) {
+                res += c;
+            }
+            return res;
+        }
+
+        /// Retrieve the sum of all durations in seconds.
+        double total_seconds() const {
+            return total_ns*1e-9;
+        }
+
+        /// Retrieve the longest duration in seconds.
+        double max_seconds() const {
+            return max_ns*1e-9;
+        }
+
+        /// Retrieve the duration in seconds that the given fraction of the durations do not exceed.
+        ///
+        /// The upper limit of the bucket containing the duration is returned,
+        /// so the result is never an underestimate.
+        /// @param quantile A number between 0 and 1, such as 0.99 for the 99th percentile.
+        double percentile(double quantile) const {
+            uint64_t rank = static_cast<uint64_t>(std::ceil(quantile*count()));
+            if (rank == 0) {
+                rank = 1;
+            }
+            uint64_t seen = 0;
+            for (size_t i=0; i < NUM_LATENCY_BUCKETS; i++) {
+                seen += counts[i];
+                if (seen >= rank) {
+                    return std::min(bucket_limit(i), max_ns)*1e-9;
+                }
+            }
+            return 0.0;
+        }
     };
 
-    // A globally accessible structure to store performance metrics in.
-    class PerformanceMetrics {
-        std::vector<QueryMetrics> queries;
+    /// Performance metrics aggregated over all threads at some point in time.
+    struct PerformanceSnapshot {
+        /// The number of started queries.
+        uint64_t queries;
+        /// The number of computed distances.
+        uint64_t distance_computations;
+        /// The number of candidates considered before filtering.
+        uint64_t candidates;
+        /// The number of hash tables searched, summed over all queries.
+        uint64_t considered_maps;
+        /// The hash length at which each query stopped, summed over all queries.
+        uint64_t hash_length;
+        /// The durations of each computation.
+        LatencyHistogram time[NUM_TIMED_COMPUTATIONS];
 
-        // Stores last time start_timer was called.
-        std::chrono::time_point<std::chrono::high_resolution_clock> start_time[NUM_TIMED_COMPUTATIONS];
+        PerformanceSnapshot()
+          : queries(0),
+            distance_computations(0),
+            candidates(0),
+            considered_maps(0),
+            hash_length(0)
+        {
+        }
 
-        QueryMetrics& current_query() {
-            return queries[queries.size()-1];
+        /// Retrieve the durations of a computation.
+        const LatencyHistogram& get_time(Computation computation) const {
+            return time[static_cast<int>(computation)];
         }
 
-    public:
-        PerformanceMetrics() {
+        /// Format the metrics as a JSON object.
+        ///
+        /// Besides the counters, the object contains the count, total, maximum and
+        /// 50th, 90th, 99th and 99.9th percentile of the durations of each computation in seconds,
+        /// as well as the non-empty buckets of the histograms as pairs of their upper limit and count.
+        std::string to_json() const {
+            std::ostringstream out;
+            out.precision(9);
+            out << "{\"queries\":" << queries
+                << ",\"distance_computations\":" << distance_computations
+                << ",\"candidates\":" << candidates
+                << ",\"considered_maps\":" << considered_maps
+                << ",\"hash_length\":" << hash_length
+                << ",\"time\":{";
+            for (size_t c=0; c < NUM_TIMED_COMPUTATIONS; c++) {
+                auto& hist = time[c];
+                out << (c == 0 ? "" : ",")
+                    << "\"" << computation_name(static_cast<Computation>(c)) << "\":{"
+                    << "\"count\":" << hist.count()
+                    << ",\"total\":" << hist.total_seconds()
+                    << ",\"max\":" << hist.max_seconds()
+                    << ",\"p50\":" << hist.percentile(0.5)
+                    << ",\"p90\":" << hist.percentile(0.9)
+                    << ",\"p99\":" << hist.percentile(0.99)
+                    << ",\"p999\":" << hist.percentile(0.999)
+                    << ",\"buckets\":[";
+                bool first = true;
+                for (size_t i=0; i < NUM_LATENCY_BUCKETS; i++) {
+                    if (hist.counts[i] != 0) {
+                        out << (first ? "" : ",")
+                            << "[" << LatencyHistogram::bucket_limit(i)*1e-9
+                            << "," << hist.counts[i] << "]";
+                        first = false;
+                    }
+                }
+                out << "]}";
+            }
+            out << "}}";
+            return out.str();
+        }
+
+        /// Format the metrics in the Prometheus text exposition format.
+        ///
+        /// The counters are exported as counters prefixed with ``puffinn_``,
+        /// while the durations are exported as the summary ``puffinn_computation_seconds``
+        /// with a ``computation`` label.
+        std::string to_prometheus() const {
+            std::ostringstream out;
+            out.precision(9);
+            auto counter = [&](const char* name, const char* help, uint64_t value) {
+                out << "# HELP puffinn_" << name << "_total " << help << "\n"
+                    << "# TYPE puffinn_" << name << "_total counter\n"
+                    << "puffinn_" << name << "_total " << value << "\n";
+            };
+            counter("queries", "Number of started queries.", queries);
+            counter("distance_computations", "Number of computed distances.", distance_computations);
+            counter("candidates", "Number of candidates considered before filtering.", candidates);
+            counter("considered_maps", "Number of hash tables searched by queries.",
+                considered_maps);
+            counter("hash_length", "Sum of the hash lengths at which queries stopped.", hash_length);
+
+            out << "# HELP puffinn_computation_seconds Duration of each part of a query.\n"
+                << "# TYPE puffinn_computation_seconds summary\n";
+            const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+            for (size_t c=0; c < NUM_TIMED_COMPUTATIONS; c++) {
+                auto& hist = time[c];
+                auto label = std::string("computation=\"")
+                    +computation_name(static_cast<Computation>(c))+"\"";
+                for (auto q : quantiles) {
+                    out << "puffinn_computation_seconds{" << label << ",quantile=\"" << q << "\"} "
+                        << hist.percentile(q) << "\n";
+                }
+                out << "puffinn_computation_seconds_sum{" << label << "} "
+                    << hist.total_seconds() << "\n"
+                    << "puffinn_computation_seconds_count{" << label << "} "
+                    << hist.count() << "\n";
+            }
+            return out.str();
+        }
+    };
+
+    /// Statistics about how a single query was answered.
+    struct QueryStats {
+        /// The hash length at which the search stopped.
+        /// It is 0 if every hash length was searched without reaching the expected recall,
+        /// or if the values were compared to the query by brute force.
+        unsigned int depth;
+        /// The number of hash tables searched.
+        /// A table is counted once for every hash length it was searched at.
+        unsigned int considered_maps;
+        /// The number of candidates found in the hash tables.
+        uint64_t candidates;
+        /// The number of candidates that passed the sketch filter.
+        /// If no filter is used, every candidate passes.
+        uint64_t candidates_passing_filter;
+        /// The number of computed distances.
+        uint64_t distance_computations;
+        /// The probability that a nearest neighbor was not found when the search stopped.
+        float failure_probability;
+
+        QueryStats()
+          : depth(0),
+            considered_maps(0),
+            candidates(0),
+            candidates_passing_filter(0),
+            distance_computations(0),
+            failure_probability(0.0)
+        {
+        }
+    };
+
+    // The metrics recorded by a single thread.
+    // Only that thread records metrics in it, but they can be read by any thread.
+    struct ThreadMetrics {
+        std::atomic<uint64_t> queries;
+        std::atomic<uint64_t> distance_computations;
+        std::atomic<uint64_t> candidates;
+        std::atomic<uint64_t> considered_maps;
+        std::atomic<uint64_t> hash_length;
+        std::atomic<uint64_t> time_counts[NUM_TIMED_COMPUTATIONS][NUM_LATENCY_BUCKETS];
+        std::atomic<uint64_t> time_total[NUM_TIMED_COMPUTATIONS];
+        std::atomic<uint64_t> time_max[NUM_TIMED_COMPUTATIONS];
+        // Stores last time start_timer was called.
+        // Only accessed by the owning thread.
+        std::chrono::steady_clock::time_point start_time[NUM_TIMED_COMPUTATIONS];
+
+        ThreadMetrics() {
             clear();
         }
 
         void clear() {
-            queries.clear();
-            // Add an empty query so that methods can be called without starting a query.
-            // This can happen in tests.
-            queries.push_back(QueryMetrics());
-            new_query();
+            queries.store(0, std::memory_order_relaxed);
+            distance_computations.store(0, std::memory_order_relaxed);
+            candidates.store(0, std::memory_order_relaxed);
+            considered_maps.store(0, std::memory_order_relaxed);
+            hash_length.store(0, std::memory_order_relaxed);
+            for (size_t c=0; c < NUM_TIMED_COMPUTATIONS; c++) {
+                for (auto& count : time_counts[c]) {
+                    count.store(0, std::memory_order_relaxed);
+                }
+                time_total[c].store(0, std::memory_order_relaxed);
+                time_max[c].store(0, std::memory_order_relaxed);
+            }
         }
 
-        void new_query() {
-            if (PUFFINN_PERFORMANCE || PUFFINN_PERFORMANCE_TIME) {
-                queries.push_back(QueryMetrics());
+        // Add the metrics to a snapshot.
+        void add_to(PerformanceSnapshot& snapshot) const {
+            snapshot.queries += queries.load(std::memory_order_relaxed);
+            snapshot.distance_computations += distance_computations.load(std::memory_order_relaxed);
+            snapshot.candidates += candidates.load(std::memory_order_relaxed);
+            snapshot.considered_maps += considered_maps.load(std::memory_order_relaxed);
+            snapshot.hash_length += hash_length.load(std::memory_order_relaxed);
+            for (size_t c=0; c < NUM_TIMED_COMPUTATIONS; c++) {
+                LatencyHistogram hist;
+                for (size_t i=0; i < NUM_LATENCY_BUCKETS; i++) {
+                    hist.counts[i] = time_counts[c][i].load(std::memory_order_relaxed);
+                }
+                hist.total_ns = time_total[c].load(std::memory_order_relaxed);
+                hist.max_ns = time_max[c].load(std::memory_order_relaxed);
+                snapshot.time[c].merge(hist);
             }
         }
+    };
+
+    /// Performance metrics of the queries made in this process.
+    ///
+    /// Recording is disabled by default, in which case every method that records metrics
+    /// returns immediately.
+    /// It can be enabled at runtime using ``set_enabled``,
+    /// or by setting the environment variable ``PUFFINN_METRICS`` to ``1`` before starting.
+    ///
+    /// Each thread records its metrics separately, so recording does not require synchronization.
+    /// The metrics of all threads are aggregated when a snapshot is taken.
+    /// The memory used is fixed for each thread that has recorded metrics,
+    /// and is reused after the thread exits.
+    ///
+    /// The single instance is available as ``g_performance_metrics``.
+    class PerformanceMetrics {
+        std::atomic<bool> enabled;
+        // Guards threads and unused_threads.
+        std::mutex mutex;
+        std::vector<std::unique_ptr<ThreadMetrics>> threads;
+        // Metrics of threads that have exited, which can be reused by new threads.
+        std::vector<ThreadMetrics*> unused_threads;
 
-        void add_distance_computations(unsigned int count) {
-            if (PUFFINN_PERFORMANCE) {
-                current_query().distance_computations += count;
+        // Returns the metrics of a thread to the pool when the thread exits.
+        // The recorded values are kept, since they are still part of the aggregate.
+        struct ThreadSlot {
+            PerformanceMetrics* owner = nullptr;
+            ThreadMetrics* metrics = nullptr;
+
+            ~ThreadSlot() {
+                if (metrics != nullptr) {
+                    std::lock_guard<std::mutex> lock(owner->mutex);
+                    owner->unused_threads.push_back(metrics);
+                }
             }
+        };
+
+        PerformanceMetrics() {
+            const char* env = std::getenv("PUFFINN_METRICS");
+            enabled.store(env != nullptr && std::strcmp(env, "") != 0 && std::strcmp(env, "0") != 0);
         }
 
-        void add_candidates(unsigned int count) {
-            if (PUFFINN_PERFORMANCE) {
-                current_query().candidates += count;
-            }
+        bool recording() const {
+            return enabled.load(std::memory_order_relaxed);
         }
 
-        void set_hash_length(unsigned int len) {
-            if (PUFFINN_PERFORMANCE) {
-                current_query().hash_length = len;
+        // Retrieve the metrics of the calling thread.
+        ThreadMetrics& local() {
+            thread_local ThreadSlot slot;
+            if (slot.metrics == nullptr) {
+                std::lock_guard<std::mutex> lock(mutex);
+                slot.owner = this;
+                if (unused_threads.empty()) {
+                    threads.emplace_back(new ThreadMetrics());
+                    slot.metrics = threads.back().get();
+                } else {
+                    slot.metrics = unused_threads.back();
+                    unused_threads.pop_back();
+                }
             }
+            return *slot.metrics;
+        }
+
+        static void add(std::atomic<uint64_t>& counter, uint64_t value) {
+            counter.fetch_add(value, std::memory_order_relaxed);
+        }
+
+    public:
+        PerformanceMetrics(const PerformanceMetrics&) = delete;
+        PerformanceMetrics& operator=(const PerformanceMetrics&) = delete;
+
+        /// Retrieve the single instance.
+        static PerformanceMetrics& instance() {
+            static PerformanceMetrics metrics;
+            return metrics;
+        }
+
+        /// Enable or disable recording of metrics.
+        ///
+        /// Metrics that are already recorded are kept.
+        void set_enabled(bool enable) {
+            enabled.store(enable);
+        }
+
+        /// Retrieve whether metrics are recorded.
+        bool is_enabled() const {
+            return enabled.load();
         }
 
-        void set_considered_maps(unsigned int count) {
-            if (PUFFINN_PERFORMANCE) {
-                current_query().considered_maps = count;
+        /// Reset all recorded metrics.
+        void clear() {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& thread : threads) {
+                thread->clear();
             }
         }
 
-        std::vector<QueryMetrics> get_query_metrics() const {
-            std::vector<QueryMetrics> res;
-            for (size_t i=1; i < queries.size(); i++) {
-                res.push_back(queries[i]);
+        /// Aggregate the metrics recorded by all threads.
+        PerformanceSnapshot snapshot() {
+            PerformanceSnapshot res;
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& thread : threads) {
+                thread->add_to(res);
             }
             return res;
         }
 
+        /// Retrieve the total time in seconds spent on a computation.
         double get_total_time(Computation computation) {
-            double res = 0;
-            for (auto& q : queries) {
-                res += q.get_time(computation);
+            return snapshot().get_time(computation).total_seconds();
+        }
+
+        void new_query() {
+            if (recording()) {
+                add(local().queries, 1);
+            }
+        }
+
+        void add_distance_computations(uint64_t count) {
+            if (recording()) {
+                add(local().distance_computations, count);
+            }
+        }
+
+        void add_candidates(uint64_t count) {
+            if (recording()) {
+                add(local().candidates, count);
+            }
+        }
+
+        // Record the hash length at which a query stopped.
+        void set_hash_length(unsigned int len) {
+            if (recording()) {
+                add(local().hash_length, len);
+            }
+        }
+
+        // Record the number of hash tables that a query searched.
+        void set_considered_maps(uint64_t count) {
+            if (recording()) {
+                add(local().considered_maps, count);
             }
-            return res;
         }
 
         // Start a timer whose result is stored using store_time.
         void start_timer(Computation computation) {
-            if (PUFFINN_PERFORMANCE_TIME) {
-                start_time[static_cast<int>(computation)] = std::chrono::high_resolution_clock::now();
+            if (recording()) {
+                local().start_time[static_cast<int>(computation)] = std::chrono::steady_clock::now();
             }
         }
 
         // Store that the given computation has taken the time since last call to start_timer().
         void store_time(Computation computation) {
-            if (PUFFINN_PERFORMANCE_TIME) {
-                int computation_idx = static_cast<int>(computation);
-                auto end_time = std::chrono::high_resolution_clock::now();
-                std::chrono::duration<double> duration = end_time-start_time[computation_idx];
-                current_query().time[computation_idx] += duration.count();
+            if (!recording()) {
+                return;
+            }
+            auto& metrics = local();
+            int computation_idx = static_cast<int>(computation);
+            auto& start_time = metrics.start_time[computation_idx];
+            // The timer was not started if recording was enabled in between.
+            if (start_time == std::chrono::steady_clock::time_point()) {
+                return;
+            }
+            auto end_time = std::chrono::steady_clock::now();
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                end_time-start_time).count();
+            start_time = std::chrono::steady_clock::time_point();
+
+            add(metrics.time_counts[computation_idx][LatencyHistogram::bucket_of(ns)], 1);
+            add(metrics.time_total[computation_idx], ns);
+            if (ns > metrics.time_max[computation_idx].load(std::memory_order_relaxed)) {
+                metrics.time_max[computation_idx].store(ns, std::memory_order_relaxed);
             }
         }
     };
 
-    PerformanceMetrics g_performance_metrics;
+    static PerformanceMetrics& g_performance_metrics = PerformanceMetrics::instance();
 }
-
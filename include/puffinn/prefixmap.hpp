@@ -2,6 +2,9 @@
 
 #include "puffinn/dataset.hpp"
 #include "puffinn/hash_source/hash_source.hpp"
+#include "puffinn/huge_pages.hpp"
+#include "puffinn/memory.hpp"
+#include "puffinn/numa.hpp"
 #include "puffinn/typedefs.hpp"
 #include "puffinn/performance.hpp"
 #include "puffinn/sorthash.hpp"
@@ -35,7 +38,7 @@ namespace puffinn {
         // in the map to process.
         PrefixMapQuery(
             LshDatatype hash,
-            const std::vector<LshDatatype>& hashes,
+            const LargeVector<LshDatatype>& hashes,
             uint32_t prefix_index_start,
             uint32_t prefix_index_end
         )
@@ -65,17 +68,17 @@ namespace puffinn {
     // previously queried values are not queried again.
     template <typename T>
     class PrefixMap {
-        using HashedVecIdx = std::pair<uint32_t, LshDatatype>;
         // Number of bits to precompute locations in the stored vector for.
         const static int PREFIX_INDEX_BITS = 13;
 
     public: // TODO private
         // contents
-        std::vector<uint32_t> indices;
-        std::vector<LshDatatype> hashes;
-        // Scratch space for use when rebuilding. The length and capacity is set to 0 otherwise.
-        // std::vector<HashedVecIdx> rebuilding_data;
-        std::vector<std::vector<HashedVecIdx>> parallel_rebuilding_data;
+        LargeVector<uint32_t> indices;
+        LargeVector<LshDatatype> hashes;
+        // Values inserted since the last rebuild, stored as columns with exactly
+        // the reserved length. Empty outside of a rebuild.
+        LargeVector<uint32_t> new_indices;
+        LargeVector<LshDatatype> new_hashes;
 
         // Length of the hash values used.
         unsigned int hash_length;
@@ -92,8 +95,6 @@ namespace puffinn {
         {
             // Ensure that the map can be queried even if nothing is inserted.
             rebuild();
-            auto max_threads = omp_get_max_threads();
-            parallel_rebuilding_data.resize(max_threads);
         }
 
         PrefixMap(std::istream& in) {
@@ -106,16 +107,13 @@ namespace puffinn {
                 in.read(reinterpret_cast<char*>(&hashes[0]), len*sizeof(LshDatatype));
             }
 
-            // TODO Handle serialization
             size_t rebuilding_len;
             in.read(reinterpret_cast<char*>(&rebuilding_len), sizeof(size_t));
-            // rebuilding_data.resize(rebuilding_len);
+            new_indices.resize(rebuilding_len);
+            new_hashes.resize(rebuilding_len);
             if (rebuilding_len != 0) {
-                for (size_t i=0; i<rebuilding_len; i++) {
-                    HashedVecIdx v;
-                    in.read(reinterpret_cast<char*>(&v), sizeof(HashedVecIdx));
-                    parallel_rebuilding_data[0].push_back(v);
-                }
+                in.read(reinterpret_cast<char*>(&new_indices[0]), rebuilding_len*sizeof(uint32_t));
+                in.read(reinterpret_cast<char*>(&new_hashes[0]), rebuilding_len*sizeof(LshDatatype));
             }
 
             in.read(reinterpret_cast<char*>(&hash_length), sizeof(unsigned int));
@@ -133,17 +131,11 @@ namespace puffinn {
                 out.write(reinterpret_cast<const char*>(&hashes[0]), len*sizeof(LshDatatype));
             }
 
-            size_t rebuilding_len = 0;
-            for (auto & rd : parallel_rebuilding_data) {
-                rebuilding_len += rd.size();
-            }
+            size_t rebuilding_len = new_indices.size();
             out.write(reinterpret_cast<const char*>(&rebuilding_len), sizeof(size_t));
             if (rebuilding_len != 0) {
-                for (auto & rd : parallel_rebuilding_data) {
-                    for (size_t i = 0; i <rd.size(); i++) {
-                        out.write(reinterpret_cast<const char*>(&rd[i]), sizeof(HashedVecIdx));
-                    }
-                }
+                out.write(reinterpret_cast<const char*>(&new_indices[0]), rebuilding_len*sizeof(uint32_t));
+                out.write(reinterpret_cast<const char*>(&new_hashes[0]), rebuilding_len*sizeof(LshDatatype));
             }
 
             out.write(reinterpret_cast<const char*>(&hash_length), sizeof(unsigned int));
@@ -153,78 +145,67 @@ namespace puffinn {
                 ((1 << PREFIX_INDEX_BITS)+1)*sizeof(uint32_t));
         }
 
-        // Add a hash value, and associated index, to be included next time rebuild is called. 
-        void insert(int tid, uint32_t idx, LshDatatype hash_value) {
-            parallel_rebuilding_data[tid].push_back({ idx, hash_value });
+        // Allocate room for exactly the given number of values to be inserted before the
+        // next rebuild.
+        void reserve(size_t num_new_values) {
+            new_indices.resize(num_new_values);
+            new_hashes.resize(num_new_values);
         }
 
-        // Reserve the correct amount of memory before inserting.
-        void reserve(size_t size) {
-            // TODO Divide equally across the vectors
-            for (auto & rd : parallel_rebuilding_data) {
-                rd.reserve(size);
-            }
+        // Add a hash value, and associated index, to be included next time rebuild is called.
+        // The position is the number of values inserted before this one since the last rebuild,
+        // which must be less than the reserved size. Different positions can be inserted
+        // from different threads.
+        void insert(size_t position, uint32_t idx, LshDatatype hash_value) {
+            new_indices[position] = idx;
+            new_hashes[position] = hash_value;
         }
 
+        // Sort the inserted values into the map.
+        //
+        // Besides the final contents of the map, this uses temporary space of the same size,
+        // which is released before returning.
         void rebuild() {
             // A value whose prefix will never match that of a query vector, as long as less than 32
             // hash bits are used.
             static const LshDatatype IMPOSSIBLE_PREFIX = 0xffffffff;
 
-            size_t rebuilding_data_size = 0;
-            for (auto & rd : parallel_rebuilding_data) {
-                rebuilding_data_size += rd.size();
-            }
-
-            std::vector<LshDatatype> tmp_hashes;
-            std::vector<uint32_t> tmp_indices;
-            std::vector<LshDatatype> out_hashes;
-            std::vector<uint32_t> out_indices;
-            tmp_hashes.reserve(hashes.size() + rebuilding_data_size);
-            tmp_indices.reserve(hashes.size() + rebuilding_data_size);
-            out_hashes.reserve(hashes.size() + rebuilding_data_size);
-            out_indices.reserve(hashes.size() + rebuilding_data_size);
-
+            // Collect the current contents, without padding, and the new values.
+            // Each array is freed as soon as it has been copied.
+            size_t old_size = 0;
             if (hashes.size() != 0) {
-                // Move data to temporary vector for sorting.
-                for (size_t i=SEGMENT_SIZE; i < hashes.size()-SEGMENT_SIZE; i++) {
-                    tmp_hashes.push_back(hashes[i]);
-                    tmp_indices.push_back(indices[i]);
-                }
+                old_size = hashes.size()-2*SEGMENT_SIZE;
             }
-            for (auto & rebuilding_data : parallel_rebuilding_data) {
-                for (auto pair : rebuilding_data) {
-                    tmp_indices.push_back(pair.first);
-                    tmp_hashes.push_back(pair.second);
-                }
+            size_t rebuilding_data_size = old_size+new_hashes.size();
+            LargeVector<LshDatatype> in_hashes;
+            LargeVector<uint32_t> in_indices;
+            in_hashes.reserve(rebuilding_data_size);
+            in_indices.reserve(rebuilding_data_size);
+            if (old_size != 0) {
+                in_hashes.insert(
+                    in_hashes.end(), hashes.begin()+SEGMENT_SIZE, hashes.end()-SEGMENT_SIZE);
+                in_indices.insert(
+                    in_indices.end(), indices.begin()+SEGMENT_SIZE, indices.end()-SEGMENT_SIZE);
             }
-            
+            hashes = LargeVector<LshDatatype>();
+            indices = LargeVector<uint32_t>();
+            in_hashes.insert(in_hashes.end(), new_hashes.begin(), new_hashes.end());
+            in_indices.insert(in_indices.end(), new_indices.begin(), new_indices.end());
+            new_hashes = LargeVector<LshDatatype>();
+            new_indices = LargeVector<uint32_t>();
+
+            // Sort directly into the final arrays,
+            // padded with SEGMENT_SIZE values on each size to remove need for bounds check.
+            hashes.resize(rebuilding_data_size+2*SEGMENT_SIZE, IMPOSSIBLE_PREFIX);
+            indices.resize(rebuilding_data_size+2*SEGMENT_SIZE, 0);
             puffinn::sort_hashes_pairs_24(
-                tmp_hashes,
-                out_hashes,
-                tmp_indices,
-                out_indices
+                in_hashes.data(),
+                &hashes[SEGMENT_SIZE],
+                in_indices.data(),
+                &indices[SEGMENT_SIZE],
+                rebuilding_data_size
             );
 
-            // Pad with SEGMENT_SIZE values on each size to remove need for bounds check.
-            hashes.clear();
-            hashes.reserve(out_hashes.size() + 2*SEGMENT_SIZE);
-            indices.clear();
-            indices.reserve(out_hashes.size() + 2*SEGMENT_SIZE);
-
-            for (int i=0; i < SEGMENT_SIZE; i++) {
-                hashes.push_back(IMPOSSIBLE_PREFIX);
-                indices.push_back(0);
-            }
-            for (size_t i = 0; i < out_hashes.size(); i++) {
-                indices.push_back(out_indices[i]);
-                hashes.push_back(out_hashes[i]);
-            }
-            for (int i=0; i < SEGMENT_SIZE; i++) {
-                hashes.push_back(IMPOSSIBLE_PREFIX);
-                indices.push_back(0);
-            }
-
             // Build prefix_index data structure.
             // Index of the first occurence of the prefix
             uint32_t idx = 0;
@@ -238,12 +219,6 @@ namespace puffinn {
                 prefix_index[prefix] = SEGMENT_SIZE+idx;
             }
             prefix_index[1 << PREFIX_INDEX_BITS] = SEGMENT_SIZE+rebuilding_data_size;
-
-            for (auto & rd : parallel_rebuilding_data) {
-                rd.clear();
-                rd.shrink_to_fit();
-            }
-
         }
 
         // Construct a query object to search for the nearest neighbors of the given vector.
@@ -307,12 +282,29 @@ namespace puffinn {
             return std::make_pair(&indices[left], &indices[right]);
         }
 
+        // Measure the memory used by the map.
+        // Place the sorted hashes and indices on the NUMA nodes according to the policy.
+        void apply_numa_policy(NumaPolicy policy) const {
+            puffinn::apply_numa_policy(indices, policy);
+            puffinn::apply_numa_policy(hashes, policy);
+        }
+
+        MemoryUsage memory_report() const {
+            MemoryUsage res(sizeof(PrefixMap), sizeof(PrefixMap));
+            res += vector_memory(indices);
+            res += vector_memory(hashes);
+            res += vector_memory(new_indices);
+            res += vector_memory(new_hashes);
+            return res;
+        }
+
+        // Number of bytes used by a rebuilt map containing the given number of values.
         static uint64_t memory_usage(size_t size, uint64_t function_size) {
             size = size+2*SEGMENT_SIZE;
             return sizeof(PrefixMap)
-                + size*sizeof(uint32_t)
-                + size*sizeof(LshDatatype)
-                + function_size; 
+                + large_allocation_bytes(size*sizeof(uint32_t))
+                + large_allocation_bytes(size*sizeof(LshDatatype))
+                + function_size;
         }
     };
 }
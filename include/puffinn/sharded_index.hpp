@@ -0,0 +1,290 @@
+#pragma once
+
+#include "puffinn/collection.hpp"
+#include "puffinn/maxbuffer.hpp"
+#include "puffinn/memory.hpp"
+
+#include <omp.h>
+
+#include <cstdint>
+#include <exception>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace puffinn {
+    /// An index which partitions the inserted values between a number of independent shards.
+    ///
+    /// Each shard is an ``Index`` with its own hash functions and an equal share of the memory limit.
+    /// Values are assigned to shards by hashing their index, so the shards are of similar size.
+    /// Shards can be rebuilt one at a time using ``rebuild_shard``,
+    /// so that rebuilding a large index does not require every shard to be rebuilt at once.
+    ///
+    /// Queries are answered by searching every shard in parallel and merging the results.
+    /// Since each shard finds the nearest neighbors among its own values with the expected recall,
+    /// so does the merged result.
+    ///
+    /// @param TSim The similarity measure. See ``Index``.
+    /// @param THash The family of Locality-Sensitive hash functions used in each shard.
+    /// @param TSketch The family of 1-bit Locality-Sensitive hash functions used in each shard.
+    template <
+        typename TSim,
+        typename THash = typename TSim::DefaultHash,
+        typename TSketch = typename TSim::DefaultSketch
+    >
+    class ShardedIndex {
+        std::vector<Index<TSim, THash, TSketch>> shards;
+        // The index of each value within its shard.
+        std::vector<uint32_t> local_indices;
+        // The index of each value in a shard within the sharded index.
+        std::vector<std::vector<uint32_t>> global_indices;
+        // Number of bytes allowed to be used in total.
+        uint64_t memory_limit;
+
+        // The shard that the value with the given index is assigned to.
+        size_t shard_of(uint32_t idx) const {
+            // Fibonacci hashing
+            return ((idx*0x9E3779B97F4A7C15ull) >> 32) % shards.size();
+        }
+
+        // Assign the value with the next index to its shard.
+        void assign_next() {
+            uint32_t idx = local_indices.size();
+            auto shard = shard_of(idx);
+            local_indices.push_back(global_indices[shard].size());
+            global_indices[shard].push_back(idx);
+        }
+
+        // Number of bytes used by the fields that are not measured elsewhere.
+        // The shards themselves are measured by their own memory reports.
+        uint64_t own_memory_usage() const {
+            uint64_t res = sizeof(ShardedIndex)
+                + (shards.capacity()-shards.size())*sizeof(Index<TSim, THash, TSketch>)
+                + vector_memory(local_indices).capacity
+                + vector_memory(global_indices).capacity;
+            for (auto& indices : global_indices) {
+                res += vector_memory(indices).capacity;
+            }
+            return res;
+        }
+
+        // Set the memory limit of a shard to its share of the memory that is not used here.
+        void share_memory(size_t shard) {
+            uint64_t used = own_memory_usage();
+            uint64_t available = memory_limit > used ? memory_limit-used : 0;
+            shards[shard].set_memory_limit(available/shards.size());
+        }
+
+    public:
+        /// Construct an empty index.
+        ///
+        /// @param dataset_args Arguments specifying how the values are stored, as in ``Index``.
+        /// @param memory_limit The number of bytes of memory that the index is permitted to use,
+        /// which is split evenly between the shards.
+        /// @param num_shards The number of shards. Must be at least 1.
+        /// @param hash_args Arguments used to construct the source from which hashes are drawn
+        /// in each shard.
+        /// @param sketch_args Similar to ``hash_args``, but for the hash family specified in ``TSketch``.
+        ShardedIndex(
+            typename TSim::Format::Args dataset_args,
+            uint64_t memory_limit,
+            unsigned int num_shards,
+            const HashSourceArgs<THash>& hash_args = IndependentHashArgs<THash>(),
+            const HashSourceArgs<TSketch>& sketch_args = IndependentHashArgs<TSketch>()
+        )
+          : global_indices(num_shards),
+            memory_limit(memory_limit)
+        {
+            if (num_shards == 0) {
+                throw std::invalid_argument("num_shards");
+            }
+            shards.reserve(num_shards);
+            for (unsigned int i=0; i < num_shards; i++) {
+                shards.emplace_back(dataset_args, memory_limit/num_shards, hash_args, sketch_args);
+            }
+        }
+
+        /// Deserialize an index.
+        ///
+        /// It is assumed that the input data is a serialized index
+        /// using the same version of PUFFINN.
+        ShardedIndex(std::istream& in) {
+            size_t num_shards;
+            in.read(reinterpret_cast<char*>(&num_shards), sizeof(size_t));
+            shards.reserve(num_shards);
+            for (size_t i=0; i < num_shards; i++) {
+                shards.emplace_back(in);
+            }
+            in.read(reinterpret_cast<char*>(&memory_limit), sizeof(uint64_t));
+            // The assignment of values to shards is determined by their indices.
+            global_indices.resize(num_shards);
+            uint64_t num_values = 0;
+            for (auto& shard : shards) {
+                num_values += shard.get_size();
+            }
+            for (uint64_t i=0; i < num_values; i++) {
+                assign_next();
+            }
+        }
+
+        /// Serialize the index to the output stream to be loaded later.
+        void serialize(std::ostream& out) const {
+            size_t num_shards = shards.size();
+            out.write(reinterpret_cast<const char*>(&num_shards), sizeof(size_t));
+            for (auto& shard : shards) {
+                shard.serialize(out);
+            }
+            out.write(reinterpret_cast<const char*>(&memory_limit), sizeof(uint64_t));
+        }
+
+        /// Insert a value into the index.
+        ///
+        /// Before the value can be found using the ``search`` method,
+        /// the shard that it is assigned to must be rebuilt.
+        template <typename T>
+        void insert(const T& value) {
+            auto shard = shard_of(local_indices.size());
+            shards[shard].insert(value);
+            assign_next();
+        }
+
+        /// Retrieve the n'th value inserted into the index.
+        template <typename T>
+        T get(uint32_t idx) {
+            return shards[shard_of(idx)].template get<T>(local_indices[idx]);
+        }
+
+        /// Rebuild all shards using the currently inserted values.
+        ///
+        /// If there are at least as many shards as threads, the shards are rebuilt in parallel,
+        /// each by a single thread.
+        /// Otherwise they are rebuilt one at a time using all threads.
+        /// See ``Index::rebuild``.
+        void rebuild() {
+            for (size_t i=0; i < shards.size(); i++) {
+                share_memory(i);
+            }
+            if (shards.size() < static_cast<size_t>(omp_get_max_threads())) {
+                for (auto& shard : shards) {
+                    shard.rebuild();
+                }
+                return;
+            }
+            // Exceptions cannot leave a parallel region, so they are rethrown afterwards.
+            std::vector<std::exception_ptr> errors(shards.size());
+            #pragma omp parallel for schedule(dynamic)
+            for (size_t i=0; i < shards.size(); i++) {
+                try {
+                    shards[i].rebuild();
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            }
+            for (auto& error : errors) {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+            }
+        }
+
+        /// Rebuild a single shard using the values inserted into it so far.
+        ///
+        /// Only the values assigned to the shard are hashed, so the time taken is proportional
+        /// to the size of the shard rather than to the size of the index.
+        /// Values assigned to other shards are not found until those shards are rebuilt.
+        /// See ``Index::rebuild``.
+        void rebuild_shard(size_t shard) {
+            share_memory(shard);
+            shards[shard].rebuild();
+        }
+
+        /// Choose how the memory of every shard is placed on the NUMA nodes of the machine.
+        ///
+        /// See ``Index::set_numa_policy``.
+        void set_numa_policy(NumaPolicy policy) {
+            for (auto& shard : shards) {
+                shard.set_numa_policy(policy);
+            }
+        }
+
+        /// Search for the approximate ``k`` nearest neighbors to a query.
+        ///
+        /// The shards are searched in parallel.
+        /// Shards that have never been rebuilt are skipped.
+        ///
+        /// @param query The query value.
+        /// @param k The number of neighbors to search for.
+        /// @param recall The expected recall of the result, as described in ``Index::search``.
+        /// @param filter_type The approach used to filter candidates.
+        /// @return The indices of the ``k`` nearest found neighbors,
+        /// ordered so that the most similar neighbor is first.
+        template <typename T>
+        std::vector<uint32_t> search(
+            const T& query,
+            unsigned int k,
+            float recall,
+            FilterType filter_type = FilterType::Default
+        ) {
+            std::vector<std::vector<std::pair<uint32_t, float>>> shard_results(shards.size());
+            #pragma omp parallel for schedule(dynamic)
+            for (size_t i=0; i < shards.size(); i++) {
+                if (shards[i].get_repetitions() != 0) {
+                    shard_results[i] =
+                        shards[i].search_with_similarities(query, k, recall, filter_type);
+                }
+            }
+            return merge(shard_results, k);
+        }
+
+        /// Measure the memory used by each component of the index, summed over the shards.
+        MemoryReport memory_report() const {
+            MemoryReport res;
+            for (auto& shard : shards) {
+                auto report = shard.memory_report();
+                res.dataset += report.dataset;
+                res.tables += report.tables;
+                res.sketches += report.sketches;
+                res.hash_functions += report.hash_functions;
+            }
+            res.tables += MemoryUsage(own_memory_usage(), own_memory_usage());
+            return res;
+        }
+
+        /// Retrieve the number of inserted values.
+        unsigned int get_size() const {
+            return local_indices.size();
+        }
+
+        /// Retrieve the number of shards.
+        size_t get_num_shards() const {
+            return shards.size();
+        }
+
+        /// Retrieve the shard that the n'th inserted value is assigned to.
+        size_t get_shard(uint32_t idx) const {
+            return shard_of(idx);
+        }
+
+        /// Retrieve the number of values assigned to a shard.
+        unsigned int get_shard_size(size_t shard) const {
+            return global_indices[shard].size();
+        }
+
+    private:
+        // Merge the neighbors found in each shard into the k nearest overall.
+        std::vector<uint32_t> merge(
+            const std::vector<std::vector<std::pair<uint32_t, float>>>& shard_results,
+            unsigned int k
+        ) const {
+            MaxBuffer res(k);
+            for (size_t i=0; i < shard_results.size(); i++) {
+                for (auto& entry : shard_results[i]) {
+                    res.insert(global_indices[i][entry.first], entry.second);
+                }
+            }
+            return res.best_indices();
+        }
+    };
+}
@@ -21,6 +21,26 @@ namespace puffinn {
                 dot_product_i16(lhs, rhs, desc.args));
             return (dot+1)/2; // Ensure the similarity is between 0 and 1.
         }
+
+        // Marks that compute_similarities is supported.
+        using BlockSimilarity = void;
+
+        // Compute the similarities between consecutively stored rows and columns.
+        template <typename F>
+        static void compute_similarities(
+            const int16_t* rows,
+            unsigned int num_rows,
+            const int16_t* cols,
+            unsigned int num_cols,
+            DatasetDescription<Format> desc,
+            F&& store
+        ) {
+            dot_products_i16_block(
+                rows, num_rows, cols, num_cols, desc.storage_len, desc.args,
+                [&](unsigned int i, unsigned int j, int16_t dot) {
+                    store(i, j, (Format::from_16bit_fixed_point(dot)+1)/2);
+                });
+        }
     };
 }
 
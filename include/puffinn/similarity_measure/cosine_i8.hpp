@@ -0,0 +1,51 @@
+#pragma once
+
+#include "puffinn/format/unit_vector_i8.hpp"
+#include "puffinn/math.hpp"
+#include "puffinn/similarity_measure/cosine.hpp"
+
+namespace puffinn {
+    /// Measures the cosine of the angle between two unit vectors,
+    /// which are stored using a single byte per coordinate.
+    ///
+    /// The vectors are hashed as by ``CosineSimilarity``,
+    /// so the supported LSH families are the same.
+    /// Since the stored vectors are quantized,
+    /// the computed similarities are approximate.
+    struct CosineSimilarityI8 {
+        using Format = UnitVectorI8Format;
+        // Values are converted to the format of this similarity measure before being hashed.
+        using HashSim = CosineSimilarity;
+        using DefaultHash = FHTCrossPolytopeHash;
+        using DefaultSketch = SimHash;
+
+        static float compute_similarity(int8_t* lhs, int8_t* rhs, DatasetDescription<Format> desc) {
+            float unit = desc.args.max_coordinate/Format::MAX_VALUE;
+            float dot = dot_product_i8(lhs, rhs, desc.storage_len)*unit*unit;
+            return (dot+1)/2; // Ensure the similarity is between 0 and 1.
+        }
+
+        static DatasetDescription<UnitVectorFormat> hash_description(DatasetDescription<Format> desc) {
+            DatasetDescription<UnitVectorFormat> res;
+            res.args = desc.args.dimensions;
+            res.storage_len = pad_dimensions<UnitVectorFormat>(desc.args.dimensions);
+            return res;
+        }
+
+        // Convert a stored vector to the format used when hashing.
+        static void to_hash_format(
+            const int8_t* values,
+            int16_t* res,
+            DatasetDescription<Format> desc
+        ) {
+            auto hash_desc = hash_description(desc);
+            for (size_t i=0; i < desc.args.dimensions; i++) {
+                auto val = Format::from_8bit(values[i], desc.args);
+                res[i] = UnitVectorFormat::to_16bit_fixed_point(val);
+            }
+            for (size_t i=desc.args.dimensions; i < hash_desc.storage_len; i++) {
+                res[i] = UnitVectorFormat::to_16bit_fixed_point(0.0);
+            }
+        }
+    };
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "puffinn/format/generic.hpp"
+
+#include <cstddef>
+#include <type_traits>
+
+namespace puffinn {
+    template <typename... T>
+    struct make_void {
+        using type = void;
+    };
+
+    // Describes how the values stored for a similarity measure are hashed.
+    //
+    // By default, the LSH families of the similarity measure hash the stored values directly.
+    // A similarity measure can instead declare a ``HashSim``, in which case its values are
+    // converted to the format of that similarity measure using ``TSim::to_hash_format``
+    // and hashed by its LSH families.
+    // This allows storing values in a more compact format without new LSH families.
+    template <typename TSim, typename = void>
+    struct HashedSimilarity {
+        using Sim = TSim;
+        using Format = typename TSim::Format;
+
+        // Buffer for converted values. Not needed when values are hashed directly.
+        struct Scratch {
+        };
+
+        static DatasetDescription<Format> description(DatasetDescription<Format> desc) {
+            return desc;
+        }
+
+        // Retrieve the given number of consecutive stored values in the format used for hashing.
+        static const typename Format::Type* view(
+            const typename Format::Type* values,
+            size_t,
+            DatasetDescription<Format>,
+            Scratch&
+        ) {
+            return values;
+        }
+    };
+
+    template <typename TSim>
+    struct HashedSimilarity<TSim, typename make_void<typename TSim::HashSim>::type> {
+        using Sim = typename TSim::HashSim;
+        using Format = typename Sim::Format;
+
+        struct Scratch {
+            AlignedStorage<Format> data;
+            // Number of values that fit in data.
+            size_t capacity = 0;
+        };
+
+        static DatasetDescription<Format> description(DatasetDescription<typename TSim::Format> desc) {
+            return TSim::hash_description(desc);
+        }
+
+        static const typename Format::Type* view(
+            const typename TSim::Format::Type* values,
+            size_t num_values,
+            DatasetDescription<typename TSim::Format> desc,
+            Scratch& scratch
+        ) {
+            auto hash_desc = description(desc);
+            if (scratch.capacity < num_values) {
+                scratch.data = allocate_storage<Format>(num_values, hash_desc.storage_len);
+                scratch.capacity = num_values;
+            }
+            for (size_t i=0; i < num_values; i++) {
+                TSim::to_hash_format(
+                    &values[i*desc.storage_len],
+                    &scratch.data.get()[i*hash_desc.storage_len],
+                    desc);
+            }
+            return scratch.data.get();
+        }
+    };
+
+    // Whether the similarity measure can compute the similarities between blocks of values at once,
+    // which it does using
+    //
+    //     static void compute_similarities(
+    //         const Format::Type* rows, unsigned int num_rows,
+    //         const Format::Type* cols, unsigned int num_cols,
+    //         DatasetDescription<Format> desc,
+    //         F&& store)
+    //
+    // where the values are stored consecutively and the similarity between row i and column j
+    // is passed to store(i, j, similarity).
+    template <typename TSim, typename = void>
+    struct HasBlockSimilarity : std::false_type {
+    };
+
+    template <typename TSim>
+    struct HasBlockSimilarity<TSim, typename make_void<typename TSim::BlockSimilarity>::type>
+      : std::true_type {
+    };
+}
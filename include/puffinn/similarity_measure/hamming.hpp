@@ -0,0 +1,30 @@
+#pragma once
+
+#include "puffinn/format/binary_vector.hpp"
+#include "puffinn/math.hpp"
+
+namespace puffinn {
+    class BitSamplingHash;
+    class BitSamplingHash1Bit;
+
+    /// Measures the fraction of equal bits between two binary vectors.
+    ///
+    /// This is one minus the hamming distance divided by the number of bits.
+    /// The supported LSH families are ``BitSamplingHash`` and ``BitSamplingHash1Bit``.
+    struct HammingSimilarity {
+        using Format = BinaryVectorFormat;
+        using DefaultHash = BitSamplingHash;
+        using DefaultSketch = BitSamplingHash1Bit;
+
+        static float compute_similarity(uint64_t* lhs, uint64_t* rhs, DatasetDescription<Format> desc) {
+            if (desc.args == 0) {
+                return 1.0;
+            }
+            // Padding is zero in both vectors, so it does not contribute to the distance.
+            auto dist = hamming_distance(lhs, rhs, desc.storage_len);
+            return 1.0-static_cast<float>(dist)/desc.args;
+        }
+    };
+}
+
+#include "puffinn/hash/bitsampling.hpp"
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "puffinn/format/real_vector.hpp"
+#include "puffinn/math.hpp"
+
+#include <cmath>
+#include <vector>
+
+namespace puffinn {
+    /// Measures the inner product between two real vectors.
+    ///
+    /// There are no LSH families for the inner product itself, so it cannot be used as
+    /// the similarity measure of an ``Index``. Instead ``InnerProductIndex`` uses
+    /// the asymmetric transformation of Simple-LSH to reduce the problem to ``CosineSimilarity``.
+    /// Inserted vectors are divided by an upper bound ``M`` on their norm,
+    /// after which a coordinate is appended so that they have unit length.
+    /// Queries are normalized and a zero is appended.
+    /// The cosine between a transformed vector ``x`` and a transformed query ``q``
+    /// is then ``dot(x, q)/(M*|q|)``, so the order of the neighbors is the same.
+    struct InnerProductSimilarity {
+        using Format = RealVectorFormat;
+
+        static float compute_similarity(float* lhs, float* rhs, DatasetDescription<Format> desc) {
+            return dot_product_float(lhs, rhs, desc.storage_len);
+        }
+
+        static float norm(const std::vector<float>& vec) {
+            float len_squared = 0.0;
+            for (auto v : vec) {
+                len_squared += v*v;
+            }
+            return std::sqrt(len_squared);
+        }
+
+        // Transform a vector that is inserted.
+        // Vectors with a norm above max_norm are shortened to it,
+        // so that the appended coordinate is zero.
+        static std::vector<float> transform_data(const std::vector<float>& vec, float max_norm) {
+            std::vector<float> res;
+            res.reserve(vec.size()+1);
+            float len = norm(vec);
+            float scale = std::max(len, max_norm);
+            for (auto v : vec) {
+                res.push_back(scale == 0.0 ? 0.0 : v/scale);
+            }
+            float rest = scale == 0.0 ? 1.0 : 1.0-(len/scale)*(len/scale);
+            res.push_back(std::sqrt(std::max(0.0f, rest)));
+            return res;
+        }
+
+        // Transform a query.
+        // It is normalized when stored, so only the zero needs to be appended.
+        static std::vector<float> transform_query(const std::vector<float>& vec) {
+            std::vector<float> res;
+            res.reserve(vec.size()+1);
+            res.insert(res.end(), vec.begin(), vec.end());
+            res.push_back(0.0);
+            return res;
+        }
+    };
+}
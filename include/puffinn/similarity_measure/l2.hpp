@@ -1,17 +1,23 @@
 #pragma once
 
 #include "puffinn/format/real_vector.hpp"
-#include "puffinn/hash/crosspolytope.hpp"
-#include "puffinn/hash/simhash.hpp"
 #include "puffinn/math.hpp"
 
 #include <cmath>
 
 namespace puffinn {
+    class PStableHash;
+    class PStableHash1Bit;
+
+    /// Measures the euclidean distance between two real vectors.
+    ///
+    /// Since the index searches for the most similar points,
+    /// the squared distance ``d`` is converted to the similarity ``1/(1+d)``.
+    /// The supported LSH families are ``PStableHash`` and ``PStableHash1Bit``.
     struct L2Distance {
         using Format = RealVectorFormat;
-//        using DefaultHash = unimplemented;
-//        using DefaultSketch = unimplemented;
+        using DefaultHash = PStableHash;
+        using DefaultSketch = PStableHash1Bit;
 
         static float compute_similarity(float* lhs, float* rhs, DatasetDescription<Format> desc) {
             auto dist = l2_distance_float(lhs, rhs, desc.args);
@@ -22,3 +28,4 @@ namespace puffinn {
     };
 }
 
+#include "puffinn/hash/pstable.hpp"
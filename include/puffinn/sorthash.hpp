@@ -130,18 +130,17 @@ void sort_hashes_24(std::vector<uint32_t> & hashes, std::vector<uint32_t> & out)
 //! In this sort routine, the indices provided in the `idx_in` argument are considered
 //! as forming a pair with the hashes in `hashes_in`, and will be sorted along with them
 //! as if we were sorting an array of std::pair using the hash as key.
+//!
+//! This version works on arrays of length n, allowing the output to be written into
+//! a part of a larger array. The input arrays are overwritten.
 void sort_hashes_pairs_24(
-    std::vector<uint32_t> & hashes_in,
-    std::vector<uint32_t> & hashes_out,
-    std::vector<uint32_t> & idx_in,
-    std::vector<uint32_t> & idx_out
+    uint32_t* hashes_in,
+    uint32_t* hashes_out,
+    uint32_t* idx_in,
+    uint32_t* idx_out,
+    size_t n
 ) {
-    const size_t n = hashes_in.size();
     const size_t n_bytes = 256;
-    hashes_out.clear();
-    hashes_out.resize(n, 0);
-    idx_out.clear();
-    idx_out.resize(n, 0);
 
     // Histograms on the stack
     uint32_t b0[n_bytes], b1[n_bytes], b2[n_bytes];
@@ -193,5 +192,21 @@ void sort_hashes_pairs_24(
     do_pass(hashes_in, hashes_out, idx_in, idx_out, b2, _2);
 }
 
+//! Sort the given vector of hash values, along with the corresponding vector of
+//! identifiers, as above. The output vectors are resized to fit.
+void sort_hashes_pairs_24(
+    std::vector<uint32_t> & hashes_in,
+    std::vector<uint32_t> & hashes_out,
+    std::vector<uint32_t> & idx_in,
+    std::vector<uint32_t> & idx_out
+) {
+    const size_t n = hashes_in.size();
+    hashes_out.clear();
+    hashes_out.resize(n, 0);
+    idx_out.clear();
+    idx_out.resize(n, 0);
+    sort_hashes_pairs_24(hashes_in.data(), hashes_out.data(), idx_in.data(), idx_out.data(), n);
+}
+
 
 } // namespace puffinn
@@ -0,0 +1,237 @@
+#pragma once
+
+#include "puffinn/collection.hpp"
+#include "puffinn/mapped_dataset.hpp"
+#include "puffinn/memory.hpp"
+#include "puffinn/similarity_measure/cosine.hpp"
+#include "puffinn/similarity_measure/cosine_i8.hpp"
+
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace puffinn {
+    /// An index which stores a compact code of each vector for searching
+    /// and a full-precision copy for ranking the results.
+    ///
+    /// The compact codes are stored in an ``Index`` using ``TCompact``,
+    /// which finds a shortlist of candidates ranked by the compact similarity.
+    /// The shortlist is then re-scored using ``TExact`` on the full-precision copies
+    /// before the best ``k`` are returned.
+    /// Both similarity measures must accept the same input type.
+    ///
+    /// The full-precision copies are either kept in memory or in a memory-mapped file.
+    /// In the latter case, they do not count towards the memory limit,
+    /// leaving more memory for the tables,
+    /// and only the pages touched when re-scoring need to be read.
+    ///
+    /// @param TExact The similarity measure used to rank the shortlist.
+    /// @param TCompact The similarity measure of the compact codes.
+    /// @param THash The family of Locality-Sensitive hash functions used for ``TCompact``.
+    /// @param TSketch The family of 1-bit Locality-Sensitive hash functions used for ``TCompact``.
+    template <
+        typename TExact = CosineSimilarity,
+        typename TCompact = CosineSimilarityI8,
+        typename THash = typename TCompact::DefaultHash,
+        typename TSketch = typename TCompact::DefaultSketch
+    >
+    class TwoTierIndex {
+        // The full-precision copies of the inserted vectors.
+        MappedDataset<typename TExact::Format> vectors;
+        // Index containing the compact codes.
+        Index<TCompact, THash, TSketch> index;
+        // Number of bytes allowed to be used in total.
+        uint64_t memory_limit;
+
+        // Number of bytes used by the fields that are not measured elsewhere.
+        uint64_t own_memory_usage() const {
+            return sizeof(TwoTierIndex)
+                - sizeof(MappedDataset<typename TExact::Format>)
+                - sizeof(Index<TCompact, THash, TSketch>);
+        }
+
+        // Order the candidates by their exact similarity to the query and keep the best k.
+        std::vector<uint32_t> rank(
+            const std::vector<uint32_t>& candidates,
+            typename TExact::Format::Type* query,
+            unsigned int k
+        ) const {
+            auto desc = vectors.get_description();
+            std::vector<std::pair<float, uint32_t>> scored;
+            scored.reserve(candidates.size());
+            for (auto idx : candidates) {
+                scored.emplace_back(TExact::compute_similarity(vectors[idx], query, desc), idx);
+            }
+            auto num_results = std::min(static_cast<size_t>(k), scored.size());
+            std::partial_sort(scored.begin(), scored.begin()+num_results, scored.end(),
+                [](const std::pair<float, uint32_t>& a, const std::pair<float, uint32_t>& b) {
+                    return a.first > b.first || (a.first == b.first && a.second < b.second);
+                });
+            std::vector<uint32_t> res;
+            res.reserve(num_results);
+            for (size_t i=0; i < num_results; i++) {
+                res.push_back(scored[i].second);
+            }
+            return res;
+        }
+
+    public:
+        /// Number of candidates in the shortlist per result when no size is given to ``search``.
+        const static unsigned int DEFAULT_SHORTLIST_FACTOR = 4;
+
+        /// Construct an empty index.
+        ///
+        /// @param exact_args Arguments specifying how the full-precision copies are stored,
+        /// as described for the ``dataset_args`` of ``Index``.
+        /// @param compact_args Arguments specifying how the compact codes are stored.
+        /// @param memory_limit The number of bytes of memory that the index is permitted to use,
+        /// including the full-precision copies unless they are stored in a file.
+        /// @param hash_args Arguments used to construct the source from which hashes are drawn.
+        /// @param sketch_args Similar to ``hash_args``, but for the hash family specified in ``TSketch``.
+        /// @param path If not empty, the full-precision copies are stored in a memory-mapped file
+        /// created at this path. The file is removed immediately, so the path only determines
+        /// which file system is used.
+        TwoTierIndex(
+            typename TExact::Format::Args exact_args,
+            typename TCompact::Format::Args compact_args,
+            uint64_t memory_limit,
+            const HashSourceArgs<THash>& hash_args = IndependentHashArgs<THash>(),
+            const HashSourceArgs<TSketch>& sketch_args = IndependentHashArgs<TSketch>(),
+            const std::string& path = ""
+        )
+          : vectors(exact_args, path),
+            index(compact_args, memory_limit, hash_args, sketch_args),
+            memory_limit(memory_limit)
+        {
+        }
+
+        /// Deserialize an index.
+        ///
+        /// It is assumed that the input data is a serialized index
+        /// using the same version of PUFFINN.
+        ///
+        /// @param path Where to store the full-precision copies, as described in the constructor.
+        TwoTierIndex(std::istream& in, const std::string& path = "")
+          : vectors(in, path),
+            index(in)
+        {
+            in.read(reinterpret_cast<char*>(&memory_limit), sizeof(uint64_t));
+        }
+
+        /// Deserialize a single chunk.
+        void deserialize_chunk(std::istream& in) {
+            index.deserialize_chunk(in);
+        }
+
+        /// Serialize the index to the output stream to be loaded later.
+        ///
+        /// The full-precision copies are always included.
+        ///
+        /// @param use_chunks Whether to split the serialized index into chunks,
+        /// as described in ``Index::serialize``. Defaults to false.
+        void serialize(std::ostream& out, bool use_chunks = false) const {
+            vectors.serialize(out);
+            index.serialize(out, use_chunks);
+            out.write(reinterpret_cast<const char*>(&memory_limit), sizeof(uint64_t));
+        }
+
+        /// Get an iterator over serialized chunks in the dataset.
+        SerializeIter serialize_chunks() const {
+            return index.serialize_chunks();
+        }
+
+        /// Insert a value into the index.
+        ///
+        /// Before the value can be found using the ``search`` method,
+        /// ``rebuild`` must be called.
+        template <typename T>
+        void insert(const T& value) {
+            vectors.insert(value);
+            index.insert(value);
+        }
+
+        /// Retrieve the full-precision copy of the n'th value inserted into the index.
+        template <typename T>
+        T get(uint32_t idx) {
+            return convert_stored_type<typename TExact::Format, T>(
+                vectors[idx],
+                vectors.get_description());
+        }
+
+        /// Rebuild the index using the currently inserted values.
+        ///
+        /// See ``Index::rebuild``.
+        void rebuild() {
+            uint64_t used = own_memory_usage();
+            if (vectors.is_anonymous()) {
+                used += vectors.memory_report().capacity;
+            }
+            index.set_memory_limit(memory_limit > used ? memory_limit-used : 0);
+            index.rebuild();
+        }
+
+        /// Search for the approximate ``k`` nearest neighbors to a query.
+        ///
+        /// @param query The query value.
+        /// @param k The number of neighbors to search for.
+        /// @param recall The expected recall of the shortlist with respect to the compact similarity,
+        /// as described in ``Index::search``.
+        /// @param filter_type The approach used to filter candidates.
+        /// @param shortlist_size The number of candidates that are re-scored
+        /// using the full-precision copies.
+        /// Larger shortlists compensate for more imprecise compact codes.
+        /// If 0, ``DEFAULT_SHORTLIST_FACTOR*k`` is used.
+        /// @return The indices of the ``k`` nearest found neighbors,
+        /// ordered so that the most similar neighbor is first.
+        template <typename T>
+        std::vector<uint32_t> search(
+            const T& query,
+            unsigned int k,
+            float recall,
+            FilterType filter_type = FilterType::Default,
+            unsigned int shortlist_size = 0
+        ) {
+            if (shortlist_size == 0) {
+                shortlist_size = DEFAULT_SHORTLIST_FACTOR*k;
+            }
+            shortlist_size = std::max(shortlist_size, k);
+            auto stored = to_stored_type<typename TExact::Format>(query, vectors.get_description());
+            auto candidates = index.search(query, shortlist_size, recall, filter_type);
+            return rank(candidates, stored.get(), k);
+        }
+
+        /// Search for the ``k`` nearest neighbors to a query
+        /// by computing the exact similarity with each inserted value.
+        ///
+        /// ``rebuild`` does not need to be called before a value is considered.
+        template <typename T>
+        std::vector<uint32_t> search_bf(const T& query, unsigned int k) const {
+            auto stored = to_stored_type<typename TExact::Format>(query, vectors.get_description());
+            std::vector<uint32_t> all(vectors.get_size());
+            for (uint32_t i=0; i < vectors.get_size(); i++) {
+                all[i] = i;
+            }
+            return rank(all, stored.get(), k);
+        }
+
+        /// Measure the memory used by each component of the index.
+        ///
+        /// The full-precision copies are included in the dataset unless they are stored in a file.
+        MemoryReport memory_report() const {
+            auto res = index.memory_report();
+            if (vectors.is_anonymous()) {
+                res.dataset += vectors.memory_report();
+            }
+            res.tables += MemoryUsage(own_memory_usage(), own_memory_usage());
+            return res;
+        }
+
+        /// Retrieve the number of inserted values.
+        unsigned int get_size() const {
+            return vectors.get_size();
+        }
+    };
+}
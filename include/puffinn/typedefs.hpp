@@ -8,6 +8,9 @@ namespace puffinn {
     // Number of bits used in filtering sketches.
     const static unsigned int NUM_FILTER_HASHBITS = 64;
     using FilterLshDatatype = uint64_t;
+    // Number of sketches stored for each value.
+    const size_t NUM_SKETCHES = 32;
+    const size_t LOG_NUM_SKETCHES = 5;
 
     // Number of bits used in hashes.
     const static unsigned int MAX_HASHBITS = 24;
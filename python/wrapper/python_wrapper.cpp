@@ -4,6 +4,8 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
+#include <functional>
+#include <memory>
 #include <sstream>
 
 namespace puffinn {
@@ -43,6 +45,14 @@ struct AbstractIndex {
         float recall,
         FilterType filter_type
     ) = 0;
+    virtual KnnGraph knn_graph(unsigned int k, float recall) = 0;
+    virtual void similarity_join(
+        float threshold,
+        float recall,
+        const std::function<void(uint32_t, uint32_t, float)>& callback,
+        FilterType filter_type
+    ) = 0;
+    virtual MemoryReport memory_report() = 0;
     virtual void serialize(std::ostream& out) = 0;
     virtual std::string metric() = 0;
     virtual std::string hash_function() = 0;
@@ -62,6 +72,12 @@ public:
         float recall,
         FilterType filter_type
     ) = 0;
+    virtual std::pair<std::vector<uint32_t>, QueryStats> search_with_stats(
+        const std::vector<float>& vec,
+        unsigned int k,
+        float recall,
+        FilterType filter_type
+    ) = 0;
 };
 
 template <typename T, typename U = SimHash>
@@ -99,6 +115,15 @@ public:
         return table.search(vec, k, recall, filter_type);
     }
 
+    std::pair<std::vector<uint32_t>, QueryStats> search_with_stats(
+        const std::vector<float>& vec,
+        unsigned int k,
+        float recall,
+        FilterType filter_type
+    ) {
+        return table.search_with_stats(vec, k, recall, filter_type);
+    }
+
     std::vector<std::pair<uint32_t, uint32_t>> closest_pairs(
         unsigned int k,
         float recall,
@@ -107,6 +132,23 @@ public:
         return table.closest_pairs(k, recall, filter_type);
     }
 
+    KnnGraph knn_graph(unsigned int k, float recall) {
+        return table.knn_graph(k, recall);
+    }
+
+    void similarity_join(
+        float threshold,
+        float recall,
+        const std::function<void(uint32_t, uint32_t, float)>& callback,
+        FilterType filter_type
+    ) {
+        table.similarity_join(threshold, recall, callback, filter_type);
+    }
+
+    MemoryReport memory_report() {
+        return table.memory_report();
+    }
+
     std::vector<uint32_t> search_from_index(
         uint32_t idx,
         unsigned int k,
@@ -145,6 +187,115 @@ public:
     }
 };
 
+
+template <typename T, typename U = PStableHash1Bit>
+class EuclideanIndex : public RealIndex {
+    Index<L2Distance, T, U> table;
+
+public:
+    EuclideanIndex(std::istream& stream) : table(stream)
+    {
+    }
+
+    EuclideanIndex(
+        unsigned int dimensions,
+        uint64_t memory_limit,
+        const HashSourceArgs<T>& hash_args,
+        const HashSourceArgs<U>& sketch_args
+    )
+      : table(dimensions, memory_limit, hash_args, sketch_args)
+    {
+    }
+
+    void insert(const std::vector<float>& vec) {
+        table.insert(vec);
+    }
+
+    std::vector<float> get(uint32_t idx) {
+        return table.template get<std::vector<float>>(idx);
+    }
+
+    void rebuild() {
+        table.rebuild();
+    }
+
+    std::vector<uint32_t> search(
+        const std::vector<float>& vec,
+        unsigned int k,
+        float recall,
+        FilterType filter_type
+    ) {
+        return table.search(vec, k, recall, filter_type);
+    }
+
+    std::pair<std::vector<uint32_t>, QueryStats> search_with_stats(
+        const std::vector<float>& vec,
+        unsigned int k,
+        float recall,
+        FilterType filter_type
+    ) {
+        return table.search_with_stats(vec, k, recall, filter_type);
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t>> closest_pairs(
+        unsigned int k,
+        float recall,
+        FilterType filter_type
+    ) {
+        return table.closest_pairs(k, recall, filter_type);
+    }
+
+    KnnGraph knn_graph(unsigned int k, float recall) {
+        return table.knn_graph(k, recall);
+    }
+
+    void similarity_join(
+        float threshold,
+        float recall,
+        const std::function<void(uint32_t, uint32_t, float)>& callback,
+        FilterType filter_type
+    ) {
+        table.similarity_join(threshold, recall, callback, filter_type);
+    }
+
+    MemoryReport memory_report() {
+        return table.memory_report();
+    }
+
+    std::vector<uint32_t> search_from_index(
+        uint32_t idx,
+        unsigned int k,
+        float recall,
+        FilterType filter_type
+    ) {
+        return table.search_from_index(idx, k, recall, filter_type);
+    }
+
+    void serialize(std::ostream& out) {
+        table.serialize(out, true);
+    }
+
+    std::string metric() {
+        return "l2";
+    }
+
+    std::string hash_function() {
+        if (std::is_same<T, PStableHash>::value) {
+            return "pstable";
+        }
+        return "";
+    }
+
+    PySerializeIter serialize_chunks() {
+        return PySerializeIter(table.serialize_chunks());
+    }
+
+    void append_chunk(std::string s) {
+        std::stringstream stream(s);
+        table.deserialize_chunk(stream);
+    }
+};
+
 class AbstractSetIndex : public AbstractIndex {
 public:
     virtual void insert(const std::vector<uint32_t>& vec) = 0;
@@ -155,6 +306,12 @@ public:
         float recall,
         FilterType filter_type
     ) = 0;
+    virtual std::pair<std::vector<uint32_t>, QueryStats> search_with_stats(
+        const std::vector<uint32_t>& vec,
+        unsigned int k,
+        float recall,
+        FilterType filter_type
+    ) = 0;
 };
 
 template <typename T, typename U = MinHash1Bit>
@@ -196,6 +353,15 @@ public:
         return table.search(vec, k, recall, filter_type);
     }
 
+    std::pair<std::vector<uint32_t>, QueryStats> search_with_stats(
+        const std::vector<uint32_t>& vec,
+        unsigned int k,
+        float recall,
+        FilterType filter_type
+    ) {
+        return table.search_with_stats(vec, k, recall, filter_type);
+    }
+
     std::vector<std::pair<uint32_t, uint32_t>> closest_pairs(
         unsigned int k,
         float recall,
@@ -204,6 +370,23 @@ public:
         return table.closest_pairs(k, recall, filter_type);
     }
 
+    KnnGraph knn_graph(unsigned int k, float recall) {
+        return table.knn_graph(k, recall);
+    }
+
+    void similarity_join(
+        float threshold,
+        float recall,
+        const std::function<void(uint32_t, uint32_t, float)>& callback,
+        FilterType filter_type
+    ) {
+        table.similarity_join(threshold, recall, callback, filter_type);
+    }
+
+    MemoryReport memory_report() {
+        return table.memory_report();
+    }
+
     std::vector<uint32_t> search_from_index(
         uint32_t idx,
         unsigned int k,
@@ -257,6 +440,8 @@ public:
             init_angular(dimensions, memory_limit, kwargs);
         } else if (metric == "jaccard") {
             init_jaccard(dimensions, memory_limit, kwargs);
+        } else if (metric == "l2") {
+            init_l2(dimensions, memory_limit, kwargs);
         } else {
             throw std::invalid_argument("metric");
         }
@@ -274,6 +459,12 @@ public:
             } else {
                 throw std::invalid_argument("hash_function");
             }
+        } else if (metric == "l2") {
+            if (hash_function == "pstable") {
+                real_table = std::make_unique<EuclideanIndex<PStableHash>>(stream);
+            } else {
+                throw std::invalid_argument("hash_function");
+            }
         } else if (metric == "jaccard") {
             if (hash_function == "minhash") {
                 set_table = std::make_unique<SetIndex<MinHash>>(stream);
@@ -343,6 +534,32 @@ public:
         }
     }
 
+    // Returns the found neighbors together with a dictionary of the statistics of the query.
+    py::tuple search_with_stats(
+        py::list list,
+        unsigned int k,
+        float recall,
+        std::string filter_name
+    ) {
+        auto filter_type = get_filter_type(filter_name);
+        std::pair<std::vector<uint32_t>, QueryStats> res;
+        if (real_table) {
+            auto vec = list.cast<std::vector<float>>();
+            res = real_table->search_with_stats(vec, k, recall, filter_type);
+        } else {
+            auto vec = list.cast<std::vector<unsigned int>>();
+            res = set_table->search_with_stats(vec, k, recall, filter_type);
+        }
+        py::dict stats;
+        stats["depth"] = res.second.depth;
+        stats["considered_maps"] = res.second.considered_maps;
+        stats["candidates"] = res.second.candidates;
+        stats["candidates_passing_filter"] = res.second.candidates_passing_filter;
+        stats["distance_computations"] = res.second.distance_computations;
+        stats["failure_probability"] = res.second.failure_probability;
+        return py::make_tuple(res.first, stats);
+    }
+
     std::vector<std::pair<uint32_t, uint32_t>> closest_pairs(
         unsigned int k,
         float recall,
@@ -356,6 +573,78 @@ public:
         }
     }
 
+    // Returns the offsets, neighbors and similarities of the graph in compressed sparse row format.
+    py::tuple knn_graph(unsigned int k, float recall) {
+        KnnGraph graph;
+        if (real_table) {
+            graph = real_table->knn_graph(k, recall);
+        } else {
+            graph = set_table->knn_graph(k, recall);
+        }
+        return py::make_tuple(
+            py::array_t<uint64_t>(graph.offsets.size(), graph.offsets.data()),
+            py::array_t<uint32_t>(graph.neighbors.size(), graph.neighbors.data()),
+            py::array_t<float>(graph.similarities.size(), graph.similarities.data()));
+    }
+
+    // Calls the callback with (a, b, similarity) for each found pair.
+    //
+    // The callback is called from the search threads, so the GIL is released during the search
+    // and acquired for each call. The first error raised by the callback is rethrown afterwards.
+    void similarity_join(
+        float threshold,
+        float recall,
+        py::function callback,
+        std::string filter_name
+    ) {
+        auto filter_type = get_filter_type(filter_name);
+        std::unique_ptr<py::error_already_set> error;
+        auto call = [&](uint32_t a, uint32_t b, float similarity) {
+            py::gil_scoped_acquire acquire;
+            if (error) {
+                return;
+            }
+            try {
+                callback(a, b, similarity);
+            } catch (py::error_already_set& e) {
+                error.reset(new py::error_already_set(std::move(e)));
+            }
+        };
+        {
+            py::gil_scoped_release release;
+            if (real_table) {
+                real_table->similarity_join(threshold, recall, call, filter_type);
+            } else {
+                set_table->similarity_join(threshold, recall, call, filter_type);
+            }
+        }
+        if (error) {
+            throw std::move(*error);
+        }
+    }
+
+    py::dict memory_report() {
+        MemoryReport report;
+        if (real_table) {
+            report = real_table->memory_report();
+        } else {
+            report = set_table->memory_report();
+        }
+        auto to_dict = [](const MemoryUsage& usage) {
+            py::dict res;
+            res["size"] = usage.size;
+            res["capacity"] = usage.capacity;
+            return res;
+        };
+        py::dict res;
+        res["dataset"] = to_dict(report.dataset);
+        res["tables"] = to_dict(report.tables);
+        res["sketches"] = to_dict(report.sketches);
+        res["hash_functions"] = to_dict(report.hash_functions);
+        res["total"] = to_dict(report.total());
+        return res;
+    }
+
     std::vector<uint32_t> search_from_index(
         uint32_t idx,
         unsigned int k,
@@ -452,6 +741,12 @@ private:
         set(args.randomized_bits, params, "randomized_bits");
     }
 
+    void set_hash_args(PStableHash::Args& args, const py::dict& params) {
+        set(args.bucket_width, params, "bucket_width");
+        set(args.bits_per_function, params, "bits_per_function");
+        set(args.estimation_eps, params, "estimation_eps");
+    }
+
     template <typename T>
     std::unique_ptr<HashSourceArgs<T>> get_hash_source_args(const py::kwargs& kwargs) {
         std::string source = "independent";
@@ -511,6 +806,28 @@ private:
         }
     }
 
+    void init_l2(unsigned int dimensions, uint64_t memory_limit, const py::kwargs& kwargs) {
+        std::string hash_function = "pstable";
+        if (kwargs.contains("hash_function")) {
+            hash_function = py::cast<std::string>(kwargs["hash_function"]);
+        }
+        if (hash_function == "pstable") {
+            auto hash_args = get_hash_source_args<PStableHash>(kwargs);
+            // The sketches use the same bucket width as the hash functions.
+            IndependentHashArgs<PStableHash1Bit> sketch_args;
+            if (kwargs.contains("hash_args")) {
+                set_hash_args(sketch_args.args, kwargs["hash_args"]);
+            }
+            real_table = std::make_unique<EuclideanIndex<PStableHash>>(
+                dimensions,
+                memory_limit,
+                *hash_args,
+                sketch_args);
+        } else {
+            throw std::invalid_argument("hash_function");
+        }
+    }
+
     void init_jaccard(unsigned int dimensions, uint64_t memory_limit, const py::kwargs& kwargs) {
         std::string hash_function = "minhash";
         if (kwargs.contains("hash_function")) {
@@ -558,6 +875,10 @@ PYBIND11_MODULE(puffinn, m) {
              py::arg("vec"), py::arg("k"), py::arg("recall"),
              py::arg("filter_type") = "default"
          )
+        .def("search_with_stats", &Index::search_with_stats,
+             py::arg("vec"), py::arg("k"), py::arg("recall"),
+             py::arg("filter_type") = "default"
+         )
         .def("search_from_index", &Index::search_from_index,
             py::arg("index"), py::arg("k"), py::arg("recall"),
             py::arg("filter_type") = "default"
@@ -566,7 +887,15 @@ PYBIND11_MODULE(puffinn, m) {
             py::arg("k"), py::arg("recall"),
             py::arg("filter_type") = "default"
         )
+        .def("knn_graph", &Index::knn_graph,
+            py::arg("k"), py::arg("recall")
+        )
+        .def("similarity_join", &Index::similarity_join,
+            py::arg("threshold"), py::arg("recall"), py::arg("callback"),
+            py::arg("filter_type") = "default"
+        )
         .def("get", &Index::get)
+        .def("memory_report", &Index::memory_report)
         .def("__reduce__", &Index::reduce)
         .def("append", &Index::append_chunk)
         .def("extend", &Index::extend_chunks);
@@ -582,6 +911,12 @@ PYBIND11_MODULE(puffinn, m) {
 
     py::class_<PySerializeIter>(m, "PySerializeIter")
         .def("__next__", &PySerializeIter::next);
+
+    m.def("set_metrics_enabled", [](bool enabled) { g_performance_metrics.set_enabled(enabled); },
+        py::arg("enabled"));
+    m.def("clear_metrics", []() { g_performance_metrics.clear(); });
+    m.def("metrics_json", []() { return g_performance_metrics.snapshot().to_json(); });
+    m.def("metrics_prometheus", []() { return g_performance_metrics.snapshot().to_prometheus(); });
 }
 } // namespace python
 } // namespace puffinn
@@ -1,15 +1,26 @@
 #pragma once
 
 #include "catch.hpp"
+#include "memory_tracker.hpp"
 #include "puffinn/collection.hpp"
+#include "puffinn/inner_product_index.hpp"
+#include "puffinn/two_tier_index.hpp"
+#include "puffinn/sharded_index.hpp"
 #include "puffinn/hash/simhash.hpp"
 #include "puffinn/hash/crosspolytope.hpp"
 #include "puffinn/hash_source/pool.hpp"
 #include "puffinn/hash_source/independent.hpp"
 #include "puffinn/hash_source/tensor.hpp"
 #include "puffinn/similarity_measure/cosine.hpp"
+#include "puffinn/similarity_measure/cosine_i8.hpp"
 #include "puffinn/similarity_measure/jaccard.hpp"
+#include "puffinn/similarity_measure/l2.hpp"
+#include "puffinn/similarity_measure/hamming.hpp"
 
+#include <algorithm>
+#include <map>
+#include <omp.h>
+#include <set>
 #include <sstream>
 
 namespace collection {
@@ -172,9 +183,560 @@ namespace collection {
 
             args = std::make_unique<TensoredHashArgs<FHTCrossPolytopeHash>>();
             test_angular_search<FHTCrossPolytopeHash, SimHash>(500, d, std::move(args));
+
+            args = std::make_unique<SharedRotationHashArgs>();
+            test_angular_search<FHTCrossPolytopeHash, SimHash>(500, d, std::move(args));
+        }
+    }
+
+    template <typename T>
+    void test_angular_i8_search(int n, int dimensions, const HashSourceArgs<T>& hash_args) {
+        const int NUM_SAMPLES = 100;
+
+        std::vector<float> recalls = {0.2, 0.5, 0.95};
+        std::vector<unsigned int> ks = {1, 10};
+
+        std::vector<std::vector<float>> inserted;
+        for (int i=0; i<n; i++) {
+            inserted.push_back(UnitVectorFormat::generate_random(dimensions));
+        }
+        UnitVectorI8Args args(dimensions, UnitVectorI8Format::max_coordinate(inserted));
+        Index<CosineSimilarityI8, T> table(args, 100*MB, hash_args);
+        for (auto &vec : inserted) {
+            table.insert(vec);
+        }
+        table.rebuild();
+
+        for (auto k : ks) {
+            for (auto recall : recalls) {
+                int num_correct = 0;
+                float expected_correct = recall*k*NUM_SAMPLES;
+                for (int sample=0; sample < NUM_SAMPLES; sample++) {
+                    auto query = UnitVectorFormat::generate_random(dimensions);
+                    auto exact = table.search_bf(query, k);
+                    auto res = table.search(query, k, recall);
+
+                    REQUIRE(res.size() == k);
+                    for (auto i : exact) {
+                        if (std::count(res.begin(), res.end(), i) != 0) {
+                            num_correct++;
+                        }
+                    }
+                }
+                // Only fail if the recall is far away from the expectation.
+                REQUIRE(num_correct >= 0.8*expected_correct);
+            }
+        }
+    }
+
+    TEST_CASE("Index::search cosine int8") {
+        std::vector<int> dimensions = {5, 100};
+
+        for (auto d : dimensions) {
+            test_angular_i8_search(500, d, IndependentHashArgs<FHTCrossPolytopeHash>());
+            test_angular_i8_search(500, d, SharedRotationHashArgs());
+            test_angular_i8_search(500, d, HashPoolArgs<SimHash>(3000));
+        }
+    }
+
+    TEST_CASE("Index int8 dataset memory") {
+        const unsigned int DIMENSIONS = 128;
+
+        Index<CosineSimilarity> index(DIMENSIONS, 10*MB);
+        Index<CosineSimilarityI8> index_i8(DIMENSIONS, 10*MB);
+        for (int i=0; i < 1000; i++) {
+            auto vec = UnitVectorFormat::generate_random(DIMENSIONS);
+            index.insert(vec);
+            index_i8.insert(vec);
+        }
+        index.rebuild();
+        index_i8.rebuild();
+
+        auto report = index.memory_report();
+        auto report_i8 = index_i8.memory_report();
+        // The vectors take half the space.
+        REQUIRE(report_i8.dataset.size <= 0.55*report.dataset.size);
+        // The freed memory is spent on tables.
+        REQUIRE(report_i8.tables.capacity > report.tables.capacity);
+        REQUIRE(report_i8.total().capacity <= 10*MB);
+    }
+
+    void test_l2_search(
+        int n,
+        int dimensions,
+        const HashSourceArgs<PStableHash>& hash_args
+    ) {
+        const int NUM_SAMPLES = 100;
+
+        std::vector<float> recalls = {0.2, 0.5, 0.95};
+        std::vector<unsigned int> ks = {1, 10};
+
+        Index<L2Distance> table(dimensions, 100*MB, hash_args);
+        for (int i=0; i<n; i++) {
+            table.insert(RealVectorFormat::generate_random(dimensions));
+        }
+        table.rebuild();
+
+        for (auto k : ks) {
+            for (auto recall : recalls) {
+                int num_correct = 0;
+                auto adjusted_k = std::min(k, table.get_size());
+                float expected_correct = recall*adjusted_k*NUM_SAMPLES;
+                for (int sample=0; sample < NUM_SAMPLES; sample++) {
+                    auto query = RealVectorFormat::generate_random(dimensions);
+                    auto exact = table.search_bf(query, k);
+                    auto res = table.search(query, k, recall);
+
+                    REQUIRE(res.size() == static_cast<size_t>(adjusted_k));
+                    for (auto i : exact) {
+                        if (std::count(res.begin(), res.end(), i) != 0) {
+                            num_correct++;
+                        }
+                    }
+                }
+                // Only fail if the recall is far away from the expectation.
+                REQUIRE(num_correct >= 0.8*expected_correct);
+            }
         }
     }
 
+    TEST_CASE("Index::search l2") {
+        std::vector<int> dimensions = {5, 100};
+
+        for (auto d : dimensions) {
+            IndependentHashArgs<PStableHash> args;
+            test_l2_search(500, d, args);
+
+            args.args.bucket_width = 16.0;
+            test_l2_search(500, d, args);
+
+            test_l2_search(500, d, HashPoolArgs<PStableHash>(3000));
+            test_l2_search(500, d, TensoredHashArgs<PStableHash>());
+        }
+    }
+
+    void test_hamming_search(
+        int n,
+        int bits,
+        const HashSourceArgs<BitSamplingHash>& hash_args
+    ) {
+        const int NUM_SAMPLES = 100;
+        // Probability of each bit of a query being flipped from an inserted code.
+        const float FLIP_PROB = 0.1;
+
+        std::vector<float> recalls = {0.2, 0.5, 0.95};
+        std::vector<unsigned int> ks = {1, 10};
+
+        std::vector<std::vector<bool>> inserted;
+        Index<HammingSimilarity> table(bits, 100*MB, hash_args);
+        for (int i=0; i<n; i++) {
+            auto words = BinaryVectorFormat::generate_random(bits);
+            table.insert(words);
+            inserted.push_back(table.get<std::vector<bool>>(i));
+        }
+        table.rebuild();
+
+        auto& rng = get_default_random_generator();
+        std::uniform_int_distribution<int> index_distribution(0, n-1);
+        std::bernoulli_distribution flip_distribution(FLIP_PROB);
+        for (auto k : ks) {
+            for (auto recall : recalls) {
+                int num_correct = 0;
+                auto adjusted_k = std::min(k, table.get_size());
+                float expected_correct = recall*adjusted_k*NUM_SAMPLES;
+                for (int sample=0; sample < NUM_SAMPLES; sample++) {
+                    // Queries are near duplicates of inserted codes.
+                    auto query = inserted[index_distribution(rng)];
+                    for (size_t i=0; i < query.size(); i++) {
+                        if (flip_distribution(rng)) {
+                            query[i] = !query[i];
+                        }
+                    }
+                    auto exact = table.search_bf(query, k);
+                    auto res = table.search(query, k, recall);
+
+                    REQUIRE(res.size() == static_cast<size_t>(adjusted_k));
+                    for (auto i : exact) {
+                        if (std::count(res.begin(), res.end(), i) != 0) {
+                            num_correct++;
+                        }
+                    }
+                }
+                // Only fail if the recall is far away from the expectation.
+                REQUIRE(num_correct >= 0.8*expected_correct);
+            }
+        }
+    }
+
+    TEST_CASE("Index::search hamming") {
+        std::vector<int> bits = {64, 256, 1000};
+
+        for (auto b : bits) {
+            test_hamming_search(500, b, IndependentHashArgs<BitSamplingHash>());
+            test_hamming_search(500, b, HashPoolArgs<BitSamplingHash>(3000));
+            test_hamming_search(500, b, TensoredHashArgs<BitSamplingHash>());
+        }
+    }
+
+    // Vectors with norms that vary by a factor of 10.
+    std::vector<float> random_scaled_vector(unsigned int dimensions) {
+        std::uniform_real_distribution<float> scale_distribution(0.1, 1.0);
+        auto vec = UnitVectorFormat::generate_random(dimensions);
+        auto scale = scale_distribution(get_default_random_generator())
+            /InnerProductSimilarity::norm(vec);
+        for (auto& v : vec) {
+            v *= scale;
+        }
+        return vec;
+    }
+
+    template <typename T, typename U>
+    void test_inner_product_search(
+        int n,
+        int dimensions,
+        const HashSourceArgs<T>& hash_args,
+        const HashSourceArgs<U>& sketch_args
+    ) {
+        const int NUM_SAMPLES = 100;
+
+        std::vector<float> recalls = {0.2, 0.5, 0.95};
+        std::vector<unsigned int> ks = {1, 10};
+
+        InnerProductIndex<T, U> table(dimensions, 100*MB, hash_args, sketch_args);
+        for (int i=0; i<n; i++) {
+            table.insert(random_scaled_vector(dimensions));
+        }
+        table.rebuild();
+        REQUIRE(table.get_max_norm() <= 1.0);
+
+        for (auto k : ks) {
+            for (auto recall : recalls) {
+                int num_correct = 0;
+                auto adjusted_k = std::min(k, table.get_size());
+                float expected_correct = recall*adjusted_k*NUM_SAMPLES;
+                for (int sample=0; sample < NUM_SAMPLES; sample++) {
+                    auto query = random_scaled_vector(dimensions);
+                    auto exact = table.search_bf(query, k);
+                    auto res = table.search(query, k, recall);
+
+                    REQUIRE(res.size() == static_cast<size_t>(adjusted_k));
+                    for (auto i : exact) {
+                        if (std::count(res.begin(), res.end(), i) != 0) {
+                            num_correct++;
+                        }
+                    }
+                }
+                // Only fail if the recall is far away from the expectation.
+                REQUIRE(num_correct >= 0.8*expected_correct);
+            }
+        }
+    }
+
+    TEST_CASE("InnerProductIndex::search") {
+        std::vector<int> dimensions = {5, 100};
+
+        for (auto d : dimensions) {
+            test_inner_product_search(
+                500, d,
+                IndependentHashArgs<FHTCrossPolytopeHash>(),
+                IndependentHashArgs<SimHash>());
+            test_inner_product_search(
+                500, d,
+                IndependentHashArgs<SimHash>(),
+                IndependentHashArgs<SimHash>());
+        }
+    }
+
+    TEST_CASE("InnerProductIndex::search shortlist") {
+        unsigned int dims = 20;
+        InnerProductIndex<> index(dims, 10*MB);
+        for (int i=0; i < 200; i++) {
+            index.insert(random_scaled_vector(dims));
+        }
+        index.rebuild();
+
+        auto query = random_scaled_vector(dims);
+        auto inner_product = [&](uint32_t idx) {
+            auto vec = index.get<std::vector<float>>(idx);
+            float res = 0.0;
+            for (unsigned int i=0; i < dims; i++) {
+                res += vec[i]*query[i];
+            }
+            return res;
+        };
+        auto res = index.search(query, 5, 0.5, FilterType::Default, 50);
+        REQUIRE(res.size() == 5);
+        // The shortlist is cut to k after being ordered by the exact inner product.
+        for (size_t i=1; i < res.size(); i++) {
+            REQUIRE(inner_product(res[i-1]) >= inner_product(res[i]));
+        }
+        // When every vector is in the shortlist, the result is exact.
+        REQUIRE(index.search(query, 5, 1.0, FilterType::None, 200) == index.search_bf(query, 5));
+    }
+
+    TEST_CASE("InnerProductIndex::search_bf") {
+        InnerProductIndex<> index(2, 1*MB);
+        index.insert({1.0, 0.0});
+        index.insert({0.0, 1.0});
+        index.insert({4.0, 1.0});
+        index.insert({-1.0, -1.0});
+        // Unlike the cosine, the length matters.
+        REQUIRE(index.search_bf({1.0, 0.5}, 3) == std::vector<uint32_t>{2, 0, 1});
+        REQUIRE(index.search_bf({-1.0, 0.0}, 1) == std::vector<uint32_t>{3});
+    }
+
+    TEST_CASE("InnerProductIndex serialize") {
+        unsigned int dims = 50;
+        InnerProductIndex<> index(dims, 50*MB);
+        for (int i=0; i < 1000; i++) {
+            index.insert(random_scaled_vector(dims));
+        }
+        index.rebuild();
+
+        auto query = random_scaled_vector(dims);
+        auto res1 = index.search(query, 10, 0.5);
+
+        std::stringstream s;
+        index.serialize(s);
+        InnerProductIndex<> deserialized(s);
+        REQUIRE(deserialized.get_max_norm() == index.get_max_norm());
+        REQUIRE(deserialized.search(query, 10, 0.5) == res1);
+
+        std::stringstream s2;
+        deserialized.serialize(s2);
+        REQUIRE(s2.str() == s.str());
+    }
+
+    void test_two_tier_search(int n, int dimensions, const std::string& path) {
+        const int NUM_SAMPLES = 100;
+
+        std::vector<float> recalls = {0.2, 0.5, 0.95};
+        std::vector<unsigned int> ks = {1, 10};
+
+        std::vector<std::vector<float>> inserted;
+        for (int i=0; i < n; i++) {
+            inserted.push_back(UnitVectorFormat::generate_random(dimensions));
+        }
+        UnitVectorI8Args compact_args(dimensions, UnitVectorI8Format::max_coordinate(inserted));
+        TwoTierIndex<> index(
+            dimensions,
+            compact_args,
+            100*MB,
+            IndependentHashArgs<FHTCrossPolytopeHash>(),
+            IndependentHashArgs<SimHash>(),
+            path);
+        for (auto& vec : inserted) {
+            index.insert(vec);
+        }
+        index.rebuild();
+
+        for (auto k : ks) {
+            for (auto recall : recalls) {
+                int num_correct = 0;
+                float expected_correct = recall*k*NUM_SAMPLES;
+                for (int sample=0; sample < NUM_SAMPLES; sample++) {
+                    auto query = UnitVectorFormat::generate_random(dimensions);
+                    auto exact = index.search_bf(query, k);
+                    auto res = index.search(query, k, recall);
+
+                    REQUIRE(res.size() == k);
+                    for (auto i : exact) {
+                        if (std::count(res.begin(), res.end(), i) != 0) {
+                            num_correct++;
+                        }
+                    }
+                }
+                // Only fail if the recall is far away from the expectation.
+                REQUIRE(num_correct >= 0.8*expected_correct);
+            }
+        }
+    }
+
+    TEST_CASE("TwoTierIndex::search") {
+        for (auto d : {5, 100}) {
+            test_two_tier_search(500, d, "");
+            test_two_tier_search(500, d, "puffinn_two_tier_test.bin");
+        }
+    }
+
+    TEST_CASE("TwoTierIndex memory") {
+        unsigned int dims = 128;
+        TwoTierIndex<> in_memory(dims, dims, 10*MB);
+        TwoTierIndex<> mapped(
+            dims,
+            dims,
+            10*MB,
+            IndependentHashArgs<FHTCrossPolytopeHash>(),
+            IndependentHashArgs<SimHash>(),
+            "puffinn_two_tier_test.bin");
+        for (int i=0; i < 1000; i++) {
+            auto vec = UnitVectorFormat::generate_random(dims);
+            in_memory.insert(vec);
+            mapped.insert(vec);
+        }
+        in_memory.rebuild();
+        mapped.rebuild();
+
+        auto in_memory_report = in_memory.memory_report();
+        auto mapped_report = mapped.memory_report();
+        REQUIRE(in_memory_report.total().capacity <= 10*MB);
+        REQUIRE(mapped_report.total().capacity <= 10*MB);
+        // Vectors in a file leave more memory for the tables.
+        REQUIRE(mapped_report.dataset.capacity < in_memory_report.dataset.capacity);
+        REQUIRE(mapped_report.tables.capacity > in_memory_report.tables.capacity);
+        REQUIRE(mapped.get<std::vector<float>>(3) == in_memory.get<std::vector<float>>(3));
+    }
+
+    TEST_CASE("TwoTierIndex serialize") {
+        unsigned int dims = 50;
+        TwoTierIndex<> index(dims, UnitVectorI8Args(dims, 0.5), 50*MB);
+        for (int i=0; i < 1000; i++) {
+            index.insert(UnitVectorFormat::generate_random(dims));
+        }
+        index.rebuild();
+
+        auto query = UnitVectorFormat::generate_random(dims);
+        auto res1 = index.search(query, 10, 0.5);
+
+        std::stringstream s;
+        index.serialize(s);
+        TwoTierIndex<> deserialized(s, "puffinn_two_tier_test.bin");
+        REQUIRE(deserialized.search(query, 10, 0.5) == res1);
+
+        std::stringstream s2;
+        deserialized.serialize(s2);
+        REQUIRE(s2.str() == s.str());
+    }
+
+    TEST_CASE("Index::set_numa_policy") {
+        const unsigned int DIMENSIONS = 20;
+        Index<CosineSimilarity> index(DIMENSIONS, 10*MB);
+        std::vector<std::vector<float>> queries;
+        for (int i=0; i < 20; i++) {
+            queries.push_back(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        auto search_all = [&]() {
+            std::vector<std::vector<uint32_t>> res;
+            for (auto& query : queries) {
+                res.push_back(index.search(query, 10, 0.9));
+            }
+            return res;
+        };
+
+        for (int i=0; i < 1000; i++) {
+            index.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        index.rebuild();
+        // The placement of the memory does not change the index.
+        auto before = search_all();
+        index.set_numa_policy(NumaPolicy::Interleave);
+        REQUIRE(search_all() == before);
+
+        // The policy is applied to the memory allocated when rebuilding.
+        for (int i=0; i < 1000; i++) {
+            index.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        index.rebuild();
+        before = search_all();
+        index.set_numa_policy(NumaPolicy::FirstTouch);
+        REQUIRE(search_all() == before);
+    }
+
+    TEST_CASE("ShardedIndex::search") {
+        const unsigned int DIMENSIONS = 20;
+        const int NUM_SAMPLES = 200;
+        const unsigned int K = 10;
+        const float RECALL = 0.9;
+
+        ShardedIndex<CosineSimilarity> index(DIMENSIONS, 40*MB, 4);
+        // Contains the same values, used to find the exact neighbors.
+        Index<CosineSimilarity> exact_index(DIMENSIONS, 10*MB);
+        for (int i=0; i < 2000; i++) {
+            auto vec = UnitVectorFormat::generate_random(DIMENSIONS);
+            index.insert(vec);
+            exact_index.insert(vec);
+        }
+        REQUIRE(index.get_size() == 2000);
+        unsigned int total = 0;
+        for (size_t i=0; i < index.get_num_shards(); i++) {
+            REQUIRE(index.get_shard_size(i) > 2000/index.get_num_shards()/2);
+            total += index.get_shard_size(i);
+        }
+        REQUIRE(total == 2000);
+        REQUIRE(index.get<std::vector<float>>(17) == exact_index.get<std::vector<float>>(17));
+
+        index.rebuild();
+        REQUIRE(index.memory_report().total().capacity <= 40*MB);
+
+        int num_correct = 0;
+        for (int sample=0; sample < NUM_SAMPLES; sample++) {
+            auto query = UnitVectorFormat::generate_random(DIMENSIONS);
+            auto exact = exact_index.search_bf(query, K);
+            auto res = index.search(query, K, RECALL);
+            REQUIRE(res.size() == K);
+            for (auto i : exact) {
+                num_correct += std::count(res.begin(), res.end(), i);
+            }
+        }
+        // Only fail if the recall is far away from the expectation.
+        REQUIRE(num_correct >= 0.8*RECALL*K*NUM_SAMPLES);
+    }
+
+    TEST_CASE("ShardedIndex::rebuild_shard") {
+        const unsigned int DIMENSIONS = 20;
+        ShardedIndex<CosineSimilarity> index(DIMENSIONS, 40*MB, 2);
+        std::vector<std::vector<float>> inserted;
+        for (int i=0; i < 1000; i++) {
+            inserted.push_back(UnitVectorFormat::generate_random(DIMENSIONS));
+            index.insert(inserted.back());
+        }
+        index.rebuild_shard(0);
+        // Only values in the rebuilt shard can be found.
+        unsigned int num_found = 0;
+        unsigned int num_searched = 0;
+        for (uint32_t i=0; i < 100; i++) {
+            auto res = index.search(inserted[i], 1, 0.9);
+            REQUIRE(res.size() == 1);
+            REQUIRE(index.get_shard(res[0]) == 0);
+            if (index.get_shard(i) == 0) {
+                num_found += (res[0] == i);
+                num_searched++;
+            }
+        }
+        REQUIRE(num_found >= 0.8*0.9*num_searched);
+
+        index.rebuild_shard(1);
+        num_found = 0;
+        for (uint32_t i=0; i < 100; i++) {
+            auto res = index.search(inserted[i], 1, 0.9);
+            num_found += (res.size() == 1 && res[0] == i);
+        }
+        REQUIRE(num_found >= 0.8*0.9*100);
+    }
+
+    TEST_CASE("ShardedIndex serialize") {
+        unsigned int dims = 50;
+        ShardedIndex<CosineSimilarity> index(dims, 50*MB, 3);
+        for (int i=0; i < 1000; i++) {
+            index.insert(UnitVectorFormat::generate_random(dims));
+        }
+        index.rebuild();
+
+        auto query = UnitVectorFormat::generate_random(dims);
+        auto res1 = index.search(query, 10, 0.5);
+
+        std::stringstream s;
+        index.serialize(s);
+        ShardedIndex<CosineSimilarity> deserialized(s);
+        REQUIRE(deserialized.get_size() == index.get_size());
+        REQUIRE(deserialized.search(query, 10, 0.5) == res1);
+        REQUIRE(deserialized.get<std::vector<float>>(5) == index.get<std::vector<float>>(5));
+
+        std::stringstream s2;
+        deserialized.serialize(s2);
+        REQUIRE(s2.str() == s.str());
+    }
+
     void test_jaccard_search(
         int n,
         int dimensions,
@@ -288,6 +850,51 @@ namespace collection {
         }
     }
 
+    template <typename T, typename H, typename S>
+    void test_memory_report(
+        typename T::Format::Args args,
+        const HashSourceArgs<H>& hash_args,
+        const HashSourceArgs<S>& sketch_args
+    ) {
+        uint64_t memory_limit = 10*MB;
+        Index<T, H, S> index(args, memory_limit, hash_args, sketch_args);
+        for (int rebuilds = 0; rebuilds < 2; rebuilds++) {
+            for (int i=0; i < 1000; i++) {
+                index.insert(T::Format::generate_random(args));
+            }
+            index.rebuild();
+
+            auto report = index.memory_report();
+            for (auto usage : {report.dataset, report.tables, report.sketches, report.hash_functions}) {
+                REQUIRE(usage.size > 0);
+                REQUIRE(usage.capacity >= usage.size);
+            }
+            REQUIRE(report.total().capacity <= memory_limit);
+        }
+        // The tables should use most of the remaining memory.
+        auto report = index.memory_report();
+        REQUIRE(report.total().capacity >= 0.9*memory_limit);
+    }
+
+    TEST_CASE("Index::memory_report") {
+        test_memory_report<CosineSimilarity>(
+            100,
+            IndependentHashArgs<FHTCrossPolytopeHash>(),
+            IndependentHashArgs<SimHash>());
+        test_memory_report<CosineSimilarity>(
+            100,
+            SharedRotationHashArgs(),
+            IndependentHashArgs<SimHash>());
+        test_memory_report<CosineSimilarity>(
+            100,
+            HashPoolArgs<FHTCrossPolytopeHash>(3000),
+            HashPoolArgs<SimHash>(1000));
+        test_memory_report<JaccardSimilarity>(
+            1000,
+            TensoredHashArgs<MinHash>(),
+            TensoredHashArgs<MinHash1Bit>());
+    }
+
     template <typename T, typename H, typename S>
     void test_serialize(
         typename T::Format::Args args,
@@ -325,6 +932,10 @@ namespace collection {
             100,
             IndependentHashArgs<FHTCrossPolytopeHash>(),
             IndependentHashArgs<SimHash>());
+        test_serialize<CosineSimilarity>(
+            100,
+            SharedRotationHashArgs(),
+            IndependentHashArgs<SimHash>());
         test_serialize<CosineSimilarity>(
             100,
             HashPoolArgs<CrossPolytopeHash>(3000),
@@ -333,6 +944,43 @@ namespace collection {
             1000,
             TensoredHashArgs<MinHash>(),
             TensoredHashArgs<MinHash1Bit>());
+        test_serialize<L2Distance>(
+            100,
+            IndependentHashArgs<PStableHash>(),
+            IndependentHashArgs<PStableHash1Bit>());
+        test_serialize<HammingSimilarity>(
+            256,
+            IndependentHashArgs<BitSamplingHash>(),
+            IndependentHashArgs<BitSamplingHash1Bit>());
+
+        test_serialize<CosineSimilarityI8>(
+            UnitVectorI8Args(100, 0.5),
+            IndependentHashArgs<FHTCrossPolytopeHash>(),
+            IndependentHashArgs<SimHash>());
+    }
+
+    TEST_CASE("Serialize rejects other formats") {
+        int dims = 10;
+        Index<CosineSimilarity> index(dims, 1*MB);
+        for (int i=0; i < 10; i++) {
+            index.insert(UnitVectorFormat::generate_random(dims));
+        }
+        index.rebuild();
+
+        std::stringstream s;
+        index.serialize(s);
+        auto serialized = s.str();
+
+        // Indexes serialized before the format was versioned start with the dataset.
+        std::stringstream unversioned(serialized.substr(2*sizeof(uint32_t)));
+        REQUIRE_THROWS_AS(Index<CosineSimilarity>(unversioned), std::invalid_argument);
+
+        auto other_version = serialized;
+        uint32_t version = INDEX_FORMAT_VERSION+1;
+        other_version.replace(sizeof(uint32_t), sizeof(uint32_t),
+            reinterpret_cast<const char*>(&version), sizeof(uint32_t));
+        std::stringstream newer(other_version);
+        REQUIRE_THROWS_AS(Index<CosineSimilarity>(newer), std::invalid_argument);
     }
 
     TEST_CASE("Serialize chunked") {
@@ -399,4 +1047,429 @@ namespace collection {
         res2.pop_back();
         REQUIRE(res1 == res2);
     }
+
+    TEST_CASE("Index::search_with_stats") {
+        const unsigned int DIMENSIONS = 50;
+        const unsigned int N = 2000;
+        const unsigned int K = 10;
+        const float RECALL = 0.8;
+
+        Index<CosineSimilarity> index(DIMENSIONS, 10*MB);
+        for (unsigned int i=0; i < N; i++) {
+            index.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        index.rebuild();
+
+        for (auto filter_type : { FilterType::Default, FilterType::None, FilterType::Simple }) {
+            auto query = UnitVectorFormat::generate_random(DIMENSIONS);
+            auto res = index.search_with_stats(query, K, RECALL, filter_type);
+            REQUIRE(res.first == index.search(query, K, RECALL, filter_type));
+
+            auto& stats = res.second;
+            REQUIRE(stats.depth <= MAX_HASHBITS);
+            REQUIRE(stats.considered_maps > 0);
+            REQUIRE(stats.considered_maps <= MAX_HASHBITS*index.get_repetitions());
+            REQUIRE(stats.candidates >= stats.candidates_passing_filter);
+            REQUIRE(stats.candidates_passing_filter == stats.distance_computations);
+            REQUIRE(stats.distance_computations >= K);
+            if (stats.depth != 0) {
+                REQUIRE(stats.failure_probability <= 1-RECALL);
+            }
+            if (filter_type == FilterType::None) {
+                REQUIRE(stats.candidates == stats.candidates_passing_filter);
+            }
+        }
+
+        // Small indexes are searched by brute force.
+        Index<CosineSimilarity> small(DIMENSIONS, 1*MB);
+        for (unsigned int i=0; i < 50; i++) {
+            small.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        small.rebuild();
+        auto stats = small.search_with_stats(UnitVectorFormat::generate_random(DIMENSIONS), K, RECALL).second;
+        REQUIRE(stats.depth == 0);
+        REQUIRE(stats.considered_maps == 0);
+        REQUIRE(stats.distance_computations == 50);
+    }
+
+    TEST_CASE("Index::closest_pairs") {
+        const unsigned int DIMENSIONS = 20;
+        const unsigned int K = 10;
+        const float RECALL = 0.9;
+
+        Index<CosineSimilarity> index(DIMENSIONS, 100*MB);
+        for (int i=0; i < 1000; i++) {
+            index.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        index.rebuild();
+        auto exact = index.global_bf_join(K).best_indices();
+        REQUIRE(exact.size() == K);
+
+        for (auto filter_type : {FilterType::None, FilterType::Simple, FilterType::Default}) {
+            const int NUM_RUNS = 5;
+            int num_correct = 0;
+            for (int run=0; run < NUM_RUNS; run++) {
+                auto res = index.closest_pairs(K, RECALL, filter_type);
+                REQUIRE(res.size() == K);
+                for (auto p : exact) {
+                    num_correct += std::count(res.begin(), res.end(), p);
+                }
+            }
+            // Only fail if the recall is far away from the expectation.
+            REQUIRE(num_correct >= 0.8*RECALL*K*NUM_RUNS);
+        }
+    }
+
+    TEST_CASE("Index::closest_pairs large buckets") {
+        // Clusters of similar vectors, which collide in large buckets
+        // that are compared in tiles.
+        const unsigned int DIMENSIONS = 64;
+        const unsigned int CLUSTER_SIZE = 200;
+        const unsigned int K = 10;
+        const float RECALL = 0.9;
+
+        Index<CosineSimilarity> index(DIMENSIONS, 100*MB);
+        std::normal_distribution<float> noise(0, 0.1/std::sqrt(DIMENSIONS));
+        auto& rng = get_default_random_generator();
+        for (int c=0; c < 5; c++) {
+            auto center = UnitVectorFormat::generate_random(DIMENSIONS);
+            for (unsigned int i=0; i < CLUSTER_SIZE; i++) {
+                auto vec = center;
+                for (auto& v : vec) {
+                    v += noise(rng);
+                }
+                index.insert(vec);
+            }
+        }
+        index.rebuild();
+        auto exact = index.global_bf_join(K).best_entries();
+        REQUIRE(exact.size() == K);
+
+        // Many pairs are almost equally similar, so the similarities are compared
+        // rather than the pairs.
+        auto similarity = [&](std::pair<uint32_t, uint32_t> p) {
+            auto a = index.get<std::vector<float>>(p.first);
+            auto b = index.get<std::vector<float>>(p.second);
+            float dot = 0;
+            for (unsigned int i=0; i < DIMENSIONS; i++) {
+                dot += a[i]*b[i];
+            }
+            return (dot+1)/2;
+        };
+        for (auto filter_type : {FilterType::None, FilterType::Simple, FilterType::Default}) {
+            auto res = index.closest_pairs(K, RECALL, filter_type);
+            REQUIRE(res.size() == K);
+            unsigned int num_correct = 0;
+            for (auto p : res) {
+                REQUIRE(p.first != p.second);
+                if (similarity(p) >= exact[K-1].second-1e-3) {
+                    num_correct++;
+                }
+            }
+            REQUIRE(num_correct >= 0.8*RECALL*K);
+        }
+    }
+
+    TEST_CASE("Index::knn_graph") {
+        const unsigned int DIMENSIONS = 20;
+        const unsigned int N = 1000;
+        const unsigned int K = 10;
+        const float RECALL = 0.9;
+
+        Index<CosineSimilarity> index(DIMENSIONS, 100*MB);
+        for (unsigned int i=0; i < N; i++) {
+            index.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        index.rebuild();
+
+        auto graph = index.knn_graph(K, RECALL);
+        REQUIRE(graph.size() == N);
+        REQUIRE(graph.offsets.size() == N+1);
+        REQUIRE(graph.offsets[N] == graph.neighbors.size());
+        REQUIRE(graph.similarities.size() == graph.neighbors.size());
+
+        unsigned int num_correct = 0;
+        for (uint32_t i=0; i < N; i++) {
+            REQUIRE(graph.degree(i) == K);
+            auto begin = graph.neighbors.begin()+graph.offsets[i];
+            auto end = graph.neighbors.begin()+graph.offsets[i+1];
+            REQUIRE(std::find(begin, end, i) == end);
+            for (auto j = graph.offsets[i]+1; j < graph.offsets[i+1]; j++) {
+                REQUIRE(graph.similarities[j-1] >= graph.similarities[j]);
+            }
+            // The value itself is the most similar result.
+            auto exact = index.search_bf(index.get<std::vector<float>>(i), K+1);
+            for (auto neighbor : exact) {
+                num_correct += std::count(begin, end, neighbor);
+            }
+        }
+        // Only fail if the recall is far away from the expectation.
+        REQUIRE(num_correct >= 0.8*RECALL*K*N);
+
+        REQUIRE(index.knn_graph(0, RECALL).neighbors.size() == 0);
+    }
+
+    TEST_CASE("Index::join") {
+        const unsigned int DIMENSIONS = 20;
+        const unsigned int N = 500;
+        const unsigned int K = 20;
+        const float RECALL = 0.9;
+
+        Index<CosineSimilarity> r_index(DIMENSIONS, 50*MB);
+        std::vector<std::vector<float>> r_values, s_values;
+        for (unsigned int i=0; i < N; i++) {
+            r_index.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+            r_values.push_back(r_index.get<std::vector<float>>(i));
+        }
+        r_index.rebuild();
+
+        Index<CosineSimilarity> s_index(r_index, 50*MB);
+        for (unsigned int i=0; i < N; i++) {
+            s_index.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+            s_values.push_back(s_index.get<std::vector<float>>(i));
+        }
+        s_index.rebuild();
+        REQUIRE(r_index.shares_hash_functions(s_index));
+        // The shared functions are recognized after serialization.
+        std::stringstream serialized;
+        s_index.serialize(serialized);
+        Index<CosineSimilarity> s_copy(serialized);
+        REQUIRE(r_index.shares_hash_functions(s_copy));
+        // Functions sampled independently are never shared.
+        Index<CosineSimilarity> independent(DIMENSIONS, 50*MB);
+        independent.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        independent.rebuild();
+        REQUIRE(!r_index.shares_hash_functions(independent));
+
+        std::vector<std::pair<float, std::pair<uint32_t, uint32_t>>> exact;
+        for (uint32_t r=0; r < N; r++) {
+            for (uint32_t s=0; s < N; s++) {
+                float dot = 0;
+                for (unsigned int i=0; i < DIMENSIONS; i++) {
+                    dot += r_values[r][i]*s_values[s][i];
+                }
+                exact.push_back({ (dot+1)/2, { r, s } });
+            }
+        }
+        std::sort(exact.rbegin(), exact.rend());
+        std::set<std::pair<uint32_t, uint32_t>> exact_pairs;
+        for (unsigned int i=0; i < K; i++) {
+            exact_pairs.insert(exact[i].second);
+        }
+
+        for (auto filter_type : {FilterType::None, FilterType::Simple, FilterType::Default}) {
+            auto res = r_index.join(s_index, K, RECALL, filter_type);
+            REQUIRE(res.size() == K);
+            unsigned int num_correct = 0;
+            for (auto p : res) {
+                REQUIRE(p.first < N);
+                REQUIRE(p.second < N);
+                num_correct += exact_pairs.count(p);
+            }
+            // Only fail if the recall is far away from the expectation.
+            REQUIRE(num_correct >= 0.8*RECALL*K);
+        }
+
+        float threshold = exact[K-1].first;
+        auto res = r_index.join_threshold(s_index, threshold, RECALL);
+        unsigned int num_correct = 0;
+        for (size_t i=0; i < res.size(); i++) {
+            REQUIRE(res[i].second >= threshold);
+            if (i != 0) {
+                REQUIRE(res[i-1].second >= res[i].second);
+                REQUIRE(res[i-1].first != res[i].first);
+            }
+            num_correct += exact_pairs.count(res[i].first);
+        }
+        REQUIRE(num_correct >= 0.8*RECALL*K);
+
+        // Indexes with their own hash functions cannot be joined.
+        Index<CosineSimilarity> other_index(DIMENSIONS, 50*MB);
+        other_index.insert(s_values[0]);
+        other_index.rebuild();
+        REQUIRE(!r_index.shares_hash_functions(other_index));
+        REQUIRE_THROWS_AS(r_index.join(other_index, K, RECALL), std::invalid_argument);
+    }
+
+    // Check that the similarity join finds the given pairs with the expected recall.
+    template <typename TSim>
+    void test_similarity_join(
+        Index<TSim>& index,
+        float threshold,
+        const std::set<std::pair<uint32_t, uint32_t>>& exact
+    ) {
+        const float RECALL = 0.9;
+        for (auto filter_type : {FilterType::None, FilterType::Simple, FilterType::Default}) {
+            // The callback is called from the search threads, so the pairs are checked afterwards.
+            std::vector<std::pair<std::pair<uint32_t, uint32_t>, float>> reported;
+            index.similarity_join(
+                threshold,
+                RECALL,
+                [&](uint32_t a, uint32_t b, float sim) {
+                    reported.push_back({ { a, b }, sim });
+                },
+                filter_type);
+            std::map<std::pair<uint32_t, uint32_t>, unsigned int> found;
+            for (auto& pair : reported) {
+                REQUIRE(pair.first.first < pair.first.second);
+                REQUIRE(pair.first.second < index.get_size());
+                REQUIRE(pair.second >= threshold);
+                found[pair.first]++;
+            }
+            for (auto& count : found) {
+                // Each pair is reported at most once per table.
+                REQUIRE(count.second <= index.get_repetitions());
+            }
+            unsigned int num_correct = 0;
+            for (auto p : exact) {
+                num_correct += found.count(p);
+            }
+            // Only fail if the recall is far away from the expectation.
+            REQUIRE(num_correct >= 0.8*RECALL*exact.size());
+        }
+    }
+
+    // Join clusters of noisy copies of random unit vectors.
+    void test_cosine_similarity_join(
+        unsigned int num_clusters,
+        unsigned int cluster_size,
+        float noise_len,
+        float threshold
+    ) {
+        const unsigned int DIMENSIONS = 64;
+        auto& rng = get_default_random_generator();
+
+        Index<CosineSimilarity> index(DIMENSIONS, 100*MB);
+        std::normal_distribution<float> noise(0, noise_len/std::sqrt(DIMENSIONS));
+        for (unsigned int c=0; c < num_clusters; c++) {
+            auto center = UnitVectorFormat::generate_random(DIMENSIONS);
+            for (unsigned int i=0; i < cluster_size; i++) {
+                auto vec = center;
+                for (auto& v : vec) {
+                    v += noise(rng);
+                }
+                index.insert(vec);
+            }
+        }
+        index.rebuild();
+
+        // Stored vectors are rounded, so only clearly similar pairs are required.
+        std::set<std::pair<uint32_t, uint32_t>> exact;
+        for (uint32_t a=0; a < index.get_size(); a++) {
+            auto va = index.get<std::vector<float>>(a);
+            for (uint32_t b=a+1; b < index.get_size(); b++) {
+                auto vb = index.get<std::vector<float>>(b);
+                float dot = 0;
+                for (unsigned int i=0; i < DIMENSIONS; i++) {
+                    dot += va[i]*vb[i];
+                }
+                if ((dot+1)/2 >= threshold+0.01) {
+                    exact.insert({ a, b });
+                }
+            }
+        }
+        REQUIRE(exact.size() > 100);
+        test_similarity_join(index, threshold, exact);
+    }
+
+    TEST_CASE("Index::similarity_join") {
+        auto& rng = get_default_random_generator();
+        SECTION("cosine") {
+            test_cosine_similarity_join(50, 10, 0.3, 0.95);
+        }
+        SECTION("cosine large clusters") {
+            // Pairs in large clusters collide in many tables at several hash lengths.
+            test_cosine_similarity_join(20, 60, 0.7, 0.8);
+        }
+        SECTION("jaccard") {
+            const unsigned int UNIVERSE = 1000;
+            const float THRESHOLD = 0.6;
+
+            Index<JaccardSimilarity> index(UNIVERSE, 100*MB);
+            std::uniform_int_distribution<uint32_t> token(0, UNIVERSE-1);
+            std::vector<std::set<uint32_t>> sets;
+            for (int c=0; c < 50; c++) {
+                std::set<uint32_t> base;
+                while (base.size() < 40) {
+                    base.insert(token(rng));
+                }
+                for (unsigned int i=0; i < 10; i++) {
+                    // Replace a few tokens of the base set.
+                    std::vector<uint32_t> tokens(base.begin(), base.end());
+                    for (unsigned int j=0; j < 4; j++) {
+                        tokens[token(rng)%tokens.size()] = token(rng);
+                    }
+                    sets.emplace_back(tokens.begin(), tokens.end());
+                    index.insert(std::vector<uint32_t>(tokens.begin(), tokens.end()));
+                }
+            }
+            index.rebuild();
+
+            std::set<std::pair<uint32_t, uint32_t>> exact;
+            for (uint32_t a=0; a < sets.size(); a++) {
+                for (uint32_t b=a+1; b < sets.size(); b++) {
+                    std::vector<uint32_t> intersection;
+                    std::set_intersection(
+                        sets[a].begin(), sets[a].end(),
+                        sets[b].begin(), sets[b].end(),
+                        std::back_inserter(intersection));
+                    float sim = static_cast<float>(intersection.size())
+                        /(sets[a].size()+sets[b].size()-intersection.size());
+                    if (sim >= THRESHOLD) {
+                        exact.insert({ a, b });
+                    }
+                }
+            }
+            REQUIRE(exact.size() > 100);
+            test_similarity_join(index, THRESHOLD, exact);
+        }
+    }
+
+    // Peak number of bytes allocated while joining clusters of near-identical vectors.
+    // Returns the number of reported pairs in num_pairs.
+    int64_t similarity_join_peak_memory(
+        unsigned int num_clusters,
+        unsigned int cluster_size,
+        uint64_t& num_pairs
+    ) {
+        const unsigned int DIMENSIONS = 64;
+        const float THRESHOLD = 0.9;
+        auto& rng = get_default_random_generator();
+
+        Index<CosineSimilarity> index(DIMENSIONS, 100*MB);
+        std::normal_distribution<float> noise(0, 0.05/std::sqrt(DIMENSIONS));
+        for (unsigned int c=0; c < num_clusters; c++) {
+            auto center = UnitVectorFormat::generate_random(DIMENSIONS);
+            for (unsigned int i=0; i < cluster_size; i++) {
+                auto vec = center;
+                for (auto& v : vec) {
+                    v += noise(rng);
+                }
+                index.insert(vec);
+            }
+        }
+        index.rebuild();
+
+        num_pairs = 0;
+        auto start_bytes = memory_tracker::current_bytes.load();
+        memory_tracker::reset_peak();
+        index.similarity_join(THRESHOLD, 0.9, [&](uint32_t, uint32_t, float) {
+            num_pairs++;
+        });
+        return memory_tracker::peak_since(start_bytes);
+    }
+
+    TEST_CASE("Index::similarity_join memory") {
+        // The buffers of each thread are bounded, so they are only counted once.
+        auto num_threads = omp_get_max_threads();
+        omp_set_num_threads(1);
+        uint64_t few_pairs, many_pairs;
+        auto few_pairs_bytes = similarity_join_peak_memory(20, 100, few_pairs);
+        auto many_pairs_bytes = similarity_join_peak_memory(5, 400, many_pairs);
+        omp_set_num_threads(num_threads);
+
+        REQUIRE(many_pairs > few_pairs+200000);
+        // Storing even 8 bytes per pair would exceed the difference in memory.
+        REQUIRE(many_pairs_bytes-few_pairs_bytes < int64_t((many_pairs-few_pairs)*sizeof(uint64_t)));
+    }
 }
@@ -4,6 +4,7 @@
 
 #include "puffinn/dataset.hpp"
 #include "puffinn/format/unit_vector.hpp"
+#include "puffinn/huge_pages.hpp"
 
 #include <cstring>
 
@@ -48,4 +49,59 @@ namespace dataset {
         // Initial vector still there.
         REQUIRE(dataset[0][1] == UnitVectorFormat::to_16bit_fixed_point(1.0));
     }
+
+    TEST_CASE("LargeArrayAllocator") {
+        for (auto pages : {
+            HugePages::None,
+            HugePages::Transparent,
+            HugePages::Explicit2MB,
+            HugePages::Explicit1GB
+        }) {
+            set_huge_pages(pages);
+            // Explicit huge pages are usually not reserved, in which case the allocation
+            // falls back to a mapping using transparent huge pages.
+            for (size_t len : {100, 1 << 18, 3 << 20}) {
+                LargeVector<uint32_t> vec(len);
+                for (size_t i=0; i < len; i++) {
+                    vec[i] = i;
+                }
+                vec.resize(2*len, 7);
+                REQUIRE(vec[len-1] == len-1);
+                REQUIRE(vec[2*len-1] == 7);
+
+                // Whole explicit huge pages are counted when they are used.
+                auto bytes = vec.capacity()*sizeof(uint32_t);
+                auto usage = vector_memory(vec);
+                REQUIRE(usage.capacity >= bytes);
+                REQUIRE(usage.capacity <= large_allocation_bytes(bytes));
+            }
+            Dataset<UnitVectorFormat> dataset(100, 20000);
+            dataset.insert(UnitVectorFormat::generate_random(100));
+            REQUIRE(dataset.get_size() == 1);
+        }
+        set_huge_pages(HugePages::None);
+    }
+
+    TEST_CASE("Huge page sizes") {
+        const size_t MB = 1 << 20;
+        const size_t GB = 1 << 30;
+        REQUIRE(explicit_page_shift(10*MB, HugePages::None) == 0);
+        REQUIRE(explicit_page_shift(10*MB, HugePages::Transparent) == 0);
+        REQUIRE(explicit_page_shift(10*MB, HugePages::Explicit2MB) == 21);
+        // 1GB pages are only used for arrays that almost fill them.
+        REQUIRE(explicit_page_shift(10*MB, HugePages::Explicit1GB) == 21);
+        REQUIRE(explicit_page_shift(512*MB, HugePages::Explicit1GB) == 21);
+        REQUIRE(explicit_page_shift(GB-64*MB, HugePages::Explicit1GB) == 30);
+        REQUIRE(explicit_page_shift(GB+64*MB, HugePages::Explicit1GB) == 21);
+        REQUIRE(explicit_page_shift(8*GB+64*MB, HugePages::Explicit1GB) == 30);
+
+        set_huge_pages(HugePages::Explicit1GB);
+        REQUIRE(large_allocation_bytes(100) == 100);
+    #ifdef __linux__
+        REQUIRE(large_allocation_bytes(3*MB) == 4*MB);
+        REQUIRE(large_allocation_bytes(GB-64*MB) == GB);
+    #endif
+        set_huge_pages(HugePages::None);
+        REQUIRE(large_allocation_bytes(3*MB) == 3*MB);
+    }
 }
@@ -22,7 +22,8 @@ namespace filterer_test {
         std::vector<float> query({1, 0});
         auto stored = to_stored_type<UnitVectorFormat>(query, dataset.get_description());
         QuerySketches sketches;
-        filterer.sketch(stored.get(), sketches);
+        std::vector<LshDatatype> scratch;
+        filterer.sketch(stored.get(), sketches, scratch);
 
         // Anything initially passes
         for (size_t i=0; i < NUM_SKETCHES; i++) {
@@ -68,4 +69,20 @@ namespace filterer_test {
             REQUIRE(bit_counts[bit] != 0);
         }
     }
+
+    TEST_CASE("Filterer rejects unversioned serialization") {
+        Dataset<UnitVectorFormat> dataset(10);
+        dataset.insert(UnitVectorFormat::generate_random(10));
+        IndependentHashArgs<SimHash> hash_args;
+        Filterer<SimHash> filterer(hash_args, dataset.get_description());
+        filterer.add_sketches(dataset, 0);
+
+        std::stringstream s;
+        filterer.serialize(s);
+        Filterer<SimHash> copy(s);
+
+        // Filterers serialized before the format was versioned start directly with the flag.
+        std::stringstream unversioned(s.str().substr(2*sizeof(uint32_t)));
+        REQUIRE_THROWS_AS(Filterer<SimHash>(unversioned), std::invalid_argument);
+    }
 }
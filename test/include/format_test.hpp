@@ -3,6 +3,8 @@
 #include "catch.hpp"
 
 #include "puffinn/format/unit_vector.hpp"
+#include "puffinn/format/binary_vector.hpp"
+#include "puffinn/format/unit_vector_i8.hpp"
 
 namespace format {
     using namespace puffinn;
@@ -31,4 +33,55 @@ namespace format {
         REQUIRE(pad_dimensions<UnitVectorFormat>(16) == 16);
         REQUIRE(pad_dimensions<UnitVectorFormat>(17) == 32);
     }
+
+    TEST_CASE("UnitVectorI8Format::store") {
+        Dataset<UnitVectorI8Format> dataset(UnitVectorI8Args(4, 0.5));
+        auto desc = dataset.get_description();
+        REQUIRE(desc.storage_len == 32);
+
+        // Normalized to (0.2, -0.4, 0.4, 0.8), where the last coordinate is clamped.
+        auto stored = to_stored_type<UnitVectorI8Format>(std::vector<float>{1, -2, 2, 4}, desc);
+        REQUIRE(stored.get()[0] == 51);
+        REQUIRE(stored.get()[1] == -102);
+        REQUIRE(stored.get()[2] == 102);
+        REQUIRE(stored.get()[3] == 127);
+        for (unsigned int i=4; i < desc.storage_len; i++) {
+            REQUIRE(stored.get()[i] == 0);
+        }
+        auto converted = convert_stored_type<UnitVectorI8Format, std::vector<float>>(
+            stored.get(), desc);
+        REQUIRE(converted[0] == Approx(0.2).margin(0.002));
+        REQUIRE(converted[3] == Approx(0.5));
+
+        REQUIRE(UnitVectorI8Format::max_coordinate({{1, -2, 2, 4}, {0, 0, 0, 0}})
+            == Approx(0.8));
+        REQUIRE_THROWS(dataset.insert(std::vector<float>(5)));
+        REQUIRE_THROWS(UnitVectorI8Args(4, 0.0));
+    }
+
+    TEST_CASE("BinaryVectorFormat::store") {
+        Dataset<BinaryVectorFormat> dataset(70);
+        auto desc = dataset.get_description();
+        REQUIRE(desc.storage_len == 4);
+
+        std::vector<bool> bits(70, false);
+        bits[0] = bits[3] = bits[64] = bits[69] = true;
+        std::vector<uint64_t> words{9, 33};
+        auto from_bits = to_stored_type<BinaryVectorFormat>(bits, desc);
+        auto from_words = to_stored_type<BinaryVectorFormat>(words, desc);
+        for (unsigned int i=0; i < desc.storage_len; i++) {
+            REQUIRE(from_bits.get()[i] == from_words.get()[i]);
+        }
+        REQUIRE(from_bits.get()[2] == 0);
+
+        REQUIRE((convert_stored_type<BinaryVectorFormat, std::vector<bool>>(from_words.get(), desc))
+            == bits);
+        REQUIRE((convert_stored_type<BinaryVectorFormat, std::vector<uint64_t>>(from_bits.get(), desc))
+            == words);
+
+        REQUIRE_THROWS(dataset.insert(std::vector<bool>(71)));
+        REQUIRE_THROWS(dataset.insert(std::vector<uint64_t>{0}));
+        // Bit 70 is outside the vector.
+        REQUIRE_THROWS(dataset.insert(std::vector<uint64_t>{0, 64}));
+    }
 }
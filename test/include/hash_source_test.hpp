@@ -1,12 +1,16 @@
 #pragma once
 
 #include "catch.hpp"
+#include "puffinn/filterer.hpp"
 #include "puffinn/hash_source/pool.hpp"
 #include "puffinn/hash_source/independent.hpp"
+#include "puffinn/hash_source/shared_rotation.hpp"
 #include "puffinn/hash_source/tensor.hpp"
 #include "puffinn/hash/simhash.hpp"
 #include "puffinn/hash/crosspolytope.hpp"
 
+#include <sstream>
+
 using namespace puffinn;
 
 namespace hash_source {
@@ -109,5 +113,185 @@ namespace hash_source {
             TensoredHashArgs<FHTCrossPolytopeHash>().build(dimensions, NUM_HASHES, HASH_LENGTH),
             NUM_HASHES,
             HASH_LENGTH);
+        // Sketches use all 64 bits of the combined hash.
+        test_hashes<SimHash>(
+            dimensions,
+            TensoredHashArgs<SimHash>().build(dimensions, NUM_HASHES, NUM_FILTER_HASHBITS),
+            NUM_HASHES,
+            NUM_FILTER_HASHBITS);
+    }
+
+    TEST_CASE("intersperse_zero") {
+        std::vector<uint64_t> values = {0, 1, 0xFFFFFFFF, 0x12345678, 0xFFFFFFFF00000000, 0xABCDEF0123};
+        for (auto val : values) {
+            uint64_t expected = 0;
+            for (unsigned int bit=0; bit < 32; bit++) {
+                expected |= ((val >> bit) & 1) << (2*bit);
+            }
+            REQUIRE(intersperse_zero(val) == expected);
+        }
+    }
+
+    template <typename T>
+    void test_block_hashes(std::unique_ptr<HashSource<T>> source, unsigned int dimensions) {
+        const unsigned int NUM_VECTORS = 37;
+
+        Dataset<UnitVectorFormat> dataset(dimensions);
+        for (unsigned int i=0; i < NUM_VECTORS; i++) {
+            dataset.insert(UnitVectorFormat::generate_random(dimensions));
+        }
+
+        std::vector<uint64_t> block_hashes;
+        source->hash_repetitions_block(
+            dataset[0],
+            NUM_VECTORS,
+            dataset.get_description().storage_len,
+            block_hashes);
+        REQUIRE(block_hashes.size() % NUM_VECTORS == 0);
+        auto hashes_per_vector = block_hashes.size()/NUM_VECTORS;
+
+        std::vector<uint64_t> hashes, scratch_hashes;
+        std::vector<LshDatatype> scratch;
+        for (unsigned int i=0; i < NUM_VECTORS; i++) {
+            source->hash_repetitions(dataset[i], hashes);
+            REQUIRE(hashes.size() == hashes_per_vector);
+            for (size_t rep=0; rep < hashes.size(); rep++) {
+                REQUIRE(block_hashes[i*hashes_per_vector+rep] == hashes[rep]);
+            }
+            // The scratch space is reused between vectors.
+            source->hash_repetitions(dataset[i], scratch_hashes, scratch);
+            REQUIRE(scratch_hashes == hashes);
+        }
+    }
+
+    TEST_CASE("Block hashes equal single hashes") {
+        const unsigned int HASH_LENGTH = 24;
+        const unsigned int NUM_HASHES = 10;
+
+        std::vector<unsigned int> dimensions = {2, 100};
+        for (auto d : dimensions) {
+            Dataset<UnitVectorFormat> dataset(d);
+            auto desc = dataset.get_description();
+            test_block_hashes<CrossPolytopeHash>(
+                IndependentHashArgs<CrossPolytopeHash>().build(desc, NUM_HASHES, HASH_LENGTH), d);
+            test_block_hashes<FHTCrossPolytopeHash>(
+                IndependentHashArgs<FHTCrossPolytopeHash>().build(desc, NUM_HASHES, HASH_LENGTH), d);
+            test_block_hashes<SimHash>(
+                HashPoolArgs<SimHash>(60).build(desc, NUM_HASHES, HASH_LENGTH), d);
+            test_block_hashes<CrossPolytopeHash>(
+                HashPoolArgs<CrossPolytopeHash>(300).build(desc, NUM_HASHES, HASH_LENGTH), d);
+            test_block_hashes<SimHash>(
+                HashPoolArgs<SimHash>(1000).build(desc, NUM_SKETCHES, NUM_FILTER_HASHBITS), d);
+            test_block_hashes<SimHash>(
+                IndependentHashArgs<SimHash>().build(desc, NUM_HASHES, HASH_LENGTH), d);
+            test_block_hashes<FHTCrossPolytopeHash>(
+                TensoredHashArgs<FHTCrossPolytopeHash>().build(desc, NUM_HASHES, HASH_LENGTH), d);
+            test_block_hashes<SimHash>(
+                TensoredHashArgs<SimHash>().build(desc, NUM_HASHES, 23), d);
+            test_block_hashes<SimHash>(
+                IndependentHashArgs<SimHash>().build(desc, NUM_SKETCHES, NUM_FILTER_HASHBITS), d);
+        }
+    }
+
+    template <typename T>
+    void test_clone(std::unique_ptr<HashSource<T>> source, unsigned int dimensions) {
+        const unsigned int NUM_VECTORS = 100;
+        Dataset<typename T::Sim::Format> dataset(dimensions);
+        for (unsigned int i=0; i < NUM_VECTORS; i++) {
+            dataset.insert(T::Sim::Format::generate_random(dimensions));
+        }
+        auto desc = dataset.get_description();
+
+        std::vector<uint64_t> hashes;
+        source->hash_repetitions_block(dataset[0], NUM_VECTORS, desc.storage_len, hashes);
+        std::stringstream serialized;
+        source->serialize(serialized);
+
+        // The clone must not refer to the functions of the original.
+        auto clone = source->clone();
+        source.reset();
+
+        std::vector<uint64_t> clone_hashes;
+        clone->hash_repetitions_block(dataset[0], NUM_VECTORS, desc.storage_len, clone_hashes);
+        REQUIRE(clone_hashes == hashes);
+        std::stringstream clone_serialized;
+        clone->serialize(clone_serialized);
+        REQUIRE(clone_serialized.str() == serialized.str());
+    }
+
+    TEST_CASE("Cloned sources use the same functions") {
+        const unsigned int HASH_LENGTH = 24;
+        const unsigned int NUM_HASHES = 10;
+
+        std::vector<unsigned int> dimensions = {2, 100};
+        for (auto d : dimensions) {
+            Dataset<UnitVectorFormat> dataset(d);
+            auto desc = dataset.get_description();
+            test_clone<CrossPolytopeHash>(
+                IndependentHashArgs<CrossPolytopeHash>().build(desc, NUM_HASHES, HASH_LENGTH), d);
+            test_clone<FHTCrossPolytopeHash>(
+                IndependentHashArgs<FHTCrossPolytopeHash>().build(desc, NUM_HASHES, HASH_LENGTH), d);
+            test_clone<SimHash>(
+                IndependentHashArgs<SimHash>().build(desc, NUM_SKETCHES, NUM_FILTER_HASHBITS), d);
+            test_clone<CrossPolytopeHash>(
+                HashPoolArgs<CrossPolytopeHash>(300).build(desc, NUM_HASHES, HASH_LENGTH), d);
+            test_clone<SimHash>(
+                HashPoolArgs<SimHash>(1000).build(desc, NUM_SKETCHES, NUM_FILTER_HASHBITS), d);
+            test_clone<SimHash>(
+                TensoredHashArgs<SimHash>().build(desc, NUM_HASHES, 23), d);
+            test_clone<FHTCrossPolytopeHash>(
+                SharedRotationHashArgs().build(desc, NUM_HASHES, HASH_LENGTH), d);
+        }
+    }
+
+    TEST_CASE("Shared rotation hashes and sketches") {
+        const unsigned int HASH_LENGTH = 24;
+        const unsigned int NUM_HASHES = 10;
+        const unsigned int NUM_VECTORS = 100;
+
+        std::vector<unsigned int> dimensions = {2, 5, 100};
+        for (auto d : dimensions) {
+            Dataset<UnitVectorFormat> dataset(d);
+            auto desc = dataset.get_description();
+            for (unsigned int i=0; i < NUM_VECTORS; i++) {
+                dataset.insert(UnitVectorFormat::generate_random(d));
+            }
+            auto source = SharedRotationHashArgs().build(desc, NUM_HASHES, HASH_LENGTH);
+
+            std::vector<uint64_t> block_hashes;
+            std::vector<FilterLshDatatype> block_sketches;
+            source->hash_and_sketch_block(
+                dataset[0],
+                NUM_VECTORS,
+                desc.storage_len,
+                block_hashes,
+                block_sketches);
+            REQUIRE(block_hashes.size() == NUM_VECTORS*NUM_HASHES);
+            REQUIRE(block_sketches.size() == NUM_VECTORS*NUM_SKETCHES);
+
+            std::vector<uint64_t> hashes, sketched_hashes;
+            std::vector<FilterLshDatatype> sketches;
+            // Number of sketch bits that differ between consecutive vectors.
+            uint64_t differing_bits = 0;
+            for (unsigned int i=0; i < NUM_VECTORS; i++) {
+                source->hash_repetitions(dataset[i], hashes);
+                source->hash_and_sketch(dataset[i], sketched_hashes, sketches);
+                REQUIRE(hashes == sketched_hashes);
+                for (size_t rep=0; rep < NUM_HASHES; rep++) {
+                    REQUIRE(block_hashes[i*NUM_HASHES+rep] == hashes[rep]);
+                }
+                for (size_t sketch=0; sketch < NUM_SKETCHES; sketch++) {
+                    REQUIRE(block_sketches[i*NUM_SKETCHES+sketch] == sketches[sketch]);
+                    if (i != 0) {
+                        differing_bits += popcountll(
+                            sketches[sketch] ^ block_sketches[(i-1)*NUM_SKETCHES+sketch]);
+                    }
+                }
+            }
+            // Random vectors are orthogonal in expectation, so about half of the bits differ.
+            float expected_bits = 0.5*(NUM_VECTORS-1)*NUM_SKETCHES*NUM_FILTER_HASHBITS;
+            REQUIRE(differing_bits >= 0.8*expected_bits);
+            REQUIRE(differing_bits <= 1.2*expected_bits);
+        }
     }
 }
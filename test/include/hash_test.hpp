@@ -4,9 +4,13 @@
 #include "puffinn/hash/simhash.hpp"
 #include "puffinn/hash/crosspolytope.hpp"
 #include "puffinn/hash/minhash.hpp"
+#include "puffinn/hash/pstable.hpp"
+#include "puffinn/hash/bitsampling.hpp"
 #include "puffinn/hash_source/pool.hpp"
 #include "puffinn/similarity_measure/cosine.hpp"
 #include "puffinn/similarity_measure/jaccard.hpp"
+#include "puffinn/similarity_measure/l2.hpp"
+#include "puffinn/similarity_measure/hamming.hpp"
 
 #include <cstdlib>
 
@@ -137,6 +141,76 @@ namespace hash {
         test_hash_collision_probability<MinHash1Bit, JaccardSimilarity>(100, 4000, 1, args);
     }
 
+    TEST_CASE("PStable collision probability") {
+        test_hash_collision_probability<PStableHash, L2Distance>(10);
+        test_hash_collision_probability<PStableHash, L2Distance>(100);
+        test_hash_collision_probability<PStableHash1Bit, L2Distance>(10);
+
+        Dataset<RealVectorFormat> dataset(10);
+        PStableHash family(dataset.get_description(), PStableArgs());
+        REQUIRE(family.collision_probability(1.0, 4) > 0.99);
+        REQUIRE(family.collision_probability(0.5, 0) == 1.0);
+        REQUIRE(family.collision_probability(0.0, 4) == Approx(1.0/16));
+        // Using fewer bits is the same as using wider buckets.
+        REQUIRE(family.collision_probability(0.1, 2) > family.collision_probability(0.1, 4));
+
+        // Distances too large to count the terms are treated as independent indices.
+        REQUIRE(pstable_collision_probability(INFINITY, 1.0, 4) == 1.0/16);
+        REQUIRE(pstable_collision_probability(1e300, 1.0, 4) == 1.0/16);
+        REQUIRE(pstable_collision_probability(1e300, 1e-300, 4) == 1.0/16);
+    }
+
+    TEST_CASE("PStable collision probability of prefixes") {
+        const float ACCEPTED_DEVIATION = 0.02;
+        const unsigned int NUM_SAMPLES = 10000;
+        unsigned int dimensions = 20;
+        Dataset<RealVectorFormat> dataset(dimensions);
+        auto desc = dataset.get_description();
+        PStableHash family(desc, PStableArgs());
+        auto bits = family.bits_per_function();
+
+        std::normal_distribution<float> noise(0.0, 0.5);
+        auto& rng = get_default_random_generator();
+        for (unsigned int num_bits=1; num_bits < bits; num_bits++) {
+            float prob_sum = 0;
+            float actual_sum = 0;
+            for (unsigned int i=0; i < NUM_SAMPLES; i++) {
+                auto hasher = family.sample();
+                auto vec_a = RealVectorFormat::generate_random(dimensions);
+                auto vec_b = vec_a;
+                for (auto& v : vec_b) {
+                    v += noise(rng);
+                }
+                auto stored_a = to_stored_type<RealVectorFormat>(vec_a, desc);
+                auto stored_b = to_stored_type<RealVectorFormat>(vec_b, desc);
+                auto sim = L2Distance::compute_similarity(stored_a.get(), stored_b.get(), desc);
+                prob_sum += family.collision_probability(sim, num_bits);
+                auto shift = bits-num_bits;
+                actual_sum += (hasher(stored_a.get()) >> shift) == (hasher(stored_b.get()) >> shift);
+            }
+            // The estimates are computed for the lowest similarity in a segment.
+            REQUIRE(prob_sum <= actual_sum+ACCEPTED_DEVIATION*NUM_SAMPLES);
+            REQUIRE(prob_sum >= actual_sum-2*ACCEPTED_DEVIATION*NUM_SAMPLES);
+        }
+    }
+
+    TEST_CASE("BitSampling evenly distributed") {
+        test_hash_even_distribution<BitSamplingHash>(256);
+    }
+
+    TEST_CASE("BitSampling collision probability") {
+        BitSamplingArgs args;
+        test_hash_collision_probability<BitSamplingHash, HammingSimilarity>(256, 10000, 1, args);
+        test_hash_collision_probability<BitSamplingHash, HammingSimilarity>(256, 10000, 2, args);
+        test_hash_collision_probability<BitSamplingHash, HammingSimilarity>(100, 10000, 0, args);
+        test_hash_collision_probability<BitSamplingHash1Bit, HammingSimilarity>(70, 10000, 1, args);
+
+        Dataset<BinaryVectorFormat> dataset(256);
+        BitSamplingHash family(dataset.get_description(), args);
+        REQUIRE(family.collision_probability(1.0, 8) == 1.0);
+        REQUIRE(family.collision_probability(0.5, 3) == Approx(0.125));
+    }
+
     TEST_CASE("bits_per_function") {
         unsigned int dimensions = 100;
         Dataset<UnitVectorFormat> dataset(dimensions);
@@ -6,6 +6,8 @@
 #include "puffinn/math.hpp"
 #include "puffinn/format/unit_vector.hpp"
 #include "puffinn/format/real_vector.hpp"
+#include "puffinn/format/binary_vector.hpp"
+#include "puffinn/format/unit_vector_i8.hpp"
 
 namespace math {
     using namespace puffinn;
@@ -29,6 +31,59 @@ namespace math {
         }
     }
 
+    TEST_CASE("dot_products_i16_4xn equal to dot_product_i16") {
+        unsigned dims = 100;
+        Dataset<UnitVectorFormat> rows(dims);
+        Dataset<UnitVectorFormat> vecs(dims);
+        for (unsigned i=0; i < 4; i++) {
+            rows.insert(UnitVectorFormat::generate_random(dims));
+        }
+        for (unsigned i=0; i < 2; i++) {
+            vecs.insert(UnitVectorFormat::generate_random(dims));
+        }
+        auto stride = rows.get_description().storage_len;
+
+        #ifdef __AVX2__
+            int16_t dots[8];
+            dot_products_i16_4xn_avx2<2>(rows[0], stride, vecs[0], stride, dims, dots);
+            for (unsigned v=0; v < 2; v++) {
+                for (unsigned r=0; r < 4; r++) {
+                    REQUIRE(dots[4*v+r] == dot_product_i16(rows[r], vecs[v], dims));
+                }
+            }
+            dot_products_i16_4xn_avx2<1>(rows[0], stride, vecs[1], stride, dims, dots);
+            for (unsigned r=0; r < 4; r++) {
+                REQUIRE(dots[r] == dot_product_i16(rows[r], vecs[1], dims));
+            }
+        #endif
+    }
+
+    TEST_CASE("dot_products_i16_block equal to dot_product_i16") {
+        unsigned dims = 100;
+        // Sizes that are not multiples of the kernel size.
+        unsigned num_rows = 7;
+        unsigned num_cols = 5;
+        Dataset<UnitVectorFormat> rows(dims);
+        Dataset<UnitVectorFormat> cols(dims);
+        for (unsigned i=0; i < num_rows; i++) {
+            rows.insert(UnitVectorFormat::generate_random(dims));
+        }
+        for (unsigned i=0; i < num_cols; i++) {
+            cols.insert(UnitVectorFormat::generate_random(dims));
+        }
+        auto stride = rows.get_description().storage_len;
+
+        std::vector<unsigned> counts(num_rows*num_cols, 0);
+        dot_products_i16_block(rows[0], num_rows, cols[0], num_cols, stride, dims,
+            [&](unsigned i, unsigned j, int16_t dot) {
+                REQUIRE(dot == dot_product_i16(rows[i], cols[j], dims));
+                counts[i*num_cols+j]++;
+            });
+        for (auto c : counts) {
+            REQUIRE(c == 1);
+        }
+    }
+
     TEST_CASE("l2_distance_float versions equal") {
         unsigned reps = 100;
         unsigned dims = 100;
@@ -48,4 +103,76 @@ namespace math {
             #endif
         }
     }
+
+    TEST_CASE("dot_product_float versions equal") {
+        unsigned reps = 100;
+        for (unsigned dims : {5, 100, 300}) {
+            Dataset<RealVectorFormat> dataset(dims);
+            auto desc = dataset.get_description();
+
+            for (unsigned i=0; i < reps; i++) {
+                auto a = RealVectorFormat::generate_random(dims);
+                auto b = RealVectorFormat::generate_random(dims);
+                auto sa = to_stored_type<RealVectorFormat>(a, desc);
+                auto sb = to_stored_type<RealVectorFormat>(b, desc);
+
+                float simple = dot_product_float_simple(sa.get(), sb.get(), dims);
+                #ifdef __AVX__
+                    float avx = dot_product_float_avx(sa.get(), sb.get(), desc.storage_len);
+                    // Order of operations differ, so small error is accetable.
+                    REQUIRE(simple == Approx(avx).epsilon(0.0001).margin(0.0001));
+                #endif
+            }
+        }
+    }
+
+    TEST_CASE("dot_product_i8 versions equal") {
+        unsigned reps = 100;
+        for (unsigned dims : {32, 100, 300}) {
+            Dataset<UnitVectorI8Format> dataset(UnitVectorI8Args(dims, 0.3));
+            auto desc = dataset.get_description();
+
+            for (unsigned i=0; i < reps; i++) {
+                auto sa = to_stored_type<UnitVectorI8Format>(
+                    UnitVectorI8Format::generate_random(dims), desc);
+                auto sb = to_stored_type<UnitVectorI8Format>(
+                    UnitVectorI8Format::generate_random(dims), desc);
+
+                auto simple = dot_product_i8_simple(sa.get(), sb.get(), desc.storage_len);
+                REQUIRE(simple == dot_product_i8(sa.get(), sb.get(), desc.storage_len));
+                #ifdef __AVX2__
+                    REQUIRE(simple == dot_product_i8_avx2(sa.get(), sb.get(), desc.storage_len));
+                #endif
+            }
+        }
+        // Extreme values do not saturate.
+        alignas(32) int8_t a[32];
+        alignas(32) int8_t b[32];
+        std::fill_n(a, 32, -127);
+        std::fill_n(b, 32, -127);
+        REQUIRE(dot_product_i8(a, b, 32) == 32*127*127);
+        b[0] = 127;
+        REQUIRE(dot_product_i8(a, b, 32) == 30*127*127);
+    }
+
+    TEST_CASE("hamming_distance versions equal") {
+        unsigned reps = 100;
+        for (unsigned bits : {256, 1000, 4096}) {
+            Dataset<BinaryVectorFormat> dataset(bits);
+            auto desc = dataset.get_description();
+
+            for (unsigned i=0; i < reps; i++) {
+                auto sa = to_stored_type<BinaryVectorFormat>(
+                    BinaryVectorFormat::generate_random(bits), desc);
+                auto sb = to_stored_type<BinaryVectorFormat>(
+                    BinaryVectorFormat::generate_random(bits), desc);
+
+                auto simple = hamming_distance_simple(sa.get(), sb.get(), desc.storage_len);
+                REQUIRE(simple == hamming_distance(sa.get(), sb.get(), desc.storage_len));
+                #ifdef __AVX2__
+                    REQUIRE(simple == hamming_distance_avx2(sa.get(), sb.get(), desc.storage_len));
+                #endif
+            }
+        }
+    }
 }
@@ -3,6 +3,7 @@
 #include "catch.hpp"
 #include "puffinn/similarity_measure/cosine.hpp"
 #include "puffinn/maxbuffer.hpp"
+#include "puffinn/paircache.hpp"
 
 namespace maxbuffer {
     using namespace puffinn;
@@ -71,4 +72,23 @@ namespace maxbuffer {
         buffer.insert(2, 1.2);
         REQUIRE(buffer.best_entries() == std::vector<MaxBuffer::ResultPair>{{2, 1.0}});
     }
+
+    TEST_CASE("PairCache") {
+        // 10 values have 45 pairs, but only 16 slots are used.
+        PairCache cache(10, 4);
+        REQUIRE(!cache.contains(1, 2));
+        REQUIRE(!cache.insert(1, 2));
+        REQUIRE(cache.contains(2, 1));
+        REQUIRE(cache.insert(1, 2));
+        REQUIRE(cache.insert(2, 1));
+        REQUIRE(!cache.insert(0, 1));
+
+        // Pairs that are reported as seen were always inserted.
+        for (uint32_t i=0; i < 100; i++) {
+            REQUIRE(!cache.insert(i, i+1000));
+        }
+        REQUIRE(cache.memory_usage() >= 16*sizeof(uint64_t));
+        REQUIRE(cache.memory_usage() < 32*sizeof(uint64_t));
+        REQUIRE(PairCache(1).memory_usage() < 32*sizeof(uint64_t));
+    }
 }
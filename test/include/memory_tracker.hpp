@@ -0,0 +1,97 @@
+#pragma once
+
+// Replaces the global allocation functions to track the number of allocated bytes.
+// The replacements can only be defined once, so this must be included from a single file.
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace memory_tracker {
+    // The size of each allocation is stored in front of it,
+    // using enough space to keep the allocation aligned.
+    const size_t HEADER_LEN = alignof(std::max_align_t);
+
+    std::atomic<int64_t> current_bytes(0);
+    std::atomic<int64_t> peak_bytes(0);
+
+    void* allocate(size_t len) {
+        auto ptr = static_cast<char*>(std::malloc(len+HEADER_LEN));
+        if (ptr == nullptr) {
+            return nullptr;
+        }
+        *reinterpret_cast<size_t*>(ptr) = len;
+        auto current = current_bytes.fetch_add(len)+static_cast<int64_t>(len);
+        auto peak = peak_bytes.load();
+        while (peak < current && !peak_bytes.compare_exchange_weak(peak, current)) {}
+        return ptr+HEADER_LEN;
+    }
+
+    void deallocate(void* ptr) {
+        if (ptr == nullptr) {
+            return;
+        }
+        // Computed on the address, as the compiler cannot see that the header was allocated.
+        auto start = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(ptr)-HEADER_LEN);
+        current_bytes.fetch_sub(*reinterpret_cast<size_t*>(start));
+        std::free(start);
+    }
+
+    // Start measuring the peak from the currently allocated bytes.
+    void reset_peak() {
+        peak_bytes.store(current_bytes.load());
+    }
+
+    // Peak number of bytes allocated since the last reset, in addition to the bytes
+    // allocated at the time of the reset.
+    int64_t peak_since(int64_t start_bytes) {
+        return std::max(peak_bytes.load()-start_bytes, int64_t(0));
+    }
+}
+
+void* operator new(size_t len) {
+    auto ptr = memory_tracker::allocate(len);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t len) {
+    return operator new(len);
+}
+
+void* operator new(size_t len, const std::nothrow_t&) noexcept {
+    return memory_tracker::allocate(len);
+}
+
+void* operator new[](size_t len, const std::nothrow_t&) noexcept {
+    return memory_tracker::allocate(len);
+}
+
+void operator delete(void* ptr) noexcept {
+    memory_tracker::deallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    memory_tracker::deallocate(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    memory_tracker::deallocate(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    memory_tracker::deallocate(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    memory_tracker::deallocate(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    memory_tracker::deallocate(ptr);
+}
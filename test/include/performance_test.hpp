@@ -0,0 +1,91 @@
+#pragma once
+
+#include "catch.hpp"
+#include "puffinn/collection.hpp"
+#include "puffinn/performance.hpp"
+#include "puffinn/similarity_measure/cosine.hpp"
+
+#include <omp.h>
+
+namespace performance {
+    using namespace puffinn;
+
+    const unsigned int MB = 1024*1024;
+
+    TEST_CASE("LatencyHistogram buckets") {
+        size_t prev_bucket = 0;
+        for (uint64_t ns=0; ns < (uint64_t(1) << 42); ns = ns*1.01+1) {
+            auto bucket = LatencyHistogram::bucket_of(ns);
+            REQUIRE(bucket >= prev_bucket);
+            REQUIRE(bucket < NUM_LATENCY_BUCKETS);
+            auto limit = LatencyHistogram::bucket_limit(bucket);
+            REQUIRE(limit >= ns);
+            REQUIRE(limit <= ns+ns/LATENCY_SUB_BUCKETS);
+            if (bucket != 0) {
+                REQUIRE(LatencyHistogram::bucket_limit(bucket-1) < ns);
+            }
+            prev_bucket = bucket;
+        }
+        REQUIRE(LatencyHistogram::bucket_of(~uint64_t(0)) == NUM_LATENCY_BUCKETS-1);
+    }
+
+    TEST_CASE("LatencyHistogram percentiles") {
+        LatencyHistogram hist;
+        REQUIRE(hist.percentile(0.99) == 0.0);
+        for (uint64_t ns=1; ns <= 1000; ns++) {
+            hist.record(1000*ns);
+        }
+        REQUIRE(hist.count() == 1000);
+        REQUIRE(hist.max_seconds() == Approx(1e-3));
+        REQUIRE(hist.total_seconds() == Approx(0.5005));
+        REQUIRE(hist.percentile(0.5) >= 500e-6);
+        REQUIRE(hist.percentile(0.5) <= 500e-6*1.07);
+        REQUIRE(hist.percentile(0.99) >= 990e-6);
+        REQUIRE(hist.percentile(0.99) <= 1e-3);
+        REQUIRE(hist.percentile(1.0) == Approx(1e-3));
+    }
+
+    TEST_CASE("PerformanceMetrics recording") {
+        const unsigned int DIMENSIONS = 10;
+        const unsigned int N = 500;
+        Index<CosineSimilarity> index(DIMENSIONS, 1*MB);
+        for (unsigned int i=0; i < N; i++) {
+            index.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        index.rebuild();
+
+        g_performance_metrics.set_enabled(false);
+        g_performance_metrics.clear();
+        index.search(UnitVectorFormat::generate_random(DIMENSIONS), 10, 0.9);
+        REQUIRE(g_performance_metrics.snapshot().queries == 0);
+
+        // Queries made from several threads are all counted.
+        g_performance_metrics.set_enabled(true);
+        const int QUERIES = 100;
+        #pragma omp parallel for
+        for (int i=0; i < QUERIES; i++) {
+            index.search(UnitVectorFormat::generate_random(DIMENSIONS), 10, 0.9);
+        }
+        g_performance_metrics.set_enabled(false);
+        auto snapshot = g_performance_metrics.snapshot();
+        REQUIRE(snapshot.queries == QUERIES);
+        REQUIRE(snapshot.get_time(Computation::Total).count() == QUERIES);
+        REQUIRE(snapshot.get_time(Computation::Search).count() == QUERIES);
+        REQUIRE(snapshot.get_time(Computation::Total).total_seconds() > 0.0);
+        REQUIRE(snapshot.distance_computations > 0);
+        REQUIRE(snapshot.candidates >= snapshot.distance_computations);
+        REQUIRE(snapshot.considered_maps > 0);
+
+        auto json = snapshot.to_json();
+        REQUIRE(json.find("\"queries\":100,") != std::string::npos);
+        REQUIRE(json.find("\"total\":{\"count\":100,") != std::string::npos);
+        auto prometheus = snapshot.to_prometheus();
+        REQUIRE(prometheus.find("puffinn_queries_total 100\n") != std::string::npos);
+        REQUIRE(prometheus.find(
+            "puffinn_computation_seconds_count{computation=\"total\"} 100\n") != std::string::npos);
+
+        g_performance_metrics.clear();
+        REQUIRE(g_performance_metrics.snapshot().queries == 0);
+        REQUIRE(g_performance_metrics.snapshot().get_time(Computation::Total).count() == 0);
+    }
+}
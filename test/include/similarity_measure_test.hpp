@@ -4,8 +4,11 @@
 
 #include "puffinn/format/generic.hpp"
 #include "puffinn/similarity_measure/cosine.hpp"
+#include "puffinn/similarity_measure/cosine_i8.hpp"
 #include "puffinn/similarity_measure/l2.hpp"
 #include "puffinn/similarity_measure/jaccard.hpp"
+#include "puffinn/similarity_measure/hamming.hpp"
+#include "puffinn/similarity_measure/inner_product.hpp"
 
 namespace similarity_measure {
     using namespace puffinn;
@@ -41,6 +44,25 @@ namespace similarity_measure {
         REQUIRE(std::abs(res64-expected) <= 1e-4);
     }
 
+    TEST_CASE("CosineSimilarityI8::compute_similarity") {
+        std::vector<float> v1{0.2, 0.4, 0.0, 0.8, 0.4};
+        std::vector<float> v2{0.4, 0.0, 0.8, 0.2, 0.4};
+        Dataset<CosineSimilarityI8::Format> dataset(UnitVectorI8Args(5, 0.8));
+        auto desc = dataset.get_description();
+        auto stored_1 = to_stored_type<CosineSimilarityI8::Format>(v1, desc);
+        auto stored_2 = to_stored_type<CosineSimilarityI8::Format>(v2, desc);
+        float res = CosineSimilarityI8::compute_similarity(stored_1.get(), stored_2.get(), desc);
+        REQUIRE(std::abs(res-0.7) <= 1e-2);
+
+        // Hashing uses the 16-bit representation.
+        auto hash_desc = CosineSimilarityI8::hash_description(desc);
+        REQUIRE(hash_desc.storage_len == 16);
+        std::vector<int16_t> converted(hash_desc.storage_len);
+        CosineSimilarityI8::to_hash_format(stored_1.get(), converted.data(), desc);
+        REQUIRE(UnitVectorFormat::from_16bit_fixed_point(converted[3]) == Approx(0.8).margin(1e-3));
+        REQUIRE(converted[5] == 0);
+    }
+
     TEST_CASE("L2Distance::compute_similarity") {
         Dataset<RealVectorFormat> dataset(32);
         auto v1 = allocate_storage<RealVectorFormat>(1, 32);
@@ -98,6 +120,50 @@ namespace similarity_measure {
             JaccardSimilarity::compute_similarity(&a, &b, dataset.get_description())
             == Approx(2.0/7.0));
     }
-}
 
+    TEST_CASE("InnerProductSimilarity transforms") {
+        std::vector<float> x{0.5, 1.0, -1.0};
+        std::vector<float> y{3.0, 0.0, 4.0};
+        std::vector<float> q{2.0, -1.0, 2.0};
+        float max_norm = 5.0;
+
+        Dataset<UnitVectorFormat> dataset(4);
+        auto desc = dataset.get_description();
+        auto tq = to_stored_type<UnitVectorFormat>(
+            InnerProductSimilarity::transform_query(q), desc);
+        for (auto& v : {x, y}) {
+            auto tv = InnerProductSimilarity::transform_data(v, max_norm);
+            REQUIRE(tv.size() == 4);
+            REQUIRE(InnerProductSimilarity::norm(tv) == Approx(1.0));
+
+            auto stored = to_stored_type<UnitVectorFormat>(tv, desc);
+            float dot = 0.0;
+            for (size_t i=0; i < v.size(); i++) {
+                dot += v[i]*q[i];
+            }
+            // The cosine is the inner product divided by max_norm*|q|.
+            float expected = (dot/(max_norm*3.0)+1.0)/2.0;
+            REQUIRE(std::abs(
+                CosineSimilarity::compute_similarity(stored.get(), tq.get(), desc)-expected)
+                <= 1e-3);
+        }
+
+        // Vectors that are too long are shortened.
+        auto shortened = InnerProductSimilarity::transform_data({6.0, 8.0, 0.0}, max_norm);
+        REQUIRE(shortened[0] == Approx(0.6));
+        REQUIRE(shortened[3] == Approx(0.0));
+    }
 
+    TEST_CASE("HammingSimilarity::compute_similarity") {
+        Dataset<BinaryVectorFormat> dataset(100);
+        auto desc = dataset.get_description();
+        std::vector<bool> a(100, false);
+        std::vector<bool> b(100, false);
+        a[1] = a[70] = a[99] = true;
+        b[1] = b[80] = true;
+        auto sa = to_stored_type<BinaryVectorFormat>(a, desc);
+        auto sb = to_stored_type<BinaryVectorFormat>(b, desc);
+        REQUIRE(HammingSimilarity::compute_similarity(sa.get(), sb.get(), desc) == Approx(0.97));
+        REQUIRE(HammingSimilarity::compute_similarity(sa.get(), sa.get(), desc) == 1.0);
+    }
+}